@@ -201,6 +201,7 @@ HEADERS += src/qt/bitcoingui.h \
     src/qt/editaddressdialog.h \
     src/qt/bitcoinaddressvalidator.h \
     src/alert.h \
+    src/blockencodings.h \
     src/allocators.h \
     src/addrman.h \
     src/base58.h \
@@ -208,6 +209,8 @@ HEADERS += src/qt/bitcoingui.h \
     src/chainparams.h \
     src/chainparamsseeds.h \
     src/checkpoints.h \
+    src/checkqueue.h \
+    src/parallel.h \
     src/compat.h \
     src/coincontrol.h \
     src/sync.h \
@@ -328,6 +331,7 @@ SOURCES += src/qt/bitcoin.cpp src/qt/bitcoingui.cpp \
     src/qt/editaddressdialog.cpp \
     src/qt/bitcoinaddressvalidator.cpp \
     src/alert.cpp \
+    src/blockencodings.cpp \
     src/allocators.cpp \
     src/base58.cpp \
     src/chainparams.cpp \
@@ -341,6 +345,7 @@ SOURCES += src/qt/bitcoin.cpp src/qt/bitcoingui.cpp \
     src/key.cpp \
     src/pubkey.cpp \
     src/script.cpp \
+    src/parallel.cpp \
     src/scrypt.cpp \
     src/core.cpp \
     src/main.cpp \
@@ -0,0 +1,130 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+
+#include "hash.h"
+#include "txmempool.h"
+#include "util.h"
+
+using namespace std;
+
+CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock& block) :
+    nNonce(GetRand(std::numeric_limits<uint64_t>::max()))
+{
+    header = block;
+    header.vtx.clear();
+    header.vMerkleTree.clear();
+
+    FillShortTxIDSelector();
+
+    // The coinbase, and the coinstake of a proof-of-stake block, can't be
+    // in anyone's mempool
+    unsigned int nPrefilled = block.IsProofOfStake() ? 2 : 1;
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+    {
+        if (i < nPrefilled)
+        {
+            CPrefilledTransaction prefilled;
+            prefilled.nIndex = i;
+            prefilled.tx = block.vtx[i];
+            prefilledtxn.push_back(prefilled);
+        }
+        else
+            shorttxids.push_back(GetShortID(block.vtx[i].GetHash()));
+    }
+}
+
+void CBlockHeaderAndShortTxIDs::FillShortTxIDSelector() const
+{
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << header << nNonce;
+    uint256 hash = ss.GetHash();
+    shorttxidk0 = hash.Get64(0);
+    shorttxidk1 = hash.Get64(1);
+}
+
+uint64_t CBlockHeaderAndShortTxIDs::GetShortID(const uint256& txhash) const
+{
+    return SipHashUint256(shorttxidk0, shorttxidk1, txhash) & 0xffffffffffffULL;
+}
+
+bool CPartialBlock::Init(const CBlockHeaderAndShortTxIDs& cmpctblock, CTxMemPool& pool, vector<unsigned short>& vMissing)
+{
+    vMissing.clear();
+    if (cmpctblock.header.IsNull() || (cmpctblock.shorttxids.empty() && cmpctblock.prefilledtxn.empty()))
+        return error("CPartialBlock::Init() : empty compact block");
+    if (cmpctblock.BlockTxCount() > MAX_BLOCK_SIZE / 60)
+        return error("CPartialBlock::Init() : too many transactions");
+
+    header = cmpctblock.header;
+    vtx.assign(cmpctblock.BlockTxCount(), CTransaction());
+    vHave.assign(cmpctblock.BlockTxCount(), false);
+
+    BOOST_FOREACH(const CPrefilledTransaction& prefilled, cmpctblock.prefilledtxn)
+    {
+        if (prefilled.nIndex >= vtx.size() || vHave[prefilled.nIndex])
+            return error("CPartialBlock::Init() : bad prefilled transaction index %u", prefilled.nIndex);
+        vtx[prefilled.nIndex] = prefilled.tx;
+        vHave[prefilled.nIndex] = true;
+    }
+
+    // Positions of the short IDs, skipping the prefilled transactions
+    map<uint64_t, unsigned short> mapShortIDs;
+    set<uint64_t> setCollisions;
+    unsigned short nIndex = 0;
+    BOOST_FOREACH(uint64_t shortid, cmpctblock.shorttxids)
+    {
+        while (vHave[nIndex])
+            nIndex++;
+        if (!mapShortIDs.insert(make_pair(shortid, nIndex)).second)
+            setCollisions.insert(shortid);
+        nIndex++;
+    }
+
+    // Ambiguous IDs are left for the sender to fill in
+    {
+        LOCK(pool.cs);
+        for (map<uint256, CTransaction>::const_iterator mi = pool.mapTx.begin(); mi != pool.mapTx.end(); ++mi)
+        {
+            uint64_t shortid = cmpctblock.GetShortID(mi->first);
+            map<uint64_t, unsigned short>::iterator it = mapShortIDs.find(shortid);
+            if (it == mapShortIDs.end() || setCollisions.count(shortid))
+                continue;
+            if (vHave[it->second])
+            {
+                // Two pool transactions share the ID; ask for it instead
+                vHave[it->second] = false;
+                setCollisions.insert(shortid);
+                continue;
+            }
+            vtx[it->second] = mi->second;
+            vHave[it->second] = true;
+        }
+    }
+
+    for (unsigned int i = 0; i < vHave.size(); i++)
+        if (!vHave[i])
+            vMissing.push_back(i);
+    return true;
+}
+
+bool CPartialBlock::Fill(const vector<CTransaction>& vtxMissing, CBlock& block) const
+{
+    block = header;
+    block.vtx = vtx;
+
+    unsigned int nMissing = 0;
+    for (unsigned int i = 0; i < vHave.size(); i++)
+    {
+        if (vHave[i])
+            continue;
+        if (nMissing >= vtxMissing.size())
+            return error("CPartialBlock::Fill() : too few transactions");
+        block.vtx[i] = vtxMissing[nMissing++];
+    }
+    if (nMissing != vtxMissing.size())
+        return error("CPartialBlock::Fill() : too many transactions");
+    return true;
+}
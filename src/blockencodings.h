@@ -0,0 +1,131 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOCKENCODINGS_H
+#define BITCOIN_BLOCKENCODINGS_H
+
+#include "main.h"
+
+class CTxMemPool;
+
+/** A transaction sent along with a compact block because the receiver can't
+    have it yet, such as the coinbase and coinstake */
+class CPrefilledTransaction
+{
+public:
+    unsigned short nIndex; // position in the block
+    CTransaction tx;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nIndex);
+        READWRITE(tx);
+    )
+};
+
+/** A new block in short form: its header and signature, and a 6-byte SipHash
+    of each transaction keyed by the header and a random nonce. The receiver
+    rebuilds it from its mempool. */
+class CBlockHeaderAndShortTxIDs
+{
+private:
+    mutable uint64_t shorttxidk0, shorttxidk1;
+
+    void FillShortTxIDSelector() const;
+
+public:
+    static const int SHORTTXIDS_LENGTH = 6;
+
+    CBlock header; // vtx is always empty
+    uint64_t nNonce;
+    std::vector<uint64_t> shorttxids;
+    std::vector<CPrefilledTransaction> prefilledtxn;
+
+    CBlockHeaderAndShortTxIDs() : shorttxidk0(0), shorttxidk1(0), nNonce(0) {}
+    CBlockHeaderAndShortTxIDs(const CBlock& block);
+
+    uint64_t GetShortID(const uint256& txhash) const;
+    size_t BlockTxCount() const { return shorttxids.size() + prefilledtxn.size(); }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(header);
+        READWRITE(nNonce);
+
+        std::vector<unsigned char> vchShortIDs;
+        if (!fRead)
+        {
+            vchShortIDs.resize(shorttxids.size() * SHORTTXIDS_LENGTH);
+            for (unsigned int i = 0; i < shorttxids.size(); i++)
+                for (int j = 0; j < SHORTTXIDS_LENGTH; j++)
+                    vchShortIDs[i * SHORTTXIDS_LENGTH + j] = (shorttxids[i] >> (8 * j)) & 0xff;
+        }
+        READWRITE(vchShortIDs);
+        if (fRead)
+        {
+            if (vchShortIDs.size() % SHORTTXIDS_LENGTH)
+                throw std::ios_base::failure("CBlockHeaderAndShortTxIDs : short IDs not a multiple of 6 bytes");
+            std::vector<uint64_t>& vIDs = const_cast<CBlockHeaderAndShortTxIDs*>(this)->shorttxids;
+            vIDs.assign(vchShortIDs.size() / SHORTTXIDS_LENGTH, 0);
+            for (unsigned int i = 0; i < vIDs.size(); i++)
+                for (int j = 0; j < SHORTTXIDS_LENGTH; j++)
+                    vIDs[i] |= (uint64_t)vchShortIDs[i * SHORTTXIDS_LENGTH + j] << (8 * j);
+        }
+
+        READWRITE(prefilledtxn);
+
+        if (fRead)
+            FillShortTxIDSelector();
+    )
+};
+
+/** Asks the sender of a compact block for the transactions at these positions */
+class CBlockTransactionsRequest
+{
+public:
+    uint256 blockhash;
+    std::vector<unsigned short> vIndexes;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(blockhash);
+        READWRITE(vIndexes);
+    )
+};
+
+/** Reply to a CBlockTransactionsRequest, in the order they were asked for */
+class CBlockTransactions
+{
+public:
+    uint256 blockhash;
+    std::vector<CTransaction> vtx;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(blockhash);
+        READWRITE(vtx);
+    )
+};
+
+/** A compact block being rebuilt from the mempool */
+class CPartialBlock
+{
+private:
+    CBlock header;
+    std::vector<CTransaction> vtx;
+    std::vector<bool> vHave;
+
+public:
+    /** Fill in what we can from the prefilled transactions and pool, and
+        list the positions still missing. Returns false if the compact block
+        is malformed. */
+    bool Init(const CBlockHeaderAndShortTxIDs& cmpctblock, CTxMemPool& pool, std::vector<unsigned short>& vMissing);
+
+    /** Complete the block with the transactions asked for by Init(), in
+        order. Returns false if they don't fit. */
+    bool Fill(const std::vector<CTransaction>& vtxMissing, CBlock& block) const;
+
+    uint256 GetHash() const { return header.GetHash(); }
+};
+
+#endif
@@ -109,14 +109,14 @@ namespace Checkpoints
 		return checkpoints.rbegin()->first;
 	}
 
-	CBlockIndex* GetLastCheckpoint(const std::map<uint256, CBlockIndex*>& mapBlockIndex)
+	CBlockIndex* GetLastCheckpoint()
 	{
 		MapCheckpoints& checkpoints = (TestNet() ? mapCheckpointsTestnet : mapCheckpoints);
 
 		BOOST_REVERSE_FOREACH(const MapCheckpoints::value_type& i, checkpoints)
 		{
 			const uint256& hash = i.second;
-			std::map<uint256, CBlockIndex*>::const_iterator t = mapBlockIndex.find(hash);
+			BlockMap::const_iterator t = mapBlockIndex.find(hash);
 			if (t != mapBlockIndex.end())
 				return t->second;
 		}
@@ -126,11 +126,8 @@ namespace Checkpoints
 	// Automatically select a suitable sync-checkpoint 
 	const CBlockIndex* AutoSelectSyncCheckpoint()
 	{
-		const CBlockIndex *pindex = pindexBest;
-		// Search backward for a block within max span and maturity window
-		while (pindex->pprev && pindex->nHeight + nCheckpointSpan > pindexBest->nHeight)
-			pindex = pindex->pprev;
-		return pindex;
+		// The block just outside the max span and maturity window
+		return FindBlockByHeight(std::max(0, pindexBest->nHeight - nCheckpointSpan));
 	}
 
 	// Check against synchronized checkpoint
@@ -7,6 +7,11 @@
 #include "common.h"
 
 #include <string.h>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#endif
 
 // Internal implementation code.
 namespace
@@ -128,6 +133,265 @@ void Transform(uint32_t* s, const unsigned char* chunk)
 }
 
 } // namespace sha256
+
+/** Round constants, for the multi-lane transforms below. */
+const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+/** Double SHA-256 of each of nCount messages, one at a time. */
+void DoubleMany(unsigned char* out, const unsigned char* data, size_t nLength, size_t nCount)
+{
+    unsigned char hash[32];
+    for (size_t i = 0; i < nCount; i++) {
+        CSHA256().Write(data + i * nLength, nLength).Finalize(hash);
+        CSHA256().Write(hash, 32).Finalize(out + i * 32);
+    }
+}
+
+/** Pad nLanes messages of nLength bytes into whole SHA-256 blocks, one buffer of nPadded bytes per lane. */
+void PadLanes(unsigned char* padded, size_t nPadded, const unsigned char* data, size_t nLength, int nLanes)
+{
+    memset(padded, 0, nPadded * nLanes);
+    for (int i = 0; i < nLanes; i++) {
+        unsigned char* p = padded + i * nPadded;
+        memcpy(p, data + i * nLength, nLength);
+        p[nLength] = 0x80;
+        WriteBE64(p + nPadded - 8, (uint64_t)nLength << 3);
+    }
+}
+
+#if defined(__GNUC__) && defined(__SSE2__)
+#define USE_SHA256_SSE2 1
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define USE_SHA256_AVX2 1
+#endif
+
+#ifdef USE_SHA256_SSE2
+/** SHA-256 on four messages at once, one per 32-bit lane of an SSE2 register. */
+namespace sse2
+{
+typedef __m128i V;
+
+inline V Add(V x, V y) { return _mm_add_epi32(x, y); }
+inline V Xor(V x, V y) { return _mm_xor_si128(x, y); }
+inline V Or(V x, V y) { return _mm_or_si128(x, y); }
+inline V And(V x, V y) { return _mm_and_si128(x, y); }
+template<int n> inline V Shr(V x) { return _mm_srli_epi32(x, n); }
+template<int n> inline V Ror(V x) { return Or(_mm_srli_epi32(x, n), _mm_slli_epi32(x, 32 - n)); }
+
+inline V Ch(V x, V y, V z) { return Xor(z, And(x, Xor(y, z))); }
+inline V Maj(V x, V y, V z) { return Or(And(x, y), And(z, Or(x, y))); }
+inline V Sigma0(V x) { return Xor(Xor(Ror<2>(x), Ror<13>(x)), Ror<22>(x)); }
+inline V Sigma1(V x) { return Xor(Xor(Ror<6>(x), Ror<11>(x)), Ror<25>(x)); }
+inline V sigma0(V x) { return Xor(Xor(Ror<7>(x), Ror<18>(x)), Shr<3>(x)); }
+inline V sigma1(V x) { return Xor(Xor(Ror<17>(x), Ror<19>(x)), Shr<10>(x)); }
+
+const int LANES = 4;
+
+/** Process one 64-byte chunk of each lane. */
+void Transform(V* s, const unsigned char** chunk)
+{
+    V w[64];
+    for (int i = 0; i < 16; i++)
+        w[i] = _mm_set_epi32(ReadBE32(chunk[3] + 4 * i), ReadBE32(chunk[2] + 4 * i), ReadBE32(chunk[1] + 4 * i), ReadBE32(chunk[0] + 4 * i));
+    for (int i = 16; i < 64; i++)
+        w[i] = Add(Add(sigma1(w[i - 2]), w[i - 7]), Add(sigma0(w[i - 15]), w[i - 16]));
+
+    V a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+    for (int i = 0; i < 64; i++) {
+        V t1 = Add(Add(Add(h, Sigma1(e)), Add(Ch(e, f, g), _mm_set1_epi32(K[i]))), w[i]);
+        V t2 = Add(Sigma0(a), Maj(a, b, c));
+        h = g; g = f; f = e; e = Add(d, t1);
+        d = c; c = b; b = a; a = Add(t1, t2);
+    }
+    s[0] = Add(s[0], a); s[1] = Add(s[1], b); s[2] = Add(s[2], c); s[3] = Add(s[3], d);
+    s[4] = Add(s[4], e); s[5] = Add(s[5], f); s[6] = Add(s[6], g); s[7] = Add(s[7], h);
+}
+
+/** Hash LANES padded messages of nPadded bytes each, writing 32-byte digests. */
+void Hash(unsigned char* out, const unsigned char* padded, size_t nPadded)
+{
+    uint32_t init[8];
+    sha256::Initialize(init);
+    V s[8];
+    for (int i = 0; i < 8; i++)
+        s[i] = _mm_set1_epi32(init[i]);
+    for (size_t pos = 0; pos < nPadded; pos += 64) {
+        const unsigned char* chunk[LANES];
+        for (int j = 0; j < LANES; j++)
+            chunk[j] = padded + j * nPadded + pos;
+        Transform(s, chunk);
+    }
+    for (int i = 0; i < 8; i++) {
+        uint32_t lane[LANES];
+        _mm_storeu_si128((V*)lane, s[i]);
+        for (int j = 0; j < LANES; j++)
+            WriteBE32(out + j * 32 + i * 4, lane[j]);
+    }
+}
+} // namespace sse2
+#endif
+
+#ifdef USE_SHA256_AVX2
+/** SHA-256 on eight messages at once, one per 32-bit lane of an AVX2 register.
+ *  Compiled for AVX2 regardless of the build flags; only called once the
+ *  CPU has been seen to support it. */
+namespace avx2
+{
+typedef __m256i V;
+
+#define AVX2_TARGET __attribute__((target("avx2")))
+
+AVX2_TARGET inline V Add(V x, V y) { return _mm256_add_epi32(x, y); }
+AVX2_TARGET inline V Xor(V x, V y) { return _mm256_xor_si256(x, y); }
+AVX2_TARGET inline V Or(V x, V y) { return _mm256_or_si256(x, y); }
+AVX2_TARGET inline V And(V x, V y) { return _mm256_and_si256(x, y); }
+template<int n> AVX2_TARGET inline V Shr(V x) { return _mm256_srli_epi32(x, n); }
+template<int n> AVX2_TARGET inline V Ror(V x) { return Or(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n)); }
+
+AVX2_TARGET inline V Ch(V x, V y, V z) { return Xor(z, And(x, Xor(y, z))); }
+AVX2_TARGET inline V Maj(V x, V y, V z) { return Or(And(x, y), And(z, Or(x, y))); }
+AVX2_TARGET inline V Sigma0(V x) { return Xor(Xor(Ror<2>(x), Ror<13>(x)), Ror<22>(x)); }
+AVX2_TARGET inline V Sigma1(V x) { return Xor(Xor(Ror<6>(x), Ror<11>(x)), Ror<25>(x)); }
+AVX2_TARGET inline V sigma0(V x) { return Xor(Xor(Ror<7>(x), Ror<18>(x)), Shr<3>(x)); }
+AVX2_TARGET inline V sigma1(V x) { return Xor(Xor(Ror<17>(x), Ror<19>(x)), Shr<10>(x)); }
+
+const int LANES = 8;
+
+/** Process one 64-byte chunk of each lane. */
+AVX2_TARGET void Transform(V* s, const unsigned char** chunk)
+{
+    V w[64];
+    for (int i = 0; i < 16; i++)
+        w[i] = _mm256_set_epi32(ReadBE32(chunk[7] + 4 * i), ReadBE32(chunk[6] + 4 * i), ReadBE32(chunk[5] + 4 * i), ReadBE32(chunk[4] + 4 * i),
+                                ReadBE32(chunk[3] + 4 * i), ReadBE32(chunk[2] + 4 * i), ReadBE32(chunk[1] + 4 * i), ReadBE32(chunk[0] + 4 * i));
+    for (int i = 16; i < 64; i++)
+        w[i] = Add(Add(sigma1(w[i - 2]), w[i - 7]), Add(sigma0(w[i - 15]), w[i - 16]));
+
+    V a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+    for (int i = 0; i < 64; i++) {
+        V t1 = Add(Add(Add(h, Sigma1(e)), Add(Ch(e, f, g), _mm256_set1_epi32(K[i]))), w[i]);
+        V t2 = Add(Sigma0(a), Maj(a, b, c));
+        h = g; g = f; f = e; e = Add(d, t1);
+        d = c; c = b; b = a; a = Add(t1, t2);
+    }
+    s[0] = Add(s[0], a); s[1] = Add(s[1], b); s[2] = Add(s[2], c); s[3] = Add(s[3], d);
+    s[4] = Add(s[4], e); s[5] = Add(s[5], f); s[6] = Add(s[6], g); s[7] = Add(s[7], h);
+}
+
+/** Hash LANES padded messages of nPadded bytes each, writing 32-byte digests. */
+AVX2_TARGET void Hash(unsigned char* out, const unsigned char* padded, size_t nPadded)
+{
+    uint32_t init[8];
+    sha256::Initialize(init);
+    V s[8];
+    for (int i = 0; i < 8; i++)
+        s[i] = _mm256_set1_epi32(init[i]);
+    for (size_t pos = 0; pos < nPadded; pos += 64) {
+        const unsigned char* chunk[LANES];
+        for (int j = 0; j < LANES; j++)
+            chunk[j] = padded + j * nPadded + pos;
+        Transform(s, chunk);
+    }
+    for (int i = 0; i < 8; i++) {
+        uint32_t lane[LANES];
+        _mm256_storeu_si256((V*)lane, s[i]);
+        for (int j = 0; j < LANES; j++)
+            WriteBE32(out + j * 32 + i * 4, lane[j]);
+    }
+}
+
+#undef AVX2_TARGET
+} // namespace avx2
+#endif
+
+/** Double SHA-256 of nCount messages, LANES at a time through HashLanes, the remainder one by one. */
+template<int LANES>
+void DoubleManyLanes(void (*HashLanes)(unsigned char*, const unsigned char*, size_t),
+                     unsigned char* out, const unsigned char* data, size_t nLength, size_t nCount)
+{
+    size_t nPadded = ((nLength + 8) / 64 + 1) * 64;
+    std::vector<unsigned char> vFirst(nPadded * LANES), vSecond(64 * LANES);
+    unsigned char hash[32 * LANES];
+    size_t i = 0;
+    for (; i + LANES <= nCount; i += LANES) {
+        PadLanes(&vFirst[0], nPadded, data + i * nLength, nLength, LANES);
+        HashLanes(hash, &vFirst[0], nPadded);
+        PadLanes(&vSecond[0], 64, hash, 32, LANES);
+        HashLanes(out + i * 32, &vSecond[0], 64);
+    }
+    DoubleMany(out + i * 32, data + i * nLength, nLength, nCount - i);
+}
+
+#ifdef USE_SHA256_SSE2
+void DoubleManySSE2(unsigned char* out, const unsigned char* data, size_t nLength, size_t nCount)
+{
+    DoubleManyLanes<sse2::LANES>(sse2::Hash, out, data, nLength, nCount);
+}
+#endif
+
+#ifdef USE_SHA256_AVX2
+void DoubleManyAVX2(unsigned char* out, const unsigned char* data, size_t nLength, size_t nCount)
+{
+    DoubleManyLanes<avx2::LANES>(avx2::Hash, out, data, nLength, nCount);
+}
+#endif
+
+typedef void (*DoubleManyFn)(unsigned char*, const unsigned char*, size_t, size_t);
+
+/** Check an implementation against the one-at-a-time code on a few message lengths. */
+bool SelfTest(DoubleManyFn fn)
+{
+    unsigned char data[17 * 120];
+    for (size_t i = 0; i < sizeof(data); i++)
+        data[i] = (unsigned char)(i * 7 + 3);
+    static const size_t lengths[] = {0, 32, 55, 56, 64, 80, 120};
+    for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+        unsigned char expected[17 * 32], actual[17 * 32];
+        DoubleMany(expected, data, lengths[l], 17);
+        fn(actual, data, lengths[l], 17);
+        if (memcmp(expected, actual, sizeof(expected)) != 0)
+            return false;
+    }
+    return true;
+}
+
+const char* strDoubleManyImpl = "scalar";
+
+/** Pick the widest implementation this CPU runs correctly. */
+DoubleManyFn SelectDoubleMany()
+{
+#ifdef USE_SHA256_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && SelfTest(DoubleManyAVX2)) {
+        strDoubleManyImpl = "avx2";
+        return DoubleManyAVX2;
+    }
+#endif
+#ifdef USE_SHA256_SSE2
+    if (SelfTest(DoubleManySSE2)) {
+        strDoubleManyImpl = "sse2";
+        return DoubleManySSE2;
+    }
+#endif
+    return DoubleMany;
+}
+
+DoubleManyFn GetDoubleMany()
+{
+    static DoubleManyFn fn = SelectDoubleMany();
+    return fn;
+}
 } // namespace
 
 
@@ -187,3 +451,14 @@ CSHA256& CSHA256::Reset()
     sha256::Initialize(s);
     return *this;
 }
+
+void SHA256DMany(unsigned char* out, const unsigned char* data, size_t nLength, size_t nCount)
+{
+    GetDoubleMany()(out, data, nLength, nCount);
+}
+
+const char* SHA256DManyImplementation()
+{
+    GetDoubleMany();
+    return strDoubleManyImpl;
+}
@@ -25,4 +25,12 @@ public:
     CSHA256& Reset();
 };
 
+/** Compute the double SHA-256 of nCount messages of nLength bytes each, laid
+ *  out back to back in data, writing the 32-byte digests back to back in out.
+ *  Several messages are hashed side by side when the CPU supports it. */
+void SHA256DMany(unsigned char* out, const unsigned char* data, size_t nLength, size_t nCount);
+
+/** Name of the implementation SHA256DMany() picked for this CPU. */
+const char* SHA256DManyImplementation();
+
 #endif // BITCOIN_CRYPTO_SHA256_H
@@ -11,6 +11,7 @@
 #include "txdb.h"
 #include "rpcserver.h"
 #include "net.h"
+#include "parallel.h"
 #include "key.h"
 #include "pubkey.h"
 #include "util.h"
@@ -24,6 +25,7 @@
 #include "masternodeconfig.h"
 #include "spork.h"
 #include "smessage.h"
+#include "crypto/sha256.h"
 
 #ifdef ENABLE_WALLET
 #include "db.h"
@@ -130,6 +132,9 @@ void Shutdown()
         if (pwalletMain)
             pwalletMain->SetBestChain(CBlockLocator(pindexBest));
 #endif
+        // Write out the transaction database cache
+        if (pindexBest)
+            CTxDB().Flush();
     }
 #ifdef ENABLE_WALLET
     if (pwalletMain)
@@ -192,9 +197,14 @@ std::string HelpMessage()
     strUsage += "  -pid=<file>            " + _("Specify pid file (default: Harvestd.pid)") + "\n";
     strUsage += "  -datadir=<dir>         " + _("Specify data directory") + "\n";
     strUsage += "  -wallet=<dir>          " + _("Specify wallet file (within data directory)") + "\n";
-    strUsage += "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 10)") + "\n";
+    strUsage += "  -dbcache=<n>           " + strprintf(_("Set database cache size in megabytes (default: %d, was 10 in older versions)"), DEFAULT_DB_CACHE) + "\n";
+    strUsage += "  -dbflushinterval=<n>   " + strprintf(_("Write the database cache to disk at least every <n> seconds; after a crash the chain resumes from the last write and later blocks are synced again (default: %d)"), DEFAULT_DB_FLUSH_INTERVAL) + "\n";
+    strUsage += "  -sigcachemb=<n>        " + strprintf(_("Limit the signature cache to <n> megabytes (default: %d)"), DEFAULT_SIG_CACHE_MB) + "\n";
+    strUsage += "  -maxsigcachesize=<n>   " + _("Deprecated, use -sigcachemb. Limit the signature cache to <n> entries") + "\n";
     strUsage += "  -dbwalletcache=<n>     " + _("Set wallet database cache size in megabytes (default: 1)") + "\n";
     strUsage += "  -dblogsize=<n>         " + _("Set database disk log size in megabytes (default: 100)") + "\n";
+    strUsage += "  -par=<n>               " + strprintf(_("Set the number of script verification threads (up to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), MAX_SCRIPTCHECK_THREADS, 0) + "\n";
+    strUsage += "  -msgthreads=<n>        " + strprintf(_("Set the number of threads handling address relay, masternode pings and secure messaging (up to %d, 0 = none, default: %d)"), MAX_MESSAGE_WORKER_THREADS, DEFAULT_MESSAGE_WORKER_THREADS) + "\n";
     strUsage += "  -timeout=<n>           " + _("Specify connection timeout in milliseconds (default: 5000)") + "\n";
     strUsage += "  -proxy=<ip:port>       " + _("Connect through SOCKS5 proxy") + "\n";
     strUsage += "  -tor=<ip:port>         " + _("Use proxy to reach tor hidden services (default: same as -proxy)") + "\n";
@@ -267,8 +277,14 @@ std::string HelpMessage()
     strUsage += "  -salvagewallet         " + _("Attempt to recover private keys from a corrupt wallet.dat") + "\n";
     strUsage += "  -checkblocks=<n>       " + _("How many blocks to check at startup (default: 500, 0 = all)") + "\n";
     strUsage += "  -checklevel=<n>        " + _("How thorough the block verification is (0-6, default: 1)") + "\n";
+    strUsage += "  -addrindex             " + _("Maintain an index of the transactions touching each address, used by searchrawtransactions (default: 0)") + "\n";
+    strUsage += "  -addrutxoindex         " + _("Also maintain the unspent outputs of each address, used by getaddressbalance and getaddressutxos (implies -addrindex, default: 0)") + "\n";
+    strUsage += "  -reindexaddr           " + _("Rebuild the address index from the blocks on disk at startup") + "\n";
     strUsage += "  -loadblock=<file>      " + _("Imports blocks from external blk000?.dat file") + "\n";
     strUsage += "  -maxorphanblocks=<n>   " + strprintf(_("Keep at most <n> unconnectable blocks in memory (default: %u)"), DEFAULT_MAX_ORPHAN_BLOCKS) + "\n";
+    strUsage += "  -headersfirst          " + _("Download headers first and fetch blocks from several peers at once (default: 1)") + "\n";
+    strUsage += "  -maxmempool=<n>        " + strprintf(_("Keep the transaction memory pool below <n> megabytes (default: %u)"), DEFAULT_MAX_MEMPOOL_SIZE) + "\n";
+    strUsage += "  -mempoolexpiry=<n>     " + strprintf(_("Do not keep transactions in the mempool longer than <n> hours (default: %u)"), DEFAULT_MEMPOOL_EXPIRY) + "\n";
 
     strUsage += "\n" + _("Block creation options:") + "\n";
     strUsage += "  -blockminsize=<n>      "   + _("Set minimum block size in bytes (default: 0)") + "\n";
@@ -375,8 +391,26 @@ bool AppInit2(boost::thread_group& threadGroup)
 
     nNodeLifespan = GetArg("-addrlifespan", 7);
     fUseFastIndex = GetBoolArg("-fastindex", true);
+    fAddrIndex = GetBoolArg("-addrindex", false) || GetBoolArg("-addrutxoindex", false);
+    fAddrUnspentIndex = GetBoolArg("-addrutxoindex", false);
     nMinerSleep = GetArg("-minersleep", 500);
 
+    // -par=0 means autodetect, but nScriptCheckThreads==0 means no concurrency
+    nScriptCheckThreads = GetArg("-par", 0);
+    if (nScriptCheckThreads <= 0)
+        nScriptCheckThreads += boost::thread::hardware_concurrency();
+    if (nScriptCheckThreads <= 1)
+        nScriptCheckThreads = 0;
+    else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
+        nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
+
+    // -msgthreads=0 handles every message on the message handler thread
+    nMessageWorkerThreads = GetArg("-msgthreads", DEFAULT_MESSAGE_WORKER_THREADS);
+    if (nMessageWorkerThreads < 0)
+        nMessageWorkerThreads = 0;
+    else if (nMessageWorkerThreads > MAX_MESSAGE_WORKER_THREADS)
+        nMessageWorkerThreads = MAX_MESSAGE_WORKER_THREADS;
+
     nDerivationMethodIndex = 0;
 
     if (!SelectParamsFromCommandLine()) {
@@ -434,6 +468,12 @@ bool AppInit2(boost::thread_group& threadGroup)
             LogPrintf("AppInit2 : parameter interaction: -salvagewallet=1 -> setting -rescan=1\n");
     }
 
+    if (GetBoolArg("-addrutxoindex", false)) {
+        // the unspent output index is kept next to the address index
+        if (SoftSetBoolArg("-addrindex", true))
+            LogPrintf("AppInit2 : parameter interaction: -addrutxoindex=1 -> setting -addrindex=1\n");
+    }
+
     // ********************************************************* Step 3: parameter-to-internal-flags
 
     fDebug = !mapMultiArgs["-debug"].empty();
@@ -458,6 +498,14 @@ bool AppInit2(boost::thread_group& threadGroup)
     // Check for -debugnet (deprecated)
     if (GetBoolArg("-debugnet", false))
         InitWarning(_("Warning: Deprecated argument -debugnet ignored, use -debug=net"));
+    // Check for -maxsigcachesize (deprecated, still honoured as a number of entries)
+    if (mapArgs.count("-maxsigcachesize"))
+    {
+        if (mapArgs.count("-sigcachemb"))
+            InitWarning(_("Warning: Deprecated argument -maxsigcachesize ignored, -sigcachemb is set"));
+        else
+            InitWarning(_("Warning: Deprecated argument -maxsigcachesize, use -sigcachemb to size the signature cache in megabytes"));
+    }
     // Check for -socks - as this is a privacy risk to continue, exit here
     if (mapArgs.count("-socks"))
         return InitError(_("Error: Unsupported argument -socks found. Setting SOCKS version isn't possible anymore, only SOCKS5 proxies are supported."));
@@ -510,6 +558,26 @@ bool AppInit2(boost::thread_group& threadGroup)
     if (!InitSanityCheck())
         return InitError(_("Initialization sanity check failed. Harvest is shutting down."));
 
+    if (nScriptCheckThreads) {
+        LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
+        for (int i=0; i<nScriptCheckThreads-1; i++)
+            threadGroup.create_thread(&ThreadScriptCheck);
+    }
+
+    // Pool for batch work (block index loading, header hashing, rescans)
+    int nParallelThreads = boost::thread::hardware_concurrency();
+    if (nParallelThreads > 1) {
+        LogPrintf("Using %u threads for parallel batch work\n", nParallelThreads);
+        for (int i=0; i<nParallelThreads-1; i++)
+            threadGroup.create_thread(&ThreadParallelWorker);
+    }
+
+    if (nMessageWorkerThreads) {
+        LogPrintf("Using %u threads for message processing\n", nMessageWorkerThreads);
+        for (int i=0; i<nMessageWorkerThreads; i++)
+            threadGroup.create_thread(&ThreadMessageWorker);
+    }
+
     std::string strDataDir = GetDataDir().string();
 #ifdef ENABLE_WALLET
     std::string strWalletFileName = GetArg("-wallet", "wallet.dat");
@@ -531,6 +599,8 @@ bool AppInit2(boost::thread_group& threadGroup)
     LogPrintf("\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n");
     LogPrintf("Harvest version %s (%s)\n", FormatFullVersion(), CLIENT_DATE);
     LogPrintf("Using OpenSSL version %s\n", SSLeay_version(SSLEAY_VERSION));
+    LogPrintf("Using %s SHA256 for stake kernel search\n", SHA256DManyImplementation());
+    LogPrintf("Using %s scrypt for batched block hashing\n", scrypt_implementation());
     if (!fLogTimestamps)
         LogPrintf("Startup time: %s\n", DateTimeStrFormat("%x %H:%M:%S", GetTime()));
     LogPrintf("Default data directory %s\n", GetDefaultDataDir().string());
@@ -821,7 +891,7 @@ bool AppInit2(boost::thread_group& threadGroup)
     {
         string strMatch = mapArgs["-printblock"];
         int nFound = 0;
-        for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
         {
             uint256 hash = (*mi).first;
             if (strncmp(hash.ToString().c_str(), strMatch.c_str(), strMatch.size()) == 0)
@@ -1091,19 +1161,37 @@ bool AppInit2(boost::thread_group& threadGroup)
 
     RandAddSeedPerfmon();
 
+    // rows of the address index format older versions kept are not migrated
+    // block by block; they are dropped with the rest by -reindexaddr
+    if (fAddrIndex && !GetBoolArg("-reindexaddr", false))
+    {
+        CTxDB txdbAddr("r");
+        if (txdbAddr.HasLegacyAddrIndex())
+            return InitError(_("The address index was built by an older version. Restart with -reindexaddr to rebuild it."));
+    }
+
     // reindex addresses found in blockchain
-    if(GetBoolArg("-reindexaddr", false))
+    if(fAddrIndex && GetBoolArg("-reindexaddr", false))
     {
         uiInterface.InitMessage(_("Rebuilding address index..."));
         CBlockIndex *pblockAddrIndex = pindexBest;
 	CTxDB txdbAddr("rw");
+	// rows left by an earlier index, including ones for blocks since disconnected
+	if (!txdbAddr.WipeAddrIndex())
+	    return InitError(_("Error clearing the address index"));
 	while(pblockAddrIndex)
 	{
 	    uiInterface.InitMessage(strprintf("Rebuilding address index, block %i", pblockAddrIndex->nHeight));
-	    bool ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions=true);
 	    CBlock pblockAddr;
 	    if(pblockAddr.ReadFromDisk(pblockAddrIndex, true))
-	        pblockAddr.RebuildAddressIndex(txdbAddr);
+	    {
+	        // one batch per block
+	        txdbAddr.TxnBegin();
+	        if (pblockAddr.RebuildAddressIndex(txdbAddr, pblockAddrIndex))
+	            txdbAddr.TxnCommit();
+	        else
+	            txdbAddr.TxnAbort();
+	    }
 	    pblockAddrIndex = pblockAddrIndex->pprev;
 	}
     }
@@ -7,6 +7,8 @@
 
 #include "kernel.h"
 #include "txdb.h"
+#include "crypto/common.h"
+#include "crypto/sha256.h"
 
 using namespace std;
 
@@ -195,7 +197,12 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
 
 bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, unsigned int nTimeBlockFrom, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake)
 {
-    if (nTimeTx < txPrev.nTime)  // Transaction timestamp violation
+    return CheckStakeKernelHash(pindexPrev, nBits, nTimeBlockFrom, txPrev.nTime, txPrev.vout[prevout.n].nValue, prevout, nTimeTx, hashProofOfStake, targetProofOfStake, fPrintProofOfStake);
+}
+
+bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, unsigned int nTimeBlockFrom, unsigned int nTimeTxPrev, int64_t nValueIn, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake)
+{
+    if (nTimeTx < nTimeTxPrev)  // Transaction timestamp violation
         return error("CheckStakeKernelHash() : nTime violation");
 
     if (nTimeBlockFrom + nStakeMinAge > nTimeTx) // Min age requirement
@@ -206,7 +213,6 @@ bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, unsigned
     bnTarget.SetCompact(nBits);
 
     // Weighted target
-    int64_t nValueIn = txPrev.vout[prevout.n].nValue;
     CBigNum bnWeight = CBigNum(nValueIn);
     bnTarget *= bnWeight;
 
@@ -219,7 +225,7 @@ bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, unsigned
     // Calculate hash
     CDataStream ss(SER_GETHASH, 0);
 
-    ss << nStakeModifier << nTimeBlockFrom << txPrev.nTime << prevout.hash << prevout.n << nTimeTx;
+    ss << nStakeModifier << nTimeBlockFrom << nTimeTxPrev << prevout.hash << prevout.n << nTimeTx;
     hashProofOfStake = Hash(ss.begin(), ss.end());
 
     if (fPrintProofOfStake)
@@ -230,7 +236,7 @@ bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, unsigned
             DateTimeStrFormat(nTimeBlockFrom));
         LogPrintf("CheckStakeKernelHash() : check modifier=0x%016x nTimeBlockFrom=%u nTimeTxPrev=%u nPrevout=%u nTimeTx=%u hashProof=%s\n",
             nStakeModifier,
-            nTimeBlockFrom, txPrev.nTime, prevout.n, nTimeTx,
+            nTimeBlockFrom, nTimeTxPrev, prevout.n, nTimeTx,
             hashProofOfStake.ToString());
     }
 
@@ -247,7 +253,7 @@ bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, unsigned
             DateTimeStrFormat(nTimeBlockFrom));
         LogPrintf("CheckStakeKernelHash() : pass modifier=0x%016x nTimeBlockFrom=%u nTimeTxPrev=%u nPrevout=%u nTimeTx=%u hashProof=%s\n",
             nStakeModifier,
-            nTimeBlockFrom, txPrev.nTime, prevout.n, nTimeTx,
+            nTimeBlockFrom, nTimeTxPrev, prevout.n, nTimeTx,
             hashProofOfStake.ToString());
     }
 
@@ -293,8 +299,21 @@ bool CheckCoinStakeTimestamp(int nHeight, int64_t nTimeBlock, int64_t nTimeTx)
 
 bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, const COutPoint& prevout, int64_t* pBlockTime)
 {
-    uint256 hashProofOfStake, targetProofOfStake;
+    CStakeCandidate candidate;
+    if (!GetStakeCandidate(prevout, candidate))
+        return false;
+
+    if ((int64_t)candidate.nTimeBlockFrom + nStakeMinAge > nTime)
+        return false; // only count coins meeting min age requirement
+
+    if (pBlockTime)
+        *pBlockTime = candidate.nTimeBlockFrom;
 
+    return CheckKernel(pindexPrev, nBits, nTime, prevout, candidate);
+}
+
+bool GetStakeCandidate(const COutPoint& prevout, CStakeCandidate& candidate)
+{
     CTxDB txdb("r");
     CTransaction txPrev;
     CTxIndex txindex;
@@ -306,11 +325,65 @@ bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, con
     if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
         return false;
 
-    if (block.GetBlockTime() + nStakeMinAge > nTime)
+    candidate.hashBlock = block.GetHash();
+    candidate.nTimeBlockFrom = block.GetBlockTime();
+    candidate.nTimeTxPrev = txPrev.nTime;
+    candidate.nValue = txPrev.vout[prevout.n].nValue;
+    return true;
+}
+
+bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, const COutPoint& prevout, const CStakeCandidate& candidate)
+{
+    uint256 hashProofOfStake, targetProofOfStake;
+
+    if ((int64_t)candidate.nTimeBlockFrom + nStakeMinAge > nTime)
         return false; // only count coins meeting min age requirement
 
-    if (pBlockTime)
-        *pBlockTime = block.GetBlockTime();
+    return CheckStakeKernelHash(pindexPrev, nBits, candidate.nTimeBlockFrom, candidate.nTimeTxPrev, candidate.nValue, prevout, nTime, hashProofOfStake, targetProofOfStake);
+}
+
+bool CheckKernelBatch(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, unsigned int nCount, const COutPoint& prevout, const CStakeCandidate& candidate, std::vector<bool>& vKernel)
+{
+    vKernel.assign(nCount, false);
+
+    // Same weighted target as CheckStakeKernelHash(), compared as a uint256
+    // unless it is too large for any hash to miss it
+    CBigNum bnTarget;
+    bnTarget.SetCompact(nBits);
+    bnTarget *= CBigNum(candidate.nValue);
+    bool fAnyHash = (bnTarget >= CBigNum(~uint256(0)));
+    uint256 hashTarget = fAnyHash ? uint256(0) : bnTarget.getuint256();
+
+    // Every kernel shares everything but the trailing timestamp
+    CDataStream ss(SER_GETHASH, 0);
+    ss << pindexPrev->nStakeModifier << candidate.nTimeBlockFrom << candidate.nTimeTxPrev << prevout.hash << prevout.n;
+    const size_t nKernelSize = ss.size() + sizeof(unsigned int);
+    std::vector<unsigned char> vData(nKernelSize * nCount);
+    for (unsigned int n = 0; n < nCount; n++)
+    {
+        unsigned char* p = &vData[n * nKernelSize];
+        memcpy(p, &ss[0], ss.size());
+        WriteLE32(p + ss.size(), (uint32_t)(nTime - n));
+    }
+
+    std::vector<unsigned char> vHash(32 * nCount);
+    if (nCount > 0)
+        SHA256DMany(&vHash[0], &vData[0], nKernelSize, nCount);
 
-    return CheckStakeKernelHash(pindexPrev, nBits, block.GetBlockTime(), txPrev, prevout, nTime, hashProofOfStake, targetProofOfStake);
+    bool fFound = false;
+    for (unsigned int n = 0; n < nCount; n++)
+    {
+        int64_t nTimeTx = nTime - n;
+        if (nTimeTx < candidate.nTimeTxPrev || (int64_t)candidate.nTimeBlockFrom + nStakeMinAge > nTimeTx)
+            continue;
+
+        uint256 hashProofOfStake;
+        memcpy(hashProofOfStake.begin(), &vHash[n * 32], 32);
+        if (fAnyHash || hashProofOfStake <= hashTarget)
+        {
+            vKernel[n] = true;
+            fFound = true;
+        }
+    }
+    return fFound;
 }
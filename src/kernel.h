@@ -20,9 +20,27 @@ static const int MODIFIER_INTERVAL_RATIO = 3;
 // Compute the hash modifier for proof-of-stake
 bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeModifier, bool& fGeneratedStakeModifier);
 
+// Everything the kernel hash needs to know about a staked output, so that a
+// kernel search does not have to read it back from disk for every timestamp
+class CStakeCandidate
+{
+public:
+    uint256 hashBlock;          // block the output was confirmed in
+    unsigned int nTimeBlockFrom;
+    unsigned int nTimeTxPrev;
+    int64_t nValue;
+
+    CStakeCandidate()
+    {
+        nTimeBlockFrom = nTimeTxPrev = 0;
+        nValue = 0;
+    }
+};
+
 // Check whether stake kernel meets hash target
 // Sets hashProofOfStake on success return
 bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, unsigned int nTimeBlockFrom, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake=false);
+bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, unsigned int nTimeBlockFrom, unsigned int nTimeTxPrev, int64_t nValueIn, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake=false);
 
 // Check kernel hash target and coinstake signature
 // Sets hashProofOfStake on success return
@@ -39,4 +57,15 @@ int64_t GetWeight(int64_t nIntervalBeginning, int64_t nIntervalEnd);
 // Convenient for searching a kernel
 bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, const COutPoint& prevout, int64_t* pBlockTime = NULL);
 
+// Read the kernel hash inputs of a staked output from disk
+bool GetStakeCandidate(const COutPoint& prevout, CStakeCandidate& candidate);
+
+// CheckKernel() against an output already looked up with GetStakeCandidate()
+bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, const COutPoint& prevout, const CStakeCandidate& candidate);
+
+// CheckKernel() for nCount timestamps counting down from nTime, hashed side
+// by side. vKernel[n] is set when nTime - n meets the target. Returns
+// whether any did.
+bool CheckKernelBatch(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, unsigned int nCount, const COutPoint& prevout, const CStakeCandidate& candidate, std::vector<bool>& vKernel);
+
 #endif // PPCOIN_KERNEL_H
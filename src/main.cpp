@@ -7,8 +7,10 @@
 
 #include "addrman.h"
 #include "alert.h"
+#include "blockencodings.h"
 #include "chainparams.h"
 #include "checkpoints.h"
+#include "checkqueue.h"
 #include "db.h"
 #include "init.h"
 #include "kernel.h"
@@ -27,6 +29,8 @@
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
 #include <boost/lexical_cast.hpp>
 using namespace std;
 using namespace boost;
@@ -42,7 +46,7 @@ CCriticalSection cs_main;
 
 CTxMemPool mempool;
 
-map<uint256, CBlockIndex*> mapBlockIndex;
+BlockMap mapBlockIndex;
 set<pair<COutPoint, unsigned int> > setStakeSeen;
 
 CBigNum bnProofOfStakeLimit(~uint256(0) >> 20);
@@ -59,11 +63,16 @@ uint256 nBestInvalidTrust = 0;
 
 uint256 hashBestChain = 0;
 CBlockIndex* pindexBest = NULL;
+CCriticalSection cs_vBestChain;
+std::vector<CBlockIndex*> vBestChain;
 int64_t nTimeBestReceived = 0;
 bool fImporting = false;
 bool fReindex = false;
 bool fAddrIndex = false;
+bool fAddrUnspentIndex = false;
 bool fHaveGUI = false;
+int nScriptCheckThreads = 0;
+int nMessageWorkerThreads = 0;
 
 struct COrphanBlock {
 	uint256 hashBlock;
@@ -162,15 +171,72 @@ namespace {
 		// Whether this peer should be disconnected and banned.
 		bool fShouldBan;
 		std::string name;
+		// Time our getheaders to this peer was sent, 0 when none is outstanding.
+		int64_t nHeadersSyncStart;
+		// Height of the last header this peer sent us.
+		int nBestKnownHeight;
+		// Number of entries in mapHeaders that came from this peer.
+		unsigned int nHeadersHeld;
+		// Header to ask on from once there is room for more, 0 if none.
+		uint256 hashHeadersResume;
+		// Number of headers-first block requests outstanding with this peer.
+		int nBlocksInFlight;
+		// Don't request more blocks from this peer before this time.
+		int64_t nDownloadBackoffUntil;
+		// Whether the peer asked for new blocks in compact form.
+		bool fPreferCompactBlocks;
+		// Compact block from this peer waiting for the transactions we asked for.
+		bool fPartialBlock;
+		CPartialBlock partialBlock;
+		// Time the missing transactions of partialBlock were asked for.
+		int64_t nPartialBlockTime;
 
 		CNodeState() {
 			nMisbehavior = 0;
 			fShouldBan = false;
+			nHeadersSyncStart = 0;
+			nBestKnownHeight = 0;
+			nHeadersHeld = 0;
+			hashHeadersResume = 0;
+			nBlocksInFlight = 0;
+			nDownloadBackoffUntil = 0;
+			fPreferCompactBlocks = false;
+			fPartialBlock = false;
+			nPartialBlockTime = 0;
 		}
 	};
 
 	map<NodeId, CNodeState> mapNodeState;
 
+	// Headers-first sync. Headers from the sync peer that are not in
+	// mapBlockIndex yet are kept here; the bodies along the best of these
+	// chains are then fetched from all peers, a window at a time.
+	struct CHeaderEntry {
+		uint256 hashPrev;
+		int nHeight;
+		unsigned int nTime;
+		unsigned int nBits;
+		// Whether the header was taken for proof-of-stake rather than
+		// proof-of-work; it carries no coinstake to tell
+		bool fProofOfStake;
+		uint256 nChainTrust;
+		NodeId nodeid;
+	};
+
+	map<uint256, CHeaderEntry> mapHeaders;
+	// Best header chain from the first block we don't have, in height order.
+	deque<uint256> dqHeaderChain;
+	uint256 hashBestHeader;
+	int nBestHeaderHeight = 0;
+	uint256 nBestHeaderTrust = 0;
+	int64_t nLastHeaderChainProgress = 0;
+	// Blocks asked for along the header chain: hash -> (peer, time requested).
+	map<uint256, pair<NodeId, int64_t> > mapBlocksInFlight;
+	// Downloaded blocks waiting for their parent: hash -> (peer, block),
+	// and hashPrevBlock -> hash for every block in it.
+	map<uint256, pair<NodeId, CBlock> > mapBlocksStashed;
+	multimap<uint256, uint256> mapBlocksStashedByPrev;
+
 	// Requires cs_main.
 	CNodeState *State(NodeId pnode) {
 		map<NodeId, CNodeState>::iterator it = mapNodeState.find(pnode);
@@ -194,8 +260,39 @@ namespace {
 		state.name = pnode->addrName;
 	}
 
+	// Forget a header, keeping the count of the peer that sent it in step
+	void EraseHeader(map<uint256, CHeaderEntry>::iterator mi)
+	{
+		CNodeState *state = State(mi->second.nodeid);
+		if (state && state->nHeadersHeld > 0)
+			state->nHeadersHeld--;
+		mapHeaders.erase(mi);
+	}
+
+	// Drop the headers a peer sent that are not on the best header chain
+	void EvictPeerHeaders(NodeId nodeid)
+	{
+		set<uint256> setBestChain(dqHeaderChain.begin(), dqHeaderChain.end());
+		for (map<uint256, CHeaderEntry>::iterator mi = mapHeaders.begin(); mi != mapHeaders.end(); )
+		{
+			if (mi->second.nodeid == nodeid && !setBestChain.count(mi->first))
+				EraseHeader(mi++);
+			else
+				++mi;
+		}
+	}
+
 	void FinalizeNode(NodeId nodeid) {
 		LOCK(cs_main);
+		EvictPeerHeaders(nodeid);
+		// Hand its outstanding block requests back to the download window
+		for (map<uint256, pair<NodeId, int64_t> >::iterator it = mapBlocksInFlight.begin(); it != mapBlocksInFlight.end(); )
+		{
+			if (it->second.first == nodeid)
+				mapBlocksInFlight.erase(it++);
+			else
+				++it;
+		}
 		mapNodeState.erase(nodeid);
 	}
 
@@ -604,7 +701,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
 	}
 
 	// Is the tx in a block that's in the main chain
-	map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+	BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
 	if (mi == mapBlockIndex.end())
 		return 0;
 	CBlockIndex* pindex = (*mi).second;
@@ -772,6 +869,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
 		}
 	}
 
+	int64_t nFees = 0;
 	{
 		CTxDB txdb("r");
 
@@ -815,7 +913,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
 				error("AcceptToMemoryPool : too many sigops %s, %d > %d",
 					hash.ToString(), nSigOps, MAX_TX_SIGOPS));
 
-		int64_t nFees = tx.GetValueIn(mapInputs) - tx.GetValueOut();
+		nFees = tx.GetValueIn(mapInputs) - tx.GetValueOut();
 		unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
 
 		// Don't accept it if it can't get into a block
@@ -831,6 +929,14 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
 					hash.ToString(),
 					nFees, txMinFee);
 
+			// Once the pool has had to evict, demand at least the feerate
+			// of what was thrown out
+			int64_t nPoolMinFee = pool.GetMinFee(nSize);
+			if (fLimitFree && nPoolMinFee > 0 && nFees < nPoolMinFee)
+				return error("AcceptToMemoryPool : mempool min fee not met %s, %d < %d",
+					hash.ToString(),
+					nFees, nPoolMinFee);
+
 			// Continuously rate-limit free transactions
 			// This mitigates 'penny-flooding' -- sending thousands of free transactions just to
 			// be annoying or make others' transactions take longer to confirm.
@@ -883,7 +989,15 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
 	}
 
 	// Store transaction in memory
-	pool.addUnchecked(hash, tx);
+	pool.addUnchecked(hash, tx, nFees);
+
+	// Drop stale entries and keep the pool within -maxmempool. If that
+	// pushed out the transaction we just added, it does not get in.
+	pool.Expire(GetTime() - GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+	pool.TrimToSize(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000);
+	if (!pool.exists(hash))
+		return error("AcceptToMemoryPool : mempool full, %s not accepted", hash.ToString());
+
 	setValidatedTx.insert(hash);
 
 	SyncWithWallets(tx, NULL);
@@ -1046,7 +1160,7 @@ int CMerkleTx::GetDepthInMainChainINTERNAL(CBlockIndex* &pindexRet) const
 	AssertLockHeld(cs_main);
 
 	// Find the block it claims to be in
-	map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+	BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
 	if (mi == mapBlockIndex.end())
 		return 0;
 	CBlockIndex* pindex = (*mi).second;
@@ -1212,7 +1326,7 @@ int CTxIndex::GetDepthInMainChain() const
 	if (!block.ReadFromDisk(pos.nFile, pos.nBlockPos, false))
 		return 0;
 	// Find the block in the index
-	map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.GetHash());
+	BlockMap::iterator mi = mapBlockIndex.find(block.GetHash());
 	if (mi == mapBlockIndex.end())
 		return 0;
 	CBlockIndex* pindex = (*mi).second;
@@ -1268,22 +1382,31 @@ bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock)
 // CBlock and CBlockIndex
 //
 
-static CBlockIndex* pblockindexFBBHLast;
+// Callers without cs_main may be racing a reorganisation, but a
+// CBlockIndex is never freed, so the entry returned stays valid
 CBlockIndex* FindBlockByHeight(int nHeight)
 {
-	CBlockIndex *pblockindex;
-	if (nHeight < nBestHeight / 2)
-		pblockindex = pindexGenesisBlock;
-	else
-		pblockindex = pindexBest;
-	if (pblockindexFBBHLast && abs(nHeight - pblockindex->nHeight) > abs(nHeight - pblockindexFBBHLast->nHeight))
-		pblockindex = pblockindexFBBHLast;
-	while (pblockindex->nHeight > nHeight)
-		pblockindex = pblockindex->pprev;
-	while (pblockindex->nHeight < nHeight)
-		pblockindex = pblockindex->pnext;
-	pblockindexFBBHLast = pblockindex;
-	return pblockindex;
+	LOCK(cs_vBestChain);
+	if (nHeight < 0 || nHeight >= (int)vBestChain.size())
+		return NULL;
+	return vBestChain[nHeight];
+}
+
+void SetBestChainIndex(CBlockIndex* pindex)
+{
+	LOCK(cs_vBestChain);
+	if (pindex == NULL)
+	{
+		vBestChain.clear();
+		return;
+	}
+	vBestChain.resize(pindex->nHeight + 1);
+	// Only the blocks past the fork with the old chain need to be written
+	while (pindex && vBestChain[pindex->nHeight] != pindex)
+	{
+		vBestChain[pindex->nHeight] = pindex;
+		pindex = pindex->pprev;
+	}
 }
 
 bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions)
@@ -1385,32 +1508,18 @@ const CBlockIndex* GetLastBlockIndex(const CBlockIndex* pindex, bool fProofOfSta
 	return pindex;
 }
 
-unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfStake)
+// Retarget from the last block and the spacing between the last two blocks
+// of the kind being targeted, nBitsPrev == 0 while there aren't two yet
+static unsigned int CalculateNextTarget(int nHeightLast, unsigned int nTimeLast, bool fProofOfStake, unsigned int nBitsPrev, int64_t nActualSpacing, int64_t nTimespan)
 {
 	unsigned int nTargetTemp = TARGET_SPACING;
-	if (pindexLast->nTime > FORK_TIME)
+	if (nTimeLast > FORK_TIME)
 		nTargetTemp = TARGET_SPACING2;
 
-	if (pindexLast->GetBlockTime() > STAKE_TIMESPAN_SWITCH_TIME)
-		nTargetTimespan = 2 * 60; // 2 minutes
-
-	if (pindexLast->GetBlockTime() > STAKE_TIMESPAN_SWITCH_TIME1)
-		nTargetTimespan = 10 * 60; // 10 minutes
-
-	CBigNum bnTargetLimit = fProofOfStake ? GetProofOfStakeLimit(pindexLast->nHeight) : Params().ProofOfWorkLimit();
-
-	if (pindexLast == NULL)
-		return bnTargetLimit.GetCompact(); // genesis block
-
-
-	const CBlockIndex* pindexPrev = GetLastBlockIndex(pindexLast, fProofOfStake);
-	if (pindexPrev->pprev == NULL)
-		return bnTargetLimit.GetCompact(); // first block
-	const CBlockIndex* pindexPrevPrev = GetLastBlockIndex(pindexPrev->pprev, fProofOfStake);
-	if (pindexPrevPrev->pprev == NULL)
-		return bnTargetLimit.GetCompact(); // second block
+	CBigNum bnTargetLimit = fProofOfStake ? GetProofOfStakeLimit(nHeightLast) : Params().ProofOfWorkLimit();
 
-	int64_t nActualSpacing = pindexPrev->GetBlockTime() - pindexPrevPrev->GetBlockTime();
+	if (nBitsPrev == 0)
+		return bnTargetLimit.GetCompact();
 
 	if (nActualSpacing < 0) {
 		nActualSpacing = nTargetTemp;
@@ -1419,8 +1528,8 @@ unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfS
 	// ppcoin: target change every block
 	// ppcoin: retarget with exponential moving toward target spacing
 	CBigNum bnNew;
-	bnNew.SetCompact(pindexPrev->nBits);
-	int64_t nInterval = nTargetTimespan / nTargetTemp;
+	bnNew.SetCompact(nBitsPrev);
+	int64_t nInterval = nTimespan / nTargetTemp;
 	bnNew *= ((nInterval - 1) * nTargetTemp + nActualSpacing + nActualSpacing);
 	bnNew /= ((nInterval + 1) * nTargetTemp);
 
@@ -1430,6 +1539,36 @@ unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfS
 	return bnNew.GetCompact();
 }
 
+unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfStake)
+{
+	if (pindexLast->GetBlockTime() > STAKE_TIMESPAN_SWITCH_TIME)
+		nTargetTimespan = 2 * 60; // 2 minutes
+
+	if (pindexLast->GetBlockTime() > STAKE_TIMESPAN_SWITCH_TIME1)
+		nTargetTimespan = 10 * 60; // 10 minutes
+
+	if (pindexLast == NULL)
+		return CalculateNextTarget(0, 0, fProofOfStake, 0, 0, nTargetTimespan); // genesis block
+
+	const CBlockIndex* pindexPrev = GetLastBlockIndex(pindexLast, fProofOfStake);
+	if (pindexPrev->pprev == NULL)
+		return CalculateNextTarget(pindexLast->nHeight, pindexLast->nTime, fProofOfStake, 0, 0, nTargetTimespan); // first block
+	const CBlockIndex* pindexPrevPrev = GetLastBlockIndex(pindexPrev->pprev, fProofOfStake);
+	if (pindexPrevPrev->pprev == NULL)
+		return CalculateNextTarget(pindexLast->nHeight, pindexLast->nTime, fProofOfStake, 0, 0, nTargetTimespan); // second block
+
+	int64_t nActualSpacing = pindexPrev->GetBlockTime() - pindexPrevPrev->GetBlockTime();
+	return CalculateNextTarget(pindexLast->nHeight, pindexLast->nTime, fProofOfStake, pindexPrev->nBits, nActualSpacing, nTargetTimespan);
+}
+
+// Blocks on the main chain whose nBits don't follow the retarget rule
+static bool IsTargetException(const uint256& hash)
+{
+	return hash == uint256("0x474619e0a58ec88c8e2516f8232064881750e87acac3a416d65b99bd61246968") ||
+		hash == uint256("0x4f3dd45d3de3737d60da46cff2d36df0002b97c505cdac6756d2d88561840b63") ||
+		hash == uint256("0x274996cec47b3f3e6cd48c8f0b39c32310dd7ddc8328ae37762be956b9031024");
+}
+
 bool CheckProofOfWork(uint256 hash, unsigned int nBits)
 {
 	CBigNum bnTarget;
@@ -1520,27 +1659,55 @@ bool CTransaction::DisconnectInputs(CTxDB& txdb)
 	// Relinquish previous transactions' spent pointers
 	if (!IsCoinBase())
 	{
+		map<uint256, CTxIndex> mapPrevIndex;
 		BOOST_FOREACH(const CTxIn& txin, vin)
 		{
 			COutPoint prevout = txin.prevout;
 
 			// Get prev txindex from disk
-			CTxIndex txindex;
-			if (!txdb.ReadTxIndex(prevout.hash, txindex))
-				return error("DisconnectInputs() : ReadTxIndex failed");
+			map<uint256, CTxIndex>::iterator mi = mapPrevIndex.find(prevout.hash);
+			if (mi == mapPrevIndex.end())
+			{
+				CTxIndex txindex;
+				if (!txdb.ReadTxIndex(prevout.hash, txindex))
+					return error("DisconnectInputs() : ReadTxIndex failed");
+				mi = mapPrevIndex.insert(make_pair(prevout.hash, txindex)).first;
+			}
+			CTxIndex& txindex = (*mi).second;
 
 			if (prevout.n >= txindex.vSpent.size())
 				return error("DisconnectInputs() : prevout.n out of range");
 
 			// Mark outpoint as not spent
 			txindex.vSpent[prevout.n].SetNull();
+		}
+
+		for (map<uint256, CTxIndex>::iterator mi = mapPrevIndex.begin(); mi != mapPrevIndex.end(); ++mi)
+		{
+			const uint256& hashPrev = (*mi).first;
+			const CTxIndex& txindex = (*mi).second;
 
 			// Write back
-			if (!txdb.UpdateTxIndex(prevout.hash, txindex))
+			if (!txdb.UpdateTxIndex(hashPrev, txindex))
 				return error("DisconnectInputs() : UpdateTxIndex failed");
+
+			// Give the outputs back to the coins store. The store only keeps
+			// unspent outputs and the record may have been pruned, so rebuild
+			// it from the block file, once per previous transaction.
+			CTransaction txPrev;
+			if (!txPrev.ReadFromDisk(txindex.pos))
+				return error("DisconnectInputs() : ReadFromDisk prev tx %s failed", hashPrev.ToString());
+			CCoins coins(txPrev);
+			for (unsigned int i = 0; i < txindex.vSpent.size(); i++)
+				if (!txindex.vSpent[i].IsNull())
+					coins.Spend(i);
+			if (!txdb.WriteCoins(hashPrev, coins))
+				return error("DisconnectInputs() : WriteCoins failed");
 		}
 	}
 
+	txdb.EraseCoins(GetHash());
+
 	// Remove transaction from index
 	// This can fail if a duplicate of this transaction was in a chain that got
 	// reorganized away. This is only possible if this transaction was completely
@@ -1552,7 +1719,7 @@ bool CTransaction::DisconnectInputs(CTxDB& txdb)
 
 
 bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTestPool,
-	bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid)
+	bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid, bool fFullTx)
 {
 	// FetchInputs can return false either because we just haven't seen some inputs
 	// (in which case the transaction should be stored as an orphan)
@@ -1585,21 +1752,35 @@ bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTes
 		if (!fFound && (fBlock || fMiner))
 			return fMiner ? false : error("FetchInputs() : %s prev tx %s index entry not found", GetHash().ToString(), prevout.hash.ToString());
 
-		// Read txPrev
-		CTransaction& txPrev = inputsRet[prevout.hash].second;
+		// Read the outputs of txPrev
+		CCoins& coins = inputsRet[prevout.hash].second;
 		if (!fFound || txindex.pos == CDiskTxPos(1, 1, 1))
 		{
 			// Get prev tx from single transactions in memory
+			CTransaction txPrev;
 			if (!mempool.lookup(prevout.hash, txPrev))
 				return error("FetchInputs() : %s mempool Tx prev not found %s", GetHash().ToString(), prevout.hash.ToString());
 			if (!fFound)
 				txindex.vSpent.resize(txPrev.vout.size());
+			coins = CCoins(txPrev, false);
 		}
 		else
 		{
-			// Get prev tx from disk
-			if (!txPrev.ReadFromDisk(txindex.pos))
-				return error("FetchInputs() : %s ReadFromDisk prev tx %s failed", GetHash().ToString(), prevout.hash.ToString());
+			// Use the coins store if it still has every output of txPrev
+			// that we spend, so the block file doesn't have to be read
+			bool fCoins = !fFullTx && txdb.ReadCoins(prevout.hash, coins);
+			for (unsigned int j = i; fCoins && j < vin.size(); j++)
+				if (vin[j].prevout.hash == prevout.hash && !coins.IsAvailable(vin[j].prevout.n))
+					fCoins = false;
+
+			if (!fCoins)
+			{
+				// Get prev tx from disk
+				CTransaction txPrev;
+				if (!txPrev.ReadFromDisk(txindex.pos))
+					return error("FetchInputs() : %s ReadFromDisk prev tx %s failed", GetHash().ToString(), prevout.hash.ToString());
+				coins = CCoins(txPrev, false);
+			}
 		}
 	}
 
@@ -1609,13 +1790,13 @@ bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTes
 		const COutPoint prevout = vin[i].prevout;
 		assert(inputsRet.count(prevout.hash) != 0);
 		const CTxIndex& txindex = inputsRet[prevout.hash].first;
-		const CTransaction& txPrev = inputsRet[prevout.hash].second;
-		if (prevout.n >= txPrev.vout.size() || prevout.n >= txindex.vSpent.size())
+		const CCoins& coins = inputsRet[prevout.hash].second;
+		if (prevout.n >= coins.vout.size() || prevout.n >= txindex.vSpent.size())
 		{
 			// Revisit this if/when transaction replacement is implemented and allows
 			// adding inputs:
 			fInvalid = true;
-			return DoS(100, error("FetchInputs() : %s prevout.n out of range %d %u %u prev tx %s\n%s", GetHash().ToString(), prevout.n, txPrev.vout.size(), txindex.vSpent.size(), prevout.hash.ToString(), txPrev.ToString()));
+			return DoS(100, error("FetchInputs() : %s prevout.n out of range %d %u %u prev tx %s\n%s", GetHash().ToString(), prevout.n, coins.vout.size(), txindex.vSpent.size(), prevout.hash.ToString(), coins.ToString()));
 		}
 	}
 
@@ -1628,11 +1809,11 @@ const CTxOut& CTransaction::GetOutputFor(const CTxIn& input, const MapPrevTx& in
 	if (mi == inputs.end())
 		throw std::runtime_error("CTransaction::GetOutputFor() : prevout.hash not found");
 
-	const CTransaction& txPrev = (mi->second).second;
-	if (input.prevout.n >= txPrev.vout.size())
+	const CCoins& coins = (mi->second).second;
+	if (input.prevout.n >= coins.vout.size())
 		throw std::runtime_error("CTransaction::GetOutputFor() : prevout.n out of range");
 
-	return txPrev.vout[input.prevout.n];
+	return coins.vout[input.prevout.n];
 }
 
 int64_t CTransaction::GetValueIn(const MapPrevTx& inputs) const
@@ -1649,8 +1830,14 @@ int64_t CTransaction::GetValueIn(const MapPrevTx& inputs) const
 
 }
 
+bool CScriptCheck::operator()() const
+{
+	const CScript& scriptSig = ptxTo->vin[nIn].scriptSig;
+	return VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType, psighashcache.get());
+}
+
 bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-	const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags, bool fValidateSig)
+	const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags, bool fValidateSig, std::vector<CScriptCheck>* pvChecks)
 {
 	// Take over previous transactions' spent pointers
 	// fBlock is true when this is called from AcceptBlock when a new best-block is added to the blockchain
@@ -1665,38 +1852,39 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
 			COutPoint prevout = vin[i].prevout;
 			assert(inputs.count(prevout.hash) > 0);
 			CTxIndex& txindex = inputs[prevout.hash].first;
-			CTransaction& txPrev = inputs[prevout.hash].second;
+			const CCoins& coins = inputs[prevout.hash].second;
 
-			if (prevout.n >= txPrev.vout.size() || prevout.n >= txindex.vSpent.size())
-				return DoS(100, error("ConnectInputs() : %s prevout.n out of range %d %u %u prev tx %s\n%s", GetHash().ToString(), prevout.n, txPrev.vout.size(), txindex.vSpent.size(), prevout.hash.ToString(), txPrev.ToString()));
+			if (prevout.n >= coins.vout.size() || prevout.n >= txindex.vSpent.size())
+				return DoS(100, error("ConnectInputs() : %s prevout.n out of range %d %u %u prev tx %s\n%s", GetHash().ToString(), prevout.n, coins.vout.size(), txindex.vSpent.size(), prevout.hash.ToString(), coins.ToString()));
 
 			// If prev is coinbase or coinstake, check that it's matured
-			if (txPrev.IsCoinBase() || txPrev.IsCoinStake())
+			if (coins.IsCoinBase() || coins.IsCoinStake())
 			{
 				int nSpendDepth;
 				if (IsConfirmedInNPrevBlocks(txindex, pindexBlock, nCoinbaseMaturity, nSpendDepth)) {
-					return error("ConnectInputs() : tried to spend %s at depth %d", txPrev.IsCoinBase() ? "coinbase" : "coinstake", nSpendDepth);
+					return error("ConnectInputs() : tried to spend %s at depth %d", coins.IsCoinBase() ? "coinbase" : "coinstake", nSpendDepth);
 				}
 			}
 			// ppcoin: check transaction timestamp
-			if (txPrev.nTime > nTime)
+			if (coins.nTime > nTime)
 				return DoS(100, error("ConnectInputs() : transaction timestamp earlier than input transaction"));
 
 			// Check for negative or overflow input values
-			nValueIn += txPrev.vout[prevout.n].nValue;
-			if (!MoneyRange(txPrev.vout[prevout.n].nValue) || !MoneyRange(nValueIn))
+			nValueIn += coins.vout[prevout.n].nValue;
+			if (!MoneyRange(coins.vout[prevout.n].nValue) || !MoneyRange(nValueIn))
 				return DoS(100, error("ConnectInputs() : txin values out of range"));
 
 		}
 		// The first loop above does all the inexpensive checks.
 		// Only if ALL inputs pass do we perform expensive ECDSA signature checks.
 		// Helps prevent CPU exhaustion attacks.
+		boost::shared_ptr<const CSigHashCache> psighashcache;
 		for (unsigned int i = 0; i < vin.size(); i++)
 		{
 			COutPoint prevout = vin[i].prevout;
 			assert(inputs.count(prevout.hash) > 0);
 			CTxIndex& txindex = inputs[prevout.hash].first;
-			CTransaction& txPrev = inputs[prevout.hash].second;
+			const CScript& scriptPubKey = inputs[prevout.hash].second.vout[prevout.n].scriptPubKey;
 
 			// Check for conflicts (double-spend)
 			// This doesn't trigger the DoS code on purpose; if it did, it would make it easier
@@ -1711,8 +1899,19 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
 				// still computed and checked, and any change will be caught at the next checkpoint.
 				if (!(fBlock && !IsInitialBlockDownload()))
 				{
+					// Inputs of one transaction share the serialization
+					// their signature hashes are computed over
+					if (!psighashcache && vin.size() > 1)
+						psighashcache.reset(new CSigHashCache(*this));
+					if (pvChecks)
+					{
+						// Defer to the caller's check queue; it reports
+						// failures for the block as a whole.
+						pvChecks->push_back(CScriptCheck());
+						CScriptCheck(scriptPubKey, *this, i, flags, 0, psighashcache).swap(pvChecks->back());
+					}
 					// Verify signature
-					if (!VerifySignature(txPrev, *this, i, flags, 0))
+					else if (!CScriptCheck(scriptPubKey, *this, i, flags, 0, psighashcache)())
 					{
 						if (flags & STANDARD_NOT_MANDATORY_VERIFY_FLAGS) {
 							// Check whether the failure was caused by a
@@ -1721,7 +1920,7 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
 							// if so, don't trigger DoS protection to
 							// avoid splitting the network between upgraded and
 							// non-upgraded nodes.
-							if (VerifySignature(txPrev, *this, i, flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, 0))
+							if (CScriptCheck(scriptPubKey, *this, i, flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, 0)())
 								return error("ConnectInputs() : %s non-mandatory VerifySignature failed", GetHash().ToString());
 						}
 						// Failures of other flags indicate a transaction that is
@@ -1765,30 +1964,6 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
 	return true;
 }
 
-bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
-{
-	// Disconnect in reverse order
-	for (int i = vtx.size() - 1; i >= 0; i--)
-		if (!vtx[i].DisconnectInputs(txdb))
-			return false;
-
-	// Update block index on disk without changing it in memory.
-	// The memory index structure will be changed after the db commits.
-	if (pindex->pprev)
-	{
-		CDiskBlockIndex blockindexPrev(pindex->pprev);
-		blockindexPrev.hashNext = 0;
-		if (!txdb.WriteBlockIndex(blockindexPrev))
-			return error("DisconnectBlock() : WriteBlockIndex failed");
-	}
-
-	// ppcoin: clean up wallet after disconnecting coinstake
-	BOOST_FOREACH(CTransaction& tx, vtx)
-		SyncWithWallets(tx, this, false);
-
-	return true;
-}
-
 bool static BuildAddrIndex(const CScript &script, std::vector<uint160>& addrIds)
 {
 	CScript::const_iterator pc = script.begin();
@@ -1824,17 +1999,115 @@ bool static BuildAddrIndex(const CScript &script, std::vector<uint160>& addrIds)
 	}
 }
 
-bool FindTransactionsByDestination(const CTxDestination &dest, std::vector<uint256> &vtxhash) {
-	uint160 addrid = 0;
+/** An address index row and the outpoint it creates or spends, which is
+ * what the unspent output index is keyed by. */
+struct CAddrIndexRow
+{
+	CAddrIndexKey key;
+	int64_t nValue;
+	COutPoint outpoint;
+};
+
+// Append the address index rows of tx to vRows: one for each address of
+// every output it spends and of every output it creates. mapInputs holds the
+// previous transactions, as returned by FetchInputs.
+static void GetAddrIndexRows(const CTransaction& tx, const MapPrevTx& mapInputs, int nHeight, std::vector<CAddrIndexRow>& vRows)
+{
+	uint256 hashTx = tx.GetHash();
+	if (!tx.IsCoinBase())
+	{
+		for (unsigned int i = 0; i < tx.vin.size(); i++)
+		{
+			const COutPoint& prevout = tx.vin[i].prevout;
+			MapPrevTx::const_iterator mi = mapInputs.find(prevout.hash);
+			if (mi == mapInputs.end() || prevout.n >= (*mi).second.second.vout.size())
+				continue;
+			const CTxOut& txout = (*mi).second.second.vout[prevout.n];
+			std::vector<uint160> addrIds;
+			if (txout.IsEmpty() || !BuildAddrIndex(txout.scriptPubKey, addrIds))
+				continue;
+			BOOST_FOREACH(const uint160& addrId, addrIds)
+			{
+				CAddrIndexRow row;
+				row.key = CAddrIndexKey(addrId, nHeight, hashTx, true, i);
+				row.nValue = -txout.nValue;
+				row.outpoint = prevout;
+				vRows.push_back(row);
+			}
+		}
+	}
+	for (unsigned int i = 0; i < tx.vout.size(); i++)
+	{
+		const CTxOut& txout = tx.vout[i];
+		std::vector<uint160> addrIds;
+		if (txout.IsEmpty() || !BuildAddrIndex(txout.scriptPubKey, addrIds))
+			continue;
+		BOOST_FOREACH(const uint160& addrId, addrIds)
+		{
+			CAddrIndexRow row;
+			row.key = CAddrIndexKey(addrId, nHeight, hashTx, false, i);
+			row.nValue = txout.nValue;
+			row.outpoint = COutPoint(hashTx, i);
+			vRows.push_back(row);
+		}
+	}
+}
+
+// Write the rows of a connected block, or with fErase remove those of a
+// disconnected one. Rows are applied in block order (reverse order when
+// erasing), so an output created and spent in the same block leaves no
+// unspent entry behind.
+static bool UpdateAddrIndex(CTxDB& txdb, const std::vector<CAddrIndexRow>& vRows, bool fErase)
+{
+	if (!fErase)
+	{
+		BOOST_FOREACH(const CAddrIndexRow& row, vRows)
+		{
+			if (!txdb.WriteAddrIndex(row.key, row.nValue))
+				return false;
+			if (!fAddrUnspentIndex)
+				continue;
+			if (row.key.fSpend ? !txdb.EraseAddrUnspent(row.key.addrId, row.outpoint)
+				: !txdb.WriteAddrUnspent(row.key.addrId, row.outpoint, row.nValue))
+				return false;
+		}
+		return true;
+	}
+
+	BOOST_REVERSE_FOREACH(const CAddrIndexRow& row, vRows)
+	{
+		if (!txdb.EraseAddrIndex(row.key))
+			return false;
+		if (!fAddrUnspentIndex)
+			continue;
+		if (row.key.fSpend ? !txdb.WriteAddrUnspent(row.key.addrId, row.outpoint, -row.nValue)
+			: !txdb.EraseAddrUnspent(row.key.addrId, row.outpoint))
+			return false;
+	}
+	return true;
+}
+
+static bool GetAddrIndexId(const CTxDestination &dest, uint160& addrId)
+{
 	const CKeyID *pkeyid = boost::get<CKeyID>(&dest);
 	if (pkeyid)
-		addrid = static_cast<uint160>(*pkeyid);
-	if (!addrid) {
-		const CScriptID *pscriptid = boost::get<CScriptID>(&dest);
-		if (pscriptid)
-			addrid = static_cast<uint160>(*pscriptid);
+	{
+		addrId = static_cast<uint160>(*pkeyid);
+		return true;
+	}
+	const CScriptID *pscriptid = boost::get<CScriptID>(&dest);
+	if (pscriptid)
+	{
+		addrId = static_cast<uint160>(*pscriptid);
+		return true;
 	}
-	if (!addrid)
+	return false;
+}
+
+bool FindTransactionsByDestination(const CTxDestination &dest, int nSkip, int nCount, std::vector<uint256> &vtxhash)
+{
+	uint160 addrId;
+	if (!GetAddrIndexId(dest, addrId))
 	{
 		LogPrintf("FindTransactionsByDestination(): Couldn't parse dest into addrid\n");
 		return false;
@@ -1842,7 +2115,7 @@ bool FindTransactionsByDestination(const CTxDestination &dest, std::vector<uint2
 
 	LOCK(cs_main);
 	CTxDB txdb("r");
-	if (!txdb.ReadAddrIndex(addrid, vtxhash))
+	if (!txdb.ReadAddrIndex(addrId, nSkip, nCount, vtxhash))
 	{
 		LogPrintf("FindTransactionsByDestination(): txdb.ReadAddrIndex failed\n");
 		return false;
@@ -1850,50 +2123,103 @@ bool FindTransactionsByDestination(const CTxDestination &dest, std::vector<uint2
 	return true;
 }
 
-void CBlock::RebuildAddressIndex(CTxDB& txdb)
+bool FindUnspentByDestination(const CTxDestination &dest, std::vector<std::pair<COutPoint, int64_t> > &vUnspent)
+{
+	uint160 addrId;
+	if (!GetAddrIndexId(dest, addrId))
+	{
+		LogPrintf("FindUnspentByDestination(): Couldn't parse dest into addrid\n");
+		return false;
+	}
+
+	LOCK(cs_main);
+	CTxDB txdb("r");
+	if (!txdb.ReadAddrUnspent(addrId, vUnspent))
+	{
+		LogPrintf("FindUnspentByDestination(): txdb.ReadAddrUnspent failed\n");
+		return false;
+	}
+	return true;
+}
+
+bool CBlock::RebuildAddressIndex(CTxDB& txdb, CBlockIndex* pindex)
 {
+	std::vector<CAddrIndexRow> vAddrRows;
 	BOOST_FOREACH(CTransaction& tx, vtx)
 	{
-		uint256 hashTx = tx.GetHash();
-		// inputs
-		if (!tx.IsCoinBase())
+		MapPrevTx mapInputs;
+		map<uint256, CTxIndex> mapUnused;
+		bool fInvalid;
+		if (!tx.FetchInputs(txdb, mapUnused, true, false, mapInputs, fInvalid, true))
+			return error("RebuildAddressIndex() : FetchInputs failed for %s", tx.GetHash().ToString());
+		GetAddrIndexRows(tx, mapInputs, pindex->nHeight, vAddrRows);
+	}
+
+	// Blocks are rebuilt newest first, so the unspent entries are taken from
+	// the txindex instead of replaying the spends.
+	BOOST_FOREACH(const CAddrIndexRow& row, vAddrRows)
+	{
+		if (!txdb.WriteAddrIndex(row.key, row.nValue))
+			return error("RebuildAddressIndex() : WriteAddrIndex failed");
+		if (!fAddrUnspentIndex || row.key.fSpend)
+			continue;
+		CTxIndex txindex;
+		bool fUnspent = txdb.ReadTxIndex(row.outpoint.hash, txindex) &&
+			row.outpoint.n < txindex.vSpent.size() && txindex.vSpent[row.outpoint.n].IsNull();
+		if (fUnspent ? !txdb.WriteAddrUnspent(row.key.addrId, row.outpoint, row.nValue)
+			: !txdb.EraseAddrUnspent(row.key.addrId, row.outpoint))
+			return error("RebuildAddressIndex() : updating unspent index failed");
+	}
+	return true;
+}
+
+bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
+{
+	// Remove the block's address index rows while the txindex entries of the
+	// outputs it spends are still in place
+	if (fAddrIndex)
+	{
+		std::vector<CAddrIndexRow> vAddrRows;
+		BOOST_FOREACH(CTransaction& tx, vtx)
 		{
 			MapPrevTx mapInputs;
-			map<uint256, CTxIndex> mapQueuedChangesT;
+			map<uint256, CTxIndex> mapUnused;
 			bool fInvalid;
-			if (!tx.FetchInputs(txdb, mapQueuedChangesT, true, false, mapInputs, fInvalid))
-				return;
-
-			MapPrevTx::const_iterator mi;
-			for (MapPrevTx::const_iterator mi = mapInputs.begin(); mi != mapInputs.end(); ++mi)
-			{
-				BOOST_FOREACH(const CTxOut &atxout, (*mi).second.second.vout)
-				{
-					std::vector<uint160> addrIds;
-					if (BuildAddrIndex(atxout.scriptPubKey, addrIds))
-					{
-						BOOST_FOREACH(uint160 addrId, addrIds)
-						{
-							if (!txdb.WriteAddrIndex(addrId, hashTx))
-								LogPrintf("RebuildAddressIndex(): txins WriteAddrIndex failed addrId: %s txhash: %s\n", addrId.ToString().c_str(), hashTx.ToString().c_str());
-						}
-					}
-				}
-			}
-		}
-		// outputs
-		BOOST_FOREACH(const CTxOut &atxout, tx.vout) {
-			std::vector<uint160> addrIds;
-			if (BuildAddrIndex(atxout.scriptPubKey, addrIds))
-			{
-				BOOST_FOREACH(uint160 addrId, addrIds)
-				{
-					if (!txdb.WriteAddrIndex(addrId, hashTx))
-						LogPrintf("RebuildAddressIndex(): txouts WriteAddrIndex failed addrId: %s txhash: %s\n", addrId.ToString().c_str(), hashTx.ToString().c_str());
-				}
-			}
+			if (!tx.FetchInputs(txdb, mapUnused, true, false, mapInputs, fInvalid, true))
+				return error("DisconnectBlock() : FetchInputs failed for %s", tx.GetHash().ToString());
+			GetAddrIndexRows(tx, mapInputs, pindex->nHeight, vAddrRows);
 		}
+		if (!UpdateAddrIndex(txdb, vAddrRows, true))
+			return error("DisconnectBlock() : erasing address index failed");
+	}
+
+	// Disconnect in reverse order
+	for (int i = vtx.size() - 1; i >= 0; i--)
+		if (!vtx[i].DisconnectInputs(txdb))
+			return false;
+
+	// Update block index on disk without changing it in memory.
+	// The memory index structure will be changed after the db commits.
+	if (pindex->pprev)
+	{
+		CDiskBlockIndex blockindexPrev(pindex->pprev);
+		blockindexPrev.hashNext = 0;
+		if (!txdb.WriteBlockIndex(blockindexPrev))
+			return error("DisconnectBlock() : WriteBlockIndex failed");
 	}
+
+	// ppcoin: clean up wallet after disconnecting coinstake
+	BOOST_FOREACH(CTransaction& tx, vtx)
+		SyncWithWallets(tx, this, false);
+
+	return true;
+}
+
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+
+void ThreadScriptCheck() {
+	RenameThread("Harvest-scriptch");
+	scriptcheckqueue.Thread();
 }
 
 bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
@@ -1921,6 +2247,12 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
 	unsigned int nSigOps = 0;
 	int nInputs = 0;
 
+	CCheckQueueControl<CScriptCheck> control(nScriptCheckThreads ? &scriptcheckqueue : NULL);
+
+	// Address index rows are gathered from the inputs fetched for validation
+	// and written with the rest of the block
+	std::vector<CAddrIndexRow> vAddrRows;
+
 	BOOST_FOREACH(CTransaction& tx, vtx)
 	{
 		uint256 hashTx = tx.GetHash();
@@ -1960,13 +2292,21 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
 				nStakeReward = nTxValueOut - nTxValueIn;
 
 
-			if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, flags))
+			std::vector<CScriptCheck> vChecks;
+			if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, flags, true, nScriptCheckThreads ? &vChecks : NULL))
 				return false;
+			control.Add(vChecks);
 		}
 
+		if (fAddrIndex && !fJustCheck)
+			GetAddrIndexRows(tx, mapInputs, pindex->nHeight, vAddrRows);
+
 		mapQueuedChanges[hashTx] = CTxIndex(posThisTx, tx.vout.size());
 	}
 
+	if (!control.Wait())
+		return DoS(100, error("ConnectBlock() : one of the scripts failed"));
+
 	if (IsProofOfWork())
 	{
 		int64_t nReward = GetProofOfWorkReward(pindex->nHeight, nFees);
@@ -2007,55 +2347,46 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
 			return error("ConnectBlock() : UpdateTxIndex failed");
 	}
 
-	if (GetBoolArg("-addrindex", false))
+	// Update the coins store: prune the outputs spent by this block and add
+	// the outputs it creates. Transactions connected before the store
+	// existed have no record and are simply skipped.
+	map<uint256, CCoins> mapQueuedCoins;
+	BOOST_FOREACH(CTransaction& tx, vtx)
 	{
-		// Write Address Index
-		BOOST_FOREACH(CTransaction& tx, vtx)
+		if (!tx.IsCoinBase())
 		{
-			uint256 hashTx = tx.GetHash();
-			// inputs
-			if (!tx.IsCoinBase())
-			{
-				MapPrevTx mapInputs;
-				map<uint256, CTxIndex> mapQueuedChangesT;
-				bool fInvalid;
-				if (!tx.FetchInputs(txdb, mapQueuedChangesT, true, false, mapInputs, fInvalid))
-					return false;
-
-				MapPrevTx::const_iterator mi;
-				for (MapPrevTx::const_iterator mi = mapInputs.begin(); mi != mapInputs.end(); ++mi)
-				{
-					BOOST_FOREACH(const CTxOut &atxout, (*mi).second.second.vout)
-					{
-						std::vector<uint160> addrIds;
-						if (BuildAddrIndex(atxout.scriptPubKey, addrIds))
-						{
-							BOOST_FOREACH(uint160 addrId, addrIds)
-							{
-								if (!txdb.WriteAddrIndex(addrId, hashTx))
-									LogPrintf("ConnectBlock(): txins WriteAddrIndex failed addrId: %s txhash: %s\n", addrId.ToString().c_str(), hashTx.ToString().c_str());
-							}
-						}
-					}
-				}
-			}
-
-			// outputs
-			BOOST_FOREACH(const CTxOut &atxout, tx.vout)
+			BOOST_FOREACH(const CTxIn& txin, tx.vin)
 			{
-				std::vector<uint160> addrIds;
-				if (BuildAddrIndex(atxout.scriptPubKey, addrIds))
+				const uint256& hashPrev = txin.prevout.hash;
+				map<uint256, CCoins>::iterator mi = mapQueuedCoins.find(hashPrev);
+				if (mi == mapQueuedCoins.end())
 				{
-					BOOST_FOREACH(uint160 addrId, addrIds)
-					{
-						if (!txdb.WriteAddrIndex(addrId, hashTx))
-							LogPrintf("ConnectBlock(): txouts WriteAddrIndex failed addrId: %s txhash: %s\n", addrId.ToString().c_str(), hashTx.ToString().c_str());
-					}
+					CCoins coins;
+					if (!txdb.ReadCoins(hashPrev, coins))
+						continue;
+					// Records written before Cleanup() existed
+					coins.Cleanup();
+					mi = mapQueuedCoins.insert(make_pair(hashPrev, coins)).first;
 				}
+				(*mi).second.Spend(txin.prevout.n);
 			}
 		}
+		mapQueuedCoins[tx.GetHash()] = CCoins(tx);
+	}
+	for (map<uint256, CCoins>::iterator mi = mapQueuedCoins.begin(); mi != mapQueuedCoins.end(); ++mi)
+	{
+		if ((*mi).second.IsPruned())
+		{
+			if (!txdb.EraseCoins((*mi).first))
+				return error("ConnectBlock() : EraseCoins failed");
+		}
+		else if (!txdb.WriteCoins((*mi).first, (*mi).second))
+			return error("ConnectBlock() : WriteCoins failed");
 	}
 
+	if (fAddrIndex && !UpdateAddrIndex(txdb, vAddrRows, false))
+		return error("ConnectBlock() : writing address index failed");
+
 	// Update block index on disk without changing it in memory.
 	// The memory index structure will be changed after the db commits.
 	if (pindex->pprev)
@@ -2275,7 +2606,7 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
 	// New best block
 	hashBestChain = hash;
 	pindexBest = pindexNew;
-	pblockindexFBBHLast = NULL;
+	SetBestChainIndex(pindexBest);
 	nBestHeight = pindexBest->nHeight;
 	nBestChainTrust = pindexNew->nChainTrust;
 	nTimeBestReceived = GetTime();
@@ -2372,11 +2703,10 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
 		return error("AddToBlockIndex() : %s already exists", hash.ToString());
 
 	// Construct new block index object
-	CBlockIndex* pindexNew = new CBlockIndex(nFile, nBlockPos, *this);
-	if (!pindexNew)
-		return error("AddToBlockIndex() : new CBlockIndex failed");
+	CBlockIndex* pindexNew = NewBlockIndex();
+	*pindexNew = CBlockIndex(nFile, nBlockPos, *this);
 	pindexNew->phashBlock = &hash;
-	map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
+	BlockMap::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
 	if (miPrev != mapBlockIndex.end())
 	{
 		pindexNew->pprev = (*miPrev).second;
@@ -2401,7 +2731,7 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
 	pindexNew->SetStakeModifier(nStakeModifier, fGeneratedStakeModifier);
 
 	// Add to mapBlockIndex
-	map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+	BlockMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
 	if (pindexNew->IsProofOfStake())
 		setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
 	pindexNew->phashBlock = &((*mi).first);
@@ -2686,7 +3016,7 @@ bool CBlock::AcceptBlock()
 		return error("AcceptBlock() : block already in mapBlockIndex");
 
 	// Get prev block index
-	map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashPrevBlock);
+	BlockMap::iterator mi = mapBlockIndex.find(hashPrevBlock);
 	if (mi == mapBlockIndex.end())
 		return DoS(10, error("AcceptBlock() : prev block not found"));
 	CBlockIndex* pindexPrev = (*mi).second;
@@ -2716,7 +3046,7 @@ bool CBlock::AcceptBlock()
 		return DoS(50, error("AcceptBlock() : coinstake timestamp violation nTimeBlock=%d nTimeTx=%u", GetBlockTime(), vtx[1].nTime));
 
 	// Check proof-of-work or proof-of-stake
-	if (nBits != GetNextTargetRequired(pindexPrev, IsProofOfStake()) && hash != uint256("0x474619e0a58ec88c8e2516f8232064881750e87acac3a416d65b99bd61246968") && hash != uint256("0x4f3dd45d3de3737d60da46cff2d36df0002b97c505cdac6756d2d88561840b63") && hash != uint256("0x274996cec47b3f3e6cd48c8f0b39c32310dd7ddc8328ae37762be956b9031024"))
+	if (nBits != GetNextTargetRequired(pindexPrev, IsProofOfStake()) && !IsTargetException(hash))
 		return DoS(100, error("AcceptBlock() : incorrect %s", IsProofOfWork() ? "proof-of-work" : "proof-of-stake"));
 
 	// Check timestamp against prev
@@ -2766,16 +3096,43 @@ bool CBlock::AcceptBlock()
 	int nBlockEstimate = Checkpoints::GetTotalBlocksEstimate();
 	if (hashBestChain == hash)
 	{
+		// Peers that asked for compact blocks get the block itself straight
+		// away, in short form, instead of an inv
+		CSerializedMessageRef pcmpctblock;
+		CInv inv(MSG_BLOCK, hash);
+		bool fCompact = !IsInitialBlockDownload();
 		LOCK(cs_vNodes);
 		BOOST_FOREACH(CNode* pnode, vNodes)
-			if (nBestHeight > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
-				pnode->PushInventory(CInv(MSG_BLOCK, hash));
-	}
+		{
+			if (nBestHeight <= (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
+				continue;
+
+			CNodeState *state = State(pnode->GetId());
+			if (fCompact && state && state->fPreferCompactBlocks)
+			{
+				{
+					LOCK(pnode->cs_inventory);
+					if (!pnode->setInventoryKnown.insert(inv).second)
+						continue;
+				}
+				if (!pcmpctblock)
+				{
+					CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+					ss << CBlockHeaderAndShortTxIDs(*this);
+					pcmpctblock = SerializeMessage("cmpctblock", ss);
+				}
+				pnode->PushSerializedMessage(pcmpctblock);
+			}
+			else
+				pnode->PushInventory(inv);
+		}
+	}
 
 	return true;
 }
 
-uint256 CBlockIndex::GetBlockTrust() const
+// Trust a block of the given target adds to its chain
+static uint256 GetBlockTrustFromBits(unsigned int nBits)
 {
 	CBigNum bnTarget;
 	bnTarget.SetCompact(nBits);
@@ -2786,6 +3143,11 @@ uint256 CBlockIndex::GetBlockTrust() const
 	return ((CBigNum(1) << 256) / (bnTarget + 1)).getuint256();
 }
 
+uint256 CBlockIndex::GetBlockTrust() const
+{
+	return GetBlockTrustFromBits(nBits);
+}
+
 void PushGetBlocks(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd)
 {
 	// Filter out duplicate requests
@@ -2811,6 +3173,8 @@ void Misbehaving(NodeId pnode, int howmuch)
 	if (howmuch == 0)
 		return;
 
+	// Also reached from the message worker threads, which don't hold cs_main
+	LOCK(cs_main);
 	CNodeState *state = State(pnode);
 	if (state == NULL)
 		return;
@@ -2825,6 +3189,289 @@ void Misbehaving(NodeId pnode, int howmuch)
 		LogPrintf("Misbehaving: %s (%d -> %d)\n", state->name.c_str(), state->nMisbehavior - howmuch, state->nMisbehavior);
 }
 
+void static PushGetHeaders(CNode* pnode, const CBlockLocator& locator)
+{
+	CNodeState *state = State(pnode->GetId());
+	if (state)
+		state->nHeadersSyncStart = GetTime();
+	pnode->PushMessage("getheaders", locator, uint256(0));
+}
+
+void static ResetHeaderChain()
+{
+	mapHeaders.clear();
+	dqHeaderChain.clear();
+	mapBlocksStashed.clear();
+	mapBlocksStashedByPrev.clear();
+	hashBestHeader = 0;
+	nBestHeaderHeight = 0;
+	nBestHeaderTrust = 0;
+	for (map<NodeId, CNodeState>::iterator it = mapNodeState.begin(); it != mapNodeState.end(); ++it)
+	{
+		it->second.nHeadersHeld = 0;
+		it->second.hashHeadersResume = 0;
+	}
+}
+
+// A block we have or a header we hold, as far as retargeting needs it
+static bool GetHeaderEntry(const uint256& hash, CHeaderEntry& entry)
+{
+	map<uint256, CHeaderEntry>::iterator mh = mapHeaders.find(hash);
+	if (mh != mapHeaders.end())
+	{
+		entry = mh->second;
+		return true;
+	}
+	BlockMap::iterator mi = mapBlockIndex.find(hash);
+	if (mi == mapBlockIndex.end())
+		return false;
+	const CBlockIndex* pindex = mi->second;
+	entry.hashPrev = pindex->pprev ? pindex->pprev->GetBlockHash() : 0;
+	entry.nHeight = pindex->nHeight;
+	entry.nTime = pindex->nTime;
+	entry.nBits = pindex->nBits;
+	entry.fProofOfStake = pindex->IsProofOfStake();
+	entry.nChainTrust = pindex->nChainTrust;
+	entry.nodeid = -1;
+	return true;
+}
+
+// The nBits a block on top of hashPrev has to carry, as
+// GetNextTargetRequired() works it out, but through held headers too.
+// Headers are checked ahead of the blocks, so the retarget timespan comes
+// from the header's own time rather than from whatever block was last
+// checked.
+static bool GetNextHeaderTarget(const uint256& hashPrev, bool fProofOfStake, unsigned int& nBitsRet)
+{
+	CHeaderEntry last, prev, prevprev;
+	if (!GetHeaderEntry(hashPrev, last))
+		return false;
+
+	int64_t nTimespan = 48 * 60;
+	if (last.nTime > STAKE_TIMESPAN_SWITCH_TIME)
+		nTimespan = 2 * 60;
+	if (last.nTime > STAKE_TIMESPAN_SWITCH_TIME1)
+		nTimespan = 10 * 60;
+
+	prev = last;
+	while (prev.hashPrev != 0 && prev.fProofOfStake != fProofOfStake)
+		if (!GetHeaderEntry(prev.hashPrev, prev))
+			return false;
+	if (prev.hashPrev == 0)
+	{
+		nBitsRet = CalculateNextTarget(last.nHeight, last.nTime, fProofOfStake, 0, 0, nTimespan);
+		return true;
+	}
+	if (!GetHeaderEntry(prev.hashPrev, prevprev))
+		return false;
+	while (prevprev.hashPrev != 0 && prevprev.fProofOfStake != fProofOfStake)
+		if (!GetHeaderEntry(prevprev.hashPrev, prevprev))
+			return false;
+	if (prevprev.hashPrev == 0)
+	{
+		nBitsRet = CalculateNextTarget(last.nHeight, last.nTime, fProofOfStake, 0, 0, nTimespan);
+		return true;
+	}
+
+	nBitsRet = CalculateNextTarget(last.nHeight, last.nTime, fProofOfStake, prev.nBits, (int64_t)prev.nTime - (int64_t)prevprev.nTime, nTimespan);
+	return true;
+}
+
+// Make hash the tip of the header chain, walking back to the blocks we
+// already have unless it simply extends the current one
+void static SetBestHeader(const uint256& hash, const CHeaderEntry& entry)
+{
+	if (dqHeaderChain.empty())
+		nLastHeaderChainProgress = GetTime();
+
+	if (!dqHeaderChain.empty() && dqHeaderChain.back() == entry.hashPrev)
+		dqHeaderChain.push_back(hash);
+	else
+	{
+		deque<uint256> dqChain;
+		uint256 hashWalk = hash;
+		while (!mapBlockIndex.count(hashWalk))
+		{
+			map<uint256, CHeaderEntry>::iterator mi = mapHeaders.find(hashWalk);
+			if (mi == mapHeaders.end())
+				break;
+			dqChain.push_front(hashWalk);
+			hashWalk = mi->second.hashPrev;
+		}
+		dqHeaderChain.swap(dqChain);
+	}
+	hashBestHeader = hash;
+	nBestHeaderHeight = entry.nHeight;
+	nBestHeaderTrust = entry.nChainTrust;
+}
+
+// Drop blocks from the front of the header chain once they are accepted
+void static PruneHeaderChain()
+{
+	while (!dqHeaderChain.empty() && mapBlockIndex.count(dqHeaderChain.front()))
+	{
+		map<uint256, CHeaderEntry>::iterator mi = mapHeaders.find(dqHeaderChain.front());
+		if (mi != mapHeaders.end())
+			EraseHeader(mi);
+		dqHeaderChain.pop_front();
+		nLastHeaderChainProgress = GetTime();
+	}
+}
+
+// Connect downloaded blocks that were waiting on the block hash, and
+// then their own descendants
+void static ProcessStashedBlocks(CNode* pfrom, const uint256& hashParent)
+{
+	vector<uint256> vWorkQueue;
+	vWorkQueue.push_back(hashParent);
+	for (unsigned int i = 0; i < vWorkQueue.size(); i++)
+	{
+		uint256 hashPrev = vWorkQueue[i];
+		pair<multimap<uint256, uint256>::iterator, multimap<uint256, uint256>::iterator> range = mapBlocksStashedByPrev.equal_range(hashPrev);
+		vector<uint256> vChildren;
+		for (multimap<uint256, uint256>::iterator mi = range.first; mi != range.second; ++mi)
+			vChildren.push_back(mi->second);
+		mapBlocksStashedByPrev.erase(range.first, range.second);
+
+		BOOST_FOREACH(const uint256& hash, vChildren)
+		{
+			map<uint256, pair<NodeId, CBlock> >::iterator it = mapBlocksStashed.find(hash);
+			if (it == mapBlocksStashed.end())
+				continue;
+			NodeId nodeid = it->second.first;
+			CBlock block = it->second.second;
+			mapBlocksStashed.erase(it);
+
+			if (!ProcessBlock(pfrom, &block))
+			{
+				if (block.nDoS) Misbehaving(nodeid, block.nDoS);
+				continue;
+			}
+			if (fSecMsgEnabled)
+				SecureMsgScanBlock(block);
+			vWorkQueue.push_back(hash);
+		}
+	}
+}
+
+// Pick blocks from the download window that nobody is fetching yet
+void static FindNextBlocksToDownload(CNode* pto, CNodeState& state, vector<CInv>& vGetData)
+{
+	int64_t nNow = GetTime();
+
+	// Requests that went unanswered are handed to another peer
+	if (state.nBlocksInFlight > 0)
+	{
+		for (map<uint256, pair<NodeId, int64_t> >::iterator it = mapBlocksInFlight.begin(); it != mapBlocksInFlight.end(); )
+		{
+			if (it->second.first == pto->GetId() && nNow - it->second.second > BLOCK_DOWNLOAD_TIMEOUT)
+			{
+				LogPrint("net", "block %s from peer=%d timed out\n", it->first.ToString(), pto->id);
+				state.nBlocksInFlight--;
+				state.nDownloadBackoffUntil = nNow + BLOCK_DOWNLOAD_TIMEOUT;
+				mapBlocksInFlight.erase(it++);
+			}
+			else
+				++it;
+		}
+	}
+
+	PruneHeaderChain();
+	if (dqHeaderChain.empty())
+		return;
+
+	// Headers nobody can supply the blocks for are given up on, and sync
+	// carries on through getblocks
+	if (nNow - nLastHeaderChainProgress > HEADERS_CHAIN_STALL_TIMEOUT)
+	{
+		LogPrintf("FindNextBlocksToDownload() : no progress towards header %d %s, dropping header chain\n", nBestHeaderHeight, hashBestHeader.ToString());
+		ResetHeaderChain();
+		return;
+	}
+
+	// Blocks whose parent got connected by some other route
+	map<uint256, CHeaderEntry>::iterator mi = mapHeaders.find(dqHeaderChain.front());
+	if (mi != mapHeaders.end() && mapBlocksStashed.count(dqHeaderChain.front()))
+		ProcessStashedBlocks(pto, mi->second.hashPrev);
+
+	if (nBestHeaderTrust <= nBestChainTrust || nNow < state.nDownloadBackoffUntil)
+		return;
+
+	int nPeerHeight = max(pto->nStartingHeight, state.nBestKnownHeight);
+	unsigned int nWindow = min((unsigned int)dqHeaderChain.size(), BLOCK_DOWNLOAD_WINDOW);
+	for (unsigned int i = 0; i < nWindow && state.nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER; i++)
+	{
+		const uint256& hash = dqHeaderChain[i];
+		if (mapBlocksInFlight.count(hash) || mapBlockIndex.count(hash) || mapOrphanBlocks.count(hash) || mapBlocksStashed.count(hash))
+			continue;
+		mi = mapHeaders.find(hash);
+		if (mi == mapHeaders.end())
+			continue;
+		// Only ask peers that can be expected to have it
+		if (mi->second.nHeight > nPeerHeight)
+			break;
+
+		vGetData.push_back(CInv(MSG_BLOCK, hash));
+		mapBlocksInFlight[hash] = make_pair(pto->GetId(), nNow);
+		state.nBlocksInFlight++;
+	}
+}
+
+// Serialized "block" messages for recent tips and recently requested
+// blocks, shared by every peer that asks for them instead of each getdata
+// reading the block from disk and serializing it again. Entries are kept
+// in LRU order within MAX_BLOCK_MESSAGE_CACHE_SIZE bytes; blocks never
+// change once stored, so nothing needs invalidating. Guarded by cs_main.
+class CBlockMessageCache
+{
+private:
+	typedef std::list<uint256> lru_type;
+	typedef std::map<uint256, std::pair<CSerializedMessageRef, lru_type::iterator> > map_type;
+	map_type mapMessages;
+	lru_type lru; // most recently used first
+	size_t nSize;
+
+public:
+	CBlockMessageCache() : nSize(0) {}
+
+	CSerializedMessageRef Get(const uint256& hash)
+	{
+		map_type::iterator mi = mapMessages.find(hash);
+		if (mi == mapMessages.end())
+			return CSerializedMessageRef();
+		lru.splice(lru.begin(), lru, mi->second.second);
+		return mi->second.first;
+	}
+
+	CSerializedMessageRef Insert(const uint256& hash, const CBlock& block)
+	{
+		CSerializedMessageRef pmsg = Get(hash);
+		if (pmsg)
+			return pmsg;
+
+		CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+		ss.reserve(::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION));
+		ss << block;
+		pmsg = SerializeMessage("block", ss);
+
+		lru.push_front(hash);
+		mapMessages.insert(make_pair(hash, make_pair(pmsg, lru.begin())));
+		nSize += pmsg->size();
+
+		// Peers still sending an evicted message keep their reference
+		while (nSize > MAX_BLOCK_MESSAGE_CACHE_SIZE && lru.size() > 1)
+		{
+			map_type::iterator mi = mapMessages.find(lru.back());
+			nSize -= mi->second.first->size();
+			mapMessages.erase(mi);
+			lru.pop_back();
+		}
+		return pmsg;
+	}
+};
+
+static CBlockMessageCache blockMessageCache;
+
 bool ProcessBlock(CNode* pfrom, CBlock* pblock)
 {
 	AssertLockHeld(cs_main);
@@ -2909,6 +3556,10 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
 	if (!pblock->AcceptBlock())
 		return error("ProcessBlock() : AcceptBlock FAILED");
 
+	// A new tip is about to be announced; have it ready for the getdatas
+	if (hash == hashBestChain && !IsInitialBlockDownload())
+		blockMessageCache.Insert(hash, *pblock);
+
 	// Recursively process any orphan blocks that depended on this one
 	vector<uint256> vWorkQueue;
 	vWorkQueue.push_back(hash);
@@ -3099,6 +3750,109 @@ FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszM
 	return file;
 }
 
+// Block files are only ever appended to, so a read-only mapping of a file
+// stays valid as it grows; it only has to be redone to see the new end.
+// The most recently used few are kept mapped. 32-bit builds keep reading
+// through stdio, as block files are too big for their address space.
+class CBlockFileMapping
+{
+public:
+	boost::interprocess::file_mapping file;
+	boost::interprocess::mapped_region region;
+
+	CBlockFileMapping(const std::string& strPath) :
+		file(strPath.c_str(), boost::interprocess::read_only),
+		region(file, boost::interprocess::read_only)
+	{
+	}
+
+	const char* begin() const { return (const char*)region.get_address(); }
+	const char* end() const { return begin() + region.get_size(); }
+	size_t size() const { return region.get_size(); }
+};
+
+static const unsigned int MAX_BLOCK_FILE_MAPS = 8;
+static CCriticalSection cs_blockfilemaps;
+static map<unsigned int, boost::shared_ptr<CBlockFileMapping> > mapBlockFileMaps;
+static list<unsigned int> lBlockFileMapsLRU; // most recently used first
+
+static boost::shared_ptr<CBlockFileMapping> GetBlockFileMapping(unsigned int nFile, unsigned int nPos, bool fRemap)
+{
+	boost::shared_ptr<CBlockFileMapping> mapping;
+	if (sizeof(void*) < 8 || (nFile < 1) || (nFile == (unsigned int)-1))
+		return mapping;
+
+	LOCK(cs_blockfilemaps);
+	map<unsigned int, boost::shared_ptr<CBlockFileMapping> >::iterator mi = mapBlockFileMaps.find(nFile);
+	if (mi != mapBlockFileMaps.end())
+	{
+		lBlockFileMapsLRU.remove(nFile);
+		lBlockFileMapsLRU.push_front(nFile);
+		if (!fRemap && nPos < mi->second->size())
+			return mi->second;
+	}
+
+	try {
+		mapping.reset(new CBlockFileMapping(BlockFilePath(nFile).string()));
+	}
+	catch (boost::interprocess::interprocess_exception &e) {
+		LogPrint("db", "GetBlockFileMapping() : cannot map blk%04u.dat: %s\n", nFile, e.what());
+		return boost::shared_ptr<CBlockFileMapping>();
+	}
+
+	// Readers still holding the old mapping keep it alive until they finish
+	mapBlockFileMaps[nFile] = mapping;
+	if (mi == mapBlockFileMaps.end())
+		lBlockFileMapsLRU.push_front(nFile);
+	while (lBlockFileMapsLRU.size() > MAX_BLOCK_FILE_MAPS)
+	{
+		mapBlockFileMaps.erase(lBlockFileMapsLRU.back());
+		lBlockFileMapsLRU.pop_back();
+	}
+
+	if (nPos >= mapping->size())
+		return boost::shared_ptr<CBlockFileMapping>();
+	return mapping;
+}
+
+// Deserialize obj from the mapping. The object owns its data, so every field
+// is copied out of the mapped pages; what is saved is the fopen and fseek and
+// the copy through the stdio buffer.
+template<typename T>
+static bool ReadFromBlockFileMapImpl(unsigned int nFile, unsigned int nPos, int nType, T& obj)
+{
+	// A read that runs off the end may just mean the file grew since it was
+	// mapped, so map it again once before giving up
+	for (int nTry = 0; nTry < 2; nTry++)
+	{
+		boost::shared_ptr<CBlockFileMapping> mapping = GetBlockFileMapping(nFile, nPos, nTry > 0);
+		if (!mapping)
+			return false;
+		try {
+			CBufferReader reader(mapping->begin() + nPos, mapping->end(), nType, CLIENT_VERSION);
+			reader >> obj;
+			return true;
+		}
+		catch (std::ios_base::failure &e) {
+			continue;
+		}
+		catch (std::exception &e) {
+			return false;
+		}
+	}
+	return false;
+}
+
+bool ReadFromBlockFileMap(unsigned int nFile, unsigned int nPos, int nType, CBlock& block)
+{
+	return ReadFromBlockFileMapImpl(nFile, nPos, nType, block);
+}
+
+bool ReadFromBlockFileMap(unsigned int nFile, unsigned int nPos, int nType, CTransaction& tx)
+{
+	return ReadFromBlockFileMapImpl(nFile, nPos, nType, tx);
+}
+
 static unsigned int nCurrentBlockFile = 1;
 
 FILE* AppendBlockFile(unsigned int& nFileRet)
@@ -3122,6 +3876,30 @@ FILE* AppendBlockFile(unsigned int& nFileRet)
 	}
 }
 
+size_t BlockHasher::operator()(const uint256& hash) const
+{
+	// Salted on first use rather than at static init, before the RNG is seeded
+	static const uint64_t nSalt = GetRand(std::numeric_limits<uint64_t>::max());
+	uint64_t nHash;
+	memcpy(&nHash, hash.begin(), sizeof(nHash));
+	return (size_t)((nHash ^ nSalt) * 0x9E3779B97F4A7C15ULL);
+}
+
+CBlockIndex* NewBlockIndex()
+{
+	// Block index entries live for the lifetime of the process, so they are
+	// handed out from large slabs that are never freed instead of one heap
+	// allocation per block.
+	static CBlockIndex* pslab = NULL;
+	static unsigned int nSlabUsed = BLOCKINDEX_SLAB_SIZE;
+	if (nSlabUsed == BLOCKINDEX_SLAB_SIZE)
+	{
+		pslab = new CBlockIndex[BLOCKINDEX_SLAB_SIZE];
+		nSlabUsed = 0;
+	}
+	return &pslab[nSlabUsed++];
+}
+
 bool LoadBlockIndex(bool fAllowNew)
 {
 	LOCK(cs_main);
@@ -3166,7 +3944,7 @@ void PrintBlockTree()
 	AssertLockHeld(cs_main);
 	// pre-compute tree structure
 	map<CBlockIndex*, vector<CBlockIndex*> > mapNext;
-	for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+	for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
 	{
 		CBlockIndex* pindex = (*mi).second;
 		mapNext[pindex->pprev].push_back(pindex);
@@ -3240,55 +4018,109 @@ void PrintBlockTree()
 	}
 }
 
+// Work out the scrypt hashes of a run of blocks side by side, so that the
+// GetHash()/GetPoWHash() calls made while processing them are lookups
+static void PrecomputePoWHashes(const std::vector<CBlock>& vBlocks)
+{
+	std::vector<unsigned char> vHeaders;
+	BOOST_FOREACH(const CBlock& block, vBlocks)
+	{
+		if (block.nVersion <= 6 || (!block.vtx.empty() && block.IsProofOfWork()))
+			vHeaders.insert(vHeaders.end(), (const unsigned char*)&block.nVersion, (const unsigned char*)&block.nVersion + 80);
+	}
+	if (vHeaders.empty())
+		return;
+	std::vector<uint256> vHashes(vHeaders.size() / 80);
+	scrypt_blockhash_many(&vHeaders[0], vHashes.size(), &vHashes[0]);
+}
+
 bool LoadExternalBlockFile(FILE* fileIn)
 {
 	int64_t nStart = GetTimeMillis();
 
+	// Blocks are read ahead in runs of this many so their proof-of-work
+	// can be hashed together
+	static const unsigned int LOAD_BATCH_SIZE = 128;
+
 	int nLoaded = 0;
 	{
 		try {
 			CAutoFile blkdat(fileIn, SER_DISK, CLIENT_VERSION);
 			unsigned int nPos = 0;
-			while (nPos != (unsigned int)-1 && blkdat.good())
+			bool fReadError = false;
+			while (nPos != (unsigned int)-1 && blkdat.good() && !fReadError)
 			{
-				boost::this_thread::interruption_point();
-				unsigned char pchData[65536];
-				do {
-					fseek(blkdat.Get(), nPos, SEEK_SET);
-					int nRead = fread(pchData, 1, sizeof(pchData), blkdat.Get());
-					if (nRead <= 8)
-					{
-						nPos = (unsigned int)-1;
-						break;
-					}
-					void* nFind = memchr(pchData, Params().MessageStart()[0], nRead + 1 - MESSAGE_START_SIZE);
-					if (nFind)
-					{
-						if (memcmp(nFind, Params().MessageStart(), MESSAGE_START_SIZE) == 0)
+				std::vector<CBlock> vBlocks;
+				std::vector<unsigned int> vBlockPos, vBlockSize;
+				unsigned int nReadPos = nPos;
+				while (nReadPos != (unsigned int)-1 && blkdat.good() && vBlocks.size() < LOAD_BATCH_SIZE)
+				{
+					boost::this_thread::interruption_point();
+					unsigned char pchData[65536];
+					do {
+						fseek(blkdat.Get(), nReadPos, SEEK_SET);
+						int nRead = fread(pchData, 1, sizeof(pchData), blkdat.Get());
+						if (nRead <= 8)
 						{
-							nPos += ((unsigned char*)nFind - pchData) + MESSAGE_START_SIZE;
+							nReadPos = (unsigned int)-1;
 							break;
 						}
-						nPos += ((unsigned char*)nFind - pchData) + 1;
+						void* nFind = memchr(pchData, Params().MessageStart()[0], nRead + 1 - MESSAGE_START_SIZE);
+						if (nFind)
+						{
+							if (memcmp(nFind, Params().MessageStart(), MESSAGE_START_SIZE) == 0)
+							{
+								nReadPos += ((unsigned char*)nFind - pchData) + MESSAGE_START_SIZE;
+								break;
+							}
+							nReadPos += ((unsigned char*)nFind - pchData) + 1;
+						}
+						else
+							nReadPos += sizeof(pchData) - MESSAGE_START_SIZE + 1;
+						boost::this_thread::interruption_point();
+					} while (true);
+					if (nReadPos == (unsigned int)-1)
+						break;
+					try {
+						fseek(blkdat.Get(), nReadPos, SEEK_SET);
+						unsigned int nSize;
+						blkdat >> nSize;
+						if (nSize > 0 && nSize <= MAX_BLOCK_SIZE)
+						{
+							CBlock block;
+							blkdat >> block;
+							vBlocks.push_back(block);
+							vBlockPos.push_back(nReadPos);
+							vBlockSize.push_back(nSize);
+							nReadPos += 4 + nSize;
+						}
 					}
-					else
-						nPos += sizeof(pchData) - MESSAGE_START_SIZE + 1;
-					boost::this_thread::interruption_point();
-				} while (true);
-				if (nPos == (unsigned int)-1)
-					break;
-				fseek(blkdat.Get(), nPos, SEEK_SET);
-				unsigned int nSize;
-				blkdat >> nSize;
-				if (nSize > 0 && nSize <= MAX_BLOCK_SIZE)
+					catch (std::exception &e) {
+						// Still process what was read before the bad block
+						LogPrintf("%s() : Deserialize or I/O error caught during load\n",
+							__PRETTY_FUNCTION__);
+						fReadError = true;
+						break;
+					}
+				}
+
+				PrecomputePoWHashes(vBlocks);
+
+				// A block that is not accepted is rescanned from just after
+				// its message start, and whatever was read after it again
+				nPos = nReadPos;
+				for (unsigned int i = 0; i < vBlocks.size(); i++)
 				{
-					CBlock block;
-					blkdat >> block;
 					LOCK(cs_main);
-					if (ProcessBlock(NULL, &block))
-					{
+					if (ProcessBlock(NULL, &vBlocks[i]))
 						nLoaded++;
-						nPos += 4 + nSize;
+					else
+					{
+						// The blocks after it have not been processed yet;
+						// if the read error is real it will come up again
+						nPos = vBlockPos[i];
+						fReadError = false;
+						break;
 					}
 				}
 			}
@@ -3467,12 +4299,20 @@ void static ProcessGetData(CNode* pfrom)
 			if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
 			{
 				// Send block from disk
-				map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
+				BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
 				if (mi != mapBlockIndex.end())
 				{
-					CBlock block;
-					block.ReadFromDisk((*mi).second);
-					pfrom->PushMessage("block", block);
+					CSerializedMessageRef pmsg = blockMessageCache.Get(inv.hash);
+					if (!pmsg)
+					{
+						CBlock block;
+						if (block.ReadFromDisk((*mi).second))
+							pmsg = blockMessageCache.Insert(inv.hash, block);
+						else
+							LogPrintf("ProcessGetData() : failed to read block %s\n", inv.hash.ToString());
+					}
+					if (pmsg)
+						pfrom->PushSerializedMessage(pmsg);
 
 					// Trigger them to send a getblocks request for the next batch of inventory
 					if (inv.hash == pfrom->hashContinue)
@@ -3589,6 +4429,63 @@ void static ProcessGetData(CNode* pfrom)
 	}
 }
 
+// Handle a block a peer sent us, whole or rebuilt from a compact block.
+// Requires cs_main.
+void static ProcessReceivedBlock(CNode* pfrom, CBlock& block)
+{
+	uint256 hashBlock = block.GetHash();
+	CInv inv(MSG_BLOCK, hashBlock);
+
+	map<uint256, pair<NodeId, int64_t> >::iterator itInFlight = mapBlocksInFlight.find(hashBlock);
+	if (itInFlight != mapBlocksInFlight.end())
+	{
+		CNodeState *state = State(itInFlight->second.first);
+		if (state)
+			state->nBlocksInFlight--;
+		mapBlocksInFlight.erase(itInFlight);
+	}
+
+	// Headers-first downloads arrive out of order; blocks on the header
+	// chain wait for their parent here instead of in the orphan pool
+	if (!mapBlockIndex.count(block.hashPrevBlock) && mapHeaders.count(hashBlock) &&
+		mapBlocksStashed.size() < BLOCK_DOWNLOAD_WINDOW)
+	{
+		// A body that doesn't match its header must not hold the slot the
+		// real block would take
+		if (!block.CheckBlock())
+		{
+			if (block.nDoS) Misbehaving(pfrom->GetId(), block.nDoS);
+			return;
+		}
+		if (mapBlocksStashed.insert(make_pair(hashBlock, make_pair(pfrom->GetId(), block))).second)
+			mapBlocksStashedByPrev.insert(make_pair(block.hashPrevBlock, hashBlock));
+		mapAlreadyAskedFor.erase(inv);
+		return;
+	}
+
+	if (ProcessBlock(pfrom, &block))
+	{
+		mapAlreadyAskedFor.erase(inv);
+		ProcessStashedBlocks(pfrom, hashBlock);
+	}
+	if (block.nDoS) Misbehaving(pfrom->GetId(), block.nDoS);
+	if (fSecMsgEnabled)
+		SecureMsgScanBlock(block);
+}
+
+// A short ID can match the wrong pool transaction; such a block won't
+// rebuild to its merkle root and is fetched in full instead
+void static ProcessCompactBlock(CNode* pfrom, CBlock& block)
+{
+	if (block.BuildMerkleTree() != block.hashMerkleRoot)
+	{
+		LogPrint("net", "compact block %s did not rebuild, requesting it in full\n", block.GetHash().ToString());
+		pfrom->PushMessage("getdata", vector<CInv>(1, CInv(MSG_BLOCK, block.GetHash())));
+		return;
+	}
+	ProcessReceivedBlock(pfrom, block);
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 {
 	RandAddSeedPerfmon();
@@ -3680,6 +4577,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 			if (pfrom->fOneShot || pfrom->nVersion >= CADDR_TIME_VERSION || addrman.size() < 1000)
 			{
 				pfrom->PushMessage("getaddr");
+				LOCK(pfrom->cs_addr);
 				pfrom->fGetAddr = true;
 			}
 			addrman.Good(pfrom->addr);
@@ -3721,6 +4619,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 	else if (strCommand == "verack")
 	{
 		pfrom->SetRecvVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
+
+		// Ask for new blocks to be sent in compact form
+		if (pfrom->nVersion >= COMPACT_BLOCKS_VERSION)
+			pfrom->PushMessage("sendcmpct");
 	}
 
 
@@ -3742,6 +4644,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 		vector<CAddress> vAddrOk;
 		int64_t nNow = GetAdjustedTime();
 		int64_t nSince = nNow - 10 * 60;
+		bool fGetAddr;
+		{
+			LOCK(pfrom->cs_addr);
+			fGetAddr = pfrom->fGetAddr;
+		}
 		BOOST_FOREACH(CAddress& addr, vAddr)
 		{
 			boost::this_thread::interruption_point();
@@ -3750,7 +4657,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 				addr.nTime = nNow - 5 * 24 * 60 * 60;
 			pfrom->AddAddressKnown(addr);
 			bool fReachable = IsReachable(addr);
-			if (addr.nTime > nSince && !pfrom->fGetAddr && vAddr.size() <= 10 && addr.IsRoutable())
+			if (addr.nTime > nSince && !fGetAddr && vAddr.size() <= 10 && addr.IsRoutable())
 			{
 				// Relay to a limited number of other nodes
 				{
@@ -3785,7 +4692,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 		}
 		addrman.Add(vAddrOk, pfrom->addr, 2 * 60 * 60);
 		if (vAddr.size() < 1000)
+		{
+			LOCK(pfrom->cs_addr);
 			pfrom->fGetAddr = false;
+		}
 		if (pfrom->fOneShot)
 			pfrom->fDisconnect = true;
 	}
@@ -3915,7 +4825,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 		if (locator.IsNull())
 		{
 			// If locator is null, return the hashStop block
-			map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+			BlockMap::iterator mi = mapBlockIndex.find(hashStop);
 			if (mi == mapBlockIndex.end())
 				return true;
 			pindex = (*mi).second;
@@ -3929,7 +4839,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 		}
 
 		vector<CBlock> vHeaders;
-		int nLimit = 2000;
+		int nLimit = MAX_HEADERS_RESULTS;
 		LogPrint("net", "getheaders %d to %s\n", (pindex ? pindex->nHeight : -1), hashStop.ToString());
 		for (; pindex; pindex = pindex->pnext)
 		{
@@ -3941,6 +4851,146 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 	}
 
 
+	else if (strCommand == "headers" && !fImporting && !fReindex)
+	{
+		vector<CBlock> vHeaders;
+		vRecv >> vHeaders;
+		if (vHeaders.size() > MAX_HEADERS_RESULTS)
+		{
+			Misbehaving(pfrom->GetId(), 20);
+			return error("message headers size() = %u", vHeaders.size());
+		}
+
+		// Only follow headers we asked for
+		{
+			LOCK(cs_main);
+			CNodeState *state = State(pfrom->GetId());
+			if (state == NULL || state->nHeadersSyncStart == 0)
+				return true;
+			state->nHeadersSyncStart = 0;
+		}
+
+		// Old headers are hashed with scrypt; work those out side by side
+		// before taking cs_main
+		PrecomputePoWHashes(vHeaders);
+
+		LOCK(cs_main);
+		CNodeState *state = State(pfrom->GetId());
+		if (state == NULL)
+			return true;
+
+		// Headers carry no coinstake, so stake itself can only be checked
+		// once the block arrives; until then a header has to meet its
+		// proof-of-work or carry the target the chain calls for, and is
+		// held to the checkpoints and clock
+		const CBlockIndex* pcheckpoint = Checkpoints::AutoSelectSyncCheckpoint();
+		int64_t nMaxTime = FutureDrift(GetAdjustedTime());
+		uint256 hashLast = 0;
+		bool fEvicted = false;
+		bool fFull = false;
+		BOOST_FOREACH(const CBlock& header, vHeaders)
+		{
+			uint256 hash = header.GetHash();
+			if (mapBlockIndex.count(hash) || mapHeaders.count(hash))
+			{
+				hashLast = hash;
+				continue;
+			}
+
+			CHeaderEntry parent;
+			if (!GetHeaderEntry(header.hashPrevBlock, parent))
+			{
+				Misbehaving(pfrom->GetId(), 20);
+				return error("headers : non-continuous headers sequence at %s", hash.ToString());
+			}
+			int nHeight = parent.nHeight + 1;
+
+			if (!Checkpoints::CheckHardened(nHeight, hash))
+			{
+				Misbehaving(pfrom->GetId(), 100);
+				return error("headers : rejected by hardened checkpoint lock-in at %d", nHeight);
+			}
+			if (nHeight <= pcheckpoint->nHeight || header.GetBlockTime() < pcheckpoint->nTime)
+			{
+				Misbehaving(pfrom->GetId(), 1);
+				return error("headers : header %s forks before the sync checkpoint", hash.ToString());
+			}
+			if (header.GetBlockTime() > nMaxTime)
+				return error("headers : header %s timestamp too far in the future", hash.ToString());
+
+			// Up to the last proof-of-work block a header may be either kind;
+			// it is taken for proof-of-work only if its hash meets a target
+			// that follows the retarget rule
+			unsigned int nBitsRequired;
+			bool fProofOfWork = false;
+			if (nHeight <= Params().LastPOWBlock())
+			{
+				CBigNum bnTarget;
+				bnTarget.SetCompact(header.nBits);
+				fProofOfWork = bnTarget > 0 && bnTarget <= Params().ProofOfWorkLimit() &&
+					header.GetPoWHash() <= bnTarget.getuint256();
+				if (fProofOfWork)
+				{
+					if (!GetNextHeaderTarget(header.hashPrevBlock, false, nBitsRequired))
+						return error("headers : ancestors of %s no longer held", hash.ToString());
+					fProofOfWork = header.nBits == nBitsRequired || IsTargetException(hash);
+				}
+			}
+			if (!fProofOfWork)
+			{
+				if (nHeight < Params().POSStartBlock())
+				{
+					Misbehaving(pfrom->GetId(), 50);
+					return error("headers : header %s fails proof-of-work", hash.ToString());
+				}
+				if (!GetNextHeaderTarget(header.hashPrevBlock, true, nBitsRequired))
+					return error("headers : ancestors of %s no longer held", hash.ToString());
+				if (header.nBits != nBitsRequired && !IsTargetException(hash))
+				{
+					Misbehaving(pfrom->GetId(), 100);
+					return error("headers : incorrect proof-of-stake target in header %s", hash.ToString());
+				}
+			}
+
+			// Make room from this peer's own side branches first; what
+			// doesn't fit is asked for again once the download catches up
+			if (state->nHeadersHeld >= MAX_HEADERS_PER_PEER || mapHeaders.size() >= MAX_HEADERS_HELD)
+			{
+				if (!fEvicted)
+					EvictPeerHeaders(pfrom->GetId());
+				fEvicted = true;
+				if (state->nHeadersHeld >= MAX_HEADERS_PER_PEER || mapHeaders.size() >= MAX_HEADERS_HELD)
+				{
+					state->hashHeadersResume = header.hashPrevBlock;
+					fFull = true;
+					break;
+				}
+			}
+
+			CHeaderEntry entry;
+			entry.hashPrev = header.hashPrevBlock;
+			entry.nHeight = nHeight;
+			entry.nTime = header.nTime;
+			entry.nBits = header.nBits;
+			entry.fProofOfStake = !fProofOfWork;
+			entry.nChainTrust = parent.nChainTrust + GetBlockTrustFromBits(header.nBits);
+			entry.nodeid = pfrom->GetId();
+			mapHeaders.insert(make_pair(hash, entry));
+			state->nHeadersHeld++;
+			state->nBestKnownHeight = max(state->nBestKnownHeight, nHeight);
+			if (entry.nChainTrust > nBestHeaderTrust)
+				SetBestHeader(hash, entry);
+			hashLast = hash;
+		}
+
+		LogPrint("net", "received %u headers from peer=%d, best header %d\n", vHeaders.size(), pfrom->id, nBestHeaderHeight);
+
+		// A full reply means the peer has more
+		if (vHeaders.size() == MAX_HEADERS_RESULTS && !fFull)
+			PushGetHeaders(pfrom, CBlockLocator(vector<uint256>(1, hashLast)));
+	}
+
+
 	else if (strCommand == "tx" || strCommand == "dstx")
 	{
 		vector<uint256> vWorkQueue;
@@ -4078,15 +5128,231 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
 		LogPrint("net", "received block %s\n", hashBlock.ToString());
 
+		pfrom->AddInventoryKnown(CInv(MSG_BLOCK, hashBlock));
+
+		LOCK(cs_main);
+		ProcessReceivedBlock(pfrom, block);
+	}
+
+
+	else if (strCommand == "sendcmpct")
+	{
+		LOCK(cs_main);
+		CNodeState *state = State(pfrom->GetId());
+		if (state)
+			state->fPreferCompactBlocks = true;
+	}
+
+
+	else if (strCommand == "cmpctblock" && !fImporting && !fReindex)
+	{
+		CBlockHeaderAndShortTxIDs cmpctblock;
+		vRecv >> cmpctblock;
+		uint256 hashBlock = cmpctblock.header.GetHash();
+
+		LogPrint("net", "received compact block %s (%u transactions)\n", hashBlock.ToString(), cmpctblock.BlockTxCount());
+
 		CInv inv(MSG_BLOCK, hashBlock);
 		pfrom->AddInventoryKnown(inv);
 
 		LOCK(cs_main);
-		if (ProcessBlock(pfrom, &block))
-			mapAlreadyAskedFor.erase(inv);
-		if (block.nDoS) Misbehaving(pfrom->GetId(), block.nDoS);
-		if (fSecMsgEnabled)
-			SecureMsgScanBlock(block);
+		if (mapBlockIndex.count(hashBlock) || mapOrphanBlocks.count(hashBlock))
+			return true;
+
+		// Nothing to connect it to yet, so fetch it whole
+		if (!mapBlockIndex.count(cmpctblock.header.hashPrevBlock))
+		{
+			pfrom->PushMessage("getdata", vector<CInv>(1, inv));
+			return true;
+		}
+
+		// Rebuilding hashes the whole mempool, so only do it for blocks that
+		// could become the new tip and whose header passes the cheap checks
+		const CBlock& header = cmpctblock.header;
+		CBlockIndex* pindexPrev = mapBlockIndex[header.hashPrevBlock];
+		int nHeight = pindexPrev->nHeight + 1;
+		if (nHeight + MAX_CMPCTBLOCK_DEPTH <= nBestHeight)
+		{
+			LogPrint("net", "ignoring compact block %s at height %d, too far below the tip\n", hashBlock.ToString(), nHeight);
+			return true;
+		}
+		if (header.nVersion > CBlock::CURRENT_VERSION)
+		{
+			Misbehaving(pfrom->GetId(), 100);
+			return error("cmpctblock : unknown block version %d", header.nVersion);
+		}
+		if (!Checkpoints::CheckHardened(nHeight, hashBlock))
+		{
+			Misbehaving(pfrom->GetId(), 100);
+			return error("cmpctblock : rejected by hardened checkpoint lock-in at %d", nHeight);
+		}
+		const CBlockIndex* pcheckpoint = Checkpoints::AutoSelectSyncCheckpoint();
+		if (nHeight <= pcheckpoint->nHeight || header.GetBlockTime() < pcheckpoint->nTime)
+		{
+			Misbehaving(pfrom->GetId(), 1);
+			return error("cmpctblock : block %s forks before the sync checkpoint", hashBlock.ToString());
+		}
+		if (header.GetBlockTime() > FutureDrift(GetAdjustedTime()))
+			return error("cmpctblock : block %s timestamp too far in the future", hashBlock.ToString());
+		if (header.GetBlockTime() <= pindexPrev->GetPastTimeLimit() || FutureDrift(header.GetBlockTime()) < pindexPrev->GetBlockTime())
+			return error("cmpctblock : block %s timestamp is too early", hashBlock.ToString());
+
+		// The block also has to show its stake, or its work, first; the
+		// coinstake comes prefilled as it can't be in anyone's mempool
+		const CPrefilledTransaction* pcoinstake = NULL;
+		BOOST_FOREACH(const CPrefilledTransaction& prefilled, cmpctblock.prefilledtxn)
+			if (prefilled.nIndex == 1 && prefilled.tx.IsCoinStake())
+				pcoinstake = &prefilled;
+		if (pcoinstake)
+		{
+			if (nHeight < Params().POSStartBlock())
+			{
+				Misbehaving(pfrom->GetId(), 100);
+				return error("cmpctblock : proof-of-stake block %s at height %d", hashBlock.ToString(), nHeight);
+			}
+			if (header.nBits != GetNextTargetRequired(pindexPrev, true) && !IsTargetException(hashBlock))
+			{
+				Misbehaving(pfrom->GetId(), 100);
+				return error("cmpctblock : block %s has incorrect proof-of-stake target", hashBlock.ToString());
+			}
+			if (!CheckCoinStakeTimestamp(nHeight, header.GetBlockTime(), (int64_t)pcoinstake->tx.nTime))
+			{
+				Misbehaving(pfrom->GetId(), 50);
+				return error("cmpctblock : coinstake timestamp violation in block %s", hashBlock.ToString());
+			}
+
+			// CheckBlockSignature() only looks at the coinstake
+			CBlock blockSig = header;
+			blockSig.vtx.resize(2);
+			blockSig.vtx[1] = pcoinstake->tx;
+			if (!blockSig.CheckBlockSignature())
+			{
+				Misbehaving(pfrom->GetId(), 100);
+				return error("cmpctblock : bad block signature on %s", hashBlock.ToString());
+			}
+
+			CTransaction txCoinStake = pcoinstake->tx;
+			uint256 hashProof, targetProofOfStake;
+			if (!CheckProofOfStake(pindexPrev, txCoinStake, header.nBits, hashProof, targetProofOfStake))
+			{
+				if (txCoinStake.nDoS)
+					Misbehaving(pfrom->GetId(), txCoinStake.nDoS);
+				return error("cmpctblock : check proof-of-stake failed for block %s", hashBlock.ToString());
+			}
+		}
+		else
+		{
+			if (nHeight > Params().LastPOWBlock())
+			{
+				Misbehaving(pfrom->GetId(), 100);
+				return error("cmpctblock : proof-of-work block %s at height %d", hashBlock.ToString(), nHeight);
+			}
+			if (!CheckProofOfWork(header.GetPoWHash(), header.nBits))
+			{
+				Misbehaving(pfrom->GetId(), 50);
+				return error("cmpctblock : block %s fails proof-of-work", hashBlock.ToString());
+			}
+			if (header.nBits != GetNextTargetRequired(pindexPrev, false) && !IsTargetException(hashBlock))
+			{
+				Misbehaving(pfrom->GetId(), 100);
+				return error("cmpctblock : block %s has incorrect proof-of-work target", hashBlock.ToString());
+			}
+		}
+
+		CNodeState *state = State(pfrom->GetId());
+		if (state == NULL)
+			return true;
+
+		// A compact block still waiting for its transactions is fetched whole
+		if (state->fPartialBlock && state->partialBlock.GetHash() != hashBlock)
+		{
+			state->fPartialBlock = false;
+			if (!mapBlockIndex.count(state->partialBlock.GetHash()))
+				pfrom->PushMessage("getdata", vector<CInv>(1, CInv(MSG_BLOCK, state->partialBlock.GetHash())));
+		}
+
+		vector<unsigned short> vMissing;
+		if (!state->partialBlock.Init(cmpctblock, mempool, vMissing))
+		{
+			state->fPartialBlock = false;
+			Misbehaving(pfrom->GetId(), 100);
+			return error("cmpctblock : malformed compact block %s", hashBlock.ToString());
+		}
+
+		if (vMissing.empty())
+		{
+			state->fPartialBlock = false;
+			CBlock block;
+			state->partialBlock.Fill(vector<CTransaction>(), block);
+			ProcessCompactBlock(pfrom, block);
+		}
+		else
+		{
+			LogPrint("net", "compact block %s missing %u transactions\n", hashBlock.ToString(), vMissing.size());
+			state->fPartialBlock = true;
+			state->nPartialBlockTime = GetTime();
+			CBlockTransactionsRequest req;
+			req.blockhash = hashBlock;
+			req.vIndexes = vMissing;
+			pfrom->PushMessage("getblocktxn", req);
+		}
+	}
+
+
+	else if (strCommand == "getblocktxn")
+	{
+		CBlockTransactionsRequest req;
+		vRecv >> req;
+
+		LOCK(cs_main);
+		BlockMap::iterator mi = mapBlockIndex.find(req.blockhash);
+		if (mi == mapBlockIndex.end())
+			return true;
+
+		// Only recent blocks are worth rebuilding; older ones are served whole
+		if (mi->second->nHeight + MAX_BLOCKTXN_DEPTH < nBestHeight)
+		{
+			LogPrint("net", "peer=%d asked for transactions of block %s, too deep below the tip\n", pfrom->id, req.blockhash.ToString());
+			return true;
+		}
+
+		CBlock block;
+		if (!block.ReadFromDisk(mi->second))
+			return error("getblocktxn : failed to read block %s", req.blockhash.ToString());
+
+		CBlockTransactions resp;
+		resp.blockhash = req.blockhash;
+		BOOST_FOREACH(unsigned short nIndex, req.vIndexes)
+		{
+			if (nIndex >= block.vtx.size())
+			{
+				Misbehaving(pfrom->GetId(), 100);
+				return error("getblocktxn : index %u out of range for block %s", nIndex, req.blockhash.ToString());
+			}
+			resp.vtx.push_back(block.vtx[nIndex]);
+		}
+		pfrom->PushMessage("blocktxn", resp);
+	}
+
+
+	else if (strCommand == "blocktxn" && !fImporting && !fReindex)
+	{
+		CBlockTransactions resp;
+		vRecv >> resp;
+
+		LOCK(cs_main);
+		CNodeState *state = State(pfrom->GetId());
+		if (state == NULL || !state->fPartialBlock || state->partialBlock.GetHash() != resp.blockhash)
+			return true;
+		state->fPartialBlock = false;
+
+		CBlock block;
+		if (!state->partialBlock.Fill(resp.vtx, block))
+		{
+			Misbehaving(pfrom->GetId(), 100);
+			return error("blocktxn : transactions don't fit block %s", resp.blockhash.ToString());
+		}
+		ProcessCompactBlock(pfrom, block);
 	}
 
 	// This asymmetric behavior for inbound and outbound connections was introduced
@@ -4098,7 +5364,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 	{
 		// Don't return addresses older than nCutOff timestamp
 		int64_t nCutOff = GetTime() - (nNodeLifespan * 24 * 60 * 60);
-		pfrom->vAddrToSend.clear();
+		{
+			LOCK(pfrom->cs_addr);
+			pfrom->vAddrToSend.clear();
+		}
 		vector<CAddress> vAddr = addrman.GetAddr();
 		BOOST_FOREACH(const CAddress &addr, vAddr)
 			if (addr.nTime > nCutOff)
@@ -4239,6 +5508,14 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 	}
 
 
+	else if (strCommand == "dseep")
+	{
+		// Handled on the message workers, so it goes straight to the
+		// masternode list rather than past every other handler below
+		mnodeman.ProcessMessage(pfrom, strCommand, vRecv);
+	}
+
+
 	else
 	{
 		if (fSecMsgEnabled)
@@ -4263,6 +5540,138 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 	return true;
 }
 
+bool static ProcessMessageCatch(CNode* pfrom, const string& strCommand, CDataStream& vRecv, unsigned int nMessageSize)
+{
+	bool fRet = false;
+	try
+	{
+		fRet = ProcessMessage(pfrom, strCommand, vRecv);
+		boost::this_thread::interruption_point();
+	}
+	catch (std::ios_base::failure& e)
+	{
+		if (strstr(e.what(), "end of data"))
+		{
+			// Allow exceptions from under-length message on vRecv
+			LogPrintf("ProcessMessages(%s, %u bytes) : Exception '%s' caught, normally caused by a message being shorter than its stated length\n", strCommand, nMessageSize, e.what());
+		}
+		else if (strstr(e.what(), "size too large"))
+		{
+			// Allow exceptions from over-long size
+			LogPrintf("ProcessMessages(%s, %u bytes) : Exception '%s' caught\n", strCommand, nMessageSize, e.what());
+		}
+		else
+		{
+			PrintExceptionContinue(&e, "ProcessMessages()");
+		}
+	}
+	catch (boost::thread_interrupted) {
+		throw;
+	}
+	catch (std::exception& e) {
+		PrintExceptionContinue(&e, "ProcessMessages()");
+	}
+	catch (...) {
+		PrintExceptionContinue(NULL, "ProcessMessages()");
+	}
+
+	if (!fRet)
+		LogPrintf("ProcessMessage(%s, %u bytes) FAILED\n", strCommand, nMessageSize);
+	return fRet;
+}
+
+// Messages whose handlers guard all the state they touch with their own
+// locks: address relay (the node's cs_addr and addrman), masternode pings
+// (cs_process_message, and cs_main only through TRY_LOCK and Misbehaving)
+// and secure messaging (cs_smsg and the per-peer cs_smsg_net). inv stays on
+// the message handler thread with everything else that needs cs_main, as
+// AlreadyHave() and the block requests it makes read the chain; so does
+// pong, whose fields SendMessages uses without a lock.
+bool static IsConcurrentMessage(const string& strCommand)
+{
+	return strCommand == "addr" || strCommand == "dseep" || strCommand.compare(0, 4, "smsg") == 0;
+}
+
+// Queue of peers with messages for the worker threads. Each peer's messages
+// wait in its own CNode::vWorkerMsg and are handled in the order they
+// arrived, by one worker at a time.
+class CMessageWorkQueue
+{
+private:
+	boost::mutex mutex;
+	boost::condition_variable condWorker;
+	// Peers with queued messages, each holding a reference
+	std::deque<CNode*> queue;
+
+public:
+	// Returns false if the peer already has too many messages waiting
+	bool Push(CNode* pnode, const CNetMessage& msg)
+	{
+		boost::unique_lock<boost::mutex> lock(mutex);
+		if (pnode->vWorkerMsg.size() >= MAX_WORKER_MESSAGES_PER_PEER)
+			return false;
+		pnode->vWorkerMsg.push_back(msg);
+		if (!pnode->fWorkerQueued)
+		{
+			pnode->fWorkerQueued = true;
+			{
+				LOCK(cs_vNodes);
+				pnode->AddRef();
+			}
+			queue.push_back(pnode);
+			condWorker.notify_one();
+		}
+		return true;
+	}
+
+	void Thread()
+	{
+		while (true)
+		{
+			CNode* pnode;
+			std::deque<CNetMessage> vMsg;
+			{
+				boost::unique_lock<boost::mutex> lock(mutex);
+				while (queue.empty())
+					condWorker.wait(lock);
+				pnode = queue.front();
+				queue.pop_front();
+				vMsg.swap(pnode->vWorkerMsg);
+			}
+
+			while (!vMsg.empty())
+			{
+				CNetMessage& msg = vMsg.front();
+				if (!pnode->fDisconnect)
+					ProcessMessageCatch(pnode, msg.hdr.GetCommand(), msg.vRecv, msg.hdr.nMessageSize);
+				vMsg.pop_front();
+
+				// Pick up what arrived for this peer in the meantime
+				if (vMsg.empty())
+				{
+					boost::unique_lock<boost::mutex> lock(mutex);
+					vMsg.swap(pnode->vWorkerMsg);
+					if (vMsg.empty())
+						pnode->fWorkerQueued = false;
+				}
+			}
+
+			{
+				LOCK(cs_vNodes);
+				pnode->Release();
+			}
+		}
+	}
+};
+
+static CMessageWorkQueue messageWorkQueue;
+
+void ThreadMessageWorker()
+{
+	RenameThread("Harvest-msgwork");
+	messageWorkQueue.Thread();
+}
+
 // requires LOCK(cs_vRecvMsg)
 bool ProcessMessages(CNode* pfrom)
 {
@@ -4337,42 +5746,20 @@ bool ProcessMessages(CNode* pfrom)
 			continue;
 		}
 
-		// Process message
-		bool fRet = false;
-		try
+		// Messages that don't need cs_main go to the worker threads
+		if (nMessageWorkerThreads && pfrom->nVersion != 0 && IsConcurrentMessage(strCommand))
 		{
-			fRet = ProcessMessage(pfrom, strCommand, vRecv);
-			boost::this_thread::interruption_point();
-		}
-		catch (std::ios_base::failure& e)
-		{
-			if (strstr(e.what(), "end of data"))
-			{
-				// Allow exceptions from under-length message on vRecv
-				LogPrintf("ProcessMessages(%s, %u bytes) : Exception '%s' caught, normally caused by a message being shorter than its stated length\n", strCommand, nMessageSize, e.what());
-			}
-			else if (strstr(e.what(), "size too large"))
-			{
-				// Allow exceptions from over-long size
-				LogPrintf("ProcessMessages(%s, %u bytes) : Exception '%s' caught\n", strCommand, nMessageSize, e.what());
-			}
-			else
+			if (!messageWorkQueue.Push(pfrom, msg))
 			{
-				PrintExceptionContinue(&e, "ProcessMessages()");
+				// Leave it in the receive buffer until the workers catch up
+				--it;
+				break;
 			}
-		}
-		catch (boost::thread_interrupted) {
-			throw;
-		}
-		catch (std::exception& e) {
-			PrintExceptionContinue(&e, "ProcessMessages()");
-		}
-		catch (...) {
-			PrintExceptionContinue(NULL, "ProcessMessages()");
+			continue;
 		}
 
-		if (!fRet)
-			LogPrintf("ProcessMessage(%s, %u bytes) FAILED\n", strCommand, nMessageSize);
+		// Process message
+		ProcessMessageCatch(pfrom, strCommand, vRecv, nMessageSize);
 
 		break;
 	}
@@ -4427,12 +5814,44 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
 		if (!lockMain)
 			return true;
 
+		CNodeState *pstate = State(pto->GetId());
+		if (pstate == NULL)
+			return true;
+		CNodeState &state = *pstate;
+
 		// Start block sync
 		if (pto->fStartSync && !fImporting && !fReindex) {
 			pto->fStartSync = false;
+			if (GetBoolArg("-headersfirst", true))
+				PushGetHeaders(pto, CBlockLocator(pindexBest));
+			else
+				PushGetBlocks(pto, pindexBest, uint256(0));
+		}
+
+		// Peers still in initial download don't answer getheaders
+		if (state.nHeadersSyncStart && GetTime() - state.nHeadersSyncStart > HEADERS_RESPONSE_TIMEOUT) {
+			LogPrint("net", "no headers from peer=%d, falling back to getblocks\n", pto->id);
+			state.nHeadersSyncStart = 0;
 			PushGetBlocks(pto, pindexBest, uint256(0));
 		}
 
+		// Compact block transactions that never came; get the block whole
+		if (state.fPartialBlock && GetTime() - state.nPartialBlockTime > BLOCKTXN_RESPONSE_TIMEOUT) {
+			uint256 hashPartial = state.partialBlock.GetHash();
+			LogPrint("net", "no transactions for compact block %s from peer=%d, requesting it in full\n", hashPartial.ToString(), pto->id);
+			state.fPartialBlock = false;
+			if (!mapBlockIndex.count(hashPartial) && !mapOrphanBlocks.count(hashPartial))
+				pto->PushMessage("getdata", vector<CInv>(1, CInv(MSG_BLOCK, hashPartial)));
+		}
+
+		// Carry on with the headers held back while there was no room
+		if (state.hashHeadersResume != 0 && state.nHeadersSyncStart == 0 &&
+			state.nHeadersHeld < MAX_HEADERS_PER_PEER / 2 && mapHeaders.size() < MAX_HEADERS_HELD / 2)
+		{
+			PushGetHeaders(pto, CBlockLocator(vector<uint256>(1, state.hashHeadersResume)));
+			state.hashHeadersResume = 0;
+		}
+
 		// Resend wallet transactions that haven't gotten in a block yet
 		// Except during reindex, importing and IBD, when old wallet
 		// transactions become unconfirmed and spams other nodes.
@@ -4451,7 +5870,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
 				{
 					// Periodically clear setAddrKnown to allow refresh broadcasts
 					if (nLastRebroadcast)
+					{
+						LOCK(pnode->cs_addr);
 						pnode->setAddrKnown.clear();
+					}
 
 					// Rebroadcast our address
 					if (!fNoListen)
@@ -4470,35 +5892,31 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
 		//
 		if (fSendTrickle)
 		{
-			vector<CAddress> vAddr;
-			vAddr.reserve(pto->vAddrToSend.size());
-			BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
+			vector<CAddress> vAddrNew;
 			{
-				// returns true if wasn't already contained in the set
-				if (pto->setAddrKnown.insert(addr).second)
+				LOCK(pto->cs_addr);
+				vAddrNew.reserve(pto->vAddrToSend.size());
+				BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
 				{
-					vAddr.push_back(addr);
-					// receiver rejects addr messages larger than 1000
-					if (vAddr.size() >= 1000)
-					{
-						pto->PushMessage("addr", vAddr);
-						vAddr.clear();
-					}
+					// returns true if wasn't already contained in the set
+					if (pto->setAddrKnown.insert(addr).second)
+						vAddrNew.push_back(addr);
 				}
+				pto->vAddrToSend.clear();
 			}
-			pto->vAddrToSend.clear();
-			if (!vAddr.empty())
-				pto->PushMessage("addr", vAddr);
+			// receiver rejects addr messages larger than 1000
+			for (unsigned int i = 0; i < vAddrNew.size(); i += 1000)
+				pto->PushMessage("addr", vector<CAddress>(vAddrNew.begin() + i, vAddrNew.begin() + min((size_t)i + 1000, vAddrNew.size())));
 		}
 
-		if (State(pto->GetId())->fShouldBan) {
+		if (state.fShouldBan) {
 			if (pto->addr.IsLocal())
 				LogPrintf("Warning: not banning local node %s!\n", pto->addr.ToString().c_str());
 			else {
 				pto->fDisconnect = true;
 				CNode::Ban(pto->addr, BanReasonNodeMisbehaving);
 			}
-			State(pto->GetId())->fShouldBan = false;
+			state.fShouldBan = false;
 		}
 
 		//
@@ -4553,6 +5971,8 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
 		// Message: getdata
 		//
 		vector<CInv> vGetData;
+		if (!fImporting && !fReindex && !pto->fClient && pto->fSuccessfullyConnected)
+			FindNextBlocksToDownload(pto, state, vGetData);
 		int64_t nNow = GetTime() * 1000000;
 		CTxDB txdb("r");
 		while (!pto->mapAskFor.empty() && (*pto->mapAskFor.begin()).first <= nNow)
@@ -15,6 +15,9 @@
 
 #include <list>
 
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
+
 class CValidationState;
 
 #define START_MASTERNODE_PAYMENTS_TESTNET 1428034047 //Fri, 09 Jan 2015 21:05:58 GMT
@@ -61,6 +64,30 @@ static const unsigned int MAX_TX_SIGOPS = MAX_BLOCK_SIGOPS / 5;
 static const unsigned int MAX_ORPHAN_TRANSACTIONS = MAX_BLOCK_SIZE / 100;
 /** Default for -maxorphanblocks, maximum number of orphan blocks kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_BLOCKS = 750;
+/** Bytes of serialized block messages kept to answer getdata without reading the disk */
+static const size_t MAX_BLOCK_MESSAGE_CACHE_SIZE = 32 * 1000000;
+/** Maximum number of headers returned for one getheaders request */
+static const unsigned int MAX_HEADERS_RESULTS = 2000;
+/** Number of blocks that can be requested at any given time from a single peer during headers-first sync */
+static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Size of the window of blocks ahead of the best chain that are downloaded in parallel */
+static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
+/** Seconds before an unanswered block request is handed to another peer */
+static const int64_t BLOCK_DOWNLOAD_TIMEOUT = 60;
+/** Seconds to wait for a headers reply before falling back to getblocks */
+static const int64_t HEADERS_RESPONSE_TIMEOUT = 60;
+/** Seconds without progress along the header chain before it is given up */
+static const int64_t HEADERS_CHAIN_STALL_TIMEOUT = 10 * 60;
+/** Headers kept from a single peer for blocks we don't have yet */
+static const unsigned int MAX_HEADERS_PER_PEER = 25 * MAX_HEADERS_RESULTS;
+/** Headers kept from all peers together for blocks we don't have yet */
+static const unsigned int MAX_HEADERS_HELD = 4 * MAX_HEADERS_PER_PEER;
+/** Compact blocks are only rebuilt when they attach within this many blocks of the best chain tip */
+static const int MAX_CMPCTBLOCK_DEPTH = 5;
+/** Deepest block below the best chain tip whose transactions are served to getblocktxn */
+static const int MAX_BLOCKTXN_DEPTH = 10;
+/** Seconds to wait for the transactions of a compact block before fetching it whole */
+static const int64_t BLOCKTXN_RESPONSE_TIMEOUT = 10;
 /** Fees smaller than this (in satoshi) are considered zero fee (for transaction creation) */
 static const int64_t MIN_TX_FEE = 1000;
 /** Fees smaller than this (in satoshi) are considered zero fee (for relaying) */
@@ -74,15 +101,39 @@ static const unsigned int LOCKTIME_THRESHOLD = 500000000; // Tue Nov  5 00:53:20
 static const int64_t DRIFT = 120;
 inline int64_t FutureDrift(int64_t nTime) { return nTime + DRIFT; }
 
+/** Maximum number of script-checking threads allowed */
+static const int MAX_SCRIPTCHECK_THREADS = 16;
+/** Maximum number of message worker threads allowed */
+static const int MAX_MESSAGE_WORKER_THREADS = 16;
+/** Default for -msgthreads, number of threads handling address relay, masternode pings and secure messaging */
+static const int DEFAULT_MESSAGE_WORKER_THREADS = 2;
+/** Messages from one peer that may wait for the message workers before its receive buffer is left to fill */
+static const unsigned int MAX_WORKER_MESSAGES_PER_PEER = 100;
+
 /** "reject" message codes **/
 static const unsigned char REJECT_INVALID = 0x10;
 
 inline int64_t GetMNCollateral(int nHeight) { if (nHeight >= 499649) {	return 5000;} else {return 2500; } }
 
+/** Number of CBlockIndex objects carved from each allocation by NewBlockIndex() */
+static const unsigned int BLOCKINDEX_SLAB_SIZE = 4096;
+
+/** Hasher for mapBlockIndex keys. Block hashes are already uniformly
+ * distributed, so 64 bits of the hash mixed with a per-process salt are
+ * enough; the salt keeps peers from choosing hashes that collide in a bucket.
+ */
+class BlockHasher
+{
+public:
+	size_t operator()(const uint256& hash) const;
+};
+
+typedef boost::unordered_map<uint256, CBlockIndex*, BlockHasher> BlockMap;
+
 extern CScript COINBASE_FLAGS;
 extern CCriticalSection cs_main;
 extern CTxMemPool mempool;
-extern std::map<uint256, CBlockIndex*> mapBlockIndex;
+extern BlockMap mapBlockIndex;
 extern std::set<std::pair<COutPoint, unsigned int> > setStakeSeen;
 extern CBlockIndex* pindexGenesisBlock;
 extern int nStakeMinConfirmations;
@@ -94,6 +145,10 @@ extern uint256 nBestChainTrust;
 extern uint256 nBestInvalidTrust;
 extern uint256 hashBestChain;
 extern CBlockIndex* pindexBest;
+/** The blocks of the best chain, indexed by height. Written under cs_main
+ * and guarded by cs_vBestChain, so FindBlockByHeight() works without cs_main. */
+extern CCriticalSection cs_vBestChain;
+extern std::vector<CBlockIndex*> vBestChain;
 extern uint64_t nLastBlockTx;
 extern uint64_t nLastBlockSize;
 extern int64_t nLastCoinStakeSearchInterval;
@@ -101,9 +156,13 @@ extern const std::string strMessageMagic;
 extern int64_t nTimeBestReceived;
 extern bool fImporting;
 extern bool fReindex;
+extern bool fAddrIndex;
+extern bool fAddrUnspentIndex;
 struct COrphanBlock;
 extern std::map<uint256, COrphanBlock*> mapOrphanBlocks;
 extern bool fHaveGUI;
+extern int nScriptCheckThreads;
+extern int nMessageWorkerThreads;
 
 // Settings
 extern bool fUseFastIndex;
@@ -115,7 +174,9 @@ extern bool fLargeWorkInvalidChainFound;
 // Minimum disk space required - used in CheckDiskSpace()
 static const uint64_t nMinDiskSpace = 52428800;
 
+class CCoins;
 class CReserveKey;
+class CScriptCheck;
 class CTxDB;
 class CTxIndex;
 class CWalletInterface;
@@ -142,13 +203,28 @@ void PushGetBlocks(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd);
 bool ProcessBlock(CNode* pfrom, CBlock* pblock);
 bool CheckDiskSpace(uint64_t nAdditionalBytes = 0);
 FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode = "rb");
+/** Deserialize the block or transaction at nPos of block file nFile from
+    a memory mapping of the file. This saves the open, seek and stdio
+    buffering of OpenBlockFile(); the fields are still copied into the
+    object. Returns false if the file cannot be mapped
+    or the data does not deserialize; callers then fall back to OpenBlockFile(). */
+bool ReadFromBlockFileMap(unsigned int nFile, unsigned int nPos, int nType, CBlock& block);
+bool ReadFromBlockFileMap(unsigned int nFile, unsigned int nPos, int nType, CTransaction& tx);
 FILE* AppendBlockFile(unsigned int& nFileRet);
 bool LoadBlockIndex(bool fAllowNew = true);
+/** Allocate a default-constructed CBlockIndex from the block index pool. Not thread-safe; callers serialize on cs_main as for mapBlockIndex. */
+CBlockIndex* NewBlockIndex();
 void PrintBlockTree();
 CBlockIndex* FindBlockByHeight(int nHeight);
+/** Point vBestChain at the chain ending in pindex */
+void SetBestChainIndex(CBlockIndex* pindex);
 bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 void ThreadImport(std::vector<boost::filesystem::path> vImportFiles);
+/** Run an instance of the script checking thread */
+void ThreadScriptCheck();
+/** Run a worker for messages handed off by ProcessMessages */
+void ThreadMessageWorker();
 
 bool CheckProofOfWork(uint256 hash, unsigned int nBits);
 unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfStake);
@@ -172,7 +248,11 @@ bool AcceptableInputs(CTxMemPool& pool, const CTransaction &txo, bool fLimitFree
 	bool* pfMissingInputs, bool fRejectInsaneFee = false, bool isDSTX = false);
 
 
-bool FindTransactionsByDestination(const CTxDestination &dest, std::vector<uint256> &vtxhash);
+/** Find the transactions touching dest in the address index, oldest first.
+ * nSkip counts from the end when negative. */
+bool FindTransactionsByDestination(const CTxDestination &dest, int nSkip, int nCount, std::vector<uint256> &vtxhash);
+/** Find the unspent outputs paying to dest (requires -addrutxoindex) */
+bool FindUnspentByDestination(const CTxDestination &dest, std::vector<std::pair<COutPoint, int64_t> > &vUnspent);
 
 int GetInputAge(CTxIn& vin);
 int GetInputAgeIX(uint256 nTXHash, CTxIn& vin);
@@ -245,7 +325,11 @@ enum GetMinFee_mode
 	GMF_SEND,
 };
 
-typedef std::map<uint256, std::pair<CTxIndex, CTransaction> > MapPrevTx;
+/** Previous transactions spent by a transaction, keyed by txid: the txindex
+	entry (position and spent pointers) and the outputs and metadata needed to
+	check the spend. Coins read from the coins store or built from the full
+	transaction carry the same data, so no stand-in transaction is made up. */
+typedef std::map<uint256, std::pair<CTxIndex, CCoins> > MapPrevTx;
 
 int64_t GetMinFee(const CTransaction& tx, unsigned int nBytes, bool fAllowFree, enum GetMinFee_mode mode);
 
@@ -349,6 +433,9 @@ public:
 
 	bool ReadFromDisk(CDiskTxPos pos, FILE** pfileRet = NULL)
 	{
+		if (!pfileRet && ReadFromBlockFileMap(pos.nFile, pos.nTxPos, SER_DISK, *this))
+			return true;
+
 		CAutoFile filein = CAutoFile(OpenBlockFile(pos.nFile, 0, pfileRet ? "rb+" : "rb"), SER_DISK, CLIENT_VERSION);
 		if (filein.IsNull())
 			return error("CTransaction::ReadFromDisk() : OpenBlockFile failed");
@@ -421,10 +508,12 @@ public:
 	 @param[in] fMiner  True if being called by CreateNewBlock
 	 @param[out] inputsRet  Pointers to this transaction's inputs
 	 @param[out] fInvalid   returns true if transaction is invalid
+	 @param[in] fFullTx  Always read complete previous transactions from disk,
+						 even when the outputs being spent are in the coins store
 	 @return    Returns true if all inputs are in txdb or mapTestPool
 	 */
 	bool FetchInputs(CTxDB& txdb, const std::map<uint256, CTxIndex>& mapTestPool,
-		bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid);
+		bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid, bool fFullTx = false);
 
 	/** Sanity check previous transactions, then, if all checks succeed,
 		mark them as spent by this transaction.
@@ -435,11 +524,13 @@ public:
 		@param[in] pindexBlock
 		@param[in] fBlock   true if called from ConnectBlock
 		@param[in] fMiner   true if called from CreateNewBlock
+		@param[out] pvChecks    If non-NULL, script checks are appended here instead of being run inline
 		@return Returns true if all checks succeed
 	 */
 	bool ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
 		std::map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-		const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags = STANDARD_SCRIPT_VERIFY_FLAGS, bool fValidateSig = true);
+		const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags = STANDARD_SCRIPT_VERIFY_FLAGS, bool fValidateSig = true,
+		std::vector<CScriptCheck>* pvChecks = NULL);
 	bool CheckTransaction() const;
 	bool GetCoinAge(CTxDB& txdb, const CBlockIndex* pindexPrev, uint64_t& nCoinAge) const;
 
@@ -449,6 +540,44 @@ public:
 
 
 
+/** Closure representing one script verification.
+	Note that this stores a copy of the spent output's scriptPubKey, so it
+	remains valid after the MapPrevTx it was taken from goes out of scope.
+ */
+class CScriptCheck
+{
+private:
+	CScript scriptPubKey;
+	const CTransaction* ptxTo;
+	unsigned int nIn;
+	unsigned int nFlags;
+	int nHashType;
+	// Shared by the checks of all inputs of ptxTo
+	boost::shared_ptr<const CSigHashCache> psighashcache;
+
+public:
+	CScriptCheck() : ptxTo(0), nIn(0), nFlags(0), nHashType(0) {}
+	CScriptCheck(const CScript& scriptPubKeyIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn,
+		const boost::shared_ptr<const CSigHashCache>& psighashcacheIn = boost::shared_ptr<const CSigHashCache>()) :
+		scriptPubKey(scriptPubKeyIn),
+		ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn), psighashcache(psighashcacheIn) { }
+
+	bool operator()() const;
+
+	void swap(CScriptCheck& check)
+	{
+		scriptPubKey.swap(check.scriptPubKey);
+		std::swap(ptxTo, check.ptxTo);
+		std::swap(nIn, check.nIn);
+		std::swap(nFlags, check.nFlags);
+		std::swap(nHashType, check.nHashType);
+		psighashcache.swap(check.psighashcache);
+	}
+};
+
+
+
+
 /** wrapper for CTxOut that provides a more compact serialization */
 class CTxOutCompressor
 {
@@ -615,6 +744,211 @@ public:
 };
 
 
+/** A row of the address index (-addrindex). There is one row for every
+ * output paying to an address and one for every input spending from it, so
+ * connecting a block only appends rows and never rewrites old ones. The
+ * height and index are stored big-endian, which keeps the rows of an
+ * address in chain order in LevelDB and lets them be paged through with a
+ * range scan. The value stored under the row is the amount moved, negative
+ * for spends.
+ */
+class CAddrIndexKey
+{
+public:
+	uint160 addrId;
+	int nHeight;
+	uint256 txid;
+	bool fSpend;
+	unsigned int nIndex;
+
+	CAddrIndexKey()
+	{
+		SetNull();
+	}
+
+	CAddrIndexKey(const uint160& addrIdIn, int nHeightIn, const uint256& txidIn, bool fSpendIn, unsigned int nIndexIn)
+	{
+		addrId = addrIdIn;
+		nHeight = nHeightIn;
+		txid = txidIn;
+		fSpend = fSpendIn;
+		nIndex = nIndexIn;
+	}
+
+	IMPLEMENT_SERIALIZE
+	(
+		CAddrIndexKey* pthis = const_cast<CAddrIndexKey*>(this);
+		READWRITE(pthis->addrId);
+		unsigned char vchHeight[4];
+		unsigned char vchIndex[4];
+		for (int i = 0; i < 4; i++)
+		{
+			vchHeight[i] = (unsigned char)((unsigned int)nHeight >> (24 - 8 * i));
+			vchIndex[i] = (unsigned char)(nIndex >> (24 - 8 * i));
+		}
+		READWRITE(FLATDATA(vchHeight));
+		READWRITE(pthis->txid);
+		READWRITE(pthis->fSpend);
+		READWRITE(FLATDATA(vchIndex));
+		if (fRead)
+		{
+			pthis->nHeight = 0;
+			pthis->nIndex = 0;
+			for (int i = 0; i < 4; i++)
+			{
+				pthis->nHeight = (pthis->nHeight << 8) | vchHeight[i];
+				pthis->nIndex = (pthis->nIndex << 8) | vchIndex[i];
+			}
+		}
+	)
+
+	void SetNull()
+	{
+		addrId = 0;
+		nHeight = 0;
+		txid = 0;
+		fSpend = false;
+		nIndex = 0;
+	}
+};
+
+
+
+/** A txdb record holding the outputs of a transaction that are still
+ * unspent, so that inputs can be fetched without reading the block files.
+ * Outputs are stored with CTxOutCompressor; spent outputs are kept as null
+ * placeholders so output indexes are preserved. The spent/unspent state in
+ * CTxIndex::vSpent stays authoritative; this is only a compact copy of the
+ * immutable output data.
+ *
+ * CTxIndex is still needed next to it: its position is how transactions are
+ * located in the block files (getrawtransaction, the wallet, stake kernels,
+ * coinbase maturity) and vSpent is the double-spend record that reorgs rewind.
+ * A CCoins record is erased once every output is spent, so this store grows
+ * with the unspent set rather than with the chain.
+ */
+class CCoins
+{
+public:
+	bool fCoinBase;
+	bool fCoinStake;
+	int nTxVersion;
+	unsigned int nTime;
+	std::vector<CTxOut> vout;
+
+	CCoins()
+	{
+		SetNull();
+	}
+
+	/** fPrune drops the outputs that can never be spent (see Cleanup());
+		pass false to keep every output as it is in tx, as input checks do.
+	 */
+	explicit CCoins(const CTransaction& tx, bool fPrune = true)
+	{
+		fCoinBase = tx.IsCoinBase();
+		fCoinStake = tx.IsCoinStake();
+		nTxVersion = tx.nVersion;
+		nTime = tx.nTime;
+		vout = tx.vout;
+		if (fPrune)
+			Cleanup();
+	}
+
+	// Outputs that can never be spent are dropped on the way in: the empty
+	// first output of a coinstake and of a proof-of-stake coinbase, and
+	// provably unspendable OP_RETURN outputs. Otherwise their record could
+	// never become fully spent and be pruned.
+	void Cleanup()
+	{
+		BOOST_FOREACH(CTxOut& txout, vout)
+			if (txout.IsEmpty() || txout.scriptPubKey.IsUnspendable())
+				txout.SetNull();
+	}
+
+	IMPLEMENT_SERIALIZE
+	(
+		CCoins* pthis = const_cast<CCoins*>(this);
+		unsigned char nFlags = (fCoinBase ? 1 : 0) | (fCoinStake ? 2 : 0);
+		READWRITE(nFlags);
+		READWRITE(pthis->nTxVersion);
+		READWRITE(pthis->nTime);
+		unsigned int nOutputs = vout.size();
+		READWRITE(VARINT(nOutputs));
+		std::vector<unsigned char> vAvail((nOutputs + 7) / 8, 0);
+		if (!fRead)
+			for (unsigned int i = 0; i < nOutputs; i++)
+				if (!vout[i].IsNull())
+					vAvail[i / 8] |= (1 << (i % 8));
+		READWRITE(vAvail);
+		if (fRead)
+		{
+			if (vAvail.size() != (nOutputs + 7) / 8)
+				throw std::runtime_error("CCoins::Unserialize() : availability mask size mismatch");
+			pthis->fCoinBase = (nFlags & 1) != 0;
+			pthis->fCoinStake = (nFlags & 2) != 0;
+			pthis->vout.assign(nOutputs, CTxOut());
+		}
+		for (unsigned int i = 0; i < nOutputs; i++)
+		{
+			if (vAvail[i / 8] & (1 << (i % 8)))
+			{
+				CTxOutCompressor txout(REF(pthis->vout[i]));
+				READWRITE(txout);
+			}
+		}
+	)
+
+	void SetNull()
+	{
+		fCoinBase = false;
+		fCoinStake = false;
+		nTxVersion = 0;
+		nTime = 0;
+		vout.clear();
+	}
+
+	bool IsAvailable(unsigned int n) const
+	{
+		return (n < vout.size() && !vout[n].IsNull());
+	}
+
+	void Spend(unsigned int n)
+	{
+		if (n < vout.size())
+			vout[n].SetNull();
+	}
+
+	bool IsPruned() const
+	{
+		BOOST_FOREACH(const CTxOut& txout, vout)
+			if (!txout.IsNull())
+				return false;
+		return true;
+	}
+
+	bool IsCoinBase() const
+	{
+		return fCoinBase;
+	}
+
+	bool IsCoinStake() const
+	{
+		return fCoinStake;
+	}
+
+	std::string ToString() const
+	{
+		std::string str;
+		str += strprintf("CCoins(coinbase=%d, coinstake=%d, ver=%d, nTime=%u, vout.size=%u)\n",
+			fCoinBase, fCoinStake, nTxVersion, nTime, vout.size());
+		for (unsigned int i = 0; i < vout.size(); i++)
+			str += "    " + vout[i].ToString() + "\n";
+		return str;
+	}
+};
+
+
 
 
 
@@ -835,19 +1169,23 @@ public:
 	{
 		SetNull();
 
-		// Open history file to read
-		CAutoFile filein = CAutoFile(OpenBlockFile(nFile, nBlockPos, "rb"), SER_DISK, CLIENT_VERSION);
-		if (filein.IsNull())
-			return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
-		if (!fReadTransactions)
-			filein.nType |= SER_BLOCKHEADERONLY;
+		int nType = SER_DISK | (fReadTransactions ? 0 : SER_BLOCKHEADERONLY);
+		if (!ReadFromBlockFileMap(nFile, nBlockPos, nType, *this))
+		{
+			SetNull();
 
-		// Read block
-		try {
-			filein >> *this;
-		}
-		catch (std::exception &e) {
-			return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+			// Open history file to read
+			CAutoFile filein = CAutoFile(OpenBlockFile(nFile, nBlockPos, "rb"), nType, CLIENT_VERSION);
+			if (filein.IsNull())
+				return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
+
+			// Read block
+			try {
+				filein >> *this;
+			}
+			catch (std::exception &e) {
+				return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+			}
 		}
 
 		// Check the header
@@ -891,7 +1229,7 @@ public:
 	bool AcceptBlock();
 	bool SignBlock(CWallet& keystore, int64_t nFees);
 	bool CheckBlockSignature() const;
-	void RebuildAddressIndex(CTxDB& txdb);
+	bool RebuildAddressIndex(CTxDB& txdb, CBlockIndex* pindex);
 
 private:
 	bool SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew);
@@ -912,18 +1250,41 @@ private:
 class CBlockIndex
 {
 public:
+	// Members are ordered so that the pointers and 32-bit fields used by
+	// chain traversal and header checks share the first cache line, and so
+	// that the object needs no alignment padding.
 	const uint256* phashBlock;
 	CBlockIndex* pprev;
 	CBlockIndex* pnext;
+	int nHeight;
+	unsigned int nFlags;  // ppcoin: block index flags
 	unsigned int nFile;
 	unsigned int nBlockPos;
+
+	// block header
+	unsigned int nTime;
+	unsigned int nBits;
+	unsigned int nNonce;
+	int nVersion;
+
+	// proof-of-stake specific fields
+	unsigned int nStakeTime;
+
 	uint256 nChainTrust; // ppcoin: trust score of block chain
-	int nHeight;
+	uint256 hashProof;
+#ifndef LOWMEM
+	uint256 bnStakeModifierV2;
+#endif
+	uint256 hashMerkleRoot;
+	COutPoint prevoutStake;
+
+	// 64-bit fields last, where they start 8-byte aligned without padding
 #ifndef LOWMEM
 	int64_t nMint;
 	int64_t nMoneySupply;
 #endif
-	unsigned int nFlags;  // ppcoin: block index flags
+	uint64_t nStakeModifier; // hash modifier for proof-of-stake
+
 	enum
 	{
 		BLOCK_PROOF_OF_STAKE = (1 << 0), // is proof-of-stake block
@@ -931,23 +1292,6 @@ public:
 		BLOCK_STAKE_MODIFIER = (1 << 2), // regenerated stake modifier
 	};
 
-	uint64_t nStakeModifier; // hash modifier for proof-of-stake
-#ifndef LOWMEM
-	uint256 bnStakeModifierV2;
-#endif
-	// proof-of-stake specific fields
-	COutPoint prevoutStake;
-	unsigned int nStakeTime;
-
-	uint256 hashProof;
-
-	// block header
-	int nVersion;
-	uint256 hashMerkleRoot;
-	unsigned int nTime;
-	unsigned int nBits;
-	unsigned int nNonce;
-
 	CBlockIndex()
 	{
 		phashBlock = NULL;
@@ -1254,7 +1598,7 @@ public:
 
 	explicit CBlockLocator(uint256 hashBlock)
 	{
-		std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+		BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
 		if (mi != mapBlockIndex.end())
 			Set((*mi).second);
 	}
@@ -1305,7 +1649,7 @@ public:
 		int nStep = 1;
 		BOOST_FOREACH(const uint256& hash, vHave)
 		{
-			std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+			BlockMap::iterator mi = mapBlockIndex.find(hash);
 			if (mi != mapBlockIndex.end())
 			{
 				CBlockIndex* pindex = (*mi).second;
@@ -1324,7 +1668,7 @@ public:
 		// Find the first block the caller has in the main chain
 		BOOST_FOREACH(const uint256& hash, vHave)
 		{
-			std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+			BlockMap::iterator mi = mapBlockIndex.find(hash);
 			if (mi != mapBlockIndex.end())
 			{
 				CBlockIndex* pindex = (*mi).second;
@@ -1340,7 +1684,7 @@ public:
 		// Find the first block the caller has in the main chain
 		BOOST_FOREACH(const uint256& hash, vHave)
 		{
-			std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+			BlockMap::iterator mi = mapBlockIndex.find(hash);
 			if (mi != mapBlockIndex.end())
 			{
 				CBlockIndex* pindex = (*mi).second;
@@ -13,20 +13,12 @@
 CMasternodeMan mnodeman;
 CCriticalSection cs_process_message;
 
-struct CompareValueOnly
+struct CompareScoreDescending
 {
-    bool operator()(const pair<int64_t, CTxIn>& t1,
-                    const pair<int64_t, CTxIn>& t2) const
+    bool operator()(const pair<unsigned int, CMasternode*>& t1,
+                    const pair<unsigned int, CMasternode*>& t2) const
     {
-        return t1.first < t2.first;
-    }
-};
-struct CompareValueOnlyMN
-{
-    bool operator()(const pair<int64_t, CMasternode>& t1,
-                    const pair<int64_t, CMasternode>& t2) const
-    {
-        return t1.first < t2.first;
+        return t1.first > t2.first;
     }
 };
 
@@ -200,13 +192,84 @@ bool CMasternodeMan::Add(CMasternode &mn)
     if (pmn == NULL)
     {
         LogPrint("masternode", "CMasternodeMan: Adding new masternode %s - %i now\n", mn.addr.ToString().c_str(), size() + 1);
-        vMasternodes.push_back(mn);
+        std::list<CMasternode>::iterator it = listMasternodes.insert(listMasternodes.end(), mn);
+        vecMasternodes.push_back(&(*it));
+        mapMasternodesByOutPoint[mn.vin.prevout] = it;
+        IndexMasternode(&(*it));
+        InvalidateRankTables();
         return true;
     }
 
     return false;
 }
 
+void CMasternodeMan::IndexMasternode(CMasternode* pmn)
+{
+    mapMasternodesByPubKey.insert(make_pair(pmn->pubkey2, pmn));
+    mapMasternodesByAddr.insert(make_pair(pmn->addr, pmn));
+}
+
+void CMasternodeMan::UnindexMasternode(CMasternode* pmn)
+{
+    std::pair<std::multimap<CPubKey, CMasternode*>::iterator, std::multimap<CPubKey, CMasternode*>::iterator> rangePubKey =
+        mapMasternodesByPubKey.equal_range(pmn->pubkey2);
+    for (std::multimap<CPubKey, CMasternode*>::iterator it = rangePubKey.first; it != rangePubKey.second; ++it)
+    {
+        if (it->second == pmn)
+        {
+            mapMasternodesByPubKey.erase(it);
+            break;
+        }
+    }
+
+    std::pair<std::multimap<CService, CMasternode*>::iterator, std::multimap<CService, CMasternode*>::iterator> rangeAddr =
+        mapMasternodesByAddr.equal_range(pmn->addr);
+    for (std::multimap<CService, CMasternode*>::iterator it = rangeAddr.first; it != rangeAddr.second; ++it)
+    {
+        if (it->second == pmn)
+        {
+            mapMasternodesByAddr.erase(it);
+            break;
+        }
+    }
+}
+
+std::list<CMasternode>::iterator CMasternodeMan::EraseMasternode(std::list<CMasternode>::iterator it)
+{
+    CMasternode* pmn = &(*it);
+    UnindexMasternode(pmn);
+    mapMasternodesByOutPoint.erase(pmn->vin.prevout);
+    // order doesn't matter, so fill the gap with the last entry
+    std::vector<CMasternode*>::iterator itVec = std::find(vecMasternodes.begin(), vecMasternodes.end(), pmn);
+    if (itVec != vecMasternodes.end())
+    {
+        *itVec = vecMasternodes.back();
+        vecMasternodes.pop_back();
+    }
+    InvalidateRankTables();
+    return listMasternodes.erase(it);
+}
+
+void CMasternodeMan::CheckMasternode(CMasternode& mn)
+{
+    int prevState = mn.activeState;
+    mn.Check();
+    // rank tables only count enabled masternodes
+    if (mn.activeState != prevState)
+        InvalidateRankTables();
+}
+
+void CMasternodeMan::UpdateMasternodeKey(CMasternode* pmn, const CPubKey& pubkey2, const CService& addr)
+{
+    LOCK(cs);
+
+    UnindexMasternode(pmn);
+    pmn->pubkey2 = pubkey2;
+    pmn->addr = addr;
+    IndexMasternode(pmn);
+    InvalidateRankTables();
+}
+
 void CMasternodeMan::AskForMN(CNode* pnode, CTxIn &vin)
 {
     std::map<COutPoint, int64_t>::iterator i = mWeAskedForMasternodeListEntry.find(vin.prevout);
@@ -228,8 +291,8 @@ void CMasternodeMan::Check()
 {
     LOCK(cs);
 
-    BOOST_FOREACH(CMasternode& mn, vMasternodes)
-        mn.Check();
+    BOOST_FOREACH(CMasternode& mn, listMasternodes)
+        CheckMasternode(mn);
 }
 
 void CMasternodeMan::CheckAndRemove()
@@ -239,11 +302,11 @@ void CMasternodeMan::CheckAndRemove()
     Check();
 
     //remove inactive
-    vector<CMasternode>::iterator it = vMasternodes.begin();
-    while(it != vMasternodes.end()){
+    std::list<CMasternode>::iterator it = listMasternodes.begin();
+    while(it != listMasternodes.end()){
         if((*it).activeState == CMasternode::MASTERNODE_REMOVE || (*it).activeState == CMasternode::MASTERNODE_VIN_SPENT || (*it).protocolVersion < nMasternodeMinProtocol){
             LogPrint("masternode", "CMasternodeMan: Removing inactive masternode %s - %i now\n", (*it).addr.ToString().c_str(), size() - 1);
-            it = vMasternodes.erase(it);
+            it = EraseMasternode(it);
         } else {
             ++it;
         }
@@ -284,7 +347,12 @@ void CMasternodeMan::CheckAndRemove()
 void CMasternodeMan::Clear()
 {
     LOCK(cs);
-    vMasternodes.clear();
+    listMasternodes.clear();
+    vecMasternodes.clear();
+    mapMasternodesByOutPoint.clear();
+    mapMasternodesByPubKey.clear();
+    mapMasternodesByAddr.clear();
+    mapRankTables.clear();
     mAskedUsForMasternodeList.clear();
     mWeAskedForMasternodeList.clear();
     mWeAskedForMasternodeListEntry.clear();
@@ -293,11 +361,13 @@ void CMasternodeMan::Clear()
 
 int CMasternodeMan::CountEnabled(int protocolVersion)
 {
+    LOCK(cs);
+
     int i = 0;
     protocolVersion = protocolVersion == -1 ? masternodePayments.GetMinMasternodePaymentsProto() : protocolVersion;
 
-    BOOST_FOREACH(CMasternode& mn, vMasternodes) {
-        mn.Check();
+    BOOST_FOREACH(CMasternode& mn, listMasternodes) {
+        CheckMasternode(mn);
         if(mn.protocolVersion < protocolVersion || !mn.IsEnabled()) continue;
         i++;
     }
@@ -307,10 +377,12 @@ int CMasternodeMan::CountEnabled(int protocolVersion)
 
 int CMasternodeMan::CountMasternodesAboveProtocol(int protocolVersion)
 {
+    LOCK(cs);
+
     int i = 0;
 
-    BOOST_FOREACH(CMasternode& mn, vMasternodes) {
-        mn.Check();
+    BOOST_FOREACH(CMasternode& mn, listMasternodes) {
+        CheckMasternode(mn);
         if(mn.protocolVersion < protocolVersion || !mn.IsEnabled()) continue;
         i++;
     }
@@ -339,12 +411,10 @@ CMasternode *CMasternodeMan::Find(const CTxIn &vin)
 {
     LOCK(cs);
 
-    BOOST_FOREACH(CMasternode& mn, vMasternodes)
-    {
-        if(mn.vin.prevout == vin.prevout)
-            return &mn;
-    }
-    return NULL;
+    std::map<COutPoint, std::list<CMasternode>::iterator>::iterator it = mapMasternodesByOutPoint.find(vin.prevout);
+    if (it == mapMasternodesByOutPoint.end())
+        return NULL;
+    return &(*it->second);
 }
 
 CMasternode* CMasternodeMan::FindOldestNotInVec(const std::vector<CTxIn> &vVins, int nMinimumAge)
@@ -353,9 +423,9 @@ CMasternode* CMasternodeMan::FindOldestNotInVec(const std::vector<CTxIn> &vVins,
 
     CMasternode *pOldestMasternode = NULL;
 
-    BOOST_FOREACH(CMasternode &mn, vMasternodes)
+    BOOST_FOREACH(CMasternode &mn, listMasternodes)
     {   
-        mn.Check();
+        CheckMasternode(mn);
         if(!mn.IsEnabled()) continue;
 
         if(mn.GetMasternodeInputAge() < nMinimumAge) continue;
@@ -382,21 +452,29 @@ CMasternode *CMasternodeMan::FindRandom()
 {
     LOCK(cs);
 
-    if(size() == 0) return NULL;
+    if(vecMasternodes.empty()) return NULL;
 
-    return &vMasternodes[GetRandInt(vMasternodes.size())];
+    return vecMasternodes[GetRandInt(vecMasternodes.size())];
 }
 
 CMasternode *CMasternodeMan::Find(const CPubKey &pubKeyMasternode)
 {
     LOCK(cs);
 
-    BOOST_FOREACH(CMasternode& mn, vMasternodes)
-    {
-        if(mn.pubkey2 == pubKeyMasternode)
-            return &mn;
-    }
-    return NULL;
+    std::multimap<CPubKey, CMasternode*>::iterator it = mapMasternodesByPubKey.find(pubKeyMasternode);
+    if (it == mapMasternodesByPubKey.end())
+        return NULL;
+    return it->second;
+}
+
+CMasternode *CMasternodeMan::Find(const CService &addr)
+{
+    LOCK(cs);
+
+    std::multimap<CService, CMasternode*>::iterator it = mapMasternodesByAddr.find(addr);
+    if (it == mapMasternodesByAddr.end())
+        return NULL;
+    return it->second;
 }
 
 CMasternode *CMasternodeMan::FindRandomNotInVec(std::vector<CTxIn> &vecToExclude, int protocolVersion)
@@ -413,7 +491,7 @@ CMasternode *CMasternodeMan::FindRandomNotInVec(std::vector<CTxIn> &vecToExclude
     LogPrintf("CMasternodeMan::FindRandomNotInVec - rand %d\n", rand);
     bool found;
 
-    BOOST_FOREACH(CMasternode &mn, vMasternodes) {
+    BOOST_FOREACH(CMasternode &mn, listMasternodes) {
         if(mn.protocolVersion < protocolVersion || !mn.IsEnabled()) continue;
         found = false;
         BOOST_FOREACH(CTxIn &usedVin, vecToExclude) {
@@ -431,136 +509,135 @@ CMasternode *CMasternodeMan::FindRandomNotInVec(std::vector<CTxIn> &vecToExclude
     return NULL;
 }
 
-CMasternode* CMasternodeMan::GetCurrentMasterNode(int mod, int64_t nBlockHeight, int minProtocol)
+const CMasternodeRankTable* CMasternodeMan::GetRankTable(int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
 {
-    unsigned int score = 0;
-    CMasternode* winner = NULL;
+    LOCK(cs);
 
-    // scan for winner
-    BOOST_FOREACH(CMasternode& mn, vMasternodes) {
-        mn.Check();
-        if(mn.protocolVersion < minProtocol || !mn.IsEnabled()) continue;
+    //make sure we know about this block
+    uint256 hash = 0;
+    if(!GetBlockHash(hash, nBlockHeight)) return NULL;
 
-        // calculate the score for each masternode
-        uint256 n = mn.CalculateScore(mod, nBlockHeight);
-        unsigned int n2 = 0;
-        memcpy(&n2, &n, sizeof(n2));
+    pair<uint256, pair<int, bool> > key = make_pair(hash, make_pair(minProtocol, fOnlyActive));
+    int64_t nNow = GetTime();
+    std::map<pair<uint256, pair<int, bool> >, CMasternodeRankTable>::iterator it = mapRankTables.find(key);
+    // masternodes can expire without the list changing, so rebuild now and then
+    if (it != mapRankTables.end() && nNow - it->second.nTimeBuilt < MASTERNODES_RANK_CACHE_SECONDS)
+        return &it->second;
 
-        // determine the winner
-        if(n2 > score){
-            score = n2;
-            winner = &mn;
-        }
+    if (it == mapRankTables.end() && mapRankTables.size() >= MASTERNODES_RANK_CACHE_SIZE)
+    {
+        std::map<pair<uint256, pair<int, bool> >, CMasternodeRankTable>::iterator itOldest = mapRankTables.begin();
+        for (std::map<pair<uint256, pair<int, bool> >, CMasternodeRankTable>::iterator it2 = mapRankTables.begin(); it2 != mapRankTables.end(); ++it2)
+            if (it2->second.nTimeBuilt < itOldest->second.nTimeBuilt)
+                itOldest = it2;
+        mapRankTables.erase(itOldest);
     }
 
-    return winner;
-}
+    // states are kept current by Check(), which drops the tables on a change
+    CMasternodeRankTable& table = mapRankTables[key];
+    table.nTimeBuilt = nNow;
+    table.vecScores.clear();
+    table.mapRanks.clear();
 
-int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
-{
-    std::vector<pair<unsigned int, CTxIn> > vecMasternodeScores;
-
-    //make sure we know about this block
-    uint256 hash = 0;
-    if(!GetBlockHash(hash, nBlockHeight)) return -1;
-
-    // scan for winner
-    BOOST_FOREACH(CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH(CMasternode& mn, listMasternodes) {
 
         if(mn.protocolVersion < minProtocol) continue;
-        if(fOnlyActive) {
-            mn.Check();
-            if(!mn.IsEnabled()) continue;
-        }
+        if(fOnlyActive && !mn.IsEnabled()) continue;
 
         uint256 n = mn.CalculateScore(1, nBlockHeight);
         unsigned int n2 = 0;
         memcpy(&n2, &n, sizeof(n2));
 
-        vecMasternodeScores.push_back(make_pair(n2, mn.vin));
+        table.vecScores.push_back(make_pair(n2, &mn));
     }
 
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareValueOnly());
+    // equal scores keep list order, so the first best entry wins as it always has
+    stable_sort(table.vecScores.begin(), table.vecScores.end(), CompareScoreDescending());
 
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(unsigned int, CTxIn)& s, vecMasternodeScores){
-        rank++;
-        if(s.second == vin) {
-            return rank;
-        }
-    }
+    for (unsigned int i = 0; i < table.vecScores.size(); i++)
+        table.mapRanks[table.vecScores[i].second->vin.prevout] = i + 1;
 
-    return -1;
+    return &table;
 }
 
-std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t nBlockHeight, int minProtocol)
+CMasternode* CMasternodeMan::GetCurrentMasterNode(int mod, int64_t nBlockHeight, int minProtocol)
 {
-    std::vector<pair<unsigned int, CMasternode> > vecMasternodeScores;
-    std::vector<pair<int, CMasternode> > vecMasternodeRanks;
+    LOCK(cs);
 
-    //make sure we know about this block
-    uint256 hash = 0;
-    if(!GetBlockHash(hash, nBlockHeight)) return vecMasternodeRanks;
+    // the rank tables are scored with mod 1
+    if (mod == 1)
+    {
+        const CMasternodeRankTable* table = GetRankTable(nBlockHeight, minProtocol, true);
+        if (table == NULL || table->vecScores.empty() || table->vecScores[0].first == 0)
+            return NULL;
 
-    // scan for winner
-    BOOST_FOREACH(CMasternode& mn, vMasternodes) {
+        return table->vecScores[0].second;
+    }
 
-        mn.Check();
+    unsigned int score = 0;
+    CMasternode* winner = NULL;
 
-        if(mn.protocolVersion < minProtocol) continue;
-        if(!mn.IsEnabled()) {
-            continue;
-        }
+    // scan for winner
+    BOOST_FOREACH(CMasternode& mn, listMasternodes) {
+        CheckMasternode(mn);
+        if(mn.protocolVersion < minProtocol || !mn.IsEnabled()) continue;
 
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
+        // calculate the score for each masternode
+        uint256 n = mn.CalculateScore(mod, nBlockHeight);
         unsigned int n2 = 0;
         memcpy(&n2, &n, sizeof(n2));
 
-        vecMasternodeScores.push_back(make_pair(n2, mn));
+        // determine the winner
+        if(n2 > score){
+            score = n2;
+            winner = &mn;
+        }
     }
 
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareValueOnlyMN());
+    return winner;
+}
 
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(unsigned int, CMasternode)& s, vecMasternodeScores){
-        rank++;
-        vecMasternodeRanks.push_back(make_pair(rank, s.second));
-    }
+int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
+{
+    LOCK(cs);
 
-    return vecMasternodeRanks;
+    const CMasternodeRankTable* table = GetRankTable(nBlockHeight, minProtocol, fOnlyActive);
+    if (table == NULL)
+        return -1;
+
+    std::map<COutPoint, int>::const_iterator it = table->mapRanks.find(vin.prevout);
+    if (it == table->mapRanks.end())
+        return -1;
+
+    return it->second;
 }
 
-CMasternode* CMasternodeMan::GetMasternodeByRank(int nRank, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
+std::vector<pair<int, CTxIn> > CMasternodeMan::GetMasternodeRanks(int64_t nBlockHeight, int minProtocol)
 {
-    std::vector<pair<unsigned int, CTxIn> > vecMasternodeScores;
+    LOCK(cs);
 
-    // scan for winner
-    BOOST_FOREACH(CMasternode& mn, vMasternodes) {
+    // Inputs rather than entries, which can be removed once cs is released
+    std::vector<pair<int, CTxIn> > vecMasternodeRanks;
 
-        if(mn.protocolVersion < minProtocol) continue;
-        if(fOnlyActive) {
-            mn.Check();
-            if(!mn.IsEnabled()) continue;
-        }
+    const CMasternodeRankTable* table = GetRankTable(nBlockHeight, minProtocol, true);
+    if (table == NULL)
+        return vecMasternodeRanks;
 
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        unsigned int n2 = 0;
-        memcpy(&n2, &n, sizeof(n2));
+    for (unsigned int i = 0; i < table->vecScores.size(); i++)
+        vecMasternodeRanks.push_back(make_pair(i + 1, table->vecScores[i].second->vin));
 
-        vecMasternodeScores.push_back(make_pair(n2, mn.vin));
-    }
+    return vecMasternodeRanks;
+}
 
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareValueOnly());
+CMasternode* CMasternodeMan::GetMasternodeByRank(int nRank, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
+{
+    LOCK(cs);
 
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(unsigned int, CTxIn)& s, vecMasternodeScores){
-        rank++;
-        if(rank == nRank) {
-            return Find(s.second);
-        }
-    }
+    const CMasternodeRankTable* table = GetRankTable(nBlockHeight, minProtocol, fOnlyActive);
+    if (table == NULL || nRank < 1 || nRank > (int)table->vecScores.size())
+        return NULL;
 
-    return NULL;
+    return table->vecScores[nRank - 1].second;
 }
 
 void CMasternodeMan::ProcessMasternodeConnections()
@@ -693,11 +770,10 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
                         addrman.Add(CAddress(addr), pfrom->addr, 2*60*60); // use this as a peer
                     }
                     LogPrintf("dsee - Got updated entry for %s\n", addr.ToString().c_str());
-                    pmn->pubkey2 = pubkey2;
                     pmn->sigTime = sigTime;
                     pmn->sig = vchSig;
                     pmn->protocolVersion = protocolVersion;
-                    pmn->addr = addr;
+                    UpdateMasternodeKey(pmn, pubkey2, addr);
                     pmn->Check();
                     pmn->isOldNode = true;
                     if(pmn->IsEnabled())
@@ -745,12 +821,12 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
             // should be at least not earlier than block when 10000 TansferCoin tx got MASTERNODE_MIN_CONFIRMATIONS
             uint256 hashBlock = 0;
             GetTransaction(vin.prevout.hash, tx, hashBlock);
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+            BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
             if (mi != mapBlockIndex.end() && (*mi).second)
             {
                 CBlockIndex* pMNIndex = (*mi).second; // block for 10000 TansferCoin tx -> 1 confirmation
                 CBlockIndex* pConfIndex = FindBlockByHeight((pMNIndex->nHeight + MASTERNODE_MIN_CONFIRMATIONS - 1)); // block where tx got MASTERNODE_MIN_CONFIRMATIONS
-                if(pConfIndex->GetBlockTime() > sigTime)
+                if(pConfIndex && pConfIndex->GetBlockTime() > sigTime)
                 {
                     LogPrintf("dsee - Bad sigTime %d for masternode %20s %105s (%i conf block is at %d)\n",
                               sigTime, addr.ToString(), vin.ToString(), MASTERNODE_MIN_CONFIRMATIONS, pConfIndex->GetBlockTime());
@@ -901,11 +977,10 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
                         addrman.Add(CAddress(addr), pfrom->addr, 2*60*60); // use this as a peer
                     }
                     LogPrintf("dsee+ - Got updated entry for %s\n", addr.ToString().c_str());
-                    pmn->pubkey2 = pubkey2;
                     pmn->sigTime = sigTime;
                     pmn->sig = vchSig;
                     pmn->protocolVersion = protocolVersion;
-                    pmn->addr = addr;
+                    UpdateMasternodeKey(pmn, pubkey2, addr);
                     pmn->rewardAddress = rewardAddress;
                     pmn->rewardPercentage = rewardPercentage;                    
                     pmn->Check();
@@ -955,12 +1030,12 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
             // should be at least not earlier than block when 10000 TansferCoin tx got MASTERNODE_MIN_CONFIRMATIONS
             uint256 hashBlock = 0;
             GetTransaction(vin.prevout.hash, tx, hashBlock);
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+            BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
            if (mi != mapBlockIndex.end() && (*mi).second)
             {
                 CBlockIndex* pMNIndex = (*mi).second; // block for 10000 TansferCoin tx -> 1 confirmation
                 CBlockIndex* pConfIndex = FindBlockByHeight((pMNIndex->nHeight + MASTERNODE_MIN_CONFIRMATIONS - 1)); // block where tx got MASTERNODE_MIN_CONFIRMATIONS
-                if(pConfIndex->GetBlockTime() > sigTime)
+                if(pConfIndex && pConfIndex->GetBlockTime() > sigTime)
                 {
                     LogPrintf("dsee+ - Bad sigTime %d for masternode %20s %105s (%i conf block is at %d)\n",
                               sigTime, addr.ToString(), vin.ToString(), MASTERNODE_MIN_CONFIRMATIONS, pConfIndex->GetBlockTime());
@@ -1052,11 +1127,14 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
 
                 if(!pmn->UpdatedWithin(MASTERNODE_MIN_DSEEP_SECONDS))
                 {
-                    if(stop) pmn->Disable();
+                    if(stop) {
+                        pmn->Disable();
+                        InvalidateRankTables();
+                    }
                     else
                     {
                         pmn->UpdateLastSeen();
-                        pmn->Check();
+                        CheckMasternode(*pmn);
                         if(!pmn->IsEnabled()) return;
                     }
                     mnodeman.RelayMasternodeEntryPing(vin, vchSig, sigTime, stop);
@@ -1143,7 +1221,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         int count = this->size();
         int i = 0;
 
-        BOOST_FOREACH(CMasternode& mn, vMasternodes) {
+        BOOST_FOREACH(CMasternode& mn, listMasternodes) {
 
             if(mn.addr.IsRFC1918()) continue; //local network
 
@@ -1201,23 +1279,20 @@ void CMasternodeMan::Remove(CTxIn vin)
 {
     LOCK(cs);
 
-    vector<CMasternode>::iterator it = vMasternodes.begin();
-    while(it != vMasternodes.end()){
-        if((*it).vin == vin){
-            LogPrint("masternode", "CMasternodeMan: Removing Masternode %s - %i now\n", (*it).addr.ToString().c_str(), size() - 1);
-            vMasternodes.erase(it);
-            break;
-        } else {
-            ++it;
-        }
-    }
+    std::map<COutPoint, std::list<CMasternode>::iterator>::iterator mi = mapMasternodesByOutPoint.find(vin.prevout);
+    if (mi == mapMasternodesByOutPoint.end() || (*mi->second).vin != vin)
+        return;
+
+    std::list<CMasternode>::iterator it = mi->second;
+    LogPrint("masternode", "CMasternodeMan: Removing Masternode %s - %i now\n", (*it).addr.ToString().c_str(), size() - 1);
+    EraseMasternode(it);
 }
 
 std::string CMasternodeMan::ToString() const
 {
     std::ostringstream info;
 
-    info << "masternodes: " << (int)vMasternodes.size() <<
+    info << "masternodes: " << (int)listMasternodes.size() <<
             ", peers who asked us for masternode list: " << (int)mAskedUsForMasternodeList.size() <<
             ", peers we asked for masternode list: " << (int)mWeAskedForMasternodeList.size() <<
             ", entries in Masternode list we asked for: " << (int)mWeAskedForMasternodeListEntry.size() <<
@@ -19,6 +19,8 @@
 
 #define MASTERNODES_DUMP_SECONDS               (15*60)
 #define MASTERNODES_DSEG_SECONDS               (3*60*60)
+#define MASTERNODES_RANK_CACHE_SECONDS         (60)
+#define MASTERNODES_RANK_CACHE_SIZE            16
 
 using namespace std;
 
@@ -52,22 +54,58 @@ public:
     ReadResult Read(CMasternodeMan& mnodemanToLoad);
 };
 
+/** Masternodes ranked by their score for one block, best first */
+class CMasternodeRankTable
+{
+public:
+    int64_t nTimeBuilt;
+    std::vector<pair<unsigned int, CMasternode*> > vecScores;
+    std::map<COutPoint, int> mapRanks; // collateral -> 1-based rank
+
+    CMasternodeRankTable() : nTimeBuilt(0) {}
+};
+
 class CMasternodeMan
 {
 private:
     // critical section to protect the inner data structures
     mutable CCriticalSection cs;
 
-    // map to hold all MNs
-    std::vector<CMasternode> vMasternodes;
+    // list to hold all MNs, so pointers to entries stay valid as others come and go
+    std::list<CMasternode> listMasternodes;
+    // indexes into listMasternodes
+    std::vector<CMasternode*> vecMasternodes; // random access, in no particular order
+    std::map<COutPoint, std::list<CMasternode>::iterator> mapMasternodesByOutPoint;
+    std::multimap<CPubKey, CMasternode*> mapMasternodesByPubKey;
+    std::multimap<CService, CMasternode*> mapMasternodesByAddr;
     // who's asked for the masternode list and the last time
     std::map<CNetAddr, int64_t> mAskedUsForMasternodeList;
     // who we asked for the masternode list and the last time
     std::map<CNetAddr, int64_t> mWeAskedForMasternodeList;
     // which masternodes we've asked for
     std::map<COutPoint, int64_t> mWeAskedForMasternodeListEntry;
+    // rank tables by (block hash, (minimum protocol, active only)), dropped whenever the list changes
+    std::map<pair<uint256, pair<int, bool> >, CMasternodeRankTable> mapRankTables;
+
+    // Add or remove an entry's pubkey2 and addr from the indexes; cs must be held
+    void IndexMasternode(CMasternode* pmn);
+    void UnindexMasternode(CMasternode* pmn);
+    // Change an entry's masternode key and address, keeping the indexes up to date
+    void UpdateMasternodeKey(CMasternode* pmn, const CPubKey& pubkey2, const CService& addr);
+    // Remove an entry from the list and every index; returns the next entry
+    std::list<CMasternode>::iterator EraseMasternode(std::list<CMasternode>::iterator it);
+    // Check an entry, dropping the rank tables if its state changed
+    void CheckMasternode(CMasternode& mn);
+
+    // Get the rank table for a block, building it if needed; NULL if we don't know the block
+    const CMasternodeRankTable* GetRankTable(int64_t nBlockHeight, int minProtocol, bool fOnlyActive);
 
 public:
+    // Drop the cached rank tables; called whenever an entry is added, removed or changes state.
+    // States are only updated by Check(), so tables may lag a state change made elsewhere until
+    // the next Check() or MASTERNODES_RANK_CACHE_SECONDS.
+    void InvalidateRankTables() { LOCK(cs); mapRankTables.clear(); }
+
     // keep track of dsq count to prevent masternodes from gaming darksend queue
     int64_t nDsqCount;
 
@@ -80,7 +118,22 @@ public:
                 LOCK(cs);
                 unsigned char nVersion = 0;
                 READWRITE(nVersion);
+                std::vector<CMasternode> vMasternodes;
+                if (!fRead)
+                    vMasternodes.assign(listMasternodes.begin(), listMasternodes.end());
                 READWRITE(vMasternodes);
+                if (fRead)
+                {
+                    CMasternodeMan* pthis = const_cast<CMasternodeMan*>(this);
+                    pthis->listMasternodes.clear();
+                    pthis->vecMasternodes.clear();
+                    pthis->mapMasternodesByOutPoint.clear();
+                    pthis->mapMasternodesByPubKey.clear();
+                    pthis->mapMasternodesByAddr.clear();
+                    pthis->mapRankTables.clear();
+                    BOOST_FOREACH(CMasternode& mn, vMasternodes)
+                        pthis->Add(mn);
+                }
                 READWRITE(mAskedUsForMasternodeList);
                 READWRITE(mWeAskedForMasternodeList);
                 READWRITE(mWeAskedForMasternodeListEntry);
@@ -94,7 +147,7 @@ public:
     // Add an entry
     bool Add(CMasternode &mn);
 
-    // Check all masternodes
+    // Check all masternodes, dropping the rank tables if any changed state
     void Check();
 
     /// Ask (source) node for mnb
@@ -115,6 +168,7 @@ public:
     // Find an entry
     CMasternode* Find(const CTxIn& vin);
     CMasternode* Find(const CPubKey& pubKeyMasternode);
+    CMasternode* Find(const CService& addr);
 
     //Find an entry thta do not match every entry provided vector
     CMasternode* FindOldestNotInVec(const std::vector<CTxIn> &vVins, int nMinimumAge);
@@ -128,9 +182,9 @@ public:
     // Get the current winner for this block
     CMasternode* GetCurrentMasterNode(int mod=1, int64_t nBlockHeight=0, int minProtocol=0);
 
-    std::vector<CMasternode> GetFullMasternodeVector() { Check(); return vMasternodes; }
+    std::vector<CMasternode> GetFullMasternodeVector() { LOCK(cs); Check(); return std::vector<CMasternode>(listMasternodes.begin(), listMasternodes.end()); }
 
-    std::vector<pair<int, CMasternode> > GetMasternodeRanks(int64_t nBlockHeight, int minProtocol=0);
+    std::vector<pair<int, CTxIn> > GetMasternodeRanks(int64_t nBlockHeight, int minProtocol=0);
     int GetMasternodeRank(const CTxIn &vin, int64_t nBlockHeight, int minProtocol=0, bool fOnlyActive=true);
     CMasternode* GetMasternodeByRank(int nRank, int64_t nBlockHeight, int minProtocol=0, bool fOnlyActive=true);
 
@@ -139,7 +193,7 @@ public:
     void ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
 
     // Return the number of (unique) masternodes
-    int size() { return vMasternodes.size(); }
+    int size() { return listMasternodes.size(); }
 
     std::string ToString() const;
 
@@ -72,6 +72,97 @@ public:
 };
 
 
+// What CreateNewBlock needs to know about a pool transaction before ordering
+// it. Depends only on the transaction and the tip, so it is kept across calls.
+class CTemplateCandidate
+{
+public:
+    set<uint256> setDependsOn;
+    double dPriority;
+    double dFeePerKb;
+
+    CTemplateCandidate()
+    {
+        dPriority = dFeePerKb = 0;
+    }
+};
+
+// State carried between CreateNewBlock calls, guarded by cs_main. The
+// candidates are refreshed as transactions enter and leave the pool and
+// dropped when the tip moves; the last selection is handed back as-is while
+// neither the pool nor the tip has changed.
+class CBlockTemplateCache
+{
+public:
+    uint256 hashPrevBlock;
+    map<uint256, CTemplateCandidate> mapCandidates;
+
+    bool fValid;
+    bool fProofOfStake;
+    bool fTimeSensitive; // something was held back for time reasons only
+    unsigned int nTransactionsUpdated;
+    int64_t nTime;
+    vector<CTransaction> vtx;
+    uint64_t nBlockSize;
+    int64_t nFees;
+
+    CBlockTemplateCache()
+    {
+        fValid = fProofOfStake = fTimeSensitive = false;
+        nTransactionsUpdated = 0;
+        nTime = 0;
+        nBlockSize = 0;
+        nFees = 0;
+    }
+};
+
+static CBlockTemplateCache templateCache;
+
+// Look up the inputs of a pool transaction. Returns false if one of them
+// cannot be found anywhere.
+static bool GetTemplateCandidate(CTxDB& txdb, const uint256& hash, const CTransaction& tx, bool fPriority, CTemplateCandidate& candidate)
+{
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        if (mempool.mapTx.count(txin.prevout.hash))
+        {
+            candidate.setDependsOn.insert(txin.prevout.hash);
+            continue;
+        }
+
+        // Without a priority area only in-pool dependencies matter
+        if (!fPriority)
+            continue;
+
+        // Read prev transaction
+        CTransaction txPrev;
+        CTxIndex txindex;
+        if (!txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
+        {
+            // This should never happen; all transactions in the memory
+            // pool should connect to either transactions in the chain
+            // or other transactions in the memory pool.
+            LogPrintf("ERROR: mempool transaction missing input\n");
+            if (fDebug) assert("mempool transaction missing input" == 0);
+            return false;
+        }
+        int64_t nValueIn = txPrev.vout[txin.prevout.n].nValue;
+
+        int nConf = txindex.GetDepthInMainChain();
+        candidate.dPriority += (double)nValueIn * nConf;
+    }
+
+    // Priority is sum(valuein * age) / txsize
+    unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    candidate.dPriority /= nTxSize;
+
+    // This is a more accurate fee-per-kilobyte than is used by the client code, because the
+    // client code rounds up the size to the nearest 1K. That's good, because it gives an
+    // incentive to create smaller transactions. The pool worked out the fee on entry.
+    candidate.dFeePerKb = mempool.mapEntry[hash].GetFeeRate();
+    return true;
+}
+
 uint64_t nLastBlockTx = 0;
 uint64_t nLastBlockSize = 0;
 int64_t nLastCoinStakeSearchInterval = 0;
@@ -169,183 +260,212 @@ CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFe
         LOCK2(cs_main, mempool.cs);
         CTxDB txdb("r");
 //>HC<
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+        // Candidates are only valid against the tip they were computed on
+        if (templateCache.hashPrevBlock != pindexPrev->GetBlockHash())
         {
-            CTransaction& tx = (*mi).second;
-            if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
-                continue;
+            templateCache.hashPrevBlock = pindexPrev->GetBlockHash();
+            templateCache.mapCandidates.clear();
+            templateCache.fValid = false;
+        }
+
+        uint64_t nBlockSize = 1000;
+        uint64_t nBlockTx = 0;
+        int nBlockSigOps = 100;
 
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            int64_t nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        // Nothing in the pool or the chain has moved since the last template:
+        // hand back the same selection without touching the inputs again.
+        unsigned int nTransactionsUpdated = mempool.GetTransactionsUpdated();
+        bool fReuse = templateCache.fValid &&
+                      templateCache.fProofOfStake == fProofOfStake &&
+                      templateCache.nTransactionsUpdated == nTransactionsUpdated &&
+                      (!templateCache.fTimeSensitive || templateCache.nTime == GetAdjustedTime());
+        if (fReuse)
+        {
+            BOOST_FOREACH(const CTransaction& tx, templateCache.vtx)
             {
-                // Read prev transaction
-                CTransaction txPrev;
-                CTxIndex txindex;
-                if (!txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
+                if (tx.nTime > GetAdjustedTime() || (fProofOfStake && tx.nTime > pblock->vtx[0].nTime))
                 {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        LogPrintf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
+                    fReuse = false;
+                    break;
+                }
+            }
+        }
 
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].vout[txin.prevout.n].nValue;
+        if (fReuse)
+        {
+            pblock->vtx.insert(pblock->vtx.end(), templateCache.vtx.begin(), templateCache.vtx.end());
+            nBlockSize = templateCache.nBlockSize;
+            nBlockTx = templateCache.vtx.size();
+            nFees = templateCache.nFees;
+        }
+        else
+        {
+            templateCache.fTimeSensitive = false;
+
+            // Priority order to process transactions
+            list<COrphan> vOrphan; // list memory doesn't move
+            map<uint256, vector<COrphan*> > mapDependers;
+
+            // This vector will be sorted into a priority queue:
+            vector<TxPriority> vecPriority;
+            vecPriority.reserve(mempool.mapTx.size());
+            for (map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+            {
+                CTransaction& tx = (*mi).second;
+                if (tx.IsCoinBase() || tx.IsCoinStake())
+                    continue;
+                if (!IsFinalTx(tx, nHeight))
+                {
+                    templateCache.fTimeSensitive = true;
                     continue;
                 }
-                int64_t nValueIn = txPrev.vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = txindex.GetDepthInMainChain();
-                dPriority += (double)nValueIn * nConf;
-            }
-            if (fMissingInputs) continue;
 
-            // Priority is sum(valuein * age) / txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority /= nTxSize;
+                // Only transactions new since the last template need their inputs looked up
+                map<uint256, CTemplateCandidate>::iterator ci = templateCache.mapCandidates.find((*mi).first);
+                if (ci == templateCache.mapCandidates.end())
+                {
+                    CTemplateCandidate candidate;
+                    if (!GetTemplateCandidate(txdb, (*mi).first, tx, nBlockPrioritySize > 0, candidate))
+                        continue;
+                    ci = templateCache.mapCandidates.insert(make_pair((*mi).first, candidate)).first;
+                }
+                const CTemplateCandidate& candidate = ci->second;
 
-            // This is a more accurate fee-per-kilobyte than is used by the client code, because the
-            // client code rounds up the size to the nearest 1K. That's good, because it gives an
-            // incentive to create smaller transactions.
-            double dFeePerKb =  double(nTotalIn-tx.GetValueOut()) / (double(nTxSize)/1000.0);
+                if (!candidate.setDependsOn.empty())
+                {
+                    // Has to wait for dependencies
+                    // Use list for automatic deletion
+                    vOrphan.push_back(COrphan(&tx));
+                    COrphan* porphan = &vOrphan.back();
+                    porphan->setDependsOn = candidate.setDependsOn;
+                    porphan->dPriority = candidate.dPriority;
+                    porphan->dFeePerKb = candidate.dFeePerKb;
+                    BOOST_FOREACH(const uint256& hashDependsOn, candidate.setDependsOn)
+                        mapDependers[hashDependsOn].push_back(porphan);
+                }
+                else
+                    vecPriority.push_back(TxPriority(candidate.dPriority, candidate.dFeePerKb, &tx));
+            }
 
-            if (porphan)
+            // Forget candidates that have left the pool
+            for (map<uint256, CTemplateCandidate>::iterator ci = templateCache.mapCandidates.begin(); ci != templateCache.mapCandidates.end(); )
             {
-                porphan->dPriority = dPriority;
-                porphan->dFeePerKb = dFeePerKb;
+                if (mempool.mapTx.count(ci->first))
+                    ++ci;
+                else
+                    templateCache.mapCandidates.erase(ci++);
             }
-            else
-                vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &(*mi).second));
-        }
 
-        // Collect transactions into block
-        map<uint256, CTxIndex> mapTestPool;
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
+            // Collect transactions into block
+            map<uint256, CTxIndex> mapTestPool;
+            bool fSortedByFee = (nBlockPrioritySize <= 0);
 
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+            TxPriorityCompare comparer(fSortedByFee);
+            std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
 
-        while (!vecPriority.empty())
-        {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            double dFeePerKb = vecPriority.front().get<1>();
-            CTransaction& tx = *(vecPriority.front().get<2>());
+            while (!vecPriority.empty())
+            {
+                // Take highest priority transaction off the priority queue:
+                double dPriority = vecPriority.front().get<0>();
+                double dFeePerKb = vecPriority.front().get<1>();
+                CTransaction& tx = *(vecPriority.front().get<2>());
 
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
+                std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                vecPriority.pop_back();
 
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
+                // Size limits
+                unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+                if (nBlockSize + nTxSize >= nBlockMaxSize)
+                    continue;
 
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
+                // Legacy limits on sigOps:
+                unsigned int nTxSigOps = GetLegacySigOpCount(tx);
+                if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+                    continue;
 
-            // Timestamp limit
-            if (tx.nTime > GetAdjustedTime() || (fProofOfStake && tx.nTime > pblock->vtx[0].nTime))
-                continue;
+                // Timestamp limit
+                if (tx.nTime > GetAdjustedTime() || (fProofOfStake && tx.nTime > pblock->vtx[0].nTime))
+                {
+                    templateCache.fTimeSensitive = true;
+                    continue;
+                }
 
-            // Skip free transactions if we're past the minimum block size:
-            if (fSortedByFee && (dFeePerKb < nMinTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                continue;
+                // Skip free transactions if we're past the minimum block size:
+                if (fSortedByFee && (dFeePerKb < nMinTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
+                    continue;
 
-            // Prioritize by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || (dPriority < COIN * 144 / 250)))
-            {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            }
+                // Prioritize by fee once past the priority size or we run out of high-priority
+                // transactions:
+                if (!fSortedByFee &&
+                    ((nBlockSize + nTxSize >= nBlockPrioritySize) || (dPriority < COIN * 144 / 250)))
+                {
+                    fSortedByFee = true;
+                    comparer = TxPriorityCompare(fSortedByFee);
+                    std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                }
 
-            // Connecting shouldn't fail due to dependency on other memory pool transactions
-            // because we're already processing them in order of dependency
-            map<uint256, CTxIndex> mapTestPoolTmp(mapTestPool);
-            MapPrevTx mapInputs;
-            bool fInvalid;
-            if (!tx.FetchInputs(txdb, mapTestPoolTmp, false, true, mapInputs, fInvalid))
-                continue;
+                // Connecting shouldn't fail due to dependency on other memory pool transactions
+                // because we're already processing them in order of dependency
+                map<uint256, CTxIndex> mapTestPoolTmp(mapTestPool);
+                MapPrevTx mapInputs;
+                bool fInvalid;
+                if (!tx.FetchInputs(txdb, mapTestPoolTmp, false, true, mapInputs, fInvalid))
+                    continue;
 
-            int64_t nTxFees = tx.GetValueIn(mapInputs)-tx.GetValueOut();
+                int64_t nTxFees = tx.GetValueIn(mapInputs)-tx.GetValueOut();
 
-            nTxSigOps += GetP2SHSigOpCount(tx, mapInputs);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
+                nTxSigOps += GetP2SHSigOpCount(tx, mapInputs);
+                if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+                    continue;
 
-            // Note that flags: we don't want to set mempool/IsStandard()
-            // policy here, but we still have to ensure that the block we
-            // create only contains transactions that are valid in new blocks.
-            if (!tx.ConnectInputs(txdb, mapInputs, mapTestPoolTmp, CDiskTxPos(1,1,1), pindexPrev, false, true, MANDATORY_SCRIPT_VERIFY_FLAGS))
-                continue;
-            mapTestPoolTmp[tx.GetHash()] = CTxIndex(CDiskTxPos(1,1,1), tx.vout.size());
-            swap(mapTestPool, mapTestPoolTmp);
+                // Note that flags: we don't want to set mempool/IsStandard()
+                // policy here, but we still have to ensure that the block we
+                // create only contains transactions that are valid in new blocks.
+                if (!tx.ConnectInputs(txdb, mapInputs, mapTestPoolTmp, CDiskTxPos(1,1,1), pindexPrev, false, true, MANDATORY_SCRIPT_VERIFY_FLAGS))
+                    continue;
+                mapTestPoolTmp[tx.GetHash()] = CTxIndex(CDiskTxPos(1,1,1), tx.vout.size());
+                swap(mapTestPool, mapTestPoolTmp);
 
-            // Added
-            pblock->vtx.push_back(tx);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
+                // Added
+                pblock->vtx.push_back(tx);
+                nBlockSize += nTxSize;
+                ++nBlockTx;
+                nBlockSigOps += nTxSigOps;
+                nFees += nTxFees;
 
-            if (fDebug && GetBoolArg("-printpriority", false))
-            {
-                LogPrintf("priority %.1f feeperkb %.1f txid %s\n",
-                       dPriority, dFeePerKb, tx.GetHash().ToString());
-            }
+                if (fDebug && GetBoolArg("-printpriority", false))
+                {
+                    LogPrintf("priority %.1f feeperkb %.1f txid %s\n",
+                           dPriority, dFeePerKb, tx.GetHash().ToString());
+                }
 
-            // Add transactions that depend on this one to the priority queue
-            uint256 hash = tx.GetHash();
-            if (mapDependers.count(hash))
-            {
-                BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
+                // Add transactions that depend on this one to the priority queue
+                uint256 hash = tx.GetHash();
+                if (mapDependers.count(hash))
                 {
-                    if (!porphan->setDependsOn.empty())
+                    BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
                     {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
+                        if (!porphan->setDependsOn.empty())
                         {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->dFeePerKb, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                            porphan->setDependsOn.erase(hash);
+                            if (porphan->setDependsOn.empty())
+                            {
+                                vecPriority.push_back(TxPriority(porphan->dPriority, porphan->dFeePerKb, porphan->ptx));
+                                std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                            }
                         }
                     }
                 }
             }
-        }
 
+            templateCache.vtx.assign(pblock->vtx.begin() + 1, pblock->vtx.end());
+            templateCache.nBlockSize = nBlockSize;
+            templateCache.nFees = nFees;
+            templateCache.nTransactionsUpdated = nTransactionsUpdated;
+            templateCache.fProofOfStake = fProofOfStake;
+            templateCache.nTime = GetAdjustedTime();
+            templateCache.fValid = true;
+        }
         nLastBlockTx = nBlockTx;
         nLastBlockSize = nBlockSize;
 
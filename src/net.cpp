@@ -18,6 +18,11 @@
 #include <fcntl.h>
 #endif
 
+#ifdef __linux__
+#define USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
 #ifdef USE_UPNP
 #include <miniupnpc/miniupnpc.h>
 #include <miniupnpc/miniwget.h>
@@ -54,8 +59,17 @@ static CNode* pnodeLocalHost = NULL;
 static CNode* pnodeSync = NULL;
 uint64_t nLocalHostNonce = 0;
 static std::vector<SOCKET> vhListenSocket;
+#ifdef USE_EPOLL
+static int hEpoll = -1;
+#endif
 CAddrMan addrman;
 std::string strSubVersion;
+
+// Lets the socket thread wake the message handler as soon as a complete
+// message has arrived instead of leaving it to its polling interval
+static boost::mutex mutexMsgProc;
+static boost::condition_variable condMsgProc;
+static bool fMsgProcWake = false;
 int nMaxConnections = GetArg("-maxconnections", 125);
 
 vector<CNode*> vNodes;
@@ -741,10 +755,10 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode *pnode)
 {
-	std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+	std::deque<CSerializedMessageRef>::iterator it = pnode->vSendMsg.begin();
 
 	while (it != pnode->vSendMsg.end()) {
-		const CSerializeData &data = *it;
+		const CSerializeData &data = **it;
 		assert(data.size() > pnode->nSendOffset);
 		int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
 		if (nBytes > 0) {
@@ -784,11 +798,256 @@ void SocketSendData(CNode *pnode)
 	pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
 }
 
+CSerializedMessageRef SerializeMessage(const char* pszCommand, const CDataStream& ssPayload)
+{
+	CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+	ss.reserve(CMessageHeader::HEADER_SIZE + ssPayload.size());
+	ss << CMessageHeader(pszCommand, ssPayload.size());
+	if (!ssPayload.empty())
+		ss.write(&ssPayload[0], ssPayload.size());
+
+	uint256 hash = Hash(ssPayload.begin(), ssPayload.end());
+	unsigned int nChecksum = 0;
+	memcpy(&nChecksum, &hash, sizeof(nChecksum));
+	memcpy((char*)&ss[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+
+	boost::shared_ptr<CSerializeData> pdata(new CSerializeData());
+	ss.GetAndClear(*pdata);
+	return pdata;
+}
+
 static list<CNode*> vNodesDisconnected;
 
+static void WakeMessageHandler()
+{
+	{
+		boost::mutex::scoped_lock lock(mutexMsgProc);
+		fMsgProcWake = true;
+	}
+	condMsgProc.notify_one();
+}
+
+static const unsigned char SOCKET_SERVICE_RECV = 1;
+static const unsigned char SOCKET_SERVICE_SEND = 2;
+
+// Implement the following logic:
+// * If there is data to send, wait for the socket to become writable. As this
+//   only happens when optimistic write failed, we choose to first drain the
+//   write buffer in this case before receiving more. This avoids
+//   needlessly queueing received data, if the remote peer is not themselves
+//   receiving data. This means properly utilizing TCP flow control signalling.
+// * Otherwise, if there is no (complete) message in the receive buffer,
+//   or there is space left in the buffer, wait for data to be received.
+// * (if neither of the above applies, there is certainly one message
+//   in the receiver buffer ready to be processed).
+// Together, that means that at least one of the following is always possible,
+// so we don't deadlock:
+// * We send some data.
+// * We wait for data to be received (and disconnect after timeout).
+// * We process a message in the buffer (message handler thread).
+static void GetSocketWants(CNode* pnode, bool& fWantSend, bool& fWantRecv)
+{
+	fWantSend = false;
+	fWantRecv = false;
+	{
+		TRY_LOCK(pnode->cs_vSend, lockSend);
+		if (lockSend && !pnode->vSendMsg.empty()) {
+			fWantSend = true;
+			return;
+		}
+	}
+	{
+		TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+		if (lockRecv && (
+			pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+			pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
+			fWantRecv = true;
+	}
+}
+
+// Wait for socket activity with select(), which rebuilds its descriptor sets
+// on every pass. vService gets the SOCKET_SERVICE_* flags for each node;
+// returns whether a listening socket has connections to accept.
+static bool SocketEventsSelect(const vector<CNode*>& vNodesCopy, vector<unsigned char>& vService)
+{
+	struct timeval timeout;
+	timeout.tv_sec = 0;
+	timeout.tv_usec = 50000; // frequency to poll pnode->vSend
+
+	fd_set fdsetRecv;
+	fd_set fdsetSend;
+	fd_set fdsetError;
+	FD_ZERO(&fdsetRecv);
+	FD_ZERO(&fdsetSend);
+	FD_ZERO(&fdsetError);
+	SOCKET hSocketMax = 0;
+	bool have_fds = false;
+
+	BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
+		FD_SET(hListenSocket, &fdsetRecv);
+		hSocketMax = max(hSocketMax, hListenSocket);
+		have_fds = true;
+	}
+	BOOST_FOREACH(CNode* pnode, vNodesCopy)
+	{
+		if (pnode->hSocket == INVALID_SOCKET)
+			continue;
+		FD_SET(pnode->hSocket, &fdsetError);
+		hSocketMax = max(hSocketMax, pnode->hSocket);
+		have_fds = true;
+
+		bool fWantSend, fWantRecv;
+		GetSocketWants(pnode, fWantSend, fWantRecv);
+		if (fWantSend)
+			FD_SET(pnode->hSocket, &fdsetSend);
+		else if (fWantRecv)
+			FD_SET(pnode->hSocket, &fdsetRecv);
+	}
+
+	int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+		&fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+
+	if (nSelect == SOCKET_ERROR)
+	{
+		if (have_fds)
+		{
+			int nErr = WSAGetLastError();
+			LogPrintf("socket select error %d\n", nErr);
+			for (unsigned int i = 0; i <= hSocketMax; i++)
+				FD_SET(i, &fdsetRecv);
+		}
+		FD_ZERO(&fdsetSend);
+		FD_ZERO(&fdsetError);
+		MilliSleep(timeout.tv_usec / 1000);
+	}
+
+	bool fListenReady = false;
+	BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+		if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+			fListenReady = true;
+
+	vService.assign(vNodesCopy.size(), 0);
+	for (unsigned int i = 0; i < vNodesCopy.size(); i++)
+	{
+		SOCKET hSocket = vNodesCopy[i]->hSocket;
+		if (hSocket == INVALID_SOCKET)
+			continue;
+		if (FD_ISSET(hSocket, &fdsetRecv) || FD_ISSET(hSocket, &fdsetError))
+			vService[i] |= SOCKET_SERVICE_RECV;
+		if (FD_ISSET(hSocket, &fdsetSend))
+			vService[i] |= SOCKET_SERVICE_SEND;
+	}
+	return fListenReady;
+}
+
+#ifdef USE_EPOLL
+// Listening sockets are registered level-triggered with a NULL pointer;
+// node sockets are added edge-triggered the first time they are seen.
+static int CreateEpollSocketEvents()
+{
+	int hEpollNew = epoll_create(1024);
+	if (hEpollNew == -1)
+	{
+		LogPrintf("epoll_create failed with error %d, using select\n", errno);
+		return -1;
+	}
+	BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+	{
+		struct epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN;
+		event.data.ptr = NULL;
+		if (epoll_ctl(hEpollNew, EPOLL_CTL_ADD, hListenSocket, &event) == -1)
+		{
+			LogPrintf("epoll_ctl failed with error %d, using select\n", errno);
+			close(hEpollNew);
+			return -1;
+		}
+	}
+	return hEpollNew;
+}
+
+// Wait for socket activity with epoll. Only sockets that changed state are
+// reported, so the cost no longer grows with the number of idle peers and
+// there is no FD_SETSIZE limit. Readiness is remembered in the node's
+// fRecvReady/fSendReady until a read or write finds the socket drained or
+// full, as edge-triggered events are not repeated.
+static bool SocketEventsEpoll(const vector<CNode*>& vNodesCopy, vector<unsigned char>& vService, int nTimeout)
+{
+	BOOST_FOREACH(CNode* pnode, vNodesCopy)
+	{
+		if (pnode->fSocketRegistered || pnode->hSocket == INVALID_SOCKET)
+			continue;
+		struct epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		event.data.ptr = pnode;
+		if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, pnode->hSocket, &event) == -1)
+		{
+			LogPrintf("socket epoll_ctl error %d\n", errno);
+			pnode->CloseSocketDisconnect();
+			continue;
+		}
+		pnode->fSocketRegistered = true;
+		// Data that arrived before registration raises no edge
+		pnode->fRecvReady = true;
+		pnode->fSendReady = true;
+		nTimeout = 0;
+	}
+
+	bool fListenReady = false;
+	struct epoll_event events[256];
+	int nEvents = epoll_wait(hEpoll, events, 256, nTimeout);
+	if (nEvents == -1)
+	{
+		if (errno != EINTR)
+			LogPrintf("socket epoll_wait error %d\n", errno);
+		nEvents = 0;
+	}
+	for (int i = 0; i < nEvents; i++)
+	{
+		CNode* pnode = (CNode*)events[i].data.ptr;
+		if (pnode == NULL)
+		{
+			fListenReady = true;
+			continue;
+		}
+		// Errors and hangups are found out by the next recv
+		if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+			pnode->fRecvReady = true;
+		if (events[i].events & EPOLLOUT)
+			pnode->fSendReady = true;
+	}
+
+	vService.assign(vNodesCopy.size(), 0);
+	for (unsigned int i = 0; i < vNodesCopy.size(); i++)
+	{
+		CNode* pnode = vNodesCopy[i];
+		if (pnode->hSocket == INVALID_SOCKET || !(pnode->fRecvReady || pnode->fSendReady))
+			continue;
+		bool fWantSend, fWantRecv;
+		GetSocketWants(pnode, fWantSend, fWantRecv);
+		if (fWantSend && pnode->fSendReady)
+			vService[i] |= SOCKET_SERVICE_SEND;
+		if (fWantRecv && pnode->fRecvReady)
+			vService[i] |= SOCKET_SERVICE_RECV;
+	}
+	return fListenReady;
+}
+#endif
+
 void ThreadSocketHandler()
 {
 	unsigned int nPrevNodeCount = 0;
+	// Some socket was left readable after a full read
+	bool fMoreWork = false;
+
+#ifdef USE_EPOLL
+	if (hEpoll == -1)
+		hEpoll = CreateEpollSocketEvents();
+	LogPrintf("Socket events: %s\n", hEpoll != -1 ? "epoll" : "select");
+#endif
+
 	while (true)
 	{
 		//
@@ -858,90 +1117,31 @@ void ThreadSocketHandler()
 		//
 		// Find which sockets have data to receive
 		//
-		struct timeval timeout;
-		timeout.tv_sec = 0;
-		timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-		fd_set fdsetRecv;
-		fd_set fdsetSend;
-		fd_set fdsetError;
-		FD_ZERO(&fdsetRecv);
-		FD_ZERO(&fdsetSend);
-		FD_ZERO(&fdsetError);
-		SOCKET hSocketMax = 0;
-		bool have_fds = false;
-
-		BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
-			FD_SET(hListenSocket, &fdsetRecv);
-			hSocketMax = max(hSocketMax, hListenSocket);
-			have_fds = true;
-		}
+		vector<CNode*> vNodesCopy;
 		{
 			LOCK(cs_vNodes);
-			BOOST_FOREACH(CNode* pnode, vNodes)
-			{
-				if (pnode->hSocket == INVALID_SOCKET)
-					continue;
-				FD_SET(pnode->hSocket, &fdsetError);
-				hSocketMax = max(hSocketMax, pnode->hSocket);
-				have_fds = true;
-
-				// Implement the following logic:
-				// * If there is data to send, select() for sending data. As this only
-				//   happens when optimistic write failed, we choose to first drain the
-				//   write buffer in this case before receiving more. This avoids
-				//   needlessly queueing received data, if the remote peer is not themselves
-				//   receiving data. This means properly utilizing TCP flow control signalling.
-				// * Otherwise, if there is no (complete) message in the receive buffer,
-				//   or there is space left in the buffer, select() for receiving data.
-				// * (if neither of the above applies, there is certainly one message
-				//   in the receiver buffer ready to be processed).
-				// Together, that means that at least one of the following is always possible,
-				// so we don't deadlock:
-				// * We send some data.
-				// * We wait for data to be received (and disconnect after timeout).
-				// * We process a message in the buffer (message handler thread).
-				{
-					TRY_LOCK(pnode->cs_vSend, lockSend);
-					if (lockSend && !pnode->vSendMsg.empty()) {
-						FD_SET(pnode->hSocket, &fdsetSend);
-						continue;
-					}
-				}
-				{
-					TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-					if (lockRecv && (
-						pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-						pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
-						FD_SET(pnode->hSocket, &fdsetRecv);
-				}
-			}
+			vNodesCopy = vNodes;
+			BOOST_FOREACH(CNode* pnode, vNodesCopy)
+				pnode->AddRef();
 		}
 
-		int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-			&fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+		vector<unsigned char> vService;
+		bool fListenReady;
+#ifdef USE_EPOLL
+		if (hEpoll != -1)
+			fListenReady = SocketEventsEpoll(vNodesCopy, vService, fMoreWork ? 0 : 50);
+		else
+#endif
+			fListenReady = SocketEventsSelect(vNodesCopy, vService);
 		boost::this_thread::interruption_point();
-
-		if (nSelect == SOCKET_ERROR)
-		{
-			if (have_fds)
-			{
-				int nErr = WSAGetLastError();
-				LogPrintf("socket select error %d\n", nErr);
-				for (unsigned int i = 0; i <= hSocketMax; i++)
-					FD_SET(i, &fdsetRecv);
-			}
-			FD_ZERO(&fdsetSend);
-			FD_ZERO(&fdsetError);
-			MilliSleep(timeout.tv_usec / 1000);
-		}
+		fMoreWork = false;
 
 
 		//
 		// Accept new connections
 		//
 		BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
-			if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+			if (hListenSocket != INVALID_SOCKET && fListenReady)
 			{
 				struct sockaddr_storage sockaddr;
 				socklen_t len = sizeof(sockaddr);
@@ -999,15 +1199,10 @@ void ThreadSocketHandler()
 		//
 		// Service each socket
 		//
-		vector<CNode*> vNodesCopy;
-		{
-			LOCK(cs_vNodes);
-			vNodesCopy = vNodes;
-			BOOST_FOREACH(CNode* pnode, vNodesCopy)
-				pnode->AddRef();
-		}
-		BOOST_FOREACH(CNode* pnode, vNodesCopy)
+		bool fWakeMsgProc = false;
+		for (unsigned int i = 0; i < vNodesCopy.size(); i++)
 		{
+			CNode* pnode = vNodesCopy[i];
 			boost::this_thread::interruption_point();
 
 			//
@@ -1015,7 +1210,7 @@ void ThreadSocketHandler()
 			//
 			if (pnode->hSocket == INVALID_SOCKET)
 				continue;
-			if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+			if (vService[i] & SOCKET_SERVICE_RECV)
 			{
 				TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
 				if (lockRecv)
@@ -1036,7 +1231,10 @@ void ThreadSocketHandler()
 							pnode->nLastRecv = GetTime();
 							pnode->nRecvBytes += nBytes;
 							pnode->RecordBytesRecv(nBytes);
+							if (!pnode->vRecvMsg.empty() && pnode->vRecvMsg.front().complete())
+								fWakeMsgProc = true;
 						}
+
 						else if (nBytes == 0)
 						{
 							// socket closed gracefully
@@ -1055,6 +1253,13 @@ void ThreadSocketHandler()
 								pnode->CloseSocketDisconnect();
 							}
 						}
+
+						// A short read means the socket is drained, and the
+						// next data to arrive raises a new edge
+						if (nBytes == (int)sizeof(pchBuf))
+							fMoreWork = true;
+						else
+							pnode->fRecvReady = false;
 					}
 				}
 			}
@@ -1064,11 +1269,15 @@ void ThreadSocketHandler()
 			//
 			if (pnode->hSocket == INVALID_SOCKET)
 				continue;
-			if (FD_ISSET(pnode->hSocket, &fdsetSend))
+			if (vService[i] & SOCKET_SERVICE_SEND)
 			{
 				TRY_LOCK(pnode->cs_vSend, lockSend);
 				if (lockSend)
+				{
 					SocketSendData(pnode);
+					if (!pnode->vSendMsg.empty())
+						pnode->fSendReady = false;
+				}
 			}
 
 			//
@@ -1100,6 +1309,9 @@ void ThreadSocketHandler()
 			BOOST_FOREACH(CNode* pnode, vNodesCopy)
 				pnode->Release();
 		}
+
+		if (fWakeMsgProc)
+			WakeMessageHandler();
 	}
 }
 
@@ -1631,7 +1843,12 @@ void ThreadMessageHandler()
 		}
 
 		if (fSleep)
-			MilliSleep(100);
+		{
+			boost::unique_lock<boost::mutex> lock(mutexMsgProc);
+			if (!fMsgProcWake)
+				condMsgProc.timed_wait(lock, boost::posix_time::milliseconds(100));
+			fMsgProcWake = false;
+		}
 	}
 }
 
@@ -1885,6 +2102,10 @@ public:
 			if (hListenSocket != INVALID_SOCKET)
 				if (closesocket(hListenSocket) == SOCKET_ERROR)
 					LogPrintf("closesocket(hListenSocket) failed with error %d\n", WSAGetLastError());
+#ifdef USE_EPOLL
+		if (hEpoll != -1)
+			close(hEpoll);
+#endif
 
 		// clean up some globals (to help leak detection)
 		BOOST_FOREACH(CNode *pnode, vNodes)
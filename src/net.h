@@ -25,6 +25,7 @@
 
 #include <boost/array.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/signals2/signal.hpp>
 #include <openssl/rand.h>
 
@@ -34,6 +35,10 @@ extern int nBestHeight;
 
 class CNode;
 
+/** A complete message (header and payload) that can be queued on any
+    number of peers without being copied */
+typedef boost::shared_ptr<const CSerializeData> CSerializedMessageRef;
+
 namespace boost {
     class thread_group;
 }
@@ -72,6 +77,7 @@ bool BindListenPort(const CService &bindAddr, std::string& strError=REF(std::str
 void StartNode(boost::thread_group& threadGroup);
 bool StopNode();
 void SocketSendData(CNode *pnode);
+CSerializedMessageRef SerializeMessage(const char* pszCommand, const CDataStream& ssPayload);
 
 typedef int NodeId;
 
@@ -318,7 +324,7 @@ public:
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSerializedMessageRef> vSendMsg;
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
@@ -326,6 +332,15 @@ public:
     CCriticalSection cs_vRecvMsg;
     uint64_t nRecvBytes;
     int nRecvVersion;
+    // Socket readiness as last reported by the socket engine. Under epoll
+    // these stay set until a read or write finds the socket drained or full.
+    bool fRecvReady;
+    bool fSendReady;
+    bool fSocketRegistered;
+    // Messages handed to the message workers, and whether the peer is in
+    // their queue; both guarded by the work queue's mutex
+    std::deque<CNetMessage> vWorkerMsg;
+    bool fWorkerQueued;
 
     int64_t nLastSend;
     int64_t nLastRecv;
@@ -377,6 +392,8 @@ public:
     std::vector<CAddress> vAddrToSend;
     mruset<CAddress> setAddrKnown;
     bool fGetAddr;
+    // addr messages are handled on the message worker threads
+    CCriticalSection cs_addr; // guards vAddrToSend, setAddrKnown and fGetAddr
     std::set<uint256> setKnown;
     uint256 hashCheckpointKnown; // ppcoin: known sent sync-checkpoint
 
@@ -404,6 +421,10 @@ public:
         nServices = 0;
         hSocket = hSocketIn;
         nRecvVersion = INIT_PROTO_VERSION;
+        fRecvReady = false;
+        fSendReady = false;
+        fSocketRegistered = false;
+        fWorkerQueued = false;
         nLastSend = 0;
         nLastRecv = 0;
         nSendBytes = 0;
@@ -516,6 +537,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
+        LOCK(cs_addr);
         setAddrKnown.insert(addr);
     }
 
@@ -524,6 +546,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
+        LOCK(cs_addr);
         if (addr.IsValid() && !setAddrKnown.count(addr)) {
             if (vAddrToSend.size() >= MAX_ADDR_TO_SEND) {
                 vAddrToSend[insecure_rand() % vAddrToSend.size()] = addr;
@@ -639,17 +662,32 @@ public:
 
         LogPrint("net", "(%d bytes)\n", nSize);
 
-        std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-        ssSend.GetAndClear(*it);
-        nSendSize += (*it).size();
+        boost::shared_ptr<CSerializeData> pdata(new CSerializeData());
+        ssSend.GetAndClear(*pdata);
+        vSendMsg.push_back(pdata);
+        nSendSize += pdata->size();
 
         // If write queue empty, attempt "optimistic write"
-        if (it == vSendMsg.begin())
+        if (vSendMsg.size() == 1)
             SocketSendData(this);
 
         LEAVE_CRITICAL_SECTION(cs_vSend);
     }
 
+    // Queue a message framed by SerializeMessage(). The buffer is shared
+    // with every other peer it is queued on.
+    void PushSerializedMessage(const CSerializedMessageRef& pmsg)
+    {
+        LOCK(cs_vSend);
+        LogPrint("net", "sending: shared message (%d bytes)\n", pmsg->size());
+        vSendMsg.push_back(pmsg);
+        nSendSize += pmsg->size();
+
+        // If write queue empty, attempt "optimistic write"
+        if (vSendMsg.size() == 1)
+            SocketSendData(this);
+    }
+
     void PushVersion();
 
 
@@ -0,0 +1,98 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "parallel.h"
+
+#include "checkqueue.h"
+#include "util.h"
+
+#include <algorithm>
+
+#include <boost/thread/mutex.hpp>
+
+namespace {
+
+/** One run [nBegin, nEnd) of a ParallelForRange call, as a CCheckQueue job */
+class CRangeJob
+{
+private:
+    const boost::function<void(size_t, size_t)>* pfn;
+    size_t nBegin;
+    size_t nEnd;
+
+public:
+    CRangeJob() : pfn(NULL), nBegin(0), nEnd(0) {}
+    CRangeJob(const boost::function<void(size_t, size_t)>* pfnIn, size_t nBeginIn, size_t nEndIn) :
+        pfn(pfnIn), nBegin(nBeginIn), nEnd(nEndIn) {}
+
+    bool operator()()
+    {
+        (*pfn)(nBegin, nEnd);
+        return true;
+    }
+
+    void swap(CRangeJob& job)
+    {
+        std::swap(pfn, job.pfn);
+        std::swap(nBegin, job.nBegin);
+        std::swap(nEnd, job.nEnd);
+    }
+};
+
+// Each job is already a run of items, so workers take one at a time
+CCheckQueue<CRangeJob> rangequeue(1);
+
+// Held by the caller feeding rangequeue, which takes one master at a time
+boost::mutex csRangeMaster;
+
+boost::mutex csRangeWorkers;
+int nRangeWorkers = 0;
+
+} // namespace
+
+void ThreadParallelWorker()
+{
+    RenameThread("Harvest-parallel");
+    {
+        boost::unique_lock<boost::mutex> lock(csRangeWorkers);
+        nRangeWorkers++;
+    }
+    try {
+        rangequeue.Thread();
+    } catch (...) {
+        boost::unique_lock<boost::mutex> lock(csRangeWorkers);
+        nRangeWorkers--;
+        throw;
+    }
+}
+
+void ParallelForRange(size_t nCount, size_t nMinPerRun, const boost::function<void(size_t, size_t)>& fn)
+{
+    if (nCount == 0)
+        return;
+
+    int nWorkers;
+    {
+        boost::unique_lock<boost::mutex> lock(csRangeWorkers);
+        nWorkers = nRangeWorkers;
+    }
+
+    size_t nPerRun = std::max(std::max(nMinPerRun, (size_t)1), (nCount + nWorkers) / (nWorkers + 1));
+    boost::unique_lock<boost::mutex> lockMaster(csRangeMaster, boost::try_to_lock);
+    if (nWorkers == 0 || nPerRun >= nCount || !lockMaster.owns_lock())
+    {
+        // Also covers calls from inside a run, which would otherwise wait on
+        // the pool they are part of
+        fn(0, nCount);
+        return;
+    }
+
+    std::vector<CRangeJob> vJobs;
+    for (size_t i = 0; i < nCount; i += nPerRun)
+        vJobs.push_back(CRangeJob(&fn, i, std::min(nCount, i + nPerRun)));
+
+    CCheckQueueControl<CRangeJob> control(&rangequeue);
+    control.Add(vJobs);
+    control.Wait();
+}
@@ -0,0 +1,24 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_PARALLEL_H
+#define BITCOIN_PARALLEL_H
+
+#include <stddef.h>
+
+#include <boost/function.hpp>
+
+/** Run fn(nBegin, nEnd) over [0, nCount), split into contiguous runs of at
+ * least nMinPerRun items. The runs are handed to the persistent worker pool
+ * (see ThreadParallelWorker) and the calling thread works along until all
+ * are done. Without workers, or while another caller is using the pool,
+ * everything runs on the calling thread. Runs must not share output, and
+ * fn must not throw.
+ */
+void ParallelForRange(size_t nCount, size_t nMinPerRun, const boost::function<void(size_t, size_t)>& fn);
+
+/** Worker thread of the ParallelForRange pool, started by AppInit2 */
+void ThreadParallelWorker();
+
+#endif
@@ -783,9 +783,9 @@ Value masternodelist(const Array& params, bool fHelp)
 
     Object obj;
     if (strMode == "rank") {
-        std::vector<pair<int, CMasternode> > vMasternodeRanks = mnodeman.GetMasternodeRanks(pindexBest->nHeight);
-        BOOST_FOREACH(PAIRTYPE(int, CMasternode)& s, vMasternodeRanks) {
-            std::string strVin = s.second.vin.prevout.ToStringShort();
+        std::vector<pair<int, CTxIn> > vMasternodeRanks = mnodeman.GetMasternodeRanks(pindexBest->nHeight);
+        BOOST_FOREACH(PAIRTYPE(int, CTxIn)& s, vMasternodeRanks) {
+            std::string strVin = s.second.prevout.ToStringShort();
             if(strFilter !="" && strVin.find(strFilter) == string::npos) continue;
             obj.push_back(Pair(strVin,       s.first));
         }
@@ -89,7 +89,7 @@ void TxToJSON(const CTransaction& tx, const uint256 hashBlock, Object& entry)
     if (hashBlock != 0)
     {
         entry.push_back(Pair("blockhash", hashBlock.GetHex()));
-        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end() && (*mi).second)
         {
             CBlockIndex* pindex = (*mi).second;
@@ -605,15 +605,14 @@ Value searchrawtransactions(const Array &params, bool fHelp)
         throw runtime_error(
             "searchrawtransactions <address> [verbose=1] [skip=0] [count=100]\n");
 
+    if (!fAddrIndex)
+        throw JSONRPCError(RPC_MISC_ERROR, "Address index not enabled (start with -addrindex and -reindexaddr)");
+
     CHarvestcoinAddress address(params[0].get_str());
     if (!address.IsValid())
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid Bitcoin address");
     CTxDestination dest = address.Get();
 
-    std::vector<uint256> vtxhash;
-    if (!FindTransactionsByDestination(dest, vtxhash))
-        throw JSONRPCError(RPC_DATABASE_ERROR, "Cannot search for address");
-
     int nSkip = 0;
     int nCount = 100;
     bool fVerbose = true;
@@ -624,18 +623,18 @@ Value searchrawtransactions(const Array &params, bool fHelp)
     if (params.size() > 3)
         nCount = params[3].get_int();
 
-    if (nSkip < 0)
-        nSkip += vtxhash.size();
-    if (nSkip < 0)
-        nSkip = 0;
     if (nCount < 0)
         nCount = 0;
 
+    // Only the requested page is read from the index
+    std::vector<uint256> vtxhash;
+    if (!FindTransactionsByDestination(dest, nSkip, nCount, vtxhash))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Cannot search for address");
+
     std::vector<uint256>::const_iterator it = vtxhash.begin();
-    while (it != vtxhash.end() && nSkip--) it++;
 
     Array result;
-    while (it != vtxhash.end() && nCount--) {
+    while (it != vtxhash.end()) {
         CTransaction tx;
         uint256 hashBlock;
         if (!GetTransaction(*it, tx, hashBlock))
@@ -665,3 +664,61 @@ Value searchrawtransactions(const Array &params, bool fHelp)
     }
     return result;
 }
+
+Value getaddressutxos(const Array &params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressutxos <address>\n"
+            "Returns the unspent outputs paying to <address> (requires -addrutxoindex).");
+
+    if (!fAddrUnspentIndex)
+        throw JSONRPCError(RPC_MISC_ERROR, "Unspent output index not enabled (start with -addrutxoindex and -reindexaddr)");
+
+    CHarvestcoinAddress address(params[0].get_str());
+    if (!address.IsValid())
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid Bitcoin address");
+
+    std::vector<std::pair<COutPoint, int64_t> > vUnspent;
+    if (!FindUnspentByDestination(address.Get(), vUnspent))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Cannot search for address");
+
+    Array result;
+    for (unsigned int i = 0; i < vUnspent.size(); i++)
+    {
+        Object entry;
+        entry.push_back(Pair("txid", vUnspent[i].first.hash.GetHex()));
+        entry.push_back(Pair("vout", (int)vUnspent[i].first.n));
+        entry.push_back(Pair("amount", ValueFromAmount(vUnspent[i].second)));
+        result.push_back(entry);
+    }
+    return result;
+}
+
+Value getaddressbalance(const Array &params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressbalance <address>\n"
+            "Returns the confirmed balance of <address> (requires -addrutxoindex).");
+
+    if (!fAddrUnspentIndex)
+        throw JSONRPCError(RPC_MISC_ERROR, "Unspent output index not enabled (start with -addrutxoindex and -reindexaddr)");
+
+    CHarvestcoinAddress address(params[0].get_str());
+    if (!address.IsValid())
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid Bitcoin address");
+
+    std::vector<std::pair<COutPoint, int64_t> > vUnspent;
+    if (!FindUnspentByDestination(address.Get(), vUnspent))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Cannot search for address");
+
+    int64_t nBalance = 0;
+    for (unsigned int i = 0; i < vUnspent.size(); i++)
+        nBalance += vUnspent[i].second;
+
+    Object result;
+    result.push_back(Pair("balance", ValueFromAmount(nBalance)));
+    result.push_back(Pair("utxos", (int)vUnspent.size()));
+    return result;
+}
@@ -250,6 +250,8 @@ static const CRPCCommand vRPCCommands[] =
     { "validatepubkey",         &validatepubkey,         true,      false,     false },
     { "verifymessage",          &verifymessage,          false,     false,     false },
     { "searchrawtransactions",  &searchrawtransactions,  false,     false,     false },
+    { "getaddressutxos",        &getaddressutxos,        false,     false,     false },
+    { "getaddressbalance",      &getaddressbalance,      false,     false,     false },
 
 /* Dark features */
     { "spork",                  &spork,                  true,      false,      false },
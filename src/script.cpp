@@ -4,8 +4,6 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include <boost/foreach.hpp>
-#include <boost/tuple/tuple.hpp>
-#include <boost/tuple/tuple_comparison.hpp>
 
 using namespace std;
 using namespace boost;
@@ -106,7 +104,7 @@ const char* ScriptErrorString(const ScriptError serror)
 }
 
 
-bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, int flags);
+bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, int flags, const CSigHashCache* psighashcache = NULL);
 
 static const valtype vchFalse(0);
 static const valtype vchZero(0);
@@ -435,7 +433,7 @@ bool static CheckPubKeyEncoding(const valtype &vchSig) {
     return true;
 }
 
-bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType)
+bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CSigHashCache* psighashcache)
 {
     CAutoBN_CTX pctx;
     CScript::const_iterator pc = script.begin();
@@ -1132,7 +1130,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                         return false;
 
                     bool fSuccess = CheckSignatureEncoding(vchSig) && CheckPubKeyEncoding(vchPubKey) &&
-                        CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags);
+                        CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, psighashcache);
 
                     popstack(stack);
                     popstack(stack);
@@ -1196,7 +1194,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
 
                         // Check signature
                         bool fOk = CheckSignatureEncoding(vchSig) && CheckPubKeyEncoding(vchPubKey) &&
-                            CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags);
+                            CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, psighashcache);
 
                         if (fOk)
                         {
@@ -2016,19 +2014,77 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, un
 
 
 
-uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType)
+CSigHashCache::CSigHashCache(const CTransaction& txTo)
+{
+    CDataStream ss(SER_GETHASH, 0);
+    ss << txTo.nVersion << txTo.nTime;
+    WriteCompactSize(ss, txTo.vin.size());
+
+    CSHA256 hasher;
+    hasher.Write((const unsigned char*)&ss[0], ss.size());
+    vMidstates.reserve(txTo.vin.size());
+    vInputEnd.reserve(txTo.vin.size());
+    for (unsigned int i = 0; i < txTo.vin.size(); i++)
+    {
+        vMidstates.push_back(hasher);
+        ss.clear();
+        ss << CTxIn(txTo.vin[i].prevout, CScript(), txTo.vin[i].nSequence);
+        hasher.Write((const unsigned char*)&ss[0], ss.size());
+        vchInputs.insert(vchInputs.end(), ss.begin(), ss.end());
+        vInputEnd.push_back(vchInputs.size());
+    }
+
+    ss.clear();
+    ss << txTo.vout << txTo.nLockTime;
+    vchOutputs.assign(ss.begin(), ss.end());
+}
+
+bool CSigHashCache::SignatureHash(const CScript& scriptCode, unsigned int nIn, int nHashType, uint256& hashRet) const
+{
+    if (nHashType != SIGHASH_ALL || nIn >= vMidstates.size())
+        return false;
+
+    // Input nIn is the only one that differs from its blanked form: its
+    // scriptSig is replaced by scriptCode, between the prevout and nSequence
+    static const unsigned int nPrevoutSize = 36;
+    unsigned int nBegin = nIn > 0 ? vInputEnd[nIn - 1] : 0;
+    unsigned int nEnd = vInputEnd[nIn];
+    CDataStream ssScript(SER_GETHASH, 0);
+    ssScript << scriptCode;
+    unsigned char vchHashType[4];
+    for (int i = 0; i < 4; i++)
+        vchHashType[i] = (unsigned char)((unsigned int)nHashType >> (8 * i));
+
+    CSHA256 hasher(vMidstates[nIn]);
+    hasher.Write(&vchInputs[nBegin], nPrevoutSize);
+    hasher.Write((const unsigned char*)&ssScript[0], ssScript.size());
+    hasher.Write(&vchInputs[nEnd - 4], vchInputs.size() - (nEnd - 4));
+    hasher.Write(&vchOutputs[0], vchOutputs.size());
+    hasher.Write(vchHashType, 4);
+    uint256 hash1;
+    hasher.Finalize(hash1.begin());
+    CSHA256().Write(hash1.begin(), 32).Finalize(hashRet.begin());
+    return true;
+}
+
+uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const CSigHashCache* psighashcache = NULL)
 {
     if (nIn >= txTo.vin.size())
     {
         LogPrintf("ERROR: SignatureHash() : nIn=%d out of range\n", nIn);
         return 1;
     }
-    CTransaction txTmp(txTo);
 
     // In case concatenating two scripts ends up with two codeseparators,
     // or an extra one at the end, this prevents all those possible incompatibilities.
     scriptCode.FindAndDelete(CScript(OP_CODESEPARATOR));
 
+    uint256 hash;
+    if (psighashcache && psighashcache->SignatureHash(scriptCode, nIn, nHashType, hash))
+        return hash;
+
+    CTransaction txTmp(txTo);
+
     // Blank out other inputs' signatures
     for (unsigned int i = 0; i < txTmp.vin.size(); i++)
         txTmp.vin[i].scriptSig = CScript();
@@ -2129,61 +2185,119 @@ bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTrans
 // Valid signature cache, to avoid doing expensive ECDSA signature checking
 // twice for every transaction (once when accepted into memory pool, and
 // again when accepted into the block chain)
+//
+// Each valid (signature hash, signature, public key) triple is stored as a
+// 32-byte salted SHA256 digest in a fixed-size table, so entries cost no
+// allocations and an attacker can't predict where they land. Every entry has
+// CACHE_WAYS candidate slots taken from its own bits; inserting into a full
+// set of slots moves the occupant to one of its other slots, cuckoo style,
+// for a bounded number of steps and then drops the last entry moved.
 
 class CSignatureCache
 {
 private:
-     // sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, CPubKey> sigdata_type;
-    std::set< sigdata_type> setValid;
+    static const unsigned int CACHE_WAYS = 8;
+
+    uint256 nonce;
+    std::vector<uint256> vTable;
+    std::vector<bool> vFilled;
+    unsigned int nMaxDepth;
     boost::shared_mutex cs_sigcache;
 
+    // Map 32 bits of the entry onto [0, vTable.size()) without a division
+    unsigned int Slot(const uint256& entry, unsigned int nWay) const
+    {
+        uint32_t n = ((const uint32_t*)entry.begin())[nWay];
+        return (unsigned int)(((uint64_t)n * vTable.size()) >> 32);
+    }
+
 public:
-    bool
-    Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+    CSignatureCache()
     {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+        nonce = GetRandHash();
+        size_t nEntries;
+        if (mapArgs.count("-maxsigcachesize") && !mapArgs.count("-sigcachemb"))
+        {
+            // Deprecated option, a number of entries as in older versions
+            int64_t nMaxCacheSize = std::max(GetArg("-maxsigcachesize", 0), (int64_t)0);
+            nEntries = (size_t)std::min(nMaxCacheSize, (MAX_SIG_CACHE_MB << 20) / (int64_t)sizeof(uint256));
+        }
+        else
+        {
+            int64_t nCacheMB = std::min(std::max(GetArg("-sigcachemb", DEFAULT_SIG_CACHE_MB), (int64_t)0), MAX_SIG_CACHE_MB);
+            nEntries = (size_t)((nCacheMB << 20) / sizeof(uint256));
+        }
+        if (nEntries < CACHE_WAYS)
+            nEntries = 0;
+        vTable.resize(nEntries);
+        vFilled.resize(nEntries, false);
+        nMaxDepth = 0;
+        while (((uint64_t)1 << nMaxDepth) < nEntries)
+            nMaxDepth++;
+        LogPrintf("Using %u MiB for the signature cache, able to store %u elements\n",
+            (unsigned int)((nEntries * sizeof(uint256)) >> 20), (unsigned int)nEntries);
+    }
+
+    void ComputeEntry(uint256& entry, const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubkey) const
+    {
+        CSHA256 hasher;
+        hasher.Write(nonce.begin(), 32).Write(hash.begin(), 32).Write(pubkey.begin(), pubkey.size());
+        if (!vchSig.empty())
+            hasher.Write(&vchSig[0], vchSig.size());
+        hasher.Finalize(entry.begin());
+    }
 
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
+    bool Get(const uint256& entry)
+    {
+        if (vTable.empty())
+            return false;
+        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+        for (unsigned int i = 0; i < CACHE_WAYS; i++)
+        {
+            unsigned int nSlot = Slot(entry, i);
+            if (vFilled[nSlot] && vTable[nSlot] == entry)
+                return true;
+        }
         return false;
     }
 
-    void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+    void Set(const uint256& entryIn)
     {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64_t nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
-
+        if (vTable.empty())
+            return;
         boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
 
-        while (static_cast<int64_t>(setValid.size()) > nMaxCacheSize)
+        uint256 entry = entryIn;
+        unsigned int nLastSlot = vTable.size();
+        for (unsigned int nDepth = 0; nDepth <= nMaxDepth; nDepth++)
         {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
-        }
+            for (unsigned int i = 0; i < CACHE_WAYS; i++)
+            {
+                unsigned int nSlot = Slot(entry, i);
+                if (!vFilled[nSlot])
+                {
+                    vTable[nSlot] = entry;
+                    vFilled[nSlot] = true;
+                    return;
+                }
+                if (vTable[nSlot] == entry)
+                    return;
+            }
 
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+            // All slots taken: swap into the slot after the one this entry
+            // was pushed out of, and place the old occupant next round
+            unsigned int nWay = 0;
+            for (unsigned int i = 0; i < CACHE_WAYS; i++)
+                if (Slot(entry, i) == nLastSlot)
+                    nWay = (i + 1) % CACHE_WAYS;
+            nLastSlot = Slot(entry, nWay);
+            std::swap(vTable[nLastSlot], entry);
+        }
     }
 };
 
 bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode,
-              const CTransaction& txTo, unsigned int nIn, int nHashType, int flags)
+              const CTransaction& txTo, unsigned int nIn, int nHashType, int flags, const CSigHashCache* psighashcache)
 {
     static CSignatureCache signatureCache;
 
@@ -2200,16 +2314,18 @@ bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubK
         return false;
     vchSig.pop_back();
 
-    uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType);
+    uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType, psighashcache);
 
-    if (signatureCache.Get(sighash, vchSig, pubkey))
+    uint256 entry;
+    signatureCache.ComputeEntry(entry, sighash, vchSig, pubkey);
+    if (signatureCache.Get(entry))
         return true;
 
     if (!pubkey.Verify(sighash, vchSig))
         return false;
 
     if (!(flags & SCRIPT_VERIFY_NOCACHE))
-        signatureCache.Set(sighash, vchSig, pubkey);
+        signatureCache.Set(entry);
 
     return true;
 }
@@ -2707,15 +2823,15 @@ bool SignatureChecker::CheckSig(const vector<unsigned char>& vchSigIn, const vec
 }
 
 
-bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType)
+bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CSigHashCache* psighashcache)
 {
     vector<vector<unsigned char> > stack, stackCopy;
-    if (!EvalScript(stack, scriptSig, txTo, nIn, flags, nHashType))
+    if (!EvalScript(stack, scriptSig, txTo, nIn, flags, nHashType, psighashcache))
         return false;
 
     stackCopy = stack;
 
-    if (!EvalScript(stack, scriptPubKey, txTo, nIn, flags, nHashType))
+    if (!EvalScript(stack, scriptPubKey, txTo, nIn, flags, nHashType, psighashcache))
         return false;
     if (stack.empty())
         return false;
@@ -2733,7 +2849,7 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
         CScript pubKey2(pubKeySerialized.begin(), pubKeySerialized.end());
         popstack(stackCopy);
 
-        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, flags, nHashType))
+        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, flags, nHashType, psighashcache))
             return false;
         if (stackCopy.empty())
             return false;
@@ -18,6 +18,7 @@
 #include "bignum.h"
 #include "util.h"
 #include "stealth.h"
+#include "crypto/sha256.h"
 
 typedef std::vector<unsigned char> valtype;
 
@@ -25,9 +26,14 @@ class CKeyStore;
 class CTransaction;
 
 class BaseSignatureChecker;
+class CSigHashCache;
 
 static const unsigned int MAX_SCRIPT_ELEMENT_SIZE = 520; // bytes
 static const unsigned int MAX_OP_RETURN_RELAY = 40;      // bytes
+/** Default for -sigcachemb, signature cache size in megabytes */
+static const int64_t DEFAULT_SIG_CACHE_MB = 32;
+/** Largest signature cache, in megabytes */
+static const int64_t MAX_SIG_CACHE_MB = 1024;
 
 template <typename T>
 std::vector<unsigned char> ToByteVector(const T& in)
@@ -972,7 +978,7 @@ public:
 
 
 bool IsDERSignature(const valtype &vchSig, bool haveHashType = true);
-bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
+bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CSigHashCache* psighashcache = NULL);
 bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, unsigned int flags, const BaseSignatureChecker& checker, ScriptError* error = NULL);
 bool Solver(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<std::vector<unsigned char> >& vSolutionsRet);
 int ScriptSigArgsExpected(txnouttype t, const std::vector<std::vector<unsigned char> >& vSolutions);
@@ -984,7 +990,7 @@ bool ExtractDestination(const CScript& scriptPubKey, CTxDestination& addressRet)
 bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<CTxDestination>& addressRet, int& nRequiredRet);
 bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
 bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
-bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
+bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType, const CSigHashCache* psighashcache = NULL);
 bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
 
 bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, unsigned int flags, const BaseSignatureChecker& checker, ScriptError* error = NULL);
@@ -1026,4 +1032,29 @@ public:
     bool CheckSig(const std::vector<unsigned char>& scriptSig, const std::vector<unsigned char>& vchPubKey, const CScript& scriptCode) const;
 };
 
+/** The parts of a transaction's serialization that every legacy signature
+ * hash over it has in common, built once so that checking each input doesn't
+ * copy and re-serialize the whole transaction. Only SIGHASH_ALL without
+ * ANYONECANPAY is served from here; the hashes are identical to the ones
+ * SignatureHash() computes from scratch.
+ */
+class CSigHashCache
+{
+private:
+    // Every input serialized with an empty scriptSig, back to back
+    std::vector<unsigned char> vchInputs;
+    // Offset of the end of each input in vchInputs
+    std::vector<unsigned int> vInputEnd;
+    // Output count, outputs and nLockTime
+    std::vector<unsigned char> vchOutputs;
+    // SHA256 state after the header and inputs [0, i)
+    std::vector<CSHA256> vMidstates;
+
+public:
+    CSigHashCache(const CTransaction& txTo);
+
+    // Returns false if nHashType is not handled here
+    bool SignatureHash(const CScript& scriptCode, unsigned int nIn, int nHashType, uint256& hashRet) const;
+};
+
 #endif
@@ -32,9 +32,15 @@
 
 #include "scrypt.h"
 #include "pbkdf2.h"
+#include "hash.h"
 
 #include "util.h"
 #include "net.h"
+#include "parallel.h"
+
+#include <deque>
+
+#include <boost/bind.hpp>
 
 #define SCRYPT_BUFFER_SIZE (131072 + 63)
 
@@ -190,9 +196,331 @@ uint256 scrypt_salted_multiround_hash(const void* input, size_t inputlen, const
     return resultHash;
 }
 
+/* Recently hashed block headers, keyed by their SHA-256d. Blocks up to
+   version 6 use the scrypt hash as their block hash, so the same header
+   gets hashed over and over while a block is being processed. */
+static const size_t SCRYPT_CACHE_SIZE = 4096;
+static boost::mutex cs_scryptcache;
+static std::map<uint256, uint256> mapScryptCache;
+static std::deque<uint256> dqScryptCache;
+
+static void scrypt_remember(const unsigned char* input, size_t nCount, const uint256 *output)
+{
+    boost::lock_guard<boost::mutex> lock(cs_scryptcache);
+    for (size_t i = 0; i < nCount; i++)
+    {
+        uint256 hashHeader = Hash(input + i * 80, input + (i + 1) * 80);
+        if (!mapScryptCache.insert(std::make_pair(hashHeader, output[i])).second)
+            continue;
+        dqScryptCache.push_back(hashHeader);
+        if (dqScryptCache.size() > SCRYPT_CACHE_SIZE)
+        {
+            mapScryptCache.erase(dqScryptCache.front());
+            dqScryptCache.pop_front();
+        }
+    }
+}
+
 uint256 scrypt_blockhash(const void* input)
 {
+    const unsigned char* pinput = (const unsigned char*)input;
+    {
+        uint256 hashHeader = Hash(pinput, pinput + 80);
+        boost::lock_guard<boost::mutex> lock(cs_scryptcache);
+        std::map<uint256, uint256>::const_iterator it = mapScryptCache.find(hashHeader);
+        if (it != mapScryptCache.end())
+            return it->second;
+    }
+
     unsigned char scratchpad[SCRYPT_BUFFER_SIZE];
-    return scrypt_nosalt(input, 80, scratchpad);
+    uint256 result = scrypt_nosalt(input, 80, scratchpad);
+    scrypt_remember(pinput, 1, &result);
+    return result;
+}
+
+
+/* Several headers at once.
+ *
+ * The multi-way cores run the scrypt_core of 4 (SSE2) or 8 (AVX2) headers
+ * side by side, one header per 32-bit lane. Word k of X for every lane sits
+ * in X[k], and the scratchpad is laid out the same way, so only the
+ * data-dependent reads of the second loop have to pick out lanes one by one.
+ * PBKDF2 stays scalar; it is a small part of the cost.
+ */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__) && defined(__SSE2__)
+#define USE_SCRYPT_SSE2 1
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define USE_SCRYPT_AVX2 1
+#endif
+
+namespace
+{
+
+#ifdef USE_SCRYPT_SSE2
+namespace sse2
+{
+typedef __m128i V;
+const int LANES = 4;
+
+inline V Add(V x, V y) { return _mm_add_epi32(x, y); }
+inline V Xor(V x, V y) { return _mm_xor_si128(x, y); }
+template<int n> inline V Rol(V x) { return _mm_or_si128(_mm_slli_epi32(x, n), _mm_srli_epi32(x, 32 - n)); }
+
+inline void xor_salsa8(V B[16], const V Bx[16])
+{
+    V x[16];
+    for (int i = 0; i < 16; i++)
+        x[i] = B[i] = Xor(B[i], Bx[i]);
+    for (int i = 0; i < 8; i += 2) {
+        /* Operate on columns. */
+        x[ 4] = Xor(x[ 4], Rol<7>(Add(x[ 0], x[12]))); x[ 9] = Xor(x[ 9], Rol<7>(Add(x[ 5], x[ 1])));
+        x[14] = Xor(x[14], Rol<7>(Add(x[10], x[ 6]))); x[ 3] = Xor(x[ 3], Rol<7>(Add(x[15], x[11])));
+        x[ 8] = Xor(x[ 8], Rol<9>(Add(x[ 4], x[ 0]))); x[13] = Xor(x[13], Rol<9>(Add(x[ 9], x[ 5])));
+        x[ 2] = Xor(x[ 2], Rol<9>(Add(x[14], x[10]))); x[ 7] = Xor(x[ 7], Rol<9>(Add(x[ 3], x[15])));
+        x[12] = Xor(x[12], Rol<13>(Add(x[ 8], x[ 4]))); x[ 1] = Xor(x[ 1], Rol<13>(Add(x[13], x[ 9])));
+        x[ 6] = Xor(x[ 6], Rol<13>(Add(x[ 2], x[14]))); x[11] = Xor(x[11], Rol<13>(Add(x[ 7], x[ 3])));
+        x[ 0] = Xor(x[ 0], Rol<18>(Add(x[12], x[ 8]))); x[ 5] = Xor(x[ 5], Rol<18>(Add(x[ 1], x[13])));
+        x[10] = Xor(x[10], Rol<18>(Add(x[ 6], x[ 2]))); x[15] = Xor(x[15], Rol<18>(Add(x[11], x[ 7])));
+
+        /* Operate on rows. */
+        x[ 1] = Xor(x[ 1], Rol<7>(Add(x[ 0], x[ 3]))); x[ 6] = Xor(x[ 6], Rol<7>(Add(x[ 5], x[ 4])));
+        x[11] = Xor(x[11], Rol<7>(Add(x[10], x[ 9]))); x[12] = Xor(x[12], Rol<7>(Add(x[15], x[14])));
+        x[ 2] = Xor(x[ 2], Rol<9>(Add(x[ 1], x[ 0]))); x[ 7] = Xor(x[ 7], Rol<9>(Add(x[ 6], x[ 5])));
+        x[ 8] = Xor(x[ 8], Rol<9>(Add(x[11], x[10]))); x[13] = Xor(x[13], Rol<9>(Add(x[12], x[15])));
+        x[ 3] = Xor(x[ 3], Rol<13>(Add(x[ 2], x[ 1]))); x[ 4] = Xor(x[ 4], Rol<13>(Add(x[ 7], x[ 6])));
+        x[ 9] = Xor(x[ 9], Rol<13>(Add(x[ 8], x[11]))); x[14] = Xor(x[14], Rol<13>(Add(x[13], x[12])));
+        x[ 0] = Xor(x[ 0], Rol<18>(Add(x[ 3], x[ 2]))); x[ 5] = Xor(x[ 5], Rol<18>(Add(x[ 4], x[ 7])));
+        x[10] = Xor(x[10], Rol<18>(Add(x[ 9], x[ 8]))); x[15] = Xor(x[15], Rol<18>(Add(x[14], x[13])));
+    }
+    for (int i = 0; i < 16; i++)
+        B[i] = Add(B[i], x[i]);
+}
+
+/* X holds LANES interleaved states of 32 words; V needs room for 1024 * 32 vectors */
+void scrypt_core(unsigned int *X, V *Vpad)
+{
+    V x[32];
+    for (int k = 0; k < 32; k++)
+        x[k] = _mm_loadu_si128((const V*)&X[k * LANES]);
+
+    for (int i = 0; i < 1024; i++) {
+        memcpy(&Vpad[i * 32], x, sizeof(x));
+        xor_salsa8(&x[0], &x[16]);
+        xor_salsa8(&x[16], &x[0]);
+    }
+    const unsigned int *pad = (const unsigned int*)Vpad;
+    for (int i = 0; i < 1024; i++) {
+        unsigned int j[LANES];
+        _mm_storeu_si128((V*)j, x[16]);
+        for (int l = 0; l < LANES; l++)
+            j[l] = 32 * (j[l] & 1023);
+        for (int k = 0; k < 32; k++)
+            x[k] = Xor(x[k], _mm_set_epi32(pad[(j[3] + k) * LANES + 3], pad[(j[2] + k) * LANES + 2],
+                                           pad[(j[1] + k) * LANES + 1], pad[(j[0] + k) * LANES + 0]));
+        xor_salsa8(&x[0], &x[16]);
+        xor_salsa8(&x[16], &x[0]);
+    }
+
+    for (int k = 0; k < 32; k++)
+        _mm_storeu_si128((V*)&X[k * LANES], x[k]);
 }
+} // namespace sse2
+#endif
+
+#ifdef USE_SCRYPT_AVX2
+/* Compiled for AVX2 regardless of the build flags; only called once the CPU
+   has been seen to support it. */
+namespace avx2
+{
+typedef __m256i V;
+const int LANES = 8;
+
+#define AVX2_TARGET __attribute__((target("avx2")))
+
+AVX2_TARGET inline V Add(V x, V y) { return _mm256_add_epi32(x, y); }
+AVX2_TARGET inline V Xor(V x, V y) { return _mm256_xor_si256(x, y); }
+template<int n> AVX2_TARGET inline V Rol(V x) { return _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - n)); }
 
+AVX2_TARGET inline void xor_salsa8(V B[16], const V Bx[16])
+{
+    V x[16];
+    for (int i = 0; i < 16; i++)
+        x[i] = B[i] = Xor(B[i], Bx[i]);
+    for (int i = 0; i < 8; i += 2) {
+        /* Operate on columns. */
+        x[ 4] = Xor(x[ 4], Rol<7>(Add(x[ 0], x[12]))); x[ 9] = Xor(x[ 9], Rol<7>(Add(x[ 5], x[ 1])));
+        x[14] = Xor(x[14], Rol<7>(Add(x[10], x[ 6]))); x[ 3] = Xor(x[ 3], Rol<7>(Add(x[15], x[11])));
+        x[ 8] = Xor(x[ 8], Rol<9>(Add(x[ 4], x[ 0]))); x[13] = Xor(x[13], Rol<9>(Add(x[ 9], x[ 5])));
+        x[ 2] = Xor(x[ 2], Rol<9>(Add(x[14], x[10]))); x[ 7] = Xor(x[ 7], Rol<9>(Add(x[ 3], x[15])));
+        x[12] = Xor(x[12], Rol<13>(Add(x[ 8], x[ 4]))); x[ 1] = Xor(x[ 1], Rol<13>(Add(x[13], x[ 9])));
+        x[ 6] = Xor(x[ 6], Rol<13>(Add(x[ 2], x[14]))); x[11] = Xor(x[11], Rol<13>(Add(x[ 7], x[ 3])));
+        x[ 0] = Xor(x[ 0], Rol<18>(Add(x[12], x[ 8]))); x[ 5] = Xor(x[ 5], Rol<18>(Add(x[ 1], x[13])));
+        x[10] = Xor(x[10], Rol<18>(Add(x[ 6], x[ 2]))); x[15] = Xor(x[15], Rol<18>(Add(x[11], x[ 7])));
+
+        /* Operate on rows. */
+        x[ 1] = Xor(x[ 1], Rol<7>(Add(x[ 0], x[ 3]))); x[ 6] = Xor(x[ 6], Rol<7>(Add(x[ 5], x[ 4])));
+        x[11] = Xor(x[11], Rol<7>(Add(x[10], x[ 9]))); x[12] = Xor(x[12], Rol<7>(Add(x[15], x[14])));
+        x[ 2] = Xor(x[ 2], Rol<9>(Add(x[ 1], x[ 0]))); x[ 7] = Xor(x[ 7], Rol<9>(Add(x[ 6], x[ 5])));
+        x[ 8] = Xor(x[ 8], Rol<9>(Add(x[11], x[10]))); x[13] = Xor(x[13], Rol<9>(Add(x[12], x[15])));
+        x[ 3] = Xor(x[ 3], Rol<13>(Add(x[ 2], x[ 1]))); x[ 4] = Xor(x[ 4], Rol<13>(Add(x[ 7], x[ 6])));
+        x[ 9] = Xor(x[ 9], Rol<13>(Add(x[ 8], x[11]))); x[14] = Xor(x[14], Rol<13>(Add(x[13], x[12])));
+        x[ 0] = Xor(x[ 0], Rol<18>(Add(x[ 3], x[ 2]))); x[ 5] = Xor(x[ 5], Rol<18>(Add(x[ 4], x[ 7])));
+        x[10] = Xor(x[10], Rol<18>(Add(x[ 9], x[ 8]))); x[15] = Xor(x[15], Rol<18>(Add(x[14], x[13])));
+    }
+    for (int i = 0; i < 16; i++)
+        B[i] = Add(B[i], x[i]);
+}
+
+/* X holds LANES interleaved states of 32 words; V needs room for 1024 * 32 vectors */
+AVX2_TARGET void scrypt_core(unsigned int *X, V *Vpad)
+{
+    V x[32];
+    for (int k = 0; k < 32; k++)
+        x[k] = _mm256_loadu_si256((const V*)&X[k * LANES]);
+
+    for (int i = 0; i < 1024; i++) {
+        memcpy(&Vpad[i * 32], x, sizeof(x));
+        xor_salsa8(&x[0], &x[16]);
+        xor_salsa8(&x[16], &x[0]);
+    }
+    const V lanes = _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+    const V mask = _mm256_set1_epi32(1023);
+    for (int i = 0; i < 1024; i++) {
+        /* word k of lane l lives at ((32 * (X16 & 1023) + k) * LANES + l) */
+        V base = Add(_mm256_slli_epi32(_mm256_and_si256(x[16], mask), 8), lanes);
+        for (int k = 0; k < 32; k++)
+            x[k] = Xor(x[k], _mm256_i32gather_epi32((const int*)Vpad, Add(base, _mm256_set1_epi32(k * LANES)), 4));
+        xor_salsa8(&x[0], &x[16]);
+        xor_salsa8(&x[16], &x[0]);
+    }
+
+    for (int k = 0; k < 32; k++)
+        _mm256_storeu_si256((V*)&X[k * LANES], x[k]);
+}
+
+#undef AVX2_TARGET
+} // namespace avx2
+#endif
+
+/* Hash nCount 80 byte headers, LANES at a time through Core, the rest one by one */
+template<typename V, int LANES>
+void scrypt_blockhash_lanes(void (*Core)(unsigned int*, V*), const unsigned char *input, size_t nCount, uint256 *output)
+{
+    std::vector<unsigned char> vPad(1024 * 32 * sizeof(V) + 63);
+    V *Vpad = (V *)(((uintptr_t)(&vPad[0]) + 63) & ~ (uintptr_t)(63));
+    size_t i = 0;
+    for (; i + LANES <= nCount; i += LANES) {
+        unsigned int X[32], XI[32 * LANES];
+        for (int l = 0; l < LANES; l++) {
+            PBKDF2_SHA256(input + (i + l) * 80, 80, input + (i + l) * 80, 80, 1, (uint8_t *)X, 128);
+            for (int k = 0; k < 32; k++)
+                XI[k * LANES + l] = X[k];
+        }
+        Core(XI, Vpad);
+        for (int l = 0; l < LANES; l++) {
+            for (int k = 0; k < 32; k++)
+                X[k] = XI[k * LANES + l];
+            output[i + l] = 0;
+            PBKDF2_SHA256(input + (i + l) * 80, 80, (uint8_t *)X, 128, 1, (uint8_t*)&output[i + l], 32);
+        }
+    }
+    for (; i < nCount; i++)
+        output[i] = scrypt_nosalt(input + i * 80, 80, &vPad[0]);
+}
+
+void scrypt_blockhash_generic(const unsigned char *input, size_t nCount, uint256 *output)
+{
+    std::vector<unsigned char> vPad(SCRYPT_BUFFER_SIZE);
+    for (size_t i = 0; i < nCount; i++)
+        output[i] = scrypt_nosalt(input + i * 80, 80, &vPad[0]);
+}
+
+#ifdef USE_SCRYPT_SSE2
+void scrypt_blockhash_sse2(const unsigned char *input, size_t nCount, uint256 *output)
+{
+    scrypt_blockhash_lanes<sse2::V, sse2::LANES>(sse2::scrypt_core, input, nCount, output);
+}
+#endif
+
+#ifdef USE_SCRYPT_AVX2
+void scrypt_blockhash_avx2(const unsigned char *input, size_t nCount, uint256 *output)
+{
+    scrypt_blockhash_lanes<avx2::V, avx2::LANES>(avx2::scrypt_core, input, nCount, output);
+}
+#endif
+
+typedef void (*scrypt_blockhash_fn)(const unsigned char*, size_t, uint256*);
+
+/* Check a multi-way core against the one-at-a-time code */
+bool scrypt_selftest(scrypt_blockhash_fn fn)
+{
+    const size_t nCount = 9;
+    unsigned char input[nCount * 80];
+    for (size_t i = 0; i < sizeof(input); i++)
+        input[i] = (unsigned char)(i * 11 + 5);
+    uint256 expected[nCount], actual[nCount];
+    scrypt_blockhash_generic(input, nCount, expected);
+    fn(input, nCount, actual);
+    for (size_t i = 0; i < nCount; i++)
+        if (expected[i] != actual[i])
+            return false;
+    return true;
+}
+
+const char *strScryptImpl = "generic";
+
+scrypt_blockhash_fn scrypt_select()
+{
+#ifdef USE_SCRYPT_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && scrypt_selftest(scrypt_blockhash_avx2)) {
+        strScryptImpl = "avx2";
+        return scrypt_blockhash_avx2;
+    }
+#endif
+#ifdef USE_SCRYPT_SSE2
+    if (scrypt_selftest(scrypt_blockhash_sse2)) {
+        strScryptImpl = "sse2";
+        return scrypt_blockhash_sse2;
+    }
+#endif
+    return scrypt_blockhash_generic;
+}
+
+scrypt_blockhash_fn scrypt_get()
+{
+    static scrypt_blockhash_fn fn = scrypt_select();
+    return fn;
+}
+
+} // namespace
+
+const char *scrypt_implementation()
+{
+    scrypt_get();
+    return strScryptImpl;
+}
+
+static void scrypt_blockhash_range(scrypt_blockhash_fn fn, const unsigned char *pinput, uint256 *output, size_t nBegin, size_t nEnd)
+{
+    fn(pinput + nBegin * 80, nEnd - nBegin, output + nBegin);
+}
+
+void scrypt_blockhash_many(const void* input, size_t nCount, uint256 *output)
+{
+    const unsigned char *pinput = (const unsigned char *)input;
+    scrypt_blockhash_fn fn = scrypt_get();
+
+    // Spread over the worker pool; small batches stay on this thread
+    ParallelForRange(nCount, 8, boost::bind(&scrypt_blockhash_range, fn, pinput, output, _1, _2));
+
+    scrypt_remember(pinput, nCount, output);
+}
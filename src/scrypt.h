@@ -12,4 +12,12 @@ uint256 scrypt_salted_hash(const void* input, size_t inputlen, const void* salt,
 uint256 scrypt_hash(const void* input, size_t inputlen);
 uint256 scrypt_blockhash(const void* input);
 
+/* Hash nCount 80 byte block headers laid out back to back, several at a
+   time and across all cores. The results are remembered, so a following
+   scrypt_blockhash() of any of them is a lookup. */
+void scrypt_blockhash_many(const void* input, size_t nCount, uint256 *output);
+
+/* Which multi-way core scrypt_blockhash_many() picked for this CPU */
+const char *scrypt_implementation();
+
 #endif // SCRYPT_MINE_H
@@ -49,12 +49,14 @@ Notes:
 
 #include <boost/lexical_cast.hpp>
 #include <boost/algorithm/string/predicate.hpp>
+#include <boost/bind.hpp>
 
 
 #include "base58.h"
 #include "db.h"
 #include "init.h" // pwalletMain
 #include "txdb.h"
+#include "parallel.h"
 #include "sync.h"
 #include "ecwrapper.h"
 
@@ -83,6 +85,8 @@ CCriticalSection cs_smsgThreads;
 
 leveldb::DB *smsgDB = NULL;
 
+static void SecureMsgClearScanKeys();
+
 
 namespace fs = boost::filesystem;
 
@@ -1252,6 +1256,7 @@ bool SecureMsgDisable()
         };
         smsgBuckets.clear();
         smsgAddresses.clear();
+        SecureMsgClearScanKeys();
     } // cs_smsg
     
     // -- tell each smsg enabled peer that this node is disabling
@@ -2149,6 +2154,356 @@ bool SecureMsgScanBlockChain()
     return true;
 };
 
+static int SecureMsgCheckMAC(const CKey& keyDest, uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload, std::vector<uint8_t>& key_e)
+{
+    /* Derive the shared keys for keyDest and check the message MAC with them.
+       This is the cheap part of a decryption, enough to tell if a message is
+       addressed to keyDest.
+
+        returns
+            0       MAC matches, key_e is set
+            1       Error or MAC does not match
+            2       Unknown version number
+    */
+
+    SecureMessage* psmsg = (SecureMessage*) pHeader;
+
+    if (psmsg->version[0] != 1)
+    {
+        return errorN(2, "%s: Unknown version number.", __func__);
+    };
+
+    CPubKey cpkR(psmsg->cpkR, psmsg->cpkR+33);
+    if (!cpkR.IsValid())
+    {
+        return errorN(1, "%s: Could not get pubkey for key R.", __func__);
+    };
+
+    CECKey ecKeyR;
+    if (!ecKeyR.SetPubKey(cpkR.begin(), cpkR.size()))
+    {
+        return errorN(1, "%s: Could not set pubkey for key R: %s.", __func__, HexStr(cpkR).c_str());
+    };
+
+    CECKey ecKeyDest;
+    ecKeyDest.SetSecretBytes(keyDest.begin());
+    
+    // -- Do an EC point multiply with private key k and public key R. This gives you public key P.
+    std::vector<uint8_t> vchP;
+    vchP.resize(32);
+    EC_KEY* pkeyk = ecKeyDest.GetECKey();
+    EC_KEY* pkeyR = ecKeyR.GetECKey();
+
+    ECDH_set_method(pkeyk, ECDH_OpenSSL());
+    int lenPdec = ECDH_compute_key(&vchP[0], 32, EC_KEY_get0_public_key(pkeyR), pkeyk, NULL);
+
+    if (lenPdec != 32)
+    {
+        return errorN(1, "%s: ECDH_compute_key failed, lenPdec: %d.", __func__, lenPdec);
+    };
+
+
+    // -- Use public key P to calculate the SHA512 hash H.
+    //    The first 32 bytes of H are called key_e and the last 32 bytes are called key_m.
+    std::vector<uint8_t> vchHashedDec;
+    vchHashedDec.resize(64);    // 512 bits
+    SHA512(&vchP[0], vchP.size(), (uint8_t*)&vchHashedDec[0]);
+    key_e.assign(&vchHashedDec[0], &vchHashedDec[0]+32);
+    std::vector<uint8_t> key_m(&vchHashedDec[32], &vchHashedDec[32]+32);
+
+
+    // -- Message authentication code, (hash of timestamp + destination + payload)
+    uint8_t MAC[32];
+    bool fHmacOk = true;
+    uint32_t nBytes = 32;
+    HMAC_CTX ctx;
+    HMAC_CTX_init(&ctx);
+
+    if (!HMAC_Init_ex(&ctx, &key_m[0], 32, EVP_sha256(), NULL)
+        || !HMAC_Update(&ctx, (uint8_t*) &psmsg->timestamp, sizeof(psmsg->timestamp))
+        || !HMAC_Update(&ctx, pPayload, nPayload)
+        || !HMAC_Final(&ctx, MAC, &nBytes)
+        || nBytes != 32)
+        fHmacOk = false;
+
+    HMAC_CTX_cleanup(&ctx);
+
+    if (!fHmacOk)
+    {
+        return errorN(1, "%s: Could not generate MAC.", __func__);
+    };
+
+    if (memcmp(MAC, psmsg->mac, 32) != 0)
+    {
+        if (fDebugSmsg)
+            LogPrint("smessage", "MAC does not match.\n"); // expected if message is not to address on node
+
+        return 1;
+    };
+
+    return 0;
+};
+
+class SecMsgScanKey
+{
+// -- an owned address and its private key, looked up once per scan
+public:
+    std::string sAddress;
+    bool fReceiveAnon;
+    CKey key;
+};
+
+// -- private keys of the receiving addresses, kept until smsgAddresses, the
+//    address book or the wallet lock state changes. Guarded by cs_smsg.
+static std::vector<SecMsgScanKey> vSmsgScanKeys;
+static std::vector<SecMsgAddress> vSmsgScanKeysFor;
+static bool fSmsgScanKeysValid = false;
+
+static bool SecureMsgSameAddresses(const std::vector<SecMsgAddress>& a, const std::vector<SecMsgAddress>& b)
+{
+    if (a.size() != b.size())
+        return false;
+
+    for (unsigned int i = 0; i < a.size(); ++i)
+    {
+        if (a[i].sAddress != b[i].sAddress
+            || a[i].fReceiveEnabled != b[i].fReceiveEnabled
+            || a[i].fReceiveAnon != b[i].fReceiveAnon)
+            return false;
+    };
+
+    return true;
+};
+
+static const std::vector<SecMsgScanKey>& SecureMsgGetScanKeys()
+{
+    /* Fetch the private keys of the addresses we receive messages on
+
+        should have LOCK(cs_smsg) and the wallet unlocked
+    */
+
+    if (fSmsgScanKeysValid
+        && SecureMsgSameAddresses(vSmsgScanKeysFor, smsgAddresses))
+        return vSmsgScanKeys;
+
+    vSmsgScanKeys.clear();
+    for (std::vector<SecMsgAddress>::iterator it = smsgAddresses.begin(); it != smsgAddresses.end(); ++it)
+    {
+        if (!it->fReceiveEnabled)
+            continue;
+
+        CHarvestcoinAddress coinAddress(it->sAddress);
+        CKeyID ckid;
+        SecMsgScanKey scanKey;
+        if (!coinAddress.GetKeyID(ckid)
+            || !pwalletMain->GetKey(ckid, scanKey.key))
+            continue;
+
+        scanKey.sAddress = coinAddress.ToString();
+        scanKey.fReceiveAnon = it->fReceiveAnon;
+        vSmsgScanKeys.push_back(scanKey);
+    };
+
+    vSmsgScanKeysFor = smsgAddresses;
+    // -- keys fetched while locking are incomplete, fetch again next time
+    fSmsgScanKeysValid = !pwalletMain->IsLocked();
+
+    return vSmsgScanKeys;
+};
+
+static void SecureMsgClearScanKeys()
+{
+    // -- should have LOCK(cs_smsg)
+    vSmsgScanKeys.clear();
+    vSmsgScanKeysFor.clear();
+    fSmsgScanKeysValid = false;
+};
+
+static int SecureMsgFindScanKey(const std::vector<SecMsgScanKey>& vScanKeys, uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload)
+{
+    // -- returns the index of the key the message is addressed to, or -1
+
+    std::vector<uint8_t> key_e;
+    for (unsigned int i = 0; i < vScanKeys.size(); ++i)
+    {
+        if (SecureMsgCheckMAC(vScanKeys[i].key, pHeader, pPayload, nPayload, key_e) == 0)
+            return i;
+    };
+
+    return -1;
+};
+
+static void SecureMsgFindScanKeys(const std::vector<SecMsgScanKey>* pvScanKeys, const std::vector<uint8_t*>* pvMessages,
+    size_t nBegin, size_t nEnd, std::vector<int>* pvMatch)
+{
+    for (size_t i = nBegin; i < nEnd; ++i)
+    {
+        uint8_t* pHeader = (*pvMessages)[i];
+        SecureMessage* psmsg = (SecureMessage*) pHeader;
+        (*pvMatch)[i] = SecureMsgFindScanKey(*pvScanKeys, pHeader, pHeader + SMSG_HDR_LEN, psmsg->nPayload);
+    };
+};
+
+static bool SecureMsgIsOwnMessage(const SecMsgScanKey& scanKey, uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload)
+{
+    // -- a message whose MAC matched scanKey, is it one for the inbox
+
+    if (scanKey.fReceiveAnon)
+        return true;
+
+    // -- have to do full decrypt to see address from
+    std::string addressTo = scanKey.sAddress;
+    MessageData msg;
+    if (SecureMsgDecrypt(false, addressTo, pHeader, pPayload, nPayload, msg) != 0)
+        return false;
+
+    if (fDebugSmsg)
+        LogPrint("smessage", "Decrypted message with %s.\n", addressTo.c_str());
+
+    return msg.sFromAddress.compare("anon") != 0;
+};
+
+static int SecureMsgSaveInbox(SecMsgDB& dbInbox, const std::string& addressTo, uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload, bool reportToGui)
+{
+    /* Add a received message to the inbox
+
+        should have LOCK(cs_smsgDB) with dbInbox open
+
+        returns
+            0 success
+            1 error
+            4 message is already in the inbox
+    */
+
+    SecureMessage* psmsg = (SecureMessage*) pHeader;
+    std::string sPrefix("im");
+    uint8_t chKey[18];
+    memcpy(&chKey[0],  sPrefix.data(),    2);
+    memcpy(&chKey[2],  &psmsg->timestamp, 8);
+    memcpy(&chKey[10], pPayload,          8);
+
+    if (dbInbox.ExistsSmesg(chKey))
+    {
+        if (fDebugSmsg)
+            LogPrint("smessage", "Message already exists in inbox db.\n");
+        return 4;
+    };
+
+    SecMsgStored smsgInbox;
+    smsgInbox.timeReceived  = GetTime();
+    smsgInbox.status        = (SMSG_MASK_UNREAD) & 0xFF;
+    smsgInbox.sAddrTo       = addressTo;
+
+    // -- data may not be contiguous
+    try {
+        smsgInbox.vchMessage.resize(SMSG_HDR_LEN + nPayload);
+    } catch (std::exception& e) {
+        LogPrint("smessage", "SecureMsgSaveInbox(): Could not resize vchData, %u, %s\n", SMSG_HDR_LEN + nPayload, e.what());
+        return 1;
+    };
+    memcpy(&smsgInbox.vchMessage[0], pHeader, SMSG_HDR_LEN);
+    memcpy(&smsgInbox.vchMessage[SMSG_HDR_LEN], pPayload, nPayload);
+
+    if (!dbInbox.WriteSmesg(chKey, smsgInbox))
+        return 1;
+
+    if (reportToGui)
+        NotifySecMsgInboxChanged(smsgInbox);
+    LogPrint("smessage", "SecureMsg saved to inbox, received with %s.\n", addressTo.c_str());
+
+    return 0;
+};
+
+static int SecureMsgScanFile(const fs::path& path, const std::vector<SecMsgScanKey>& vScanKeys, uint32_t& nMessages, uint32_t& nFoundMessages)
+{
+    /* Scan all messages in a bucket file against vScanKeys, and save the
+       ones addressed to us to the inbox in one batch.
+       Trial decryptions of the messages are spread over all cores.
+
+        should have LOCK(cs_smsg)
+
+        returns
+            0 success
+            1 error
+    */
+
+    std::vector<uint8_t> vchFile;
+    FILE *fp;
+    errno = 0;
+    if (!(fp = fopen(path.string().c_str(), "rb")))
+    {
+        LogPrint("smessage", "Error opening file: %s\n", strerror(errno));
+        return 1;
+    };
+
+    try {
+        vchFile.resize(fs::file_size(path));
+    } catch (std::exception& e)
+    {
+        LogPrint("smessage", "SecureMsgScanFile(): Could not read file %s, %s\n", path.string().c_str(), e.what());
+        fclose(fp);
+        return 1;
+    };
+
+    if (vchFile.size() > 0
+        && fread(&vchFile[0], sizeof(uint8_t), vchFile.size(), fp) != vchFile.size())
+    {
+        LogPrint("smessage", "fread file failed: %s\n", strerror(errno));
+        vchFile.resize(0);
+    };
+    fclose(fp);
+
+    // -- the messages are stored header then payload, one after another
+    std::vector<uint8_t*> vMessages;
+    for (size_t n = 0; n + SMSG_HDR_LEN <= vchFile.size(); )
+    {
+        SecureMessage* psmsg = (SecureMessage*) &vchFile[n];
+        if (n + SMSG_HDR_LEN + psmsg->nPayload > vchFile.size())
+        {
+            LogPrint("smessage", "fread data failed: truncated message\n");
+            break;
+        };
+        vMessages.push_back(&vchFile[n]);
+        n += SMSG_HDR_LEN + psmsg->nPayload;
+    };
+    nMessages += vMessages.size();
+
+    std::vector<int> vMatch(vMessages.size(), -1);
+
+    // Spread over the worker pool; small files stay on this thread
+    size_t nCount = vMessages.size();
+    ParallelForRange(nCount, 4, boost::bind(&SecureMsgFindScanKeys, &vScanKeys, &vMessages, _1, _2, &vMatch));
+
+    {
+        LOCK(cs_smsgDB);
+        SecMsgDB dbInbox;
+
+        if (!dbInbox.Open("cw"))
+            return 1;
+
+        dbInbox.TxnBegin();
+        for (size_t i = 0; i < nCount; ++i)
+        {
+            if (vMatch[i] < 0)
+                continue;
+
+            const SecMsgScanKey& scanKey = vScanKeys[vMatch[i]];
+            uint8_t* pHeader = vMessages[i];
+            SecureMessage* psmsg = (SecureMessage*) pHeader;
+            if (!SecureMsgIsOwnMessage(scanKey, pHeader, pHeader + SMSG_HDR_LEN, psmsg->nPayload))
+                continue;
+
+            // -- don't report to gui,
+            if (SecureMsgSaveInbox(dbInbox, scanKey.sAddress, pHeader, pHeader + SMSG_HDR_LEN, psmsg->nPayload, false) == 0)
+                nFoundMessages++;
+        };
+        if (!dbInbox.TxnCommit())
+            return 1;
+    } // cs_smsgDB
+
+    return 0;
+};
+
 bool SecureMsgScanBuckets()
 {
     if (fDebugSmsg)
@@ -2174,9 +2529,6 @@ bool SecureMsgScanBuckets()
         return 0; // not an error
     };
 
-    SecureMessage smsg;
-    std::vector<uint8_t> vchData;
-
     for (fs::directory_iterator itd(pathSmsgDir) ; itd != itend ; ++itd)
     {
         if (!fs::is_regular_file(itd->status()))
@@ -2226,58 +2578,8 @@ bool SecureMsgScanBuckets()
 
         {
             LOCK(cs_smsg);
-            FILE *fp;
-            errno = 0;
-            if (!(fp = fopen((*itd).path().string().c_str(), "rb")))
-            {
-                LogPrint("smessage", "Error opening file: %s\n", strerror(errno));
+            if (SecureMsgScanFile((*itd).path(), SecureMsgGetScanKeys(), nMessages, nFoundMessages) != 0)
                 continue;
-            };
-
-            for (;;)
-            {
-                errno = 0;
-                if (fread(&smsg.hash[0], sizeof(uint8_t), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN)
-                {
-                    if (errno != 0)
-                    {
-                        LogPrint("smessage", "fread header failed: %s\n", strerror(errno));
-                    } else
-                    {
-                        //LogPrint("smessage", "End of file.\n");
-                    };
-                    break;
-                };
-
-                try { vchData.resize(smsg.nPayload); } catch (std::exception& e)
-                {
-                    LogPrint("smessage", "SecureMsgWalletUnlocked(): Could not resize vchData, %u, %s\n", smsg.nPayload, e.what());
-                    fclose(fp);
-                    return 1;
-                };
-
-                if (fread(&vchData[0], sizeof(uint8_t), smsg.nPayload, fp) != smsg.nPayload)
-                {
-                    LogPrint("smessage", "fread data failed: %s\n", strerror(errno));
-                    break;
-                };
-
-                // -- don't report to gui,
-                int rv = SecureMsgScanMessage(&smsg.hash[0], &vchData[0], smsg.nPayload, false);
-
-                if (rv == 0)
-                {
-                    nFoundMessages++;
-                } else
-                if (rv != 0)
-                {
-                    // SecureMsgScanMessage failed
-                };
-
-                nMessages ++;
-            };
-
-            fclose(fp);
 
             // -- remove wl file when scanned
             try {
@@ -2328,9 +2630,6 @@ int SecureMsgWalletUnlocked()
         return 0; // not an error
     };
 
-    SecureMessage smsg;
-    std::vector<uint8_t> vchData;
-
     for (fs::directory_iterator itd(pathSmsgDir) ; itd != itend ; ++itd)
     {
         if (!fs::is_regular_file(itd->status()))
@@ -2371,58 +2670,8 @@ int SecureMsgWalletUnlocked()
 
         {
             LOCK(cs_smsg);
-            FILE *fp;
-            errno = 0;
-            if (!(fp = fopen((*itd).path().string().c_str(), "rb")))
-            {
-                LogPrint("smessage", "Error opening file: %s\n", strerror(errno));
+            if (SecureMsgScanFile((*itd).path(), SecureMsgGetScanKeys(), nMessages, nFoundMessages) != 0)
                 continue;
-            };
-
-            for (;;)
-            {
-                errno = 0;
-                if (fread(&smsg.hash[0], sizeof(uint8_t), SMSG_HDR_LEN, fp) != (size_t)SMSG_HDR_LEN)
-                {
-                    if (errno != 0)
-                    {
-                        LogPrint("smessage", "fread header failed: %s\n", strerror(errno));
-                    } else
-                    {
-                        //LogPrint("smessage", "End of file.\n");
-                    };
-                    break;
-                };
-
-                try { vchData.resize(smsg.nPayload); } catch (std::exception& e)
-                {
-                    LogPrint("smessage", "SecureMsgWalletUnlocked(): Could not resize vchData, %u, %s\n", smsg.nPayload, e.what());
-                    fclose(fp);
-                    return 1;
-                };
-
-                if (fread(&vchData[0], sizeof(uint8_t), smsg.nPayload, fp) != smsg.nPayload)
-                {
-                    LogPrint("smessage", "fread data failed: %s\n", strerror(errno));
-                    break;
-                };
-
-                // -- don't report to gui,
-                int rv = SecureMsgScanMessage(&smsg.hash[0], &vchData[0], smsg.nPayload, false);
-
-                if (rv == 0)
-                {
-                    nFoundMessages++;
-                } else
-                if (rv != 0)
-                {
-                    // SecureMsgScanMessage failed
-                };
-
-                nMessages ++;
-            };
-
-            fclose(fp);
 
             // -- remove wl file when scanned
             try {
@@ -2442,6 +2691,24 @@ int SecureMsgWalletUnlocked()
     return 0;
 };
 
+int SecureMsgWalletLocked()
+{
+    /*
+    When the wallet is locked, drop the cached private keys.
+    */
+    if (!fSecMsgEnabled)
+        return 0;
+
+    LogPrint("smessage", "SecureMsgWalletLocked()\n");
+
+    {
+        LOCK(cs_smsg);
+        SecureMsgClearScanKeys();
+    } // cs_smsg
+
+    return 0;
+};
+
 int SecureMsgWalletKeyChanged(std::string sAddress, std::string sLabel, ChangeType mode)
 {
     if (!fSecMsgEnabled)
@@ -2454,6 +2721,9 @@ int SecureMsgWalletKeyChanged(std::string sAddress, std::string sLabel, ChangeTy
     {
         LOCK(cs_smsg);
 
+        // -- the key behind an address may have changed, fetch scan keys again
+        fSmsgScanKeysValid = false;
+
         switch(mode)
         {
             case CT_NEW:
@@ -2509,90 +2779,27 @@ int SecureMsgScanMessage(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload,
         return 3;
     };
 
-    std::string addressTo;
-    MessageData msg; // placeholder
-    bool fOwnMessage = false;
-
-    for (std::vector<SecMsgAddress>::iterator it = smsgAddresses.begin(); it != smsgAddresses.end(); ++it)
+    std::string sAddress;
     {
-        if (!it->fReceiveEnabled)
-            continue;
-
-        CHarvestcoinAddress coinAddress(it->sAddress);
-        addressTo = coinAddress.ToString();
-
-        if (!it->fReceiveAnon)
-        {
-            // -- have to do full decrypt to see address from
-            if (SecureMsgDecrypt(false, addressTo, pHeader, pPayload, nPayload, msg) == 0)
-            {
-                if (fDebugSmsg)
-                    LogPrint("smessage", "Decrypted message with %s.\n", addressTo.c_str());
+        LOCK(cs_smsg);
+        const std::vector<SecMsgScanKey>& vScanKeys = SecureMsgGetScanKeys();
 
-                if (msg.sFromAddress.compare("anon") != 0)
-                    fOwnMessage = true;
-                break;
-            };
-        } else
-        {
+        int nMatch = SecureMsgFindScanKey(vScanKeys, pHeader, pPayload, nPayload);
+        if (nMatch < 0
+            || !SecureMsgIsOwnMessage(vScanKeys[nMatch], pHeader, pPayload, nPayload))
+            return 0;
 
-            if (SecureMsgDecrypt(true, addressTo, pHeader, pPayload, nPayload, msg) == 0)
-            {
-                if (fDebugSmsg)
-                    LogPrint("smessage", "Decrypted message with %s.\n", addressTo.c_str());
-
-                fOwnMessage = true;
-                break;
-            };
-        }
-    };
+        sAddress = vScanKeys[nMatch].sAddress;
+    } // cs_smsg
 
-    if (fOwnMessage)
     {
-        // -- save to inbox
-        SecureMessage* psmsg = (SecureMessage*) pHeader;
-        std::string sPrefix("im");
-        uint8_t chKey[18];
-        memcpy(&chKey[0],  sPrefix.data(),    2);
-        memcpy(&chKey[2],  &psmsg->timestamp, 8);
-        memcpy(&chKey[10], pPayload,          8);
-
-        SecMsgStored smsgInbox;
-        smsgInbox.timeReceived  = GetTime();
-        smsgInbox.status        = (SMSG_MASK_UNREAD) & 0xFF;
-        smsgInbox.sAddrTo       = addressTo;
-
-        // -- data may not be contiguous
-        try {
-            smsgInbox.vchMessage.resize(SMSG_HDR_LEN + nPayload);
-        } catch (std::exception& e) {
-            LogPrint("smessage", "SecureMsgScanMessage(): Could not resize vchData, %u, %s\n", SMSG_HDR_LEN + nPayload, e.what());
-            return 1;
-        };
-        memcpy(&smsgInbox.vchMessage[0], pHeader, SMSG_HDR_LEN);
-        memcpy(&smsgInbox.vchMessage[SMSG_HDR_LEN], pPayload, nPayload);
-
-        {
-            LOCK(cs_smsgDB);
-            SecMsgDB dbInbox;
-
-            if (dbInbox.Open("cw"))
-            {
-                if (dbInbox.ExistsSmesg(chKey))
-                {
-                    if (fDebugSmsg)
-                        LogPrint("smessage", "Message already exists in inbox db.\n");
-                } else
-                {
-                    dbInbox.WriteSmesg(chKey, smsgInbox);
+        LOCK(cs_smsgDB);
+        SecMsgDB dbInbox;
 
-                    if (reportToGui)
-                        NotifySecMsgInboxChanged(smsgInbox);
-                    LogPrint("smessage", "SecureMsg saved to inbox, received with %s.\n", addressTo.c_str());
-                };
-            };
-        } // cs_smsgDB
-    };
+        if (dbInbox.Open("cw")
+            && SecureMsgSaveInbox(dbInbox, sAddress, pHeader, pPayload, nPayload, reportToGui) == 1)
+            return 1;
+    } // cs_smsgDB
 
     return 0;
 };
@@ -3751,73 +3958,9 @@ int SecureMsgDecrypt(bool fTestOnly, std::string &address, uint8_t *pHeader, uin
 
 
 
-    CPubKey cpkR(psmsg->cpkR, psmsg->cpkR+33);
-    if (!cpkR.IsValid())
-    {
-        return errorN(1, "%s: Could not get pubkey for key R.", __func__);
-    };
-
-    CECKey ecKeyR;
-    if (!ecKeyR.SetPubKey(cpkR.begin(), cpkR.size()))
-    {
-        return errorN(1, "%s: Could not set pubkey for key R: %s.", __func__, HexStr(cpkR).c_str());
-    };
-
-    CECKey ecKeyDest;
-    ecKeyDest.SetSecretBytes(keyDest.begin());
-    
-    // -- Do an EC point multiply with private key k and public key R. This gives you public key P.
-    std::vector<uint8_t> vchP;
-    vchP.resize(32);
-    EC_KEY* pkeyk = ecKeyDest.GetECKey();
-    EC_KEY* pkeyR = ecKeyR.GetECKey();
-
-    ECDH_set_method(pkeyk, ECDH_OpenSSL());
-    int lenPdec = ECDH_compute_key(&vchP[0], 32, EC_KEY_get0_public_key(pkeyR), pkeyk, NULL);
-
-    if (lenPdec != 32)
-    {
-        return errorN(1, "%s: ECDH_compute_key failed, lenPdec: %d.", __func__, lenPdec);
-    };
-
-
-    // -- Use public key P to calculate the SHA512 hash H.
-    //    The first 32 bytes of H are called key_e and the last 32 bytes are called key_m.
-    std::vector<uint8_t> vchHashedDec;
-    vchHashedDec.resize(64);    // 512 bits
-    SHA512(&vchP[0], vchP.size(), (uint8_t*)&vchHashedDec[0]);
-    std::vector<uint8_t> key_e(&vchHashedDec[0], &vchHashedDec[0]+32);
-    std::vector<uint8_t> key_m(&vchHashedDec[32], &vchHashedDec[32]+32);
-
-
-    // -- Message authentication code, (hash of timestamp + destination + payload)
-    uint8_t MAC[32];
-    bool fHmacOk = true;
-    uint32_t nBytes = 32;
-    HMAC_CTX ctx;
-    HMAC_CTX_init(&ctx);
-
-    if (!HMAC_Init_ex(&ctx, &key_m[0], 32, EVP_sha256(), NULL)
-        || !HMAC_Update(&ctx, (uint8_t*) &psmsg->timestamp, sizeof(psmsg->timestamp))
-        || !HMAC_Update(&ctx, pPayload, nPayload)
-        || !HMAC_Final(&ctx, MAC, &nBytes)
-        || nBytes != 32)
-        fHmacOk = false;
-
-    HMAC_CTX_cleanup(&ctx);
-
-    if (!fHmacOk)
-    {
-        return errorN(1, "%s: Could not generate MAC.", __func__);
-    };
-
-    if (memcmp(MAC, psmsg->mac, 32) != 0)
-    {
-        if (fDebugSmsg)
-            LogPrint("smessage", "MAC does not match.\n"); // expected if message is not to address on node
-
+    std::vector<uint8_t> key_e;
+    if (SecureMsgCheckMAC(keyDest, pHeader, pPayload, nPayload, key_e) != 0)
         return 1;
-    };
 
     if (fTestOnly)
         return 0;
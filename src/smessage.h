@@ -349,6 +349,7 @@ bool SecureMsgScanBuckets();
 
 
 int SecureMsgWalletUnlocked();
+int SecureMsgWalletLocked();
 int SecureMsgWalletKeyChanged(std::string sAddress, std::string sLabel, ChangeType mode);
 
 int SecureMsgScanMessage(uint8_t *pHeader, uint8_t *pPayload, uint32_t nPayload, bool reportToGui);
@@ -0,0 +1,188 @@
+#include <boost/test/unit_test.hpp>
+
+#include "blockencodings.h"
+#include "txmempool.h"
+
+using namespace std;
+
+// A proof-of-work style block: a coinbase and nTx - 1 plain transactions
+static CBlock BuildBlock(unsigned int nTx)
+{
+    CBlock block;
+    block.nVersion = 7;
+    block.hashPrevBlock = GetRandHash();
+    block.nTime = 1500000000;
+    block.nBits = 0x1e0fffff;
+    block.nNonce = 42;
+
+    CTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].prevout.SetNull();
+    coinbase.vin[0].scriptSig << OP_1 << OP_2;
+    coinbase.vout.resize(1);
+    coinbase.vout[0].nValue = 50 * COIN;
+    coinbase.vout[0].scriptPubKey << OP_TRUE;
+    block.vtx.push_back(coinbase);
+
+    for (unsigned int i = 1; i < nTx; i++)
+    {
+        CTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(GetRandHash(), i);
+        tx.vout.resize(1);
+        tx.vout[0].nValue = i * CENT;
+        tx.vout[0].scriptPubKey << OP_TRUE;
+        block.vtx.push_back(tx);
+    }
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+BOOST_AUTO_TEST_SUITE(blockencodings_tests)
+
+BOOST_AUTO_TEST_CASE(cmpctblock_roundtrip)
+{
+    CBlock block = BuildBlock(10);
+    CBlockHeaderAndShortTxIDs cmpctblock(block);
+    BOOST_CHECK_EQUAL(cmpctblock.BlockTxCount(), 10U);
+    BOOST_CHECK_EQUAL(cmpctblock.prefilledtxn.size(), 1U);
+    BOOST_CHECK_EQUAL(cmpctblock.prefilledtxn[0].nIndex, 0);
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << cmpctblock;
+    CBlockHeaderAndShortTxIDs cmpctblock2;
+    ss >> cmpctblock2;
+
+    BOOST_CHECK(cmpctblock2.header.GetHash() == block.GetHash());
+    BOOST_CHECK_EQUAL(cmpctblock2.nNonce, cmpctblock.nNonce);
+    BOOST_CHECK(cmpctblock2.shorttxids == cmpctblock.shorttxids);
+    BOOST_CHECK_EQUAL(cmpctblock2.prefilledtxn.size(), 1U);
+    BOOST_CHECK(cmpctblock2.prefilledtxn[0].tx.GetHash() == block.vtx[0].GetHash());
+
+    // The short ID keys are derived again on the receiving side
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+    {
+        uint64_t shortid = cmpctblock2.GetShortID(block.vtx[i].GetHash());
+        BOOST_CHECK_EQUAL(shortid, cmpctblock.shorttxids[i - 1]);
+        BOOST_CHECK_EQUAL(shortid >> 48, 0U);
+    }
+
+    CBlockTransactionsRequest req;
+    req.blockhash = block.GetHash();
+    req.vIndexes.push_back(1);
+    req.vIndexes.push_back(7);
+    ss << req;
+    CBlockTransactionsRequest req2;
+    ss >> req2;
+    BOOST_CHECK(req2.blockhash == req.blockhash);
+    BOOST_CHECK(req2.vIndexes == req.vIndexes);
+}
+
+BOOST_AUTO_TEST_CASE(cmpctblock_bad_shortid_length)
+{
+    CBlockHeaderAndShortTxIDs cmpctblock(BuildBlock(3));
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << cmpctblock.header << cmpctblock.nNonce;
+    // 7 bytes of short IDs is not a whole number of IDs
+    ss << vector<unsigned char>(7, 0) << cmpctblock.prefilledtxn;
+    CBlockHeaderAndShortTxIDs cmpctblock2;
+    BOOST_CHECK_THROW(ss >> cmpctblock2, std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_CASE(partialblock_from_pool)
+{
+    CBlock block = BuildBlock(6);
+    CTxMemPool pool;
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+        pool.addUnchecked(block.vtx[i].GetHash(), block.vtx[i]);
+
+    CBlockHeaderAndShortTxIDs cmpctblock(block);
+    CPartialBlock partial;
+    vector<unsigned short> vMissing;
+    BOOST_CHECK(partial.Init(cmpctblock, pool, vMissing));
+    BOOST_CHECK(vMissing.empty());
+    BOOST_CHECK(partial.GetHash() == block.GetHash());
+
+    CBlock block2;
+    BOOST_CHECK(partial.Fill(vector<CTransaction>(), block2));
+    BOOST_CHECK(block2.GetHash() == block.GetHash());
+    BOOST_CHECK_EQUAL(block2.vtx.size(), block.vtx.size());
+    BOOST_CHECK(block2.BuildMerkleTree() == block.hashMerkleRoot);
+}
+
+BOOST_AUTO_TEST_CASE(partialblock_missing)
+{
+    CBlock block = BuildBlock(6);
+    CTxMemPool pool;
+    // Transactions 2 and 4 never reached this pool
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+        if (i != 2 && i != 4)
+            pool.addUnchecked(block.vtx[i].GetHash(), block.vtx[i]);
+
+    CBlockHeaderAndShortTxIDs cmpctblock(block);
+    CPartialBlock partial;
+    vector<unsigned short> vMissing;
+    BOOST_CHECK(partial.Init(cmpctblock, pool, vMissing));
+    BOOST_CHECK_EQUAL(vMissing.size(), 2U);
+    BOOST_CHECK_EQUAL(vMissing[0], 2);
+    BOOST_CHECK_EQUAL(vMissing[1], 4);
+
+    vector<CTransaction> vtxMissing;
+    CBlock block2;
+    BOOST_CHECK(!partial.Fill(vtxMissing, block2));
+    vtxMissing.push_back(block.vtx[2]);
+    BOOST_CHECK(!partial.Fill(vtxMissing, block2));
+    vtxMissing.push_back(block.vtx[4]);
+    BOOST_CHECK(partial.Fill(vtxMissing, block2));
+    BOOST_CHECK(block2.BuildMerkleTree() == block.hashMerkleRoot);
+    vtxMissing.push_back(block.vtx[1]);
+    BOOST_CHECK(!partial.Fill(vtxMissing, block2));
+
+    // Filled in the wrong order the block doesn't rebuild to its merkle root
+    vtxMissing.clear();
+    vtxMissing.push_back(block.vtx[4]);
+    vtxMissing.push_back(block.vtx[2]);
+    BOOST_CHECK(partial.Fill(vtxMissing, block2));
+    BOOST_CHECK(block2.BuildMerkleTree() != block.hashMerkleRoot);
+}
+
+BOOST_AUTO_TEST_CASE(partialblock_shortid_collision)
+{
+    CBlock block = BuildBlock(4);
+    CTxMemPool pool;
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+        pool.addUnchecked(block.vtx[i].GetHash(), block.vtx[i]);
+
+    // Two block transactions announced under the same short ID must both be
+    // asked for rather than guessed
+    CBlockHeaderAndShortTxIDs cmpctblock(block);
+    cmpctblock.shorttxids[1] = cmpctblock.shorttxids[0];
+    CPartialBlock partial;
+    vector<unsigned short> vMissing;
+    BOOST_CHECK(partial.Init(cmpctblock, pool, vMissing));
+    BOOST_CHECK_EQUAL(vMissing.size(), 2U);
+    BOOST_CHECK_EQUAL(vMissing[0], 1);
+    BOOST_CHECK_EQUAL(vMissing[1], 2);
+}
+
+BOOST_AUTO_TEST_CASE(partialblock_malformed)
+{
+    CBlock block = BuildBlock(4);
+    CTxMemPool pool;
+    CPartialBlock partial;
+    vector<unsigned short> vMissing;
+
+    CBlockHeaderAndShortTxIDs cmpctblock(block);
+    cmpctblock.prefilledtxn[0].nIndex = 4;
+    BOOST_CHECK(!partial.Init(cmpctblock, pool, vMissing));
+
+    CBlockHeaderAndShortTxIDs cmpctblock2(block);
+    cmpctblock2.prefilledtxn.push_back(cmpctblock2.prefilledtxn[0]);
+    cmpctblock2.shorttxids.pop_back();
+    BOOST_CHECK(!partial.Init(cmpctblock2, pool, vMissing));
+
+    CBlockHeaderAndShortTxIDs cmpctblock3;
+    BOOST_CHECK(!partial.Init(cmpctblock3, pool, vMissing));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
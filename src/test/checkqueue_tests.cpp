@@ -0,0 +1,162 @@
+#include <vector>
+#include <boost/test/unit_test.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+#include "checkqueue.h"
+#include "key.h"
+#include "keystore.h"
+#include "main.h"
+#include "script.h"
+
+using namespace std;
+
+// Check that counts how often it ran and returns a fixed result
+class CCountCheck
+{
+public:
+    int* pnRuns;
+    bool fResult;
+    boost::mutex* pmutex;
+
+    CCountCheck() : pnRuns(NULL), fResult(true), pmutex(NULL) {}
+    CCountCheck(int* pnRunsIn, bool fResultIn, boost::mutex* pmutexIn) :
+        pnRuns(pnRunsIn), fResult(fResultIn), pmutex(pmutexIn) {}
+
+    bool operator()()
+    {
+        boost::unique_lock<boost::mutex> lock(*pmutex);
+        (*pnRuns)++;
+        return fResult;
+    }
+
+    void swap(CCountCheck& check)
+    {
+        std::swap(pnRuns, check.pnRuns);
+        std::swap(fResult, check.fResult);
+        std::swap(pmutex, check.pmutex);
+    }
+};
+
+// A transaction spending nInputs P2PKH outputs of txFrom, all signed
+static void BuildSignedSpend(CBasicKeyStore& keystore, CTransaction& txFrom, CTransaction& txTo, unsigned int nInputs)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    keystore.AddKey(key);
+
+    txFrom.vout.resize(nInputs);
+    for (unsigned int i = 0; i < nInputs; i++)
+    {
+        txFrom.vout[i].nValue = 1000;
+        txFrom.vout[i].scriptPubKey.SetDestination(key.GetPubKey().GetID());
+    }
+
+    txTo.vin.resize(nInputs);
+    txTo.vout.resize(1);
+    txTo.vout[0].nValue = 1000 * nInputs;
+    txTo.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
+    for (unsigned int i = 0; i < nInputs; i++)
+    {
+        txTo.vin[i].prevout.hash = txFrom.GetHash();
+        txTo.vin[i].prevout.n = i;
+    }
+    for (unsigned int i = 0; i < nInputs; i++)
+        BOOST_CHECK(SignSignature(keystore, txFrom, txTo, i));
+}
+
+// Run the script checks of every input of txTo through queue, as ConnectBlock does
+static bool CheckThroughQueue(CCheckQueue<CScriptCheck>* pqueue, const CTransaction& txFrom, const CTransaction& txTo)
+{
+    boost::shared_ptr<const CSigHashCache> psighashcache(new CSigHashCache(txTo));
+    std::vector<CScriptCheck> vChecks;
+    for (unsigned int i = 0; i < txTo.vin.size(); i++)
+    {
+        vChecks.push_back(CScriptCheck());
+        CScriptCheck(txFrom.vout[txTo.vin[i].prevout.n].scriptPubKey, txTo, i, MANDATORY_SCRIPT_VERIFY_FLAGS, 0, psighashcache).swap(vChecks.back());
+    }
+
+    CCheckQueueControl<CScriptCheck> control(pqueue);
+    control.Add(vChecks);
+    return control.Wait();
+}
+
+static bool CheckInline(const CTransaction& txFrom, const CTransaction& txTo)
+{
+    for (unsigned int i = 0; i < txTo.vin.size(); i++)
+        if (!VerifySignature(txFrom, txTo, i, MANDATORY_SCRIPT_VERIFY_FLAGS, 0))
+            return false;
+    return true;
+}
+
+BOOST_AUTO_TEST_SUITE(checkqueue_tests)
+
+BOOST_AUTO_TEST_CASE(checkqueue_runs_every_check)
+{
+    CCheckQueue<CCountCheck> queue(16);
+    boost::thread_group threads;
+    for (int i = 0; i < 3; i++)
+        threads.create_thread(boost::bind(&CCheckQueue<CCountCheck>::Thread, &queue));
+
+    boost::mutex mutex;
+    for (int nRound = 0; nRound < 10; nRound++)
+    {
+        int nRuns = 0;
+        bool fExpected = (nRound % 2 == 0);
+        {
+            CCheckQueueControl<CCountCheck> control(&queue);
+            for (int nBatch = 0; nBatch < 10; nBatch++)
+            {
+                std::vector<CCountCheck> vChecks;
+                for (int i = 0; i < 100; i++)
+                    vChecks.push_back(CCountCheck(&nRuns, fExpected || i != 50, &mutex));
+                control.Add(vChecks);
+            }
+            BOOST_CHECK_EQUAL(control.Wait(), fExpected);
+        }
+        // A failure lets the remaining checks be skipped, but never more runs than checks
+        if (fExpected)
+            BOOST_CHECK_EQUAL(nRuns, 1000);
+        else
+            BOOST_CHECK(nRuns <= 1000);
+    }
+
+    threads.interrupt_all();
+    threads.join_all();
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_scripts_match_inline)
+{
+    CCheckQueue<CScriptCheck> queue(128);
+    boost::thread_group threads;
+    for (int i = 0; i < 3; i++)
+        threads.create_thread(boost::bind(&CCheckQueue<CScriptCheck>::Thread, &queue));
+
+    CBasicKeyStore keystore;
+    CTransaction txFrom, txTo;
+    BuildSignedSpend(keystore, txFrom, txTo, 20);
+
+    // Valid spend: the queue and the inline path both accept it
+    BOOST_CHECK(CheckInline(txFrom, txTo));
+    BOOST_CHECK(CheckThroughQueue(&queue, txFrom, txTo));
+
+    // One bad signature must fail the whole batch, the same as inline
+    CTransaction txBad(txTo);
+    txBad.vin[7].scriptSig = txTo.vin[8].scriptSig;
+    BOOST_CHECK(!CheckInline(txFrom, txBad));
+    BOOST_CHECK(!CheckThroughQueue(&queue, txFrom, txBad));
+
+    // Changing an output invalidates every signature
+    CTransaction txChanged(txTo);
+    txChanged.vout[0].nValue++;
+    BOOST_CHECK(!CheckInline(txFrom, txChanged));
+    BOOST_CHECK(!CheckThroughQueue(&queue, txFrom, txChanged));
+
+    // The queue is reusable after a failure
+    BOOST_CHECK(CheckThroughQueue(&queue, txFrom, txTo));
+
+    threads.interrupt_all();
+    threads.join_all();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,99 @@
+#include <vector>
+#include <boost/test/unit_test.hpp>
+
+#include "crypto/sha256.h"
+#include "hash.h"
+#include "kernel.h"
+#include "main.h"
+
+using namespace std;
+
+// CheckKernelBatch() must agree with CheckStakeKernelHash() on every timestamp
+static void CheckBatchAgainstScalar(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, unsigned int nCount,
+    const COutPoint& prevout, const CStakeCandidate& candidate, int& nPassed)
+{
+    vector<bool> vKernel;
+    bool fFound = CheckKernelBatch(pindexPrev, nBits, nTime, nCount, prevout, candidate, vKernel);
+    BOOST_CHECK_EQUAL(vKernel.size(), nCount);
+
+    bool fAny = false;
+    for (unsigned int n = 0; n < nCount; n++)
+    {
+        uint256 hashProofOfStake, targetProofOfStake;
+        bool fScalar = CheckStakeKernelHash(pindexPrev, nBits, candidate.nTimeBlockFrom, candidate.nTimeTxPrev, candidate.nValue,
+            prevout, nTime - n, hashProofOfStake, targetProofOfStake);
+        BOOST_CHECK_EQUAL(vKernel[n], fScalar);
+        fAny |= fScalar;
+        if (fScalar)
+            nPassed++;
+    }
+    BOOST_CHECK_EQUAL(fFound, fAny);
+}
+
+BOOST_AUTO_TEST_SUITE(kernel_tests)
+
+BOOST_AUTO_TEST_CASE(sha256d_many_matches_scalar)
+{
+    // Lengths around the padding boundaries, and the 56-byte stake kernel
+    const size_t vLength[] = {0, 1, 55, 56, 63, 64, 65, 119, 120, 200};
+    for (unsigned int l = 0; l < sizeof(vLength) / sizeof(vLength[0]); l++)
+    {
+        size_t nLength = vLength[l];
+        // Counts that leave every possible remainder after the wide lanes
+        for (size_t nCount = 1; nCount <= 17; nCount++)
+        {
+            vector<unsigned char> vData(nLength * nCount + 1);
+            for (size_t i = 0; i < vData.size(); i++)
+                vData[i] = (unsigned char)(i * 7 + nLength + nCount);
+
+            vector<unsigned char> vOut(32 * nCount);
+            SHA256DMany(&vOut[0], &vData[0], nLength, nCount);
+
+            for (size_t n = 0; n < nCount; n++)
+            {
+                uint256 hash = Hash(vData.begin() + n * nLength, vData.begin() + (n + 1) * nLength);
+                BOOST_CHECK(memcmp(hash.begin(), &vOut[n * 32], 32) == 0);
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(kernel_batch_matches_checkstakekernelhash)
+{
+    CBlockIndex indexPrev;
+    indexPrev.nStakeModifier = 0x0123456789abcdefULL;
+    indexPrev.nHeight = 1000;
+    indexPrev.nTime = 1500000000;
+
+    CStakeCandidate candidate;
+    candidate.nTimeBlockFrom = 1400000000;
+    candidate.nTimeTxPrev = 1399999990;
+    candidate.nValue = 1;
+    COutPoint prevout(uint256(12345), 3);
+
+    // A target near 2^255 lets about half of the timestamps through
+    unsigned int nBits = 0x207fffff;
+    int64_t nTime = candidate.nTimeBlockFrom + nStakeMinAge + 500;
+    int nPassed = 0;
+    CheckBatchAgainstScalar(&indexPrev, nBits, nTime, 257, prevout, candidate, nPassed);
+    BOOST_CHECK(nPassed > 0 && nPassed < 257);
+
+    // Timestamps that run back past the minimum age fail on both paths
+    nPassed = 0;
+    CheckBatchAgainstScalar(&indexPrev, nBits, candidate.nTimeBlockFrom + nStakeMinAge + 5, 16, prevout, candidate, nPassed);
+    BOOST_CHECK(nPassed <= 6);
+
+    // A weighted target above any hash lets every eligible timestamp through
+    candidate.nValue = 1000 * COIN;
+    nPassed = 0;
+    CheckBatchAgainstScalar(&indexPrev, nBits, nTime, 33, prevout, candidate, nPassed);
+    BOOST_CHECK_EQUAL(nPassed, 33);
+
+    // A tight target lets nothing through
+    candidate.nValue = 1;
+    nPassed = 0;
+    CheckBatchAgainstScalar(&indexPrev, 0x1d00ffff, nTime, 33, prevout, candidate, nPassed);
+    BOOST_CHECK_EQUAL(nPassed, 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,267 @@
+#include <set>
+#include <vector>
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "masternode.h"
+#include "masternodeman.h"
+#include "util.h"
+
+using namespace std;
+
+// A best chain of made-up blocks, which is all the rank code looks at
+class CFakeChain
+{
+public:
+    vector<uint256> vHash;
+    vector<CBlockIndex> vIndex;
+
+    CFakeChain(int nHeight) : vHash(nHeight + 1), vIndex(nHeight + 1)
+    {
+        for (int i = 0; i <= nHeight; i++)
+        {
+            vHash[i] = Hash(BEGIN(i), END(i));
+            vIndex[i].phashBlock = &vHash[i];
+            vIndex[i].nHeight = i;
+            vIndex[i].pprev = i > 0 ? &vIndex[i - 1] : NULL;
+        }
+        pindexBest = &vIndex.back();
+        SetBestChainIndex(pindexBest);
+    }
+
+    ~CFakeChain()
+    {
+        pindexBest = NULL;
+        SetBestChainIndex(NULL);
+    }
+};
+
+// An enabled masternode with collateral (i, 0) at 10.0.0.i
+static CMasternode MakeMasternode(int i)
+{
+    CTxIn vin(COutPoint(uint256(1000 + i), 0));
+    CService addr(strprintf("10.0.0.%d", i), 8333);
+
+    CKey key;
+    key.MakeNewKey(true);
+
+    CMasternode mn(addr, vin, key.GetPubKey(), vector<unsigned char>(), GetAdjustedTime(), key.GetPubKey(),
+        PROTOCOL_VERSION, CScript(), 0);
+    mn.lastTimeSeen = GetAdjustedTime();
+    mn.unitTest = true;
+    return mn;
+}
+
+static bool CompareScoreDescending(const pair<unsigned int, CTxIn>& a, const pair<unsigned int, CTxIn>& b)
+{
+    return a.first > b.first;
+}
+
+// Enabled entries ordered by scoring every one of them, as done before the
+// rank tables: best first, equal scores in list order
+static vector<CTxIn> RankByScan(CMasternodeMan& man, int mod, int64_t nBlockHeight)
+{
+    vector<CMasternode> vMasternodes = man.GetFullMasternodeVector();
+    vector<pair<unsigned int, CTxIn> > vScores;
+    BOOST_FOREACH(CMasternode& mn, vMasternodes)
+    {
+        if (!mn.IsEnabled())
+            continue;
+        uint256 n = mn.CalculateScore(mod, nBlockHeight);
+        unsigned int n2 = 0;
+        memcpy(&n2, &n, sizeof(n2));
+        vScores.push_back(make_pair(n2, mn.vin));
+    }
+    stable_sort(vScores.begin(), vScores.end(), CompareScoreDescending);
+
+    vector<CTxIn> vRanked;
+    for (unsigned int i = 0; i < vScores.size(); i++)
+        vRanked.push_back(vScores[i].second);
+    return vRanked;
+}
+
+// The rank table answers for nBlockHeight must match a full scan
+static void CheckRanksAgainstScan(CMasternodeMan& man, int64_t nBlockHeight)
+{
+    vector<CTxIn> vExpected = RankByScan(man, 1, nBlockHeight);
+    for (unsigned int i = 0; i < vExpected.size(); i++)
+    {
+        CMasternode* pmn = man.GetMasternodeByRank(i + 1, nBlockHeight, PROTOCOL_VERSION);
+        BOOST_REQUIRE(pmn != NULL);
+        BOOST_CHECK(pmn->vin == vExpected[i]);
+        BOOST_CHECK_EQUAL(man.GetMasternodeRank(vExpected[i], nBlockHeight, PROTOCOL_VERSION), (int)i + 1);
+    }
+    BOOST_CHECK(man.GetMasternodeByRank(vExpected.size() + 1, nBlockHeight, PROTOCOL_VERSION) == NULL);
+
+    CMasternode* pwinner = man.GetCurrentMasterNode(1, nBlockHeight, PROTOCOL_VERSION);
+    BOOST_REQUIRE(pwinner != NULL);
+    BOOST_CHECK(pwinner->vin == vExpected[0]);
+}
+
+BOOST_AUTO_TEST_SUITE(masternodeman_tests)
+
+BOOST_AUTO_TEST_CASE(masternodeman_indexes)
+{
+    CMasternodeMan man;
+    vector<CMasternode> vMasternodes;
+    for (int i = 1; i <= 5; i++)
+    {
+        vMasternodes.push_back(MakeMasternode(i));
+        BOOST_CHECK(man.Add(vMasternodes.back()));
+    }
+    BOOST_CHECK_EQUAL(man.size(), 5);
+
+    // The same collateral is never added twice
+    BOOST_CHECK(!man.Add(vMasternodes[2]));
+    BOOST_CHECK_EQUAL(man.size(), 5);
+
+    // Every index leads to the same entry
+    BOOST_FOREACH(const CMasternode& mn, vMasternodes)
+    {
+        CMasternode* pmn = man.Find(mn.vin);
+        BOOST_REQUIRE(pmn != NULL);
+        BOOST_CHECK(pmn->vin == mn.vin);
+        BOOST_CHECK(man.Find(mn.pubkey2) == pmn);
+        BOOST_CHECK(man.Find(mn.addr) == pmn);
+    }
+
+    // Removing an entry takes it out of every index
+    man.Remove(vMasternodes[1].vin);
+    BOOST_CHECK_EQUAL(man.size(), 4);
+    BOOST_CHECK(man.Find(vMasternodes[1].vin) == NULL);
+    BOOST_CHECK(man.Find(vMasternodes[1].pubkey2) == NULL);
+    BOOST_CHECK(man.Find(vMasternodes[1].addr) == NULL);
+    BOOST_CHECK(man.Find(vMasternodes[0].vin) != NULL);
+
+    // Entries that stopped pinging are dropped by CheckAndRemove
+    man.Find(vMasternodes[3].vin)->lastTimeSeen = GetAdjustedTime() - MASTERNODE_REMOVAL_SECONDS - 1;
+    man.CheckAndRemove();
+    BOOST_CHECK_EQUAL(man.size(), 3);
+    BOOST_CHECK(man.Find(vMasternodes[3].vin) == NULL);
+    BOOST_CHECK(man.Find(vMasternodes[3].addr) == NULL);
+
+    man.Clear();
+    BOOST_CHECK_EQUAL(man.size(), 0);
+    BOOST_CHECK(man.Find(vMasternodes[0].vin) == NULL);
+    BOOST_CHECK(man.FindRandom() == NULL);
+}
+
+BOOST_AUTO_TEST_CASE(masternodeman_find_random)
+{
+    CMasternodeMan man;
+    BOOST_CHECK(man.FindRandom() == NULL);
+
+    vector<CMasternode> vMasternodes;
+    for (int i = 1; i <= 5; i++)
+    {
+        vMasternodes.push_back(MakeMasternode(i));
+        man.Add(vMasternodes.back());
+    }
+    man.Remove(vMasternodes[0].vin);
+
+    // Only live entries come back, and given enough draws all of them do
+    set<COutPoint> setSeen;
+    for (int n = 0; n < 500; n++)
+    {
+        CMasternode* pmn = man.FindRandom();
+        BOOST_REQUIRE(pmn != NULL);
+        BOOST_CHECK(man.Find(pmn->vin) == pmn);
+        setSeen.insert(pmn->vin.prevout);
+    }
+    BOOST_CHECK_EQUAL(setSeen.size(), 4U);
+    BOOST_CHECK(!setSeen.count(vMasternodes[0].vin.prevout));
+}
+
+BOOST_AUTO_TEST_CASE(masternodeman_ranks_return_inputs)
+{
+    CFakeChain chain(100);
+    CMasternodeMan man;
+    set<COutPoint> setCollateral;
+    for (int i = 1; i <= 8; i++)
+    {
+        CMasternode mn = MakeMasternode(i);
+        man.Add(mn);
+        setCollateral.insert(mn.vin.prevout);
+    }
+
+    vector<pair<int, CTxIn> > vRanks = man.GetMasternodeRanks(90, PROTOCOL_VERSION);
+    BOOST_CHECK_EQUAL(vRanks.size(), 8U);
+    for (unsigned int i = 0; i < vRanks.size(); i++)
+    {
+        BOOST_CHECK_EQUAL(vRanks[i].first, (int)i + 1);
+        BOOST_CHECK(man.Find(vRanks[i].second) != NULL);
+        BOOST_CHECK(man.GetMasternodeByRank(i + 1, 90, PROTOCOL_VERSION)->vin == vRanks[i].second);
+    }
+
+    // The inputs are copies, so they stay valid after their entries are gone
+    man.Clear();
+    for (unsigned int i = 0; i < vRanks.size(); i++)
+        BOOST_CHECK(setCollateral.count(vRanks[i].second.prevout));
+    BOOST_CHECK(man.GetMasternodeRanks(90, PROTOCOL_VERSION).empty());
+}
+
+BOOST_AUTO_TEST_CASE(masternodeman_rank_tables_match_scan)
+{
+    CFakeChain chain(100);
+    CMasternodeMan man;
+    vector<CMasternode> vMasternodes;
+    for (int i = 1; i <= 12; i++)
+    {
+        vMasternodes.push_back(MakeMasternode(i));
+        man.Add(vMasternodes.back());
+    }
+
+    // Several heights, each asked twice so the second answer comes from the table
+    for (int64_t nHeight = 50; nHeight <= 60; nHeight++)
+    {
+        CheckRanksAgainstScan(man, nHeight);
+        CheckRanksAgainstScan(man, nHeight);
+    }
+
+    // Other moduli are scored on the fly and must still pick the scan's winner
+    for (int mod = 2; mod <= 4; mod++)
+    {
+        vector<CTxIn> vExpected = RankByScan(man, mod, 55);
+        CMasternode* pwinner = man.GetCurrentMasterNode(mod, 55, PROTOCOL_VERSION);
+        BOOST_REQUIRE(pwinner != NULL);
+        BOOST_CHECK(pwinner->vin == vExpected[0]);
+    }
+
+    // Unknown blocks have no ranks
+    BOOST_CHECK_EQUAL(man.GetMasternodeRank(vMasternodes[0].vin, 500, PROTOCOL_VERSION), -1);
+    BOOST_CHECK(man.GetCurrentMasterNode(1, 500, PROTOCOL_VERSION) == NULL);
+}
+
+BOOST_AUTO_TEST_CASE(masternodeman_rank_tables_follow_changes)
+{
+    CFakeChain chain(100);
+    CMasternodeMan man;
+    vector<CMasternode> vMasternodes;
+    for (int i = 1; i <= 8; i++)
+    {
+        vMasternodes.push_back(MakeMasternode(i));
+        man.Add(vMasternodes.back());
+    }
+    CheckRanksAgainstScan(man, 70);
+
+    // Expire the winner; Check() notices the state change and drops the tables
+    CTxIn vinWinner = man.GetCurrentMasterNode(1, 70, PROTOCOL_VERSION)->vin;
+    man.Find(vinWinner)->lastTimeSeen = GetAdjustedTime() - MASTERNODE_EXPIRATION_SECONDS - 1;
+    man.Check();
+    BOOST_CHECK_EQUAL(man.GetMasternodeRank(vinWinner, 70, PROTOCOL_VERSION), -1);
+    BOOST_CHECK(man.GetMasternodeRank(vinWinner, 70, PROTOCOL_VERSION, false) > 0);
+    CheckRanksAgainstScan(man, 70);
+    BOOST_CHECK(man.GetCurrentMasterNode(1, 70, PROTOCOL_VERSION)->vin != vinWinner);
+
+    // Added and removed entries show up in the next answer
+    CMasternode mnNew = MakeMasternode(20);
+    man.Add(mnNew);
+    BOOST_CHECK(man.GetMasternodeRank(mnNew.vin, 70, PROTOCOL_VERSION) > 0);
+    CheckRanksAgainstScan(man, 70);
+
+    man.Remove(mnNew.vin);
+    BOOST_CHECK_EQUAL(man.GetMasternodeRank(mnNew.vin, 70, PROTOCOL_VERSION), -1);
+    CheckRanksAgainstScan(man, 70);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
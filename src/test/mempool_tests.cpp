@@ -0,0 +1,137 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "txmempool.h"
+#include "util.h"
+
+using namespace std;
+
+// A one-in, one-out transaction spending output n of hashPrev
+static CTransaction MakeSpend(const uint256& hashPrev, unsigned int n, int64_t nValue)
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.hash = hashPrev;
+    tx.vin[0].prevout.n = n;
+    tx.vin[0].scriptSig << OP_1;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = nValue;
+    tx.vout[0].scriptPubKey << OP_TRUE;
+    return tx;
+}
+
+static void AddToPool(CTxMemPool& pool, CTransaction tx, int64_t nFee)
+{
+    pool.addUnchecked(tx.GetHash(), tx, nFee);
+}
+
+BOOST_AUTO_TEST_SUITE(mempool_tests)
+
+BOOST_AUTO_TEST_CASE(mempool_descendant_totals)
+{
+    CTxMemPool pool;
+    CTransaction txParent = MakeSpend(uint256(1), 0, 10 * COIN);
+    CTransaction txChild = MakeSpend(txParent.GetHash(), 0, 9 * COIN);
+    uint256 hashParent = txParent.GetHash();
+
+    AddToPool(pool, txParent, 1000);
+    AddToPool(pool, txChild, 50000);
+    BOOST_CHECK_EQUAL(pool.mapEntry.size(), 2U);
+    BOOST_CHECK_EQUAL(pool.setByEntryTime.size(), 2U);
+    BOOST_CHECK_EQUAL(pool.setByDescendantScore.size(), 2U);
+
+    const CTxMemPoolEntry& parent = pool.mapEntry[hashParent];
+    BOOST_CHECK_EQUAL(parent.nCountWithDescendants, 2U);
+    BOOST_CHECK_EQUAL(parent.nFeesWithDescendants, 51000);
+    BOOST_CHECK_EQUAL(parent.nSizeWithDescendants, parent.nTxSize + pool.mapEntry[txChild.GetHash()].nTxSize);
+    BOOST_CHECK(parent.GetDescendantScore() > parent.GetFeeRate());
+    BOOST_CHECK_EQUAL(pool.GetTotalTxSize(), parent.nSizeWithDescendants);
+
+    // Removing the child takes it out of the parent's totals again
+    pool.remove(txChild);
+    BOOST_CHECK_EQUAL(pool.mapEntry[hashParent].nCountWithDescendants, 1U);
+    BOOST_CHECK_EQUAL(pool.mapEntry[hashParent].nFeesWithDescendants, 1000);
+    BOOST_CHECK_EQUAL(pool.GetTotalTxSize(), pool.mapEntry[hashParent].nTxSize);
+
+    // A recursive remove leaves every index empty
+    AddToPool(pool, txChild, 50000);
+    pool.remove(txParent, true);
+    BOOST_CHECK(pool.mapTx.empty());
+    BOOST_CHECK(pool.mapEntry.empty());
+    BOOST_CHECK(pool.setByEntryTime.empty());
+    BOOST_CHECK(pool.setByDescendantScore.empty());
+    BOOST_CHECK_EQUAL(pool.GetTotalTxSize(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(mempool_trim_evicts_lowest_package)
+{
+    SetMockTime(GetTime());
+
+    CTxMemPool pool;
+    CTransaction txLow = MakeSpend(uint256(1), 0, COIN);
+    CTransaction txMid = MakeSpend(uint256(2), 0, COIN);
+    CTransaction txHigh = MakeSpend(uint256(3), 0, COIN);
+    // A parent paying nothing whose child pays for both
+    CTransaction txParent = MakeSpend(uint256(4), 0, COIN);
+    CTransaction txChild = MakeSpend(txParent.GetHash(), 0, COIN);
+
+    AddToPool(pool, txLow, 1000);
+    AddToPool(pool, txMid, 20000);
+    AddToPool(pool, txHigh, 100000);
+    AddToPool(pool, txParent, 0);
+    AddToPool(pool, txChild, 80000);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1000), 0);
+
+    unsigned int nTxSize = pool.mapEntry[txLow.GetHash()].nTxSize;
+    double dLowRate = pool.mapEntry[txLow.GetHash()].GetFeeRate();
+
+    // Room for four transactions: the cheapest one goes
+    pool.TrimToSize(pool.GetTotalTxSize() - 1);
+    BOOST_CHECK(!pool.exists(txLow.GetHash()));
+    BOOST_CHECK_EQUAL(pool.size(), 4U);
+    BOOST_CHECK(pool.GetTotalTxSize() <= 4U * nTxSize);
+
+    // The bar for new transactions is now above what was evicted
+    BOOST_CHECK(pool.GetMinFee(1000) >= (int64_t)dLowRate + MIN_RELAY_TX_FEE);
+
+    // The zero fee parent is carried by its child, so the mid fee one goes next
+    pool.TrimToSize(pool.GetTotalTxSize() - 1);
+    BOOST_CHECK(!pool.exists(txMid.GetHash()));
+    BOOST_CHECK(pool.exists(txParent.GetHash()));
+    BOOST_CHECK(pool.exists(txChild.GetHash()));
+    BOOST_CHECK(pool.exists(txHigh.GetHash()));
+
+    // The rolling minimum halves every ROLLING_FEE_HALFLIFE
+    int64_t nMinFee = pool.GetMinFee(1000);
+    SetMockTime(GetTime() + CTxMemPool::ROLLING_FEE_HALFLIFE);
+    int64_t nDecayed = pool.GetMinFee(1000);
+    BOOST_CHECK(nDecayed >= nMinFee / 2 - 1 && nDecayed <= nMinFee / 2 + 1);
+
+    SetMockTime(0);
+}
+
+BOOST_AUTO_TEST_CASE(mempool_expire)
+{
+    int64_t nStart = GetTime();
+    SetMockTime(nStart);
+
+    CTxMemPool pool;
+    CTransaction txOld = MakeSpend(uint256(1), 0, COIN);
+    CTransaction txOldChild = MakeSpend(txOld.GetHash(), 0, COIN);
+    CTransaction txNew = MakeSpend(uint256(2), 0, COIN);
+
+    AddToPool(pool, txOld, 1000);
+    SetMockTime(nStart + 100);
+    AddToPool(pool, txOldChild, 1000);
+    AddToPool(pool, txNew, 1000);
+
+    // Expiring the old parent takes its younger child with it
+    BOOST_CHECK_EQUAL(pool.Expire(nStart + 50), 1);
+    BOOST_CHECK_EQUAL(pool.size(), 1U);
+    BOOST_CHECK(pool.exists(txNew.GetHash()));
+    BOOST_CHECK_EQUAL(pool.Expire(nStart + 50), 0);
+
+    SetMockTime(0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
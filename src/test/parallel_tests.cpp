@@ -0,0 +1,213 @@
+#include <string>
+#include <vector>
+#include <boost/bind.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+#include "main.h"
+#include "parallel.h"
+#include "txdb.h"
+
+using namespace std;
+
+// Counts how often each index was visited and how many runs there were.
+// Runs happen on the workers, so nothing in here uses the test macros.
+class CRangeCounter
+{
+public:
+    vector<int> vVisits;
+    int nRuns;
+    bool fBadRun;
+    boost::mutex mutex;
+
+    CRangeCounter(size_t nCount) : vVisits(nCount, 0), nRuns(0), fBadRun(false) {}
+
+    void Run(size_t nBegin, size_t nEnd)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        nRuns++;
+        if (nBegin >= nEnd || nEnd > vVisits.size())
+        {
+            fBadRun = true;
+            return;
+        }
+        for (size_t i = nBegin; i < nEnd; i++)
+            vVisits[i]++;
+    }
+
+    bool AllVisitedOnce() const
+    {
+        if (fBadRun)
+            return false;
+        for (size_t i = 0; i < vVisits.size(); i++)
+            if (vVisits[i] != 1)
+                return false;
+        return true;
+    }
+};
+
+static void RunCounter(CRangeCounter* pcounter, size_t nMinPerRun)
+{
+    ParallelForRange(pcounter->vVisits.size(), nMinPerRun, boost::bind(&CRangeCounter::Run, pcounter, _1, _2));
+}
+
+static void CheckCovered(size_t nCount, size_t nMinPerRun)
+{
+    CRangeCounter counter(nCount);
+    RunCounter(&counter, nMinPerRun);
+    BOOST_CHECK(counter.AllVisitedOnce());
+    if (nCount == 0)
+        BOOST_CHECK_EQUAL(counter.nRuns, 0);
+    else
+        BOOST_CHECK(counter.nRuns >= 1 && (size_t)counter.nRuns <= nCount);
+}
+
+// Runs an inner ParallelForRange over each of its items
+static void NestedRun(vector<CRangeCounter*>* pvInner, size_t nBegin, size_t nEnd)
+{
+    for (size_t i = nBegin; i < nEnd; i++)
+        RunCounter((*pvInner)[i], 1);
+}
+
+// The raw record LoadBlockIndex reads for a made-up block index entry
+static string MakeBlockIndexRecord(unsigned int n)
+{
+    CDiskBlockIndex diskindex;
+    diskindex.nVersion = 7;
+    diskindex.hashPrev = Hash(BEGIN(n), END(n));
+    diskindex.hashNext = n + 1;
+    diskindex.hashMerkleRoot = n * 31 + 5;
+    diskindex.nTime = 1500000000 + n * 60;
+    diskindex.nBits = 0x1d00ffff;
+    diskindex.nNonce = n * 7919;
+    diskindex.nFile = 1;
+    diskindex.nBlockPos = n * 200;
+    diskindex.nHeight = n;
+    diskindex.nStakeModifier = n * 1000003ULL;
+    diskindex.hashProof = n;
+    if (n % 2)
+    {
+        diskindex.nFlags = CBlockIndex::BLOCK_PROOF_OF_STAKE;
+        diskindex.prevoutStake = COutPoint(n * 3, n % 5);
+        diskindex.nStakeTime = diskindex.nTime;
+    }
+
+    CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+    ssValue << diskindex;
+    return ssValue.str();
+}
+
+BOOST_AUTO_TEST_SUITE(parallel_tests)
+
+BOOST_AUTO_TEST_CASE(parallel_for_range_inline)
+{
+    // Without workers the whole range is one run on this thread
+    const size_t vCount[] = {0, 1, 2, 100, 10007};
+    for (unsigned int i = 0; i < sizeof(vCount) / sizeof(vCount[0]); i++)
+    {
+        CRangeCounter counter(vCount[i]);
+        RunCounter(&counter, 1);
+        BOOST_CHECK(counter.AllVisitedOnce());
+        BOOST_CHECK_EQUAL(counter.nRuns, vCount[i] ? 1 : 0);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(parallel_for_range_workers)
+{
+    boost::thread_group threads;
+    for (int i = 0; i < 3; i++)
+        threads.create_thread(&ThreadParallelWorker);
+
+    // Every index exactly once, whatever the split
+    const size_t vCount[] = {0, 1, 2, 3, 7, 100, 1000, 10007};
+    const size_t vMinPerRun[] = {0, 1, 4, 256};
+    for (int nRound = 0; nRound < 5; nRound++)
+        for (unsigned int i = 0; i < sizeof(vCount) / sizeof(vCount[0]); i++)
+            for (unsigned int j = 0; j < sizeof(vMinPerRun) / sizeof(vMinPerRun[0]); j++)
+                CheckCovered(vCount[i], vMinPerRun[j]);
+
+    // Calls from inside a run fall back to running inline
+    vector<CRangeCounter*> vInner;
+    for (int i = 0; i < 64; i++)
+        vInner.push_back(new CRangeCounter(50 + i));
+    ParallelForRange(vInner.size(), 1, boost::bind(&NestedRun, &vInner, _1, _2));
+    BOOST_FOREACH(CRangeCounter* pcounter, vInner)
+    {
+        BOOST_CHECK(pcounter->AllVisitedOnce());
+        delete pcounter;
+    }
+
+    threads.interrupt_all();
+    threads.join_all();
+}
+
+BOOST_AUTO_TEST_CASE(parallel_for_range_concurrent_callers)
+{
+    boost::thread_group threads;
+    for (int i = 0; i < 2; i++)
+        threads.create_thread(&ThreadParallelWorker);
+
+    // Callers that find the pool busy run inline; none of them loses items
+    vector<CRangeCounter*> vCounters;
+    boost::thread_group callers;
+    for (int i = 0; i < 4; i++)
+    {
+        vCounters.push_back(new CRangeCounter(5000 + i));
+        callers.create_thread(boost::bind(&RunCounter, vCounters.back(), 1));
+    }
+    callers.join_all();
+    BOOST_FOREACH(CRangeCounter* pcounter, vCounters)
+    {
+        BOOST_CHECK(pcounter->AllVisitedOnce());
+        delete pcounter;
+    }
+
+    threads.interrupt_all();
+    threads.join_all();
+}
+
+BOOST_AUTO_TEST_CASE(decode_block_index_batch_matches_serial)
+{
+    boost::thread_group threads;
+    for (int i = 0; i < 3; i++)
+        threads.create_thread(&ThreadParallelWorker);
+
+    vector<string> vValues;
+    for (unsigned int n = 0; n < 3000; n++)
+        vValues.push_back(MakeBlockIndexRecord(n));
+
+    vector<CDiskBlockIndex> vDiskIndex;
+    vector<uint256> vHashes;
+    BOOST_CHECK(DecodeBlockIndexBatch(vValues, vDiskIndex, vHashes));
+    BOOST_REQUIRE_EQUAL(vDiskIndex.size(), vValues.size());
+    BOOST_REQUIRE_EQUAL(vHashes.size(), vValues.size());
+
+    // Decoding one record at a time, as the loader used to, gives the same
+    for (unsigned int i = 0; i < vValues.size(); i++)
+    {
+        CDiskBlockIndex diskindex;
+        CDataStream ssValue(vValues[i].data(), vValues[i].data() + vValues[i].size(), SER_DISK, CLIENT_VERSION);
+        ssValue >> diskindex;
+
+        BOOST_CHECK(vHashes[i] == diskindex.GetBlockHash());
+        BOOST_CHECK(vDiskIndex[i].hashPrev == diskindex.hashPrev);
+        BOOST_CHECK(vDiskIndex[i].prevoutStake == diskindex.prevoutStake);
+        BOOST_CHECK_EQUAL(vDiskIndex[i].nHeight, diskindex.nHeight);
+        BOOST_CHECK_EQUAL(vDiskIndex[i].nFlags, diskindex.nFlags);
+        BOOST_CHECK_EQUAL(vDiskIndex[i].nStakeModifier, diskindex.nStakeModifier);
+
+        CDataStream ssBatch(SER_DISK, CLIENT_VERSION), ssSerial(SER_DISK, CLIENT_VERSION);
+        ssBatch << vDiskIndex[i];
+        ssSerial << diskindex;
+        BOOST_CHECK(ssBatch.str() == ssSerial.str());
+    }
+
+    // One truncated record fails the batch
+    vValues[1234].resize(vValues[1234].size() / 2);
+    BOOST_CHECK(!DecodeBlockIndexBatch(vValues, vDiskIndex, vHashes));
+
+    threads.interrupt_all();
+    threads.join_all();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
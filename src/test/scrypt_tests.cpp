@@ -0,0 +1,56 @@
+#include <string>
+#include <vector>
+#include <boost/test/unit_test.hpp>
+
+#include "scrypt.h"
+#include "uint256.h"
+
+using namespace std;
+
+// nCount distinct 80 byte headers, varied by nSeed
+static vector<unsigned char> MakeHeaders(size_t nCount, unsigned int nSeed)
+{
+    vector<unsigned char> vHeaders(nCount * 80);
+    for (size_t i = 0; i < vHeaders.size(); i++)
+        vHeaders[i] = (unsigned char)(i * 13 + nSeed * 101 + (i >> 8));
+    return vHeaders;
+}
+
+BOOST_AUTO_TEST_SUITE(scrypt_tests)
+
+BOOST_AUTO_TEST_CASE(scrypt_implementation_name)
+{
+    string strImpl = scrypt_implementation();
+    BOOST_CHECK(strImpl == "generic" || strImpl == "sse2" || strImpl == "avx2");
+}
+
+BOOST_AUTO_TEST_CASE(scrypt_blockhash_many_matches_scalar)
+{
+    // Counts that leave every remainder after groups of 4 (SSE2) and 8 (AVX2)
+    for (size_t nCount = 1; nCount <= 17; nCount++)
+    {
+        vector<unsigned char> vHeaders = MakeHeaders(nCount, nCount);
+        vector<uint256> vHash(nCount);
+        scrypt_blockhash_many(&vHeaders[0], nCount, &vHash[0]);
+
+        for (size_t i = 0; i < nCount; i++)
+            BOOST_CHECK_EQUAL(vHash[i].ToString(), scrypt_hash(&vHeaders[i * 80], 80).ToString());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(scrypt_blockhash_uses_remembered_results)
+{
+    vector<unsigned char> vHeaders = MakeHeaders(12, 1000);
+    vector<uint256> vHash(12);
+    scrypt_blockhash_many(&vHeaders[0], 12, &vHash[0]);
+
+    // Remembered or not, scrypt_blockhash gives the scalar result
+    for (size_t i = 0; i < 12; i++)
+        BOOST_CHECK(scrypt_blockhash(&vHeaders[i * 80]) == vHash[i]);
+
+    vector<unsigned char> vOther = MakeHeaders(1, 2000);
+    BOOST_CHECK(scrypt_blockhash(&vOther[0]) == scrypt_hash(&vOther[0], 80));
+    BOOST_CHECK(scrypt_blockhash(&vOther[0]) == scrypt_hash(&vOther[0], 80));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
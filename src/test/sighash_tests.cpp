@@ -0,0 +1,92 @@
+#include <vector>
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "script.h"
+#include "util.h"
+
+using namespace std;
+
+extern uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const CSigHashCache* psighashcache);
+
+static void RandomScript(CScript& script)
+{
+    static const opcodetype oplist[] = {OP_FALSE, OP_1, OP_2, OP_3, OP_CHECKSIG, OP_IF, OP_VERIF, OP_RETURN, OP_CODESEPARATOR};
+    script = CScript();
+    int ops = GetRandInt(10);
+    for (int i = 0; i < ops; i++)
+        script << oplist[GetRandInt(sizeof(oplist) / sizeof(oplist[0]))];
+}
+
+static void RandomTransaction(CTransaction& tx, bool fSingle)
+{
+    tx.nVersion = GetRandInt(3);
+    tx.nTime = GetRandInt(2000000000);
+    tx.vin.clear();
+    tx.vout.clear();
+    tx.nLockTime = (GetRandInt(2)) ? GetRandInt(500000000) : 0;
+    int ins = GetRandInt(4) + 1;
+    int outs = fSingle ? ins : GetRandInt(4) + 1;
+    for (int in = 0; in < ins; in++)
+    {
+        tx.vin.push_back(CTxIn());
+        CTxIn& txin = tx.vin.back();
+        txin.prevout.hash = GetRandHash();
+        txin.prevout.n = GetRandInt(4);
+        RandomScript(txin.scriptSig);
+        txin.nSequence = (GetRandInt(2)) ? GetRandInt(1000000) : (unsigned int)-1;
+    }
+    for (int out = 0; out < outs; out++)
+    {
+        tx.vout.push_back(CTxOut());
+        CTxOut& txout = tx.vout.back();
+        txout.nValue = GetRandInt(100000000);
+        RandomScript(txout.scriptPubKey);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(sighash_tests)
+
+// The shared midstates must give exactly the digest of the plain
+// serialization, and every hash type the cache doesn't handle must fall
+// through to it
+BOOST_AUTO_TEST_CASE(sighashcache_matches_signaturehash)
+{
+    static const int hashtypes[] = {
+        SIGHASH_ALL, SIGHASH_NONE, SIGHASH_SINGLE,
+        SIGHASH_ALL | SIGHASH_ANYONECANPAY, SIGHASH_NONE | SIGHASH_ANYONECANPAY, SIGHASH_SINGLE | SIGHASH_ANYONECANPAY,
+        0, 4, 0x41, 0x21, 0x7f, 0xff, 0x101
+    };
+
+    for (int i = 0; i < 200; i++)
+    {
+        CTransaction tx;
+        RandomTransaction(tx, (i % 3) == 0);
+        CSigHashCache cache(tx);
+
+        for (unsigned int nIn = 0; nIn < tx.vin.size(); nIn++)
+        {
+            CScript scriptCode;
+            RandomScript(scriptCode);
+
+            for (unsigned int j = 0; j < sizeof(hashtypes) / sizeof(hashtypes[0]); j++)
+            {
+                int nHashType = hashtypes[j];
+                uint256 hashPlain = SignatureHash(scriptCode, tx, nIn, nHashType, NULL);
+                uint256 hashCached = SignatureHash(scriptCode, tx, nIn, nHashType, &cache);
+                BOOST_CHECK_MESSAGE(hashPlain == hashCached, strprintf("nIn=%u nHashType=%d", nIn, nHashType));
+
+                uint256 hashDirect;
+                bool fHandled = cache.SignatureHash(scriptCode, nIn, nHashType, hashDirect);
+                BOOST_CHECK_EQUAL(fHandled, nHashType == SIGHASH_ALL);
+                if (fHandled && scriptCode.Find(OP_CODESEPARATOR) == 0)
+                    BOOST_CHECK(hashDirect == hashPlain);
+            }
+        }
+
+        uint256 hashUnused;
+        BOOST_CHECK(!cache.SignatureHash(CScript(), tx.vin.size(), SIGHASH_ALL, hashUnused));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,265 @@
+#include <map>
+#include <string>
+#include <vector>
+#include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+#include "base58.h"
+#include "init.h"
+#include "parallel.h"
+#include "smessage.h"
+#include "util.h"
+#include "wallet.h"
+
+using namespace std;
+
+// Secure messaging against an in-memory wallet and a throwaway data directory
+struct SmsgTestingSetup
+{
+    boost::filesystem::path pathTemp;
+
+    SmsgTestingSetup()
+    {
+        pathTemp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("test_harvest_smsg_%%%%-%%%%");
+        boost::filesystem::create_directories(pathTemp);
+        mapArgs["-datadir"] = pathTemp.string();
+        ClearDatadirCache();
+
+        pwalletMain = new CWallet();
+        fSecMsgEnabled = true;
+    }
+
+    ~SmsgTestingSetup()
+    {
+        // Drops the addresses, the cached scan keys and the inbox db
+        SecureMsgDisable();
+
+        delete pwalletMain;
+        pwalletMain = NULL;
+        mapArgs.erase("-datadir");
+        ClearDatadirCache();
+        boost::filesystem::remove_all(pathTemp);
+    }
+};
+
+// A new key in the wallet, returned as its address
+static string AddWalletKey()
+{
+    CKey key;
+    key.MakeNewKey(true);
+    {
+        LOCK(pwalletMain->cs_wallet);
+        BOOST_CHECK(pwalletMain->AddKeyPubKey(key, key.GetPubKey()));
+    }
+    return CHarvestcoinAddress(key.GetPubKey().GetID()).ToString();
+}
+
+// Header and payload of a message from addressFrom to addressTo, back to back
+static vector<uint8_t> MakeMessage(const string& addressFrom, const string& addressTo, const string& message)
+{
+    SecureMessage smsg;
+    BOOST_CHECK_EQUAL(SecureMsgEncrypt(smsg, addressFrom, addressTo, message), 0);
+
+    vector<uint8_t> vchMessage(SMSG_HDR_LEN + smsg.nPayload);
+    memcpy(&vchMessage[0], &smsg.hash[0], SMSG_HDR_LEN);
+    memcpy(&vchMessage[SMSG_HDR_LEN], smsg.pPayload, smsg.nPayload);
+    return vchMessage;
+}
+
+static uint32_t PayloadSize(const vector<uint8_t>& vchMessage)
+{
+    return ((SecureMessage*) &vchMessage[0])->nPayload;
+}
+
+// The inbox address for a message found by trial decrypting it with every
+// receiving address in turn, as done before the scan keys were cached
+static string ScanByDecrypt(vector<uint8_t>& vchMessage)
+{
+    uint8_t* pHeader = &vchMessage[0];
+    uint8_t* pPayload = &vchMessage[SMSG_HDR_LEN];
+    uint32_t nPayload = PayloadSize(vchMessage);
+
+    for (unsigned int i = 0; i < smsgAddresses.size(); i++)
+    {
+        if (!smsgAddresses[i].fReceiveEnabled)
+            continue;
+
+        string address = smsgAddresses[i].sAddress;
+        MessageData msg;
+        if (SecureMsgDecrypt(true, address, pHeader, pPayload, nPayload, msg) != 0)
+            continue;
+
+        if (smsgAddresses[i].fReceiveAnon)
+            return address;
+
+        if (SecureMsgDecrypt(false, address, pHeader, pPayload, nPayload, msg) != 0
+            || msg.sFromAddress == "anon")
+            return "";
+        return address;
+    }
+    return "";
+}
+
+static void RecordInbox(map<vector<uint8_t>, string>* pmapInbox, SecMsgStored& inboxHdr)
+{
+    (*pmapInbox)[inboxHdr.vchMessage] = inboxHdr.sAddrTo;
+}
+
+// Every message in the inbox db, with the address it was received on
+static map<vector<uint8_t>, string> ReadInbox()
+{
+    map<vector<uint8_t>, string> mapInbox;
+
+    LOCK(cs_smsgDB);
+    SecMsgDB dbInbox;
+    BOOST_REQUIRE(dbInbox.Open("cw"));
+
+    string sPrefix("im");
+    uint8_t chKey[18];
+    SecMsgStored smsgStored;
+    leveldb::Iterator* it = dbInbox.pdb->NewIterator(leveldb::ReadOptions());
+    while (dbInbox.NextSmesg(it, sPrefix, chKey, smsgStored))
+        mapInbox[smsgStored.vchMessage] = smsgStored.sAddrTo;
+    delete it;
+
+    return mapInbox;
+}
+
+// Scan each message with SecureMsgScanMessage and check it lands where trial
+// decryption says it should
+static void CheckScanAgainstDecrypt(vector<vector<uint8_t> >& vMessages)
+{
+    map<vector<uint8_t>, string> mapInbox;
+    boost::signals2::connection conn = NotifySecMsgInboxChanged.connect(boost::bind(&RecordInbox, &mapInbox, _1));
+
+    for (unsigned int i = 0; i < vMessages.size(); i++)
+    {
+        vector<uint8_t>& vchMessage = vMessages[i];
+        BOOST_CHECK_EQUAL(SecureMsgScanMessage(&vchMessage[0], &vchMessage[SMSG_HDR_LEN], PayloadSize(vchMessage), true), 0);
+
+        string sExpected = ScanByDecrypt(vchMessage);
+        if (sExpected.empty())
+            BOOST_CHECK(!mapInbox.count(vchMessage));
+        else
+            BOOST_CHECK_EQUAL(mapInbox[vchMessage], sExpected);
+    }
+
+    conn.disconnect();
+}
+
+BOOST_FIXTURE_TEST_SUITE(smessage_tests, SmsgTestingSetup)
+
+BOOST_AUTO_TEST_CASE(smsg_scan_matches_decrypt)
+{
+    // Receiving with and without anon, a disabled address, a wallet key that
+    // is not listed, and a sender
+    string addrAnon = AddWalletKey();
+    string addrNoAnon = AddWalletKey();
+    string addrDisabled = AddWalletKey();
+    string addrUnlisted = AddWalletKey();
+    string addrFrom = AddWalletKey();
+    {
+        LOCK(cs_smsg);
+        smsgAddresses.push_back(SecMsgAddress(addrAnon, true, true));
+        smsgAddresses.push_back(SecMsgAddress(addrNoAnon, true, false));
+        smsgAddresses.push_back(SecMsgAddress(addrDisabled, false, true));
+    }
+
+    const string vTo[] = {addrAnon, addrNoAnon, addrDisabled, addrUnlisted};
+    vector<vector<uint8_t> > vMessages;
+    for (unsigned int i = 0; i < sizeof(vTo) / sizeof(vTo[0]); i++)
+    {
+        vMessages.push_back(MakeMessage("anon", vTo[i], strprintf("anon to %u", i)));
+        vMessages.push_back(MakeMessage(addrFrom, vTo[i], strprintf("signed to %u", i)));
+    }
+    CheckScanAgainstDecrypt(vMessages);
+
+    // Only the messages to the receiving addresses, anon ones where allowed
+    map<vector<uint8_t>, string> mapInbox = ReadInbox();
+    BOOST_CHECK_EQUAL(mapInbox.size(), 3U);
+    BOOST_CHECK_EQUAL(mapInbox[vMessages[0]], addrAnon);
+    BOOST_CHECK_EQUAL(mapInbox[vMessages[1]], addrAnon);
+    BOOST_CHECK_EQUAL(mapInbox[vMessages[3]], addrNoAnon);
+
+    // Changing an address's settings is seen by the next scan
+    {
+        LOCK(cs_smsg);
+        smsgAddresses[1].fReceiveEnabled = false;
+        smsgAddresses[2].fReceiveEnabled = true;
+    }
+    vMessages.clear();
+    for (unsigned int i = 0; i < sizeof(vTo) / sizeof(vTo[0]); i++)
+        vMessages.push_back(MakeMessage(addrFrom, vTo[i], strprintf("again to %u", i)));
+    CheckScanAgainstDecrypt(vMessages);
+    BOOST_CHECK_EQUAL(ReadInbox().size(), 5U);
+
+    // So is a new address from the address book
+    string addrNew = AddWalletKey();
+    SecureMsgWalletKeyChanged(addrNew, "", CT_NEW);
+    vMessages.clear();
+    vMessages.push_back(MakeMessage(addrFrom, addrNew, "to the new address"));
+    CheckScanAgainstDecrypt(vMessages);
+    BOOST_CHECK_EQUAL(ReadInbox()[vMessages[0]], addrNew);
+
+    // And a deleted one stops receiving
+    SecureMsgWalletKeyChanged(addrNew, "", CT_DELETED);
+    vMessages.clear();
+    vMessages.push_back(MakeMessage(addrFrom, addrNew, "after delete"));
+    CheckScanAgainstDecrypt(vMessages);
+    BOOST_CHECK(!ReadInbox().count(vMessages[0]));
+}
+
+BOOST_AUTO_TEST_CASE(smsg_stored_file_scan_matches_decrypt)
+{
+    boost::thread_group threads;
+    for (int i = 0; i < 3; i++)
+        threads.create_thread(&ThreadParallelWorker);
+
+    vector<string> vTo;
+    for (int i = 0; i < 4; i++)
+        vTo.push_back(AddWalletKey());
+    string addrFrom = AddWalletKey();
+    {
+        LOCK(cs_smsg);
+        smsgAddresses.push_back(SecMsgAddress(vTo[0], true, true));
+        smsgAddresses.push_back(SecMsgAddress(vTo[1], true, false));
+        smsgAddresses.push_back(SecMsgAddress(vTo[2], false, true));
+    }
+
+    // Enough messages for the trial decryptions to be split over the pool,
+    // stored as if they arrived while the wallet was locked
+    vector<vector<uint8_t> > vMessages;
+    for (unsigned int i = 0; i < 40; i++)
+    {
+        string addressFrom = (i % 3 == 0) ? "anon" : addrFrom;
+        vMessages.push_back(MakeMessage(addressFrom, vTo[i % vTo.size()], strprintf("message %u", i)));
+        vector<uint8_t>& vchMessage = vMessages.back();
+        BOOST_CHECK_EQUAL(SecureMsgStoreUnscanned(&vchMessage[0], &vchMessage[SMSG_HDR_LEN], PayloadSize(vchMessage)), 0);
+    }
+
+    // Unlocking scans the stored file in one batch
+    BOOST_CHECK_EQUAL(SecureMsgWalletUnlocked(), 0);
+
+    map<vector<uint8_t>, string> mapInbox = ReadInbox();
+    unsigned int nExpected = 0;
+    for (unsigned int i = 0; i < vMessages.size(); i++)
+    {
+        string sExpected = ScanByDecrypt(vMessages[i]);
+        if (sExpected.empty())
+        {
+            BOOST_CHECK(!mapInbox.count(vMessages[i]));
+            continue;
+        }
+        nExpected++;
+        BOOST_CHECK_EQUAL(mapInbox[vMessages[i]], sExpected);
+    }
+    BOOST_CHECK_EQUAL(mapInbox.size(), nExpected);
+    BOOST_CHECK(nExpected > 0 && nExpected < vMessages.size());
+
+    threads.interrupt_all();
+    threads.join_all();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,182 @@
+#include <set>
+#include <vector>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+#include "main.h"
+#include "parallel.h"
+#include "stealth.h"
+#include "wallet.h"
+
+using namespace std;
+
+// An owned stealth address with fresh scan and spend keys
+static CStealthAddress MakeStealthAddress()
+{
+    ec_secret scan_secret, spend_secret;
+    BOOST_REQUIRE(GenerateRandomSecret(scan_secret) == 0 && GenerateRandomSecret(spend_secret) == 0);
+
+    CStealthAddress sxAddr;
+    BOOST_REQUIRE(SecretToPublicKey(scan_secret, sxAddr.scan_pubkey) == 0);
+    BOOST_REQUIRE(SecretToPublicKey(spend_secret, sxAddr.spend_pubkey) == 0);
+    sxAddr.scan_secret.assign(&scan_secret.e[0], &scan_secret.e[0] + ec_secret_size);
+    sxAddr.spend_secret.assign(&spend_secret.e[0], &spend_secret.e[0] + ec_secret_size);
+    return sxAddr;
+}
+
+// A payment to sxAddr as SendStealthMoneyToDestination makes it, with the
+// key the recipient should end up holding for it
+static CTransaction MakeStealthPayment(const CStealthAddress& sxAddr, unsigned int nLockTime, CKey& keyExpected)
+{
+    ec_secret ephem_secret, secretShared;
+    ec_point pkSendTo, ephem_pubkey;
+    ec_point scan_pubkey = sxAddr.scan_pubkey;
+    BOOST_REQUIRE(GenerateRandomSecret(ephem_secret) == 0);
+    BOOST_REQUIRE(StealthSecret(ephem_secret, scan_pubkey, sxAddr.spend_pubkey, secretShared, pkSendTo) == 0);
+    BOOST_REQUIRE(SecretToPublicKey(ephem_secret, ephem_pubkey) == 0);
+
+    CTransaction tx;
+    tx.nLockTime = nLockTime;
+    tx.vout.resize(2);
+    tx.vout[0].nValue = 1000;
+    tx.vout[0].scriptPubKey.SetDestination(CPubKey(pkSendTo).GetID());
+    tx.vout[1].scriptPubKey = CScript() << OP_RETURN << ephem_pubkey;
+
+    // The recipient's side, worked out directly from the address's secrets
+    if (sxAddr.scan_secret.size() == ec_secret_size)
+    {
+        ec_secret scan_secret, spend_secret, secretSpend;
+        memcpy(&scan_secret.e[0], &sxAddr.scan_secret[0], ec_secret_size);
+        memcpy(&spend_secret.e[0], &sxAddr.spend_secret[0], ec_secret_size);
+        BOOST_REQUIRE(StealthSecretSpend(scan_secret, ephem_pubkey, spend_secret, secretSpend) == 0);
+        keyExpected.Set(&secretSpend.e[0], &secretSpend.e[0] + ec_secret_size, true);
+        BOOST_CHECK(keyExpected.GetPubKey().GetID() == CPubKey(pkSendTo).GetID());
+    }
+    return tx;
+}
+
+static void ResetStealthCounts(CWallet& wallet)
+{
+    wallet.nStealth = 0;
+    wallet.nFoundStealth = 0;
+}
+
+BOOST_AUTO_TEST_SUITE(stealth_tests)
+
+BOOST_AUTO_TEST_CASE(stealth_precomputed_secrets_match_scalar)
+{
+    boost::thread_group threads;
+    for (int i = 0; i < 3; i++)
+        threads.create_thread(&ThreadParallelWorker);
+
+    // Two owned stealth addresses, in two wallets that scan the same block
+    // with and without the secrets worked out ahead
+    CStealthAddress sxOwned[2] = {MakeStealthAddress(), MakeStealthAddress()};
+    CStealthAddress sxForeign = MakeStealthAddress();
+    sxForeign.scan_secret.clear();
+    sxForeign.spend_secret.clear();
+
+    CWallet walletPrecomputed, walletScalar;
+    for (int i = 0; i < 2; i++)
+    {
+        walletPrecomputed.stealthAddresses.insert(sxOwned[i]);
+        walletScalar.stealthAddresses.insert(sxOwned[i]);
+    }
+    ResetStealthCounts(walletPrecomputed);
+    ResetStealthCounts(walletScalar);
+
+    // Payments to both owned addresses and to one we don't own
+    CBlock block;
+    vector<CKey> vKeyExpected;
+    set<CKeyID> setForeign;
+    for (unsigned int i = 0; i < 12; i++)
+    {
+        CKey keyExpected;
+        if (i % 3 == 2)
+        {
+            block.vtx.push_back(MakeStealthPayment(sxForeign, i, keyExpected));
+            CTxDestination address;
+            BOOST_REQUIRE(ExtractDestination(block.vtx.back().vout[0].scriptPubKey, address));
+            setForeign.insert(boost::get<CKeyID>(address));
+            continue;
+        }
+        block.vtx.push_back(MakeStealthPayment(sxOwned[i % 3], i, keyExpected));
+        vKeyExpected.push_back(keyExpected);
+    }
+
+    CStealthBlockSecrets secrets;
+    walletPrecomputed.PrecomputeStealthSecrets(block, secrets);
+    BOOST_CHECK_EQUAL(secrets.vScanKeys.size(), 2U);
+    BOOST_CHECK_EQUAL(secrets.mapSecrets.size(), block.vtx.size());
+
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+    {
+        mapValue_t mapNarr;
+        walletPrecomputed.FindStealthTransactions(tx, mapNarr, &secrets);
+        walletScalar.FindStealthTransactions(tx, mapNarr);
+    }
+
+    // Both found every owned payment and nothing else, with the same keys
+    BOOST_CHECK_EQUAL(walletPrecomputed.nStealth, block.vtx.size());
+    BOOST_CHECK_EQUAL(walletPrecomputed.nFoundStealth, vKeyExpected.size());
+    BOOST_CHECK_EQUAL(walletScalar.nFoundStealth, vKeyExpected.size());
+
+    set<CKeyID> setPrecomputed, setScalar;
+    walletPrecomputed.GetKeys(setPrecomputed);
+    walletScalar.GetKeys(setScalar);
+    BOOST_CHECK(setPrecomputed == setScalar);
+    BOOST_CHECK_EQUAL(setPrecomputed.size(), vKeyExpected.size());
+
+    BOOST_FOREACH(const CKey& keyExpected, vKeyExpected)
+    {
+        CKeyID keyID = keyExpected.GetPubKey().GetID();
+        CKey keyPrecomputed, keyScalar;
+        BOOST_REQUIRE(walletPrecomputed.GetKey(keyID, keyPrecomputed));
+        BOOST_REQUIRE(walletScalar.GetKey(keyID, keyScalar));
+        BOOST_CHECK(keyPrecomputed.GetPrivKey() == keyExpected.GetPrivKey());
+        BOOST_CHECK(keyScalar.GetPrivKey() == keyExpected.GetPrivKey());
+    }
+    BOOST_FOREACH(const CKeyID& keyID, setForeign)
+        BOOST_CHECK(!walletPrecomputed.HaveKey(keyID));
+
+    // Clear() drops every scan key and secret
+    secrets.Clear();
+    BOOST_CHECK(secrets.vScanKeys.empty());
+    BOOST_CHECK(secrets.mapSecrets.empty());
+
+    threads.interrupt_all();
+    threads.join_all();
+}
+
+BOOST_AUTO_TEST_CASE(stealth_secrets_of_other_block_fall_back)
+{
+    CStealthAddress sxOwned = MakeStealthAddress();
+    CWallet wallet;
+    wallet.stealthAddresses.insert(sxOwned);
+    ResetStealthCounts(wallet);
+
+    CKey keyOther, keyExpected;
+    CBlock blockOther;
+    blockOther.vtx.push_back(MakeStealthPayment(sxOwned, 1, keyOther));
+    CTransaction tx = MakeStealthPayment(sxOwned, 2, keyExpected);
+
+    // Secrets worked out for another block don't cover tx, so it's scanned
+    // the scalar way and still found
+    CStealthBlockSecrets secrets;
+    wallet.PrecomputeStealthSecrets(blockOther, secrets);
+    BOOST_CHECK_EQUAL(secrets.mapSecrets.size(), 1U);
+
+    mapValue_t mapNarr;
+    wallet.FindStealthTransactions(tx, mapNarr, &secrets);
+    BOOST_CHECK_EQUAL(wallet.nFoundStealth, 1U);
+    BOOST_CHECK(wallet.HaveKey(keyExpected.GetPubKey().GetID()));
+    BOOST_CHECK(!wallet.HaveKey(keyOther.GetPubKey().GetID()));
+
+    // A wallet without stealth addresses has nothing to work out
+    CWallet walletEmpty;
+    walletEmpty.PrecomputeStealthSecrets(blockOther, secrets);
+    BOOST_CHECK(secrets.vScanKeys.empty());
+    BOOST_CHECK(secrets.mapSecrets.empty());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,18 @@
+#define BOOST_TEST_MODULE Harvest Test Suite
+#include <boost/test/unit_test.hpp>
+
+#include "chainparams.h"
+#include "main.h"
+#include "util.h"
+
+extern void noui_connect();
+
+struct TestingSetup {
+    TestingSetup() {
+        fPrintToDebugLog = false; // don't want to write to debug.log file
+        noui_connect();
+        SelectParams(CChainParams::MAIN);
+    }
+};
+
+BOOST_GLOBAL_FIXTURE(TestingSetup);
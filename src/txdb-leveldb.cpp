@@ -3,11 +3,17 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file license.txt or http://www.opensource.org/licenses/mit-license.php.
 
+#include <list>
 #include <map>
+#include <set>
 
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
 #include <boost/version.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/unordered_map.hpp>
 
 #include <leveldb/env.h>
 #include <leveldb/cache.h>
@@ -20,20 +26,274 @@
 #include "util.h"
 #include "main.h"
 #include "chainparams.h"
+#include "parallel.h"
 
 using namespace std;
 using namespace boost;
 
 leveldb::DB *txdb; // global pointer for LevelDB object instance
 
+// Write-back cache in front of txdb, keyed by serialized key. An entry is
+// either a value or a known-absent key (fErased), and is dirty while it
+// still has to be written to LevelDB. itLRU is its place in the recency list.
+struct CTxDBCacheEntry
+{
+    std::string strValue;
+    bool fErased;
+    bool fDirty;
+    std::list<const std::string*>::iterator itLRU;
+
+    CTxDBCacheEntry() : fErased(false), fDirty(false) {}
+};
+
+// Rough per-entry bookkeeping overhead of the hash map and recency list, in bytes
+static const size_t TXDB_CACHE_ENTRY_OVERHEAD = 128;
+
+static CCriticalSection cs_txdbcache;
+static boost::unordered_map<std::string, CTxDBCacheEntry> mapTxDBCache;
+// Dirty keys of the record types that are read by range (the address index),
+// in key order, so a range scan can merge them with LevelDB without a flush.
+static std::set<std::string> setTxDBCacheDirtyRanged;
+// Keys of every cache entry, least recently used first. They point at the
+// keys in mapTxDBCache, whose nodes don't move on rehash.
+static std::list<const std::string*> listTxDBCacheLRU;
+static size_t nTxDBCacheUsage = 0;
+static size_t nTxDBCacheDirty = 0;
+static int64_t nTxDBLastFlush = 0;
+
+static size_t TxDBCacheMaxUsage()
+{
+    // Three quarters of -dbcache go to the write-back cache, the rest to
+    // LevelDB's own block cache (see GetOptions).
+    return (size_t)GetArg("-dbcache", DEFAULT_DB_CACHE) * 1048576 / 4 * 3;
+}
+
 static leveldb::Options GetOptions() {
     leveldb::Options options;
-    int nCacheSizeMB = GetArg("-dbcache", 10);
-    options.block_cache = leveldb::NewLRUCache(nCacheSizeMB * 1048576);
+    int nCacheSizeMB = GetArg("-dbcache", DEFAULT_DB_CACHE);
+    options.block_cache = leveldb::NewLRUCache(nCacheSizeMB * 1048576 / 4);
     options.filter_policy = leveldb::NewBloomFilterPolicy(10);
     return options;
 }
 
+static bool IsRangeScannedKey(const std::string& strKey)
+{
+    // Serialized strings start with their length
+    static const char* apszTypes[] = {"\x03" "adr", "\x05" "adrtx", "\x04" "adru"};
+    for (unsigned int i = 0; i < sizeof(apszTypes) / sizeof(apszTypes[0]); i++)
+        if (strKey.compare(0, strlen(apszTypes[i]), apszTypes[i]) == 0)
+            return true;
+    return false;
+}
+
+static void TxDBCacheSet(const std::string& strKey, const std::string* pstrValue, bool fDirty)
+{
+    boost::unordered_map<std::string, CTxDBCacheEntry>::iterator it = mapTxDBCache.find(strKey);
+    if (it == mapTxDBCache.end())
+    {
+        it = mapTxDBCache.insert(make_pair(strKey, CTxDBCacheEntry())).first;
+        it->second.itLRU = listTxDBCacheLRU.insert(listTxDBCacheLRU.end(), &it->first);
+        nTxDBCacheUsage += strKey.size() + TXDB_CACHE_ENTRY_OVERHEAD;
+    }
+    else
+    {
+        listTxDBCacheLRU.splice(listTxDBCacheLRU.end(), listTxDBCacheLRU, it->second.itLRU);
+        nTxDBCacheUsage -= it->second.strValue.size();
+        if (it->second.fDirty)
+            nTxDBCacheDirty--;
+    }
+
+    CTxDBCacheEntry& entry = it->second;
+    entry.fErased = (pstrValue == NULL);
+    entry.strValue = pstrValue ? *pstrValue : std::string();
+    entry.fDirty = fDirty;
+    if (entry.fDirty)
+    {
+        nTxDBCacheDirty++;
+        if (IsRangeScannedKey(strKey))
+            setTxDBCacheDirtyRanged.insert(strKey);
+    }
+    nTxDBCacheUsage += entry.strValue.size();
+}
+
+// Drop clean entries, least recently used first, until the cache is down to
+// nTargetUsage. Dirty entries stay until they have been flushed.
+static void TxDBCacheEvict(size_t nTargetUsage)
+{
+    unsigned int nEvicted = 0;
+    std::list<const std::string*>::iterator itLRU = listTxDBCacheLRU.begin();
+    while (nTxDBCacheUsage > nTargetUsage && itLRU != listTxDBCacheLRU.end())
+    {
+        boost::unordered_map<std::string, CTxDBCacheEntry>::iterator it = mapTxDBCache.find(**itLRU);
+        if (it->second.fDirty)
+        {
+            ++itLRU;
+            continue;
+        }
+        nTxDBCacheUsage -= it->first.size() + it->second.strValue.size() + TXDB_CACHE_ENTRY_OVERHEAD;
+        itLRU = listTxDBCacheLRU.erase(itLRU);
+        mapTxDBCache.erase(it);
+        nEvicted++;
+    }
+    LogPrint("db", "Evicted %u txdb cache entries\n", nEvicted);
+}
+
+static void TxDBCacheClear()
+{
+    mapTxDBCache.clear();
+    listTxDBCacheLRU.clear();
+    setTxDBCacheDirtyRanged.clear();
+    nTxDBCacheUsage = 0;
+    nTxDBCacheDirty = 0;
+}
+
+// Write every dirty cache entry to LevelDB in a single batch.
+static bool TxDBCacheFlush(leveldb::DB* pdb)
+{
+    nTxDBLastFlush = GetTime();
+    if (nTxDBCacheDirty == 0)
+        return true;
+
+    leveldb::WriteBatch batch;
+    for (boost::unordered_map<std::string, CTxDBCacheEntry>::const_iterator it = mapTxDBCache.begin(); it != mapTxDBCache.end(); ++it)
+    {
+        if (!it->second.fDirty)
+            continue;
+        if (it->second.fErased)
+            batch.Delete(it->first);
+        else
+            batch.Put(it->first, it->second.strValue);
+    }
+
+    leveldb::WriteOptions syncoptions;
+    syncoptions.sync = true;
+    leveldb::Status status = pdb->Write(syncoptions, &batch);
+    if (!status.ok()) {
+        LogPrintf("LevelDB cache flush failure: %s\n", status.ToString());
+        return false;
+    }
+    LogPrint("db", "Flushed %u txdb cache entries\n", nTxDBCacheDirty);
+
+    for (boost::unordered_map<std::string, CTxDBCacheEntry>::iterator it = mapTxDBCache.begin(); it != mapTxDBCache.end(); ++it)
+        it->second.fDirty = false;
+    nTxDBCacheDirty = 0;
+    setTxDBCacheDirtyRanged.clear();
+    return true;
+}
+
+// Walks the records whose serialized key starts with a prefix, in key order,
+// as they would read through the write-back cache: LevelDB merged with the
+// cache entries that have not been flushed yet. Both are captured together
+// when the iterator is created. Pending batch writes are not seen.
+class CTxDBPrefixIterator
+{
+private:
+    typedef std::map<std::string, std::pair<bool, std::string> > overlay_type;
+
+    leveldb::Iterator* piter;
+    overlay_type mapOverlay; // key -> (erased, value)
+    overlay_type::const_iterator itOverlay;
+    std::string strPrefix;
+    std::string strKey;
+    std::string strValue;
+    bool fValid;
+
+    bool DBValid() const
+    {
+        return piter->Valid() && piter->key().starts_with(strPrefix);
+    }
+
+    // Move to the next live record of either source; the cache wins on
+    // keys present in both
+    void Settle()
+    {
+        while (true)
+        {
+            bool fDB = DBValid();
+            bool fOverlay = itOverlay != mapOverlay.end();
+            if (!fDB && !fOverlay)
+            {
+                fValid = false;
+                return;
+            }
+            if (fOverlay && (!fDB || piter->key().compare(itOverlay->first) >= 0))
+            {
+                if (fDB && piter->key() == itOverlay->first)
+                    piter->Next();
+                bool fErased = itOverlay->second.first;
+                strKey = itOverlay->first;
+                strValue = itOverlay->second.second;
+                ++itOverlay;
+                if (fErased)
+                    continue;
+            }
+            else
+            {
+                strKey = piter->key().ToString();
+                strValue = piter->value().ToString();
+                piter->Next();
+            }
+            fValid = true;
+            return;
+        }
+    }
+
+public:
+    CTxDBPrefixIterator(leveldb::DB* pdb, const std::string& strPrefixIn, const std::string& strStart) : strPrefix(strPrefixIn)
+    {
+        {
+            LOCK(cs_txdbcache);
+            piter = pdb->NewIterator(leveldb::ReadOptions());
+            for (std::set<std::string>::const_iterator it = setTxDBCacheDirtyRanged.lower_bound(strStart);
+                 it != setTxDBCacheDirtyRanged.end() && it->compare(0, strPrefix.size(), strPrefix) == 0; ++it)
+            {
+                boost::unordered_map<std::string, CTxDBCacheEntry>::const_iterator mi = mapTxDBCache.find(*it);
+                if (mi != mapTxDBCache.end())
+                    mapOverlay[*it] = make_pair(mi->second.fErased, mi->second.strValue);
+            }
+        }
+        itOverlay = mapOverlay.begin();
+        piter->Seek(strStart);
+        Settle();
+    }
+
+    ~CTxDBPrefixIterator()
+    {
+        delete piter;
+    }
+
+    bool Valid() const { return fValid; }
+    const std::string& Key() const { return strKey; }
+    const std::string& Value() const { return strValue; }
+    void Next() { Settle(); }
+};
+
+// Make room if the cache is over its size limit, and flush if the last
+// flush is too old. Room is made in batches, down to three quarters of the
+// limit, by evicting the least recently used clean entries; the dirty ones
+// are only flushed first when evicting clean ones isn't enough.
+static bool TxDBCacheMaybeFlush(leveldb::DB* pdb)
+{
+    size_t nMaxUsage = TxDBCacheMaxUsage();
+    if (nTxDBCacheUsage > nMaxUsage)
+    {
+        size_t nTargetUsage = nMaxUsage / 4 * 3;
+        TxDBCacheEvict(nTargetUsage);
+        if (nTxDBCacheUsage > nTargetUsage)
+        {
+            if (!TxDBCacheFlush(pdb))
+                return false;
+            TxDBCacheEvict(nTargetUsage);
+        }
+    }
+    else if (nTxDBCacheDirty > 0 && GetTime() - nTxDBLastFlush > GetArg("-dbflushinterval", DEFAULT_DB_FLUSH_INTERVAL))
+    {
+        if (!TxDBCacheFlush(pdb))
+            return false;
+    }
+    return true;
+}
+
 void init_blockindex(leveldb::Options& options, bool fRemoveOld = false) {
     // First time init.
     filesystem::path directory = GetDataDir() / "txleveldb";
@@ -70,6 +330,7 @@ CTxDB::CTxDB(const char* pszMode)
 {
     assert(pszMode);
     activeBatch = NULL;
+    activeBatchIndex = NULL;
     fReadOnly = (!strchr(pszMode, '+') && !strchr(pszMode, 'w'));
 
     if (txdb) {
@@ -96,10 +357,13 @@ CTxDB::CTxDB(const char* pszMode)
             LogPrintf("Required index version is %d, removing old database\n", DATABASE_VERSION);
 
             // Leveldb instance destruction
+            {
+                LOCK(cs_txdbcache);
+                TxDBCacheClear();
+            }
             delete txdb;
             txdb = pdb = NULL;
-            delete activeBatch;
-            activeBatch = NULL;
+            TxnAbort();
 
             init_blockindex(options, true); // Remove directory and create new database
             pdb = txdb;
@@ -123,105 +387,270 @@ CTxDB::CTxDB(const char* pszMode)
 
 void CTxDB::Close()
 {
+    {
+        LOCK(cs_txdbcache);
+        if (txdb)
+            TxDBCacheFlush(txdb);
+        TxDBCacheClear();
+    }
     delete txdb;
     txdb = pdb = NULL;
     delete options.filter_policy;
     options.filter_policy = NULL;
     delete options.block_cache;
     options.block_cache = NULL;
-    delete activeBatch;
-    activeBatch = NULL;
+    TxnAbort();
 }
 
 bool CTxDB::TxnBegin()
 {
     assert(!activeBatch);
     activeBatch = new leveldb::WriteBatch();
+    activeBatchIndex = new BatchIndex();
     return true;
 }
 
+// Applies the operations of a batch to the write-back cache, in order.
+class CBatchCacheWriter : public leveldb::WriteBatch::Handler {
+public:
+    virtual void Put(const leveldb::Slice& key, const leveldb::Slice& value) {
+        std::string strValue = value.ToString();
+        TxDBCacheSet(key.ToString(), &strValue, true);
+    }
+
+    virtual void Delete(const leveldb::Slice& key) {
+        TxDBCacheSet(key.ToString(), NULL, true);
+    }
+};
+
 bool CTxDB::TxnCommit()
 {
     assert(activeBatch);
-    leveldb::Status status = pdb->Write(leveldb::WriteOptions(), activeBatch);
-    delete activeBatch;
-    activeBatch = NULL;
+    LOCK(cs_txdbcache);
+    CBatchCacheWriter writer;
+    leveldb::Status status = activeBatch->Iterate(&writer);
+    TxnAbort();
     if (!status.ok()) {
         LogPrintf("LevelDB batch commit failure: %s\n", status.ToString());
         return false;
     }
+    return TxDBCacheMaybeFlush(pdb);
+}
+
+bool CTxDB::Flush()
+{
+    LOCK(cs_txdbcache);
+    return TxDBCacheFlush(pdb);
+}
+
+// When performing a read, if we have an active batch we need to check it first
+// before reading from the database, as the rest of the code assumes that once
+// a database transaction begins reads are consistent with it. The lookup goes
+// through activeBatchIndex, so it costs the same however large the batch is.
+bool CTxDB::ScanBatch(const CDataStream &key, string *value, bool *deleted) const {
+    assert(activeBatch && activeBatchIndex);
+    *deleted = false;
+    BatchIndex::const_iterator it = activeBatchIndex->find(key.str());
+    if (it == activeBatchIndex->end())
+        return false;
+    *deleted = it->second.first;
+    if (!*deleted)
+        *value = it->second.second;
     return true;
 }
 
-class CBatchScanner : public leveldb::WriteBatch::Handler {
-public:
-    std::string needle;
-    bool *deleted;
-    std::string *foundValue;
-    bool foundEntry;
+bool CTxDB::ReadRaw(const CDataStream &key, std::string &value)
+{
+    if (activeBatch) {
+        // First we must search for it in the currently pending set of
+        // changes to the db. If not found in the batch, go on to the cache.
+        bool deleted = false;
+        if (ScanBatch(key, &value, &deleted))
+            return !deleted;
+    }
 
-    CBatchScanner() : foundEntry(false) {}
+    std::string strKey = key.str();
+    LOCK(cs_txdbcache);
+    boost::unordered_map<std::string, CTxDBCacheEntry>::iterator it = mapTxDBCache.find(strKey);
+    if (it != mapTxDBCache.end()) {
+        listTxDBCacheLRU.splice(listTxDBCacheLRU.end(), listTxDBCacheLRU, it->second.itLRU);
+        if (it->second.fErased)
+            return false;
+        value = it->second.strValue;
+        return true;
+    }
 
-    virtual void Put(const leveldb::Slice& key, const leveldb::Slice& value) {
-        if (key.ToString() == needle) {
-            foundEntry = true;
-            *deleted = false;
-            *foundValue = value.ToString();
+    leveldb::Status status = pdb->Get(leveldb::ReadOptions(), strKey, &value);
+    if (!status.ok()) {
+        if (status.IsNotFound()) {
+            TxDBCacheSet(strKey, NULL, false);
+            TxDBCacheMaybeFlush(pdb);
+            return false;
         }
+        // Some unexpected error.
+        LogPrintf("LevelDB read failure: %s\n", status.ToString());
+        return false;
     }
+    TxDBCacheSet(strKey, &value, false);
+    TxDBCacheMaybeFlush(pdb);
+    return true;
+}
 
-    virtual void Delete(const leveldb::Slice& key) {
-        if (key.ToString() == needle) {
-            foundEntry = true;
-            *deleted = true;
-        }
+bool CTxDB::WriteRaw(const CDataStream &key, const CDataStream &value)
+{
+    if (activeBatch) {
+        std::string strKey = key.str();
+        std::string strValue = value.str();
+        activeBatch->Put(strKey, strValue);
+        (*activeBatchIndex)[strKey] = make_pair(false, strValue);
+        return true;
     }
-};
+    LOCK(cs_txdbcache);
+    std::string strValue = value.str();
+    TxDBCacheSet(key.str(), &strValue, true);
+    return TxDBCacheMaybeFlush(pdb);
+}
 
-// When performing a read, if we have an active batch we need to check it first
-// before reading from the database, as the rest of the code assumes that once
-// a database transaction begins reads are consistent with it. It would be good
-// to change that assumption in future and avoid the performance hit, though in
-// practice it does not appear to be large.
-bool CTxDB::ScanBatch(const CDataStream &key, string *value, bool *deleted) const {
-    assert(activeBatch);
-    *deleted = false;
-    CBatchScanner scanner;
-    scanner.needle = key.str();
-    scanner.deleted = deleted;
-    scanner.foundValue = value;
-    leveldb::Status status = activeBatch->Iterate(&scanner);
-    if (!status.ok()) {
-        throw runtime_error(status.ToString());
+bool CTxDB::EraseRaw(const CDataStream &key)
+{
+    if (activeBatch) {
+        std::string strKey = key.str();
+        activeBatch->Delete(strKey);
+        (*activeBatchIndex)[strKey] = make_pair(true, std::string());
+        return true;
     }
-    return scanner.foundEntry;
+    LOCK(cs_txdbcache);
+    TxDBCacheSet(key.str(), NULL, true);
+    return TxDBCacheMaybeFlush(pdb);
+}
+
+bool CTxDB::ExistsRaw(const CDataStream &key)
+{
+    std::string unused;
+    return ReadRaw(key, unused);
+}
+
+bool CTxDB::WriteAddrIndex(const CAddrIndexKey& key, int64_t nValue)
+{
+    return Write(make_pair(string("adrtx"), key), nValue);
+}
+
+bool CTxDB::EraseAddrIndex(const CAddrIndexKey& key)
+{
+    return Erase(make_pair(string("adrtx"), key));
 }
 
-bool CTxDB::WriteAddrIndex(uint160 addrHash, uint256 txHash)
+// Walk the rows of addrId in key order. Rows of one transaction are adjacent,
+// so each txid is counted once. nTotal receives the number of distinct txids
+// seen; the scan stops early once pvTxHashes holds nCount of them.
+bool CTxDB::ScanAddrIndex(const uint160& addrId, int nSkip, int nCount, std::vector<uint256>* pvTxHashes, int& nTotal)
 {
-    std::vector<uint256> txHashes;
-    if(!ReadAddrIndex(addrHash, txHashes))
+    nTotal = 0;
+    CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+    ssPrefix << string("adrtx") << addrId;
+    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
+    ssStartKey << make_pair(string("adrtx"), CAddrIndexKey(addrId, 0, 0, false, 0));
+    uint256 txidLast = 0;
+    for (CTxDBPrefixIterator iterator(pdb, ssPrefix.str(), ssStartKey.str()); iterator.Valid(); iterator.Next())
     {
-	txHashes.push_back(txHash);
-        return Write(make_pair(string("adr"), addrHash), txHashes);
+        CDataStream ssKey(iterator.Key().data(), iterator.Key().data() + iterator.Key().size(), SER_DISK, CLIENT_VERSION);
+        string strType;
+        CAddrIndexKey key;
+        try {
+            ssKey >> strType >> key;
+        }
+        catch (std::exception &e) {
+            return error("ScanAddrIndex() : deserialize error");
+        }
+        if (nTotal > 0 && key.txid == txidLast)
+            continue;
+        txidLast = key.txid;
+        if (pvTxHashes && nTotal >= nSkip)
+        {
+            if ((int)pvTxHashes->size() >= nCount)
+                break;
+            pvTxHashes->push_back(key.txid);
+        }
+        nTotal++;
     }
-    else
+    return true;
+}
+
+bool CTxDB::ReadAddrIndex(const uint160& addrId, int nSkip, int nCount, std::vector<uint256>& vTxHashes)
+{
+    vTxHashes.clear();
+    int nTotal;
+    if (nSkip < 0)
     {
-	if(std::find(txHashes.begin(), txHashes.end(), txHash) == txHashes.end()) 
-    	{
-    	    txHashes.push_back(txHash);
-            return Write(make_pair(string("adr"), addrHash), txHashes);
-	}
-	else
-	{
-	    return true; // already have this tx hash
-	}
+        if (!ScanAddrIndex(addrId, 0, 0, NULL, nTotal))
+            return false;
+        nSkip = std::max(0, nSkip + nTotal);
     }
+    return ScanAddrIndex(addrId, nSkip, nCount, &vTxHashes, nTotal);
+}
+
+bool CTxDB::WriteAddrUnspent(const uint160& addrId, const COutPoint& outpoint, int64_t nValue)
+{
+    return Write(make_pair(string("adru"), make_pair(addrId, outpoint)), nValue);
+}
+
+bool CTxDB::EraseAddrUnspent(const uint160& addrId, const COutPoint& outpoint)
+{
+    return Erase(make_pair(string("adru"), make_pair(addrId, outpoint)));
+}
+
+bool CTxDB::ReadAddrUnspent(const uint160& addrId, std::vector<std::pair<COutPoint, int64_t> >& vUnspent)
+{
+    vUnspent.clear();
+    CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+    ssPrefix << string("adru") << addrId;
+    for (CTxDBPrefixIterator iterator(pdb, ssPrefix.str(), ssPrefix.str()); iterator.Valid(); iterator.Next())
+    {
+        CDataStream ssKey(iterator.Key().data(), iterator.Key().data() + iterator.Key().size(), SER_DISK, CLIENT_VERSION);
+        CDataStream ssValue(iterator.Value().data(), iterator.Value().data() + iterator.Value().size(), SER_DISK, CLIENT_VERSION);
+        string strType;
+        uint160 addrIdKey;
+        COutPoint outpoint;
+        int64_t nValue;
+        try {
+            ssKey >> strType >> addrIdKey >> outpoint;
+            ssValue >> nValue;
+        }
+        catch (std::exception &e) {
+            return error("ReadAddrUnspent() : deserialize error");
+        }
+        vUnspent.push_back(make_pair(outpoint, nValue));
+    }
+    return true;
 }
 
-bool CTxDB::ReadAddrIndex(uint160 addrHash, std::vector<uint256>& txHashes)
+bool CTxDB::HasLegacyAddrIndex()
 {
-    return Read(make_pair(string("adr"), addrHash), txHashes);
+    CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+    ssPrefix << string("adr");
+    CTxDBPrefixIterator iterator(pdb, ssPrefix.str(), ssPrefix.str());
+    return iterator.Valid();
+}
+
+bool CTxDB::WipeAddrIndex()
+{
+    const char* apszTypes[] = {"adr", "adrtx", "adru"};
+    for (unsigned int i = 0; i < sizeof(apszTypes) / sizeof(apszTypes[0]); i++)
+    {
+        CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+        ssPrefix << string(apszTypes[i]);
+        unsigned int nErased = 0;
+        // The iterator works on a snapshot, so erasing as we go is safe
+        for (CTxDBPrefixIterator iterator(pdb, ssPrefix.str(), ssPrefix.str()); iterator.Valid(); iterator.Next())
+        {
+            CDataStream ssKey(iterator.Key().data(), iterator.Key().data() + iterator.Key().size(), SER_DISK, CLIENT_VERSION);
+            if (!EraseRaw(ssKey))
+                return error("WipeAddrIndex() : erasing %s row failed", apszTypes[i]);
+            nErased++;
+        }
+        LogPrintf("WipeAddrIndex() : erased %u %s rows\n", nErased, apszTypes[i]);
+    }
+    return true;
 }
 
 bool CTxDB::ReadTxIndex(uint256 hash, CTxIndex& txindex)
@@ -255,6 +684,22 @@ bool CTxDB::ContainsTx(uint256 hash)
     return Exists(make_pair(string("tx"), hash));
 }
 
+bool CTxDB::ReadCoins(uint256 hash, CCoins& coins)
+{
+    coins.SetNull();
+    return Read(make_pair(string("coins"), hash), coins);
+}
+
+bool CTxDB::WriteCoins(uint256 hash, const CCoins& coins)
+{
+    return Write(make_pair(string("coins"), hash), coins);
+}
+
+bool CTxDB::EraseCoins(uint256 hash)
+{
+    return Erase(make_pair(string("coins"), hash));
+}
+
 bool CTxDB::ReadDiskTx(uint256 hash, CTransaction& tx, CTxIndex& txindex)
 {
     tx.SetNull();
@@ -311,20 +756,174 @@ static CBlockIndex *InsertBlockIndex(uint256 hash)
         return NULL;
 
     // Return existing
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
     if (mi != mapBlockIndex.end())
         return (*mi).second;
 
     // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("LoadBlockIndex() : new CBlockIndex failed");
+    CBlockIndex* pindexNew = NewBlockIndex();
     mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
 
     return pindexNew;
 }
 
+// Deserialize the block index records [nBegin, nEnd) of vValues and compute
+// their block hashes. vOk[i] stays false for records that fail to decode.
+static void DecodeBlockIndexRange(const vector<string>* pvValues, vector<CDiskBlockIndex>* pvDiskIndex,
+                                  vector<uint256>* pvHashes, vector<char>* pvOk, size_t nBegin, size_t nEnd)
+{
+    for (size_t i = nBegin; i < nEnd; i++)
+    {
+        const string& strValue = (*pvValues)[i];
+        try {
+            CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+            ssValue >> (*pvDiskIndex)[i];
+        }
+        catch (std::exception &e) {
+            continue;
+        }
+        (*pvHashes)[i] = (*pvDiskIndex)[i].GetBlockHash();
+        (*pvOk)[i] = true;
+    }
+}
+
+bool DecodeBlockIndexBatch(const vector<string>& vValues, vector<CDiskBlockIndex>& vDiskIndex, vector<uint256>& vHashes)
+{
+    vDiskIndex.assign(vValues.size(), CDiskBlockIndex());
+    vHashes.assign(vValues.size(), 0);
+    vector<char> vOk(vValues.size(), false);
+    ParallelForRange(vValues.size(), 256, boost::bind(&DecodeBlockIndexRange, &vValues, &vDiskIndex, &vHashes, &vOk, _1, _2));
+
+    for (unsigned int i = 0; i < vOk.size(); i++)
+        if (!vOk[i])
+            return false;
+    return true;
+}
+
+static void GetBlockTrustRange(const vector<pair<int, CBlockIndex*> >* pvSortedByHeight, vector<uint256>* pvTrust, size_t nBegin, size_t nEnd)
+{
+    for (size_t i = nBegin; i < nEnd; i++)
+        (*pvTrust)[i] = (*pvSortedByHeight)[i].second->GetBlockTrust();
+}
+
+// A block of the best chain being verified at startup
+struct CBlockCheck
+{
+    CBlockIndex* pindex;
+    CBlock block;
+    bool fRead;
+    bool fBad;
+
+    CBlockCheck() : pindex(NULL), fRead(false), fBad(false) {}
+};
+
+typedef map<pair<unsigned int, unsigned int>, CBlockIndex*> BlockPosMap;
+
+// Read the blocks [nBegin, nEnd) of vChecks from disk and, from -checklevel 2
+// on, check them against the transaction index. mapBlockPos holds every block
+// being verified; a spend is valid if it is in one of them at or above the
+// height of the spent transaction. CheckBlock() is left to the caller, as it
+// may take cs_main.
+static void CheckBlockRange(vector<CBlockCheck>* pvChecks, const BlockPosMap* pmapBlockPos, int nCheckLevel, size_t nBegin, size_t nEnd)
+{
+    CTxDB txdb("r");
+    for (size_t i = nBegin; i < nEnd; i++)
+    {
+        CBlockCheck& check = (*pvChecks)[i];
+        CBlockIndex* pindex = check.pindex;
+        check.fRead = check.block.ReadFromDisk(pindex);
+        if (!check.fRead || nCheckLevel <= 1)
+            continue;
+
+        // check level 2: verify transaction index validity
+        BOOST_FOREACH(const CTransaction &tx, check.block.vtx)
+        {
+            uint256 hashTx = tx.GetHash();
+            CTxIndex txindex;
+            if (txdb.ReadTxIndex(hashTx, txindex))
+            {
+                // check level 3: checker transaction hashes
+                if (nCheckLevel>2 || pindex->nFile != txindex.pos.nFile || pindex->nBlockPos != txindex.pos.nBlockPos)
+                {
+                    // either an error or a duplicate transaction
+                    CTransaction txFound;
+                    if (!txFound.ReadFromDisk(txindex.pos))
+                    {
+                        LogPrintf("LoadBlockIndex() : *** cannot read mislocated transaction %s\n", hashTx.ToString());
+                        check.fBad = true;
+                    }
+                    else
+                        if (txFound.GetHash() != hashTx) // not a duplicate tx
+                        {
+                            LogPrintf("LoadBlockIndex(): *** invalid tx position for %s\n", hashTx.ToString());
+                            check.fBad = true;
+                        }
+                }
+                // check level 4: check whether spent txouts were spent within the main chain
+                unsigned int nOutput = 0;
+                if (nCheckLevel>3)
+                {
+                    BOOST_FOREACH(const CDiskTxPos &txpos, txindex.vSpent)
+                    {
+                        if (!txpos.IsNull())
+                        {
+                            BlockPosMap::const_iterator mi = pmapBlockPos->find(make_pair(txpos.nFile, txpos.nBlockPos));
+                            if (mi == pmapBlockPos->end() || (*mi).second->nHeight < pindex->nHeight)
+                            {
+                                LogPrintf("LoadBlockIndex(): *** found bad spend at %d, hashBlock=%s, hashTx=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString(), hashTx.ToString());
+                                check.fBad = true;
+                            }
+                            // check level 6: check whether spent txouts were spent by a valid transaction that consume them
+                            if (nCheckLevel>5)
+                            {
+                                CTransaction txSpend;
+                                if (!txSpend.ReadFromDisk(txpos))
+                                {
+                                    LogPrintf("LoadBlockIndex(): *** cannot read spending transaction of %s:%i from disk\n", hashTx.ToString(), nOutput);
+                                    check.fBad = true;
+                                }
+                                else if (!txSpend.CheckTransaction())
+                                {
+                                    LogPrintf("LoadBlockIndex(): *** spending transaction of %s:%i is invalid\n", hashTx.ToString(), nOutput);
+                                    check.fBad = true;
+                                }
+                                else
+                                {
+                                    bool fFound = false;
+                                    BOOST_FOREACH(const CTxIn &txin, txSpend.vin)
+                                        if (txin.prevout.hash == hashTx && txin.prevout.n == nOutput)
+                                            fFound = true;
+                                    if (!fFound)
+                                    {
+                                        LogPrintf("LoadBlockIndex(): *** spending transaction of %s:%i does not spend it\n", hashTx.ToString(), nOutput);
+                                        check.fBad = true;
+                                    }
+                                }
+                            }
+                        }
+                        nOutput++;
+                    }
+                }
+            }
+            // check level 5: check whether all prevouts are marked spent
+            if (nCheckLevel>4)
+            {
+                 BOOST_FOREACH(const CTxIn &txin, tx.vin)
+                 {
+                      CTxIndex txindex;
+                      if (txdb.ReadTxIndex(txin.prevout.hash, txindex))
+                          if (txindex.vSpent.size()-1 < txin.prevout.n || txindex.vSpent[txin.prevout.n].IsNull())
+                          {
+                              LogPrintf("LoadBlockIndex(): *** found unspent prevout %s:%i in %s\n", txin.prevout.hash.ToString(), txin.prevout.n, hashTx.ToString());
+                              check.fBad = true;
+                          }
+                 }
+            }
+        }
+    }
+}
+
 bool CTxDB::LoadBlockIndex()
 {
     if (mapBlockIndex.size() > 0) {
@@ -332,78 +931,109 @@ bool CTxDB::LoadBlockIndex()
         // from BDB.
         return true;
     }
+    // The iterator below reads LevelDB directly, so write out the cache first.
+    if (!Flush())
+        return error("LoadBlockIndex() : flushing txdb cache failed");
+
     // The block index is an in-memory structure that maps hashes to on-disk
     // locations where the contents of the block can be found. Here, we scan it
-    // out of the DB and into mapBlockIndex.
+    // out of the DB and into mapBlockIndex. Records are read in batches; each
+    // batch is decoded and hashed on all cores and then linked in on this
+    // thread.
+    // Size the hash table for the stored best chain plus some room for forks
+    // and new blocks, so the scan below does not rehash as it grows.
+    uint256 hashBestChainStored;
+    CDiskBlockIndex diskindexBest;
+    if (ReadHashBestChain(hashBestChainStored) && Read(make_pair(string("blockindex"), hashBestChainStored), diskindexBest))
+    {
+        size_t nExpected = (size_t)diskindexBest.nHeight + diskindexBest.nHeight / 8 + 1024;
+        mapBlockIndex.rehash((size_t)(nExpected / mapBlockIndex.max_load_factor()) + 1);
+    }
     leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
     // Seek to start key.
     CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
     ssStartKey << make_pair(string("blockindex"), uint256(0));
     iterator->Seek(ssStartKey.str());
-    // Now read each entry.
-    while (iterator->Valid())
+    vector<string> vValues;
+    vValues.reserve(BLOCKINDEX_LOAD_BATCH);
+    bool fDone = false;
+    while (!fDone)
     {
         boost::this_thread::interruption_point();
-        // Unpack keys and values.
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.write(iterator->key().data(), iterator->key().size());
-        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-        ssValue.write(iterator->value().data(), iterator->value().size());
-        string strType;
-        ssKey >> strType;
-        // Did we reach the end of the data to read?
-        if (strType != "blockindex")
-            break;
-        CDiskBlockIndex diskindex;
-        ssValue >> diskindex;
-
-        uint256 blockHash = diskindex.GetBlockHash();
-
-        // Construct block index object
-        CBlockIndex* pindexNew    = InsertBlockIndex(blockHash);
-        pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
-        pindexNew->pnext          = InsertBlockIndex(diskindex.hashNext);
-        pindexNew->nFile          = diskindex.nFile;
-        pindexNew->nBlockPos      = diskindex.nBlockPos;
-        pindexNew->nHeight        = diskindex.nHeight;
+        // Read the next batch of raw records.
+        vValues.clear();
+        while (iterator->Valid() && vValues.size() < BLOCKINDEX_LOAD_BATCH)
+        {
+            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+            ssKey.write(iterator->key().data(), iterator->key().size());
+            string strType;
+            ssKey >> strType;
+            // Did we reach the end of the data to read?
+            if (strType != "blockindex")
+                break;
+            vValues.push_back(iterator->value().ToString());
+            iterator->Next();
+        }
+        fDone = vValues.size() < BLOCKINDEX_LOAD_BATCH;
+
+        vector<CDiskBlockIndex> vDiskIndex;
+        vector<uint256> vHashes;
+        if (!DecodeBlockIndexBatch(vValues, vDiskIndex, vHashes)) {
+            delete iterator;
+            return error("LoadBlockIndex() : deserialize error");
+        }
+
+        for (unsigned int i = 0; i < vValues.size(); i++)
+        {
+            const CDiskBlockIndex& diskindex = vDiskIndex[i];
+            const uint256& blockHash = vHashes[i];
+
+            // Construct block index object
+            CBlockIndex* pindexNew    = InsertBlockIndex(blockHash);
+            pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
+            pindexNew->pnext          = InsertBlockIndex(diskindex.hashNext);
+            pindexNew->nFile          = diskindex.nFile;
+            pindexNew->nBlockPos      = diskindex.nBlockPos;
+            pindexNew->nHeight        = diskindex.nHeight;
 #ifndef LOWMEM
-        pindexNew->nMint          = diskindex.nMint;
-        pindexNew->nMoneySupply   = diskindex.nMoneySupply;
+            pindexNew->nMint          = diskindex.nMint;
+            pindexNew->nMoneySupply   = diskindex.nMoneySupply;
 #endif
-        pindexNew->nFlags         = diskindex.nFlags;
-        pindexNew->nStakeModifier = diskindex.nStakeModifier;
+            pindexNew->nFlags         = diskindex.nFlags;
+            pindexNew->nStakeModifier = diskindex.nStakeModifier;
 #ifndef LOWMEM
-        pindexNew->bnStakeModifierV2 = diskindex.bnStakeModifierV2;
+            pindexNew->bnStakeModifierV2 = diskindex.bnStakeModifierV2;
 #endif
-        pindexNew->prevoutStake   = diskindex.prevoutStake;
-        pindexNew->nStakeTime     = diskindex.nStakeTime;
-        pindexNew->hashProof      = diskindex.hashProof;
-        pindexNew->nVersion       = diskindex.nVersion;
-        pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-        pindexNew->nTime          = diskindex.nTime;
-        pindexNew->nBits          = diskindex.nBits;
-        pindexNew->nNonce         = diskindex.nNonce;
-
-        // Watch for genesis block
-        if (pindexGenesisBlock == NULL && blockHash == Params().HashGenesisBlock())
-            pindexGenesisBlock = pindexNew;
-
-        if (!pindexNew->CheckIndex()) {
-            delete iterator;
-            return error("LoadBlockIndex() : CheckIndex failed at %d", pindexNew->nHeight);
-        }
-
-        // NovaCoin: build setStakeSeen
-        if (pindexNew->IsProofOfStake())
-            setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+            pindexNew->prevoutStake   = diskindex.prevoutStake;
+            pindexNew->nStakeTime     = diskindex.nStakeTime;
+            pindexNew->hashProof      = diskindex.hashProof;
+            pindexNew->nVersion       = diskindex.nVersion;
+            pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+            pindexNew->nTime          = diskindex.nTime;
+            pindexNew->nBits          = diskindex.nBits;
+            pindexNew->nNonce         = diskindex.nNonce;
+
+            // Watch for genesis block
+            if (pindexGenesisBlock == NULL && blockHash == Params().HashGenesisBlock())
+                pindexGenesisBlock = pindexNew;
+
+            if (!pindexNew->CheckIndex()) {
+                delete iterator;
+                return error("LoadBlockIndex() : CheckIndex failed at %d", pindexNew->nHeight);
+            }
 
-        iterator->Next();
+            // NovaCoin: build setStakeSeen
+            if (pindexNew->IsProofOfStake())
+                setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+        }
     }
     delete iterator;
 
     boost::this_thread::interruption_point();
 
-    // Calculate nChainTrust
+    // Calculate nChainTrust. The trust of each block depends only on the
+    // block, so that part is computed in parallel and then summed up along
+    // the chain in height order.
     vector<pair<int, CBlockIndex*> > vSortedByHeight;
     vSortedByHeight.reserve(mapBlockIndex.size());
     BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
@@ -412,10 +1042,12 @@ bool CTxDB::LoadBlockIndex()
         vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
     }
     sort(vSortedByHeight.begin(), vSortedByHeight.end());
-    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
+    vector<uint256> vTrust(vSortedByHeight.size());
+    ParallelForRange(vSortedByHeight.size(), 1024, boost::bind(&GetBlockTrustRange, &vSortedByHeight, &vTrust, _1, _2));
+    for (unsigned int i = 0; i < vSortedByHeight.size(); i++)
     {
-        CBlockIndex* pindex = item.second;
-        pindex->nChainTrust = (pindex->pprev ? pindex->pprev->nChainTrust : 0) + pindex->GetBlockTrust();
+        CBlockIndex* pindex = vSortedByHeight[i].second;
+        pindex->nChainTrust = (pindex->pprev ? pindex->pprev->nChainTrust : 0) + vTrust[i];
     }
 
     // Load hashBestChain pointer to end of best chain
@@ -428,6 +1060,7 @@ bool CTxDB::LoadBlockIndex()
     if (!mapBlockIndex.count(hashBestChain))
         return error("CTxDB::LoadBlockIndex() : hashBestChain not found in the block index");
     pindexBest = mapBlockIndex[hashBestChain];
+    SetBestChainIndex(pindexBest);
     nBestHeight = pindexBest->nHeight;
     nBestChainTrust = pindexBest->nChainTrust;
 
@@ -448,112 +1081,41 @@ bool CTxDB::LoadBlockIndex()
     if (nCheckDepth > nBestHeight)
         nCheckDepth = nBestHeight;
     LogPrintf("Verifying last %i blocks at level %i\n", nCheckDepth, nCheckLevel);
-    CBlockIndex* pindexFork = NULL;
-    map<pair<unsigned int, unsigned int>, CBlockIndex*> mapBlockPos;
+    vector<CBlockIndex*> vToCheck;
+    BlockPosMap mapBlockPos;
     for (CBlockIndex* pindex = pindexBest; pindex && pindex->pprev; pindex = pindex->pprev)
     {
-        boost::this_thread::interruption_point();
         if (pindex->nHeight < nBestHeight-nCheckDepth)
             break;
-        CBlock block;
-        if (!block.ReadFromDisk(pindex))
-            return error("LoadBlockIndex() : block.ReadFromDisk failed");
-        // check level 1: verify block validity
-        // check level 7: verify block signature too
-        if (nCheckLevel>0 && !block.CheckBlock(true, true, (nCheckLevel>6)))
-        {
-            LogPrintf("LoadBlockIndex() : *** found bad block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
-            pindexFork = pindex->pprev;
-        }
-        // check level 2: verify transaction index validity
+        vToCheck.push_back(pindex);
         if (nCheckLevel>1)
+            mapBlockPos[make_pair(pindex->nFile, pindex->nBlockPos)] = pindex;
+    }
+    // Blocks are read and checked against the transaction index on all
+    // cores, a batch at a time, from the best block down.
+    CBlockIndex* pindexFork = NULL;
+    for (unsigned int nBatch = 0; nBatch < vToCheck.size(); nBatch += BLOCKINDEX_CHECK_BATCH)
+    {
+        boost::this_thread::interruption_point();
+        vector<CBlockCheck> vChecks(std::min((size_t)BLOCKINDEX_CHECK_BATCH, vToCheck.size() - nBatch));
+        for (unsigned int i = 0; i < vChecks.size(); i++)
+            vChecks[i].pindex = vToCheck[nBatch + i];
+        ParallelForRange(vChecks.size(), 8, boost::bind(&CheckBlockRange, &vChecks, &mapBlockPos, nCheckLevel, _1, _2));
+
+        BOOST_FOREACH(const CBlockCheck& check, vChecks)
         {
-            pair<unsigned int, unsigned int> pos = make_pair(pindex->nFile, pindex->nBlockPos);
-            mapBlockPos[pos] = pindex;
-            BOOST_FOREACH(const CTransaction &tx, block.vtx)
+            CBlockIndex* pindex = check.pindex;
+            if (!check.fRead)
+                return error("LoadBlockIndex() : block.ReadFromDisk failed");
+            // check level 1: verify block validity
+            // check level 7: verify block signature too
+            if (nCheckLevel>0 && !check.block.CheckBlock(true, true, (nCheckLevel>6)))
             {
-                uint256 hashTx = tx.GetHash();
-                CTxIndex txindex;
-                if (ReadTxIndex(hashTx, txindex))
-                {
-                    // check level 3: checker transaction hashes
-                    if (nCheckLevel>2 || pindex->nFile != txindex.pos.nFile || pindex->nBlockPos != txindex.pos.nBlockPos)
-                    {
-                        // either an error or a duplicate transaction
-                        CTransaction txFound;
-                        if (!txFound.ReadFromDisk(txindex.pos))
-                        {
-                            LogPrintf("LoadBlockIndex() : *** cannot read mislocated transaction %s\n", hashTx.ToString());
-                            pindexFork = pindex->pprev;
-                        }
-                        else
-                            if (txFound.GetHash() != hashTx) // not a duplicate tx
-                            {
-                                LogPrintf("LoadBlockIndex(): *** invalid tx position for %s\n", hashTx.ToString());
-                                pindexFork = pindex->pprev;
-                            }
-                    }
-                    // check level 4: check whether spent txouts were spent within the main chain
-                    unsigned int nOutput = 0;
-                    if (nCheckLevel>3)
-                    {
-                        BOOST_FOREACH(const CDiskTxPos &txpos, txindex.vSpent)
-                        {
-                            if (!txpos.IsNull())
-                            {
-                                pair<unsigned int, unsigned int> posFind = make_pair(txpos.nFile, txpos.nBlockPos);
-                                if (!mapBlockPos.count(posFind))
-                                {
-                                    LogPrintf("LoadBlockIndex(): *** found bad spend at %d, hashBlock=%s, hashTx=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString(), hashTx.ToString());
-                                    pindexFork = pindex->pprev;
-                                }
-                                // check level 6: check whether spent txouts were spent by a valid transaction that consume them
-                                if (nCheckLevel>5)
-                                {
-                                    CTransaction txSpend;
-                                    if (!txSpend.ReadFromDisk(txpos))
-                                    {
-                                        LogPrintf("LoadBlockIndex(): *** cannot read spending transaction of %s:%i from disk\n", hashTx.ToString(), nOutput);
-                                        pindexFork = pindex->pprev;
-                                    }
-                                    else if (!txSpend.CheckTransaction())
-                                    {
-                                        LogPrintf("LoadBlockIndex(): *** spending transaction of %s:%i is invalid\n", hashTx.ToString(), nOutput);
-                                        pindexFork = pindex->pprev;
-                                    }
-                                    else
-                                    {
-                                        bool fFound = false;
-                                        BOOST_FOREACH(const CTxIn &txin, txSpend.vin)
-                                            if (txin.prevout.hash == hashTx && txin.prevout.n == nOutput)
-                                                fFound = true;
-                                        if (!fFound)
-                                        {
-                                            LogPrintf("LoadBlockIndex(): *** spending transaction of %s:%i does not spend it\n", hashTx.ToString(), nOutput);
-                                            pindexFork = pindex->pprev;
-                                        }
-                                    }
-                                }
-                            }
-                            nOutput++;
-                        }
-                    }
-                }
-                // check level 5: check whether all prevouts are marked spent
-                if (nCheckLevel>4)
-                {
-                     BOOST_FOREACH(const CTxIn &txin, tx.vin)
-                     {
-                          CTxIndex txindex;
-                          if (ReadTxIndex(txin.prevout.hash, txindex))
-                              if (txindex.vSpent.size()-1 < txin.prevout.n || txindex.vSpent[txin.prevout.n].IsNull())
-                              {
-                                  LogPrintf("LoadBlockIndex(): *** found unspent prevout %s:%i in %s\n", txin.prevout.hash.ToString(), txin.prevout.n, hashTx.ToString());
-                                  pindexFork = pindex->pprev;
-                              }
-                     }
-                }
+                LogPrintf("LoadBlockIndex() : *** found bad block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
+                pindexFork = pindex->pprev;
             }
+            if (check.fBad)
+                pindexFork = pindex->pprev;
         }
     }
     if (pindexFork)
@@ -12,9 +12,20 @@
 #include <string>
 #include <vector>
 
+#include <boost/unordered_map.hpp>
+
 #include <leveldb/db.h>
 #include <leveldb/write_batch.h>
 
+/** Default for -dbcache, total transaction database cache in megabytes */
+static const int DEFAULT_DB_CACHE = 100;
+/** Default for -dbflushinterval, maximum seconds between cache flushes */
+static const int DEFAULT_DB_FLUSH_INTERVAL = 60;
+/** Block index records decoded per batch while loading the block index */
+static const unsigned int BLOCKINDEX_LOAD_BATCH = 16384;
+/** Blocks read and verified per batch by -checkblocks at startup */
+static const unsigned int BLOCKINDEX_CHECK_BATCH = 256;
+
 // Class that provides access to a LevelDB. Note that this class is frequently
 // instantiated on the stack and then destroyed again, so instantiation has to
 // be very cheap. Unfortunately that means, a CTxDB instance is actually just a
@@ -26,6 +37,12 @@
 // newer files overriding older files. A background thread compacts them
 // together when too many files stack up.
 //
+// Reads and committed writes go through a write-back cache that is shared by
+// all CTxDB instances. It is sized by -dbcache and written out to LevelDB in
+// one batch when it fills up, every -dbflushinterval seconds, and on Flush().
+// As every flush contains whole committed transactions, the database on disk
+// is always consistent, at worst a little behind.
+//
 // Learn more: http://code.google.com/p/leveldb/
 class CTxDB
 {
@@ -35,6 +52,7 @@ public:
         // Note that this is not the same as Close() because it deletes only
         // data scoped to this TxDB object.
         delete activeBatch;
+        delete activeBatchIndex;
     }
 
     // Destroys the underlying shared global state accessed by this TxDB.
@@ -46,6 +64,11 @@ private:
     // A batch stores up writes and deletes for atomic application. When this
     // field is non-NULL, writes/deletes go there instead of directly to disk.
     leveldb::WriteBatch *activeBatch;
+    // Mirror of activeBatch keyed by serialized key, so that reads during a
+    // transaction don't have to walk the whole batch. Maps to (deleted, value);
+    // later writes to the same key replace the entry, as they would in LevelDB.
+    typedef boost::unordered_map<std::string, std::pair<bool, std::string> > BatchIndex;
+    BatchIndex *activeBatchIndex;
     leveldb::Options options;
     bool fReadOnly;
     int nVersion;
@@ -56,6 +79,14 @@ protected:
     // delete for it.
     bool ScanBatch(const CDataStream &key, std::string *value, bool *deleted) const;
 
+    // Access to serialized keys and values. Reads look at activeBatch first,
+    // then at the write-back cache shared by all CTxDB instances, and only
+    // then at LevelDB. Writes outside of a batch go to the cache.
+    bool ReadRaw(const CDataStream &key, std::string &value);
+    bool WriteRaw(const CDataStream &key, const CDataStream &value);
+    bool EraseRaw(const CDataStream &key);
+    bool ExistsRaw(const CDataStream &key);
+
     template<typename K, typename T>
     bool Read(const K& key, T& value)
     {
@@ -63,28 +94,9 @@ protected:
         ssKey.reserve(1000);
         ssKey << key;
         std::string strValue;
+        if (!ReadRaw(ssKey, strValue))
+            return false;
 
-        bool readFromDb = true;
-        if (activeBatch) {
-            // First we must search for it in the currently pending set of
-            // changes to the db. If not found in the batch, go on to read disk.
-            bool deleted = false;
-            readFromDb = ScanBatch(ssKey, &strValue, &deleted) == false;
-            if (deleted) {
-                return false;
-            }
-        }
-        if (readFromDb) {
-            leveldb::Status status = pdb->Get(leveldb::ReadOptions(),
-                                              ssKey.str(), &strValue);
-            if (!status.ok()) {
-                if (status.IsNotFound())
-                    return false;
-                // Some unexpected error.
-                LogPrintf("LevelDB read failure: %s\n", status.ToString());
-                return false;
-            }
-        }
         // Unserialize value
         try {
             CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(),
@@ -109,17 +121,7 @@ protected:
         CDataStream ssValue(SER_DISK, CLIENT_VERSION);
         ssValue.reserve(10000);
         ssValue << value;
-
-        if (activeBatch) {
-            activeBatch->Put(ssKey.str(), ssValue.str());
-            return true;
-        }
-        leveldb::Status status = pdb->Put(leveldb::WriteOptions(), ssKey.str(), ssValue.str());
-        if (!status.ok()) {
-            LogPrintf("LevelDB write failure: %s\n", status.ToString());
-            return false;
-        }
-        return true;
+        return WriteRaw(ssKey, ssValue);
     }
 
     template<typename K>
@@ -133,12 +135,7 @@ protected:
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
-        if (activeBatch) {
-            activeBatch->Delete(ssKey.str());
-            return true;
-        }
-        leveldb::Status status = pdb->Delete(leveldb::WriteOptions(), ssKey.str());
-        return (status.ok() || status.IsNotFound());
+        return EraseRaw(ssKey);
     }
 
     template<typename K>
@@ -147,28 +144,21 @@ protected:
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
-        std::string unused;
-
-        if (activeBatch) {
-            bool deleted;
-            if (ScanBatch(ssKey, &unused, &deleted) && !deleted) {
-                return true;
-            }
-        }
-
-
-        leveldb::Status status = pdb->Get(leveldb::ReadOptions(), ssKey.str(), &unused);
-        return status.IsNotFound() == false;
+        return ExistsRaw(ssKey);
     }
 
 
 public:
     bool TxnBegin();
     bool TxnCommit();
+    // Write all pending changes in the shared cache to LevelDB.
+    bool Flush();
     bool TxnAbort()
     {
         delete activeBatch;
         activeBatch = NULL;
+        delete activeBatchIndex;
+        activeBatchIndex = NULL;
         return true;
     }
 
@@ -183,13 +173,27 @@ public:
         return Write(std::string("version"), nVersion);
     }
 
-    bool ReadAddrIndex(uint160 addrHash, std::vector<uint256>& txHashes);
-    bool WriteAddrIndex(uint160 addrHash, uint256 txHash);
+    bool WriteAddrIndex(const CAddrIndexKey& key, int64_t nValue);
+    bool EraseAddrIndex(const CAddrIndexKey& key);
+    // Distinct txids touching addrId in chain order, skipping the first
+    // nSkip (counted from the end when negative) and returning at most nCount.
+    bool ReadAddrIndex(const uint160& addrId, int nSkip, int nCount, std::vector<uint256>& vTxHashes);
+    bool WriteAddrUnspent(const uint160& addrId, const COutPoint& outpoint, int64_t nValue);
+    bool EraseAddrUnspent(const uint160& addrId, const COutPoint& outpoint);
+    bool ReadAddrUnspent(const uint160& addrId, std::vector<std::pair<COutPoint, int64_t> >& vUnspent);
+    // Whether rows of the format older versions kept are still present;
+    // they are only removed by WipeAddrIndex().
+    bool HasLegacyAddrIndex();
+    // Drop every address index row, before the index is rebuilt.
+    bool WipeAddrIndex();
     bool ReadTxIndex(uint256 hash, CTxIndex& txindex);
     bool UpdateTxIndex(uint256 hash, const CTxIndex& txindex);
     bool AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeight);
     bool EraseTxIndex(const CTransaction& tx);
     bool ContainsTx(uint256 hash);
+    bool ReadCoins(uint256 hash, CCoins& coins);
+    bool WriteCoins(uint256 hash, const CCoins& coins);
+    bool EraseCoins(uint256 hash);
     bool ReadDiskTx(uint256 hash, CTransaction& tx, CTxIndex& txindex);
     bool ReadDiskTx(uint256 hash, CTransaction& tx);
     bool ReadDiskTx(COutPoint outpoint, CTransaction& tx, CTxIndex& txindex);
@@ -202,7 +206,13 @@ public:
     bool LoadBlockIndex();
 private:
     bool LoadBlockIndexGuts();
+    bool ScanAddrIndex(const uint160& addrId, int nSkip, int nCount, std::vector<uint256>* pvTxHashes, int& nTotal);
 };
 
+/** Deserialize the raw "blockindex" records in vValues and compute their
+ * block hashes, spread over the ParallelForRange pool. Returns false if any
+ * record fails to decode. */
+bool DecodeBlockIndexBatch(const std::vector<std::string>& vValues, std::vector<CDiskBlockIndex>& vDiskIndex, std::vector<uint256>& vHashes);
+
 
 #endif // BITCOIN_DB_H
@@ -9,8 +9,44 @@
 
 using namespace std;
 
+CTxMemPoolEntry::CTxMemPoolEntry()
+{
+    ptx = NULL;
+    nFee = 0;
+    nTxSize = 0;
+    nTime = 0;
+    nCountWithDescendants = nSizeWithDescendants = 0;
+    nFeesWithDescendants = 0;
+}
+
+CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction* ptxIn, int64_t nFeeIn, unsigned int nTxSizeIn, int64_t nTimeIn)
+{
+    ptx = ptxIn;
+    nFee = nFeeIn;
+    nTxSize = nTxSizeIn;
+    nTime = nTimeIn;
+    nCountWithDescendants = 1;
+    nSizeWithDescendants = nTxSize;
+    nFeesWithDescendants = nFee;
+}
+
+double CTxMemPoolEntry::GetFeeRate() const
+{
+    return nTxSize ? (double)nFee * 1000.0 / nTxSize : 0;
+}
+
+double CTxMemPoolEntry::GetDescendantScore() const
+{
+    double dDescendants = nSizeWithDescendants ? (double)nFeesWithDescendants * 1000.0 / nSizeWithDescendants : 0;
+    return std::max(GetFeeRate(), dDescendants);
+}
+
 CTxMemPool::CTxMemPool()
 {
+    nTransactionsUpdated = 0;
+    nTotalTxSize = 0;
+    dRollingMinimumFeeRate = 0;
+    nLastRollingFeeUpdate = 0;
 }
 
 unsigned int CTxMemPool::GetTransactionsUpdated() const
@@ -25,17 +61,98 @@ void CTxMemPool::AddTransactionsUpdated(unsigned int n)
     nTransactionsUpdated += n;
 }
 
-bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx)
+void CTxMemPool::CalculateAncestors(const CTransaction& tx, std::set<uint256>& setAncestors) const
+{
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        std::map<uint256, CTransaction>::const_iterator mi = mapTx.find(txin.prevout.hash);
+        if (mi != mapTx.end() && setAncestors.insert(txin.prevout.hash).second)
+            CalculateAncestors(mi->second, setAncestors);
+    }
+}
+
+void CTxMemPool::CalculateDescendants(const uint256& hash, std::set<uint256>& setDescendants) const
+{
+    std::map<COutPoint, CInPoint>::const_iterator it = mapNextTx.lower_bound(COutPoint(hash, 0));
+    for (; it != mapNextTx.end() && it->first.hash == hash; ++it)
+    {
+        uint256 hashChild = it->second.ptx->GetHash();
+        if (setDescendants.insert(hashChild).second)
+            CalculateDescendants(hashChild, setDescendants);
+    }
+}
+
+void CTxMemPool::AddToIndexes(const uint256& hash, const CTxMemPoolEntry& entry)
+{
+    setByEntryTime.insert(make_pair(entry.nTime, hash));
+    setByDescendantScore.insert(make_pair(entry.GetDescendantScore(), hash));
+}
+
+void CTxMemPool::RemoveFromIndexes(const uint256& hash, const CTxMemPoolEntry& entry)
+{
+    setByEntryTime.erase(make_pair(entry.nTime, hash));
+    setByDescendantScore.erase(make_pair(entry.GetDescendantScore(), hash));
+}
+
+// Recompute the descendant totals of one entry from scratch.
+// In-pool chains are short (transactions normally need confirmed inputs to
+// get in), so walking them is cheap and avoids incremental drift.
+void CTxMemPool::UpdateAggregates(const uint256& hash)
+{
+    std::map<uint256, CTxMemPoolEntry>::iterator mi = mapEntry.find(hash);
+    if (mi == mapEntry.end())
+        return;
+    CTxMemPoolEntry& entry = mi->second;
+    RemoveFromIndexes(hash, entry);
+
+    std::set<uint256> setDescendants;
+    CalculateDescendants(hash, setDescendants);
+    entry.nCountWithDescendants = 1;
+    entry.nSizeWithDescendants = entry.nTxSize;
+    entry.nFeesWithDescendants = entry.nFee;
+    BOOST_FOREACH(const uint256& hashDescendant, setDescendants)
+    {
+        std::map<uint256, CTxMemPoolEntry>::const_iterator it = mapEntry.find(hashDescendant);
+        if (it == mapEntry.end())
+            continue;
+        const CTxMemPoolEntry& descendant = it->second;
+        entry.nCountWithDescendants++;
+        entry.nSizeWithDescendants += descendant.nTxSize;
+        entry.nFeesWithDescendants += descendant.nFee;
+    }
+
+    AddToIndexes(hash, entry);
+}
+
+bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx, int64_t nFee)
 {
     // Add to memory pool without checking anything.
     // Used by main.cpp AcceptToMemoryPool(), which DOES do
     // all the appropriate checks.
     LOCK(cs);
     {
+        std::map<uint256, CTxMemPoolEntry>::iterator mi = mapEntry.find(hash);
+        if (mi != mapEntry.end())
+        {
+            RemoveFromIndexes(hash, mi->second);
+            nTotalTxSize -= mi->second.nTxSize;
+        }
+
         mapTx[hash] = tx;
         for (unsigned int i = 0; i < tx.vin.size(); i++)
             mapNextTx[tx.vin[i].prevout] = CInPoint(&mapTx[hash], i);
         nTransactionsUpdated++;
+
+        CTxMemPoolEntry entry(&mapTx[hash], nFee, ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION), GetTime());
+        mapEntry[hash] = entry;
+        nTotalTxSize += entry.nTxSize;
+
+        std::set<uint256> setAffected;
+        CalculateAncestors(tx, setAffected);
+        CalculateDescendants(hash, setAffected);
+        UpdateAggregates(hash);
+        BOOST_FOREACH(const uint256& hashAffected, setAffected)
+            UpdateAggregates(hashAffected);
     }
     return true;
 }
@@ -55,10 +172,27 @@ bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
                         remove(*it->second.ptx, true);
                 }
             }
+
+            // Whatever is left around this transaction has it in its totals
+            std::set<uint256> setAffected;
+            CalculateAncestors(mapTx[hash], setAffected);
+            CalculateDescendants(hash, setAffected);
+
+            std::map<uint256, CTxMemPoolEntry>::iterator mi = mapEntry.find(hash);
+            if (mi != mapEntry.end())
+            {
+                RemoveFromIndexes(hash, mi->second);
+                nTotalTxSize -= mi->second.nTxSize;
+                mapEntry.erase(mi);
+            }
+
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
                 mapNextTx.erase(txin.prevout);
             mapTx.erase(hash);
             nTransactionsUpdated++;
+
+            BOOST_FOREACH(const uint256& hashAffected, setAffected)
+                UpdateAggregates(hashAffected);
         }
     }
     return true;
@@ -79,11 +213,89 @@ bool CTxMemPool::removeConflicts(const CTransaction &tx)
     return true;
 }
 
+int CTxMemPool::Expire(int64_t nTime)
+{
+    LOCK(cs);
+    std::vector<uint256> vExpired;
+    std::set<std::pair<int64_t, uint256> >::const_iterator it = setByEntryTime.begin();
+    for (; it != setByEntryTime.end() && it->first < nTime; ++it)
+        vExpired.push_back(it->second);
+
+    int nRemoved = 0;
+    BOOST_FOREACH(const uint256& hash, vExpired)
+    {
+        std::map<uint256, CTransaction>::iterator mi = mapTx.find(hash);
+        if (mi == mapTx.end())
+            continue; // already gone as a descendant of an earlier one
+        remove(mi->second, true);
+        nRemoved++;
+    }
+    return nRemoved;
+}
+
+void CTxMemPool::TrimToSize(uint64_t nSizeLimit)
+{
+    LOCK(cs);
+    double dMaxEvicted = 0;
+    int nEvicted = 0;
+    while (nTotalTxSize > nSizeLimit && !setByDescendantScore.empty())
+    {
+        // Evict the package with the lowest score along with its descendants
+        std::pair<double, uint256> worst = *setByDescendantScore.begin();
+        std::map<uint256, CTransaction>::iterator mi = mapTx.find(worst.second);
+        if (mi == mapTx.end())
+        {
+            setByDescendantScore.erase(setByDescendantScore.begin());
+            continue;
+        }
+        dMaxEvicted = std::max(dMaxEvicted, worst.first);
+        remove(mi->second, true);
+        nEvicted++;
+    }
+
+    if (nEvicted > 0)
+    {
+        // Transactions paying less than what we just evicted would only
+        // push something else out, so raise the bar above it for a while.
+        DecayRollingMinimumFee();
+        dRollingMinimumFeeRate = std::max(dRollingMinimumFeeRate, dMaxEvicted + MIN_RELAY_TX_FEE);
+        nLastRollingFeeUpdate = GetTime();
+        LogPrint("mempool", "TrimToSize : evicted %d packages, minimum fee rate now %.0f per kB\n", nEvicted, dRollingMinimumFeeRate);
+    }
+}
+
+// Apply the decay since the last update to dRollingMinimumFeeRate
+void CTxMemPool::DecayRollingMinimumFee() const
+{
+    if (dRollingMinimumFeeRate == 0)
+        return;
+
+    int64_t nNow = GetTime();
+    if (nNow > nLastRollingFeeUpdate)
+    {
+        dRollingMinimumFeeRate /= pow(2.0, (double)(nNow - nLastRollingFeeUpdate) / ROLLING_FEE_HALFLIFE);
+        nLastRollingFeeUpdate = nNow;
+        if (dRollingMinimumFeeRate < MIN_RELAY_TX_FEE / 2)
+            dRollingMinimumFeeRate = 0;
+    }
+}
+
+int64_t CTxMemPool::GetMinFee(unsigned int nBytes) const
+{
+    LOCK(cs);
+    DecayRollingMinimumFee();
+    return (int64_t)(dRollingMinimumFeeRate * nBytes / 1000);
+}
+
 void CTxMemPool::clear()
 {
     LOCK(cs);
     mapTx.clear();
     mapNextTx.clear();
+    mapEntry.clear();
+    setByEntryTime.clear();
+    setByDescendantScore.clear();
+    nTotalTxSize = 0;
     ++nTransactionsUpdated;
 }
 
@@ -7,6 +7,37 @@
 
 #include "core.h"
 
+/** Default for -maxmempool, maximum total size of pool transactions in megabytes */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/** Default for -mempoolexpiry, hours after which a transaction is dropped from the pool */
+static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 72;
+
+/** Bookkeeping for a transaction in the memory pool: its fee, size and time
+ * of entry, plus totals over its in-pool descendants. The descendant totals
+ * rate everything that goes away with it when it is evicted.
+ */
+class CTxMemPoolEntry
+{
+public:
+    const CTransaction* ptx; // points into CTxMemPool::mapTx
+    int64_t nFee;
+    unsigned int nTxSize;
+    int64_t nTime;
+
+    uint64_t nCountWithDescendants;
+    uint64_t nSizeWithDescendants;
+    int64_t nFeesWithDescendants;
+
+    CTxMemPoolEntry();
+    CTxMemPoolEntry(const CTransaction* ptxIn, int64_t nFeeIn, unsigned int nTxSizeIn, int64_t nTimeIn);
+
+    /** Fee per 1000 bytes of this transaction alone */
+    double GetFeeRate() const;
+    /** Eviction score: the better of the fee rate of this transaction alone
+        and that of it together with its descendants */
+    double GetDescendantScore() const;
+};
+
 /*
  * CTxMemPool stores valid-according-to-the-current-best-chain
  * transactions that may be included in the next block.
@@ -21,17 +52,45 @@ class CTxMemPool
 {
 private:
     unsigned int nTransactionsUpdated;
+    uint64_t nTotalTxSize;
+
+    // Floor on the fee rate for accepting transactions, raised by evictions
+    // and decaying back to zero with a half-life of ROLLING_FEE_HALFLIFE.
+    mutable double dRollingMinimumFeeRate;
+    mutable int64_t nLastRollingFeeUpdate;
+
+    void CalculateAncestors(const CTransaction& tx, std::set<uint256>& setAncestors) const;
+    void CalculateDescendants(const uint256& hash, std::set<uint256>& setDescendants) const;
+    void AddToIndexes(const uint256& hash, const CTxMemPoolEntry& entry);
+    void RemoveFromIndexes(const uint256& hash, const CTxMemPoolEntry& entry);
+    void UpdateAggregates(const uint256& hash);
+    void DecayRollingMinimumFee() const;
 
 public:
+    static const int ROLLING_FEE_HALFLIFE = 60 * 60 * 12;
+
     mutable CCriticalSection cs;
     std::map<uint256, CTransaction> mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
 
+    // Per-transaction bookkeeping and the sorted views over it that expiry
+    // and eviction walk. The views are kept up to date on every add and
+    // remove; both sort lowest first and break ties by hash.
+    std::map<uint256, CTxMemPoolEntry> mapEntry;
+    std::set<std::pair<int64_t, uint256> > setByEntryTime;
+    std::set<std::pair<double, uint256> > setByDescendantScore;
+
     CTxMemPool();
 
-    bool addUnchecked(const uint256& hash, CTransaction &tx);
+    bool addUnchecked(const uint256& hash, CTransaction &tx, int64_t nFee = 0);
     bool remove(const CTransaction &tx, bool fRecursive = false);
     bool removeConflicts(const CTransaction &tx);
+    /** Remove transactions that entered the pool before nTime, and their descendants */
+    int Expire(int64_t nTime);
+    /** Evict the lowest scoring packages until the pool holds at most nSizeLimit bytes */
+    void TrimToSize(uint64_t nSizeLimit);
+    /** Minimum fee for a transaction of nBytes to get into the pool right now */
+    int64_t GetMinFee(unsigned int nBytes) const;
     void clear();
     void queryHashes(std::vector<uint256>& vtxid);
     unsigned int GetTransactionsUpdated() const;
@@ -49,6 +108,12 @@ public:
         return (mapTx.count(hash) != 0);
     }
 
+    uint64_t GetTotalTxSize() const
+    {
+        LOCK(cs);
+        return nTotalTxSize;
+    }
+
     bool lookup(uint256 hash, CTransaction& result) const;
 };
 
@@ -21,9 +21,12 @@
 #include "masternodeman.h"
 #include "masternode-payments.h"
 #include "chainparams.h"
+#include "parallel.h"
 #include "smessage.h"
+#include "support/cleanse.h"
 
 #include <boost/algorithm/string/replace.hpp>
+#include <boost/bind.hpp>
 
 using namespace std;
 
@@ -227,7 +230,10 @@ bool CWallet::Lock()
 			sxAddr.spend_secret = sxAddrTemp.spend_secret;
 		};
 	}
-	return LockKeyStore();
+	if (!LockKeyStore())
+		return false;
+	SecureMsgWalletLocked();
+	return true;
 };
 
 bool CWallet::Unlock(const SecureString& strWalletPassphrase, bool anonymizeOnly)
@@ -716,7 +722,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
 // Add a transaction to the wallet, or update it.
 // pblock is optional, but should be provided if the transaction is known to be in a block.
 // If fUpdate is true, existing transactions will be updated.
-bool CWallet::AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate)
+bool CWallet::AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate, const CStealthBlockSecrets* pStealthSecrets)
 {
 	uint256 hash = tx.GetHash();
 	{
@@ -725,7 +731,7 @@ bool CWallet::AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pbl
 		if (fExisted && !fUpdate) return false;
 
 		mapValue_t mapNarr;
-		FindStealthTransactions(tx, mapNarr);
+		FindStealthTransactions(tx, mapNarr, pStealthSecrets);
 
 		if (fExisted || IsMine(tx) || IsFromMe(tx))
 		{
@@ -1182,9 +1188,12 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 
 			CBlock block;
 			block.ReadFromDisk(pindex, true);
+			// wiped when it goes out of scope, also on an exception
+			CStealthBlockSecrets stealthSecrets;
+			PrecomputeStealthSecrets(block, stealthSecrets);
 			BOOST_FOREACH(CTransaction& tx, block.vtx)
 			{
-				if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
+				if (AddToWalletIfInvolvingMe(tx, &block, fUpdate, &stealthSecrets))
 					ret++;
 			}
 			pindex = pindex->pnext;
@@ -3087,7 +3096,109 @@ bool CWallet::SendStealthMoneyToDestination(CStealthAddress& sxAddress, int64_t
 	return true;
 }
 
-bool CWallet::FindStealthTransactions(const CTransaction& tx, mapValue_t& mapNarr)
+void CStealthBlockSecrets::Clear()
+{
+	BOOST_FOREACH(CStealthScanKey& scanKey, vScanKeys)
+		memory_cleanse(&scanKey.sScan, sizeof(scanKey.sScan));
+	vScanKeys.clear();
+	for (std::map<ec_point, std::vector<CStealthSecret> >::iterator mi = mapSecrets.begin(); mi != mapSecrets.end(); ++mi)
+		BOOST_FOREACH(CStealthSecret& secret, mi->second)
+			memory_cleanse(&secret.sShared, sizeof(secret.sShared));
+	mapSecrets.clear();
+}
+
+void CWallet::GetStealthScanKeys(std::vector<CStealthScanKey>& vScanKeys) const
+{
+	vScanKeys.clear();
+	for (std::set<CStealthAddress>::const_iterator it = stealthAddresses.begin(); it != stealthAddresses.end(); ++it)
+	{
+		if (it->scan_secret.size() != ec_secret_size)
+			continue; // stealth address is not owned
+
+		CStealthScanKey scanKey;
+		scanKey.pAddress = &(*it);
+		memcpy(&scanKey.sScan.e[0], &it->scan_secret[0], ec_secret_size);
+		vScanKeys.push_back(scanKey);
+	}
+}
+
+static void ComputeStealthSecret(const CStealthScanKey& scanKey, const ec_point& vchEphemPK, CStealthSecret& secret)
+{
+	ec_secret sScan = scanKey.sScan;
+	ec_point pkEphem = vchEphemPK;
+	ec_point pkExtracted;
+
+	secret.fValid = false;
+	if (StealthSecret(sScan, pkEphem, scanKey.pAddress->spend_pubkey, secret.sShared, pkExtracted) != 0)
+	{
+		printf("StealthSecret failed.\n");
+		return;
+	}
+
+	memory_cleanse(&sScan, sizeof(sScan));
+
+	secret.pkExtracted = CPubKey(pkExtracted);
+	secret.fValid = secret.pkExtracted.IsValid();
+}
+
+static void ComputeStealthSecrets(const std::vector<CStealthScanKey>* pvScanKeys, const std::vector<const ec_point*>* pvEphemPK,
+	size_t nBegin, size_t nEnd, std::vector<CStealthSecret>* pvSecrets)
+{
+	// Job i is ephemeral key i / nKeys against scan key i % nKeys
+	size_t nKeys = pvScanKeys->size();
+	for (size_t i = nBegin; i < nEnd; i++)
+		ComputeStealthSecret((*pvScanKeys)[i % nKeys], *(*pvEphemPK)[i / nKeys], (*pvSecrets)[i]);
+}
+
+static bool GetStealthEphemKey(const CTxOut& txout, ec_point& vchEphemPK)
+{
+	opcodetype opCode;
+	CScript::const_iterator itTxA = txout.scriptPubKey.begin();
+	return txout.scriptPubKey.GetOp(itTxA, opCode, vchEphemPK)
+		&& opCode == OP_RETURN
+		&& txout.scriptPubKey.GetOp(itTxA, opCode, vchEphemPK)
+		&& vchEphemPK.size() == ec_compressed_size;
+}
+
+// Work out the stealth secrets of every ephemeral key in the block ahead of
+// FindStealthTransactions, using all cores. The caller owns secrets and
+// scopes it to the block, which wipes it afterwards.
+void CWallet::PrecomputeStealthSecrets(const CBlock& block, CStealthBlockSecrets& secrets) const
+{
+	secrets.Clear();
+	GetStealthScanKeys(secrets.vScanKeys);
+	const std::vector<CStealthScanKey>& vScanKeys = secrets.vScanKeys;
+	if (vScanKeys.empty())
+		return;
+
+	std::set<ec_point> setEphemPK;
+	BOOST_FOREACH(const CTransaction& tx, block.vtx)
+	{
+		ec_point vchEphemPK;
+		BOOST_FOREACH(const CTxOut& txout, tx.vout)
+			if (GetStealthEphemKey(txout, vchEphemPK))
+				setEphemPK.insert(vchEphemPK);
+	}
+	if (setEphemPK.empty())
+		return;
+
+	std::vector<const ec_point*> vEphemPK;
+	BOOST_FOREACH(const ec_point& vchEphemPK, setEphemPK)
+		vEphemPK.push_back(&vchEphemPK);
+
+	size_t nCount = vEphemPK.size() * vScanKeys.size();
+	std::vector<CStealthSecret> vSecrets(nCount);
+
+	// Spread over the worker pool; small blocks stay on this thread
+	ParallelForRange(nCount, 4, boost::bind(&ComputeStealthSecrets, &vScanKeys, &vEphemPK, _1, _2, &vSecrets));
+
+	for (size_t i = 0; i < vEphemPK.size(); i++)
+		secrets.mapSecrets[*vEphemPK[i]].assign(vSecrets.begin() + i * vScanKeys.size(), vSecrets.begin() + (i + 1) * vScanKeys.size());
+	BOOST_FOREACH(CStealthSecret& secret, vSecrets)
+		memory_cleanse(&secret.sShared, sizeof(secret.sShared));
+}
+
+bool CWallet::FindStealthTransactions(const CTransaction& tx, mapValue_t& mapNarr, const CStealthBlockSecrets* pStealthSecrets)
 {
 	if (fDebug)
 		LogPrintf("FindStealthTransactions() tx: %s\n", tx.GetHash().GetHex().c_str());
@@ -3097,17 +3208,44 @@ bool CWallet::FindStealthTransactions(const CTransaction& tx, mapValue_t& mapNar
 	LOCK(cs_wallet);
 	ec_secret sSpendR;
 	ec_secret sSpend;
-	ec_secret sScan;
 	ec_secret sShared;
 
-	ec_point pkExtracted;
-
 	std::vector<uint8_t> vchEphemPK;
 	std::vector<uint8_t> vchDataB;
 	std::vector<uint8_t> vchENarr;
 	opcodetype opCode;
 	char cbuf[256];
 
+	// -- outputs paying to a key we don't have yet, any of them could be ours
+	std::map<CKeyID, int32_t> mapCandidates;
+	int32_t nOutputId = -1;
+	BOOST_FOREACH(const CTxOut& txoutB, tx.vout)
+	{
+		nOutputId++;
+
+		CTxDestination address;
+		if (!ExtractDestination(txoutB.scriptPubKey, address))
+			continue;
+
+		if (address.type() != typeid(CKeyID))
+			continue;
+
+		CKeyID ckidMatch = boost::get<CKeyID>(address);
+
+		if (HaveKey(ckidMatch)) // no point checking if already have key
+			continue;
+
+		mapCandidates.insert(std::make_pair(ckidMatch, nOutputId));
+	}
+
+	// secrets worked out here rather than ahead, wiped on return
+	CStealthBlockSecrets secretsLocal;
+	const std::vector<CStealthScanKey>* pvScanKeys = &secretsLocal.vScanKeys;
+	if (pStealthSecrets)
+		pvScanKeys = &pStealthSecrets->vScanKeys;
+	else
+		GetStealthScanKeys(secretsLocal.vScanKeys);
+
 	int32_t nOutputIdOuter = -1;
 	BOOST_FOREACH(const CTxOut& txout, tx.vout)
 	{
@@ -3148,172 +3286,157 @@ bool CWallet::FindStealthTransactions(const CTransaction& tx, mapValue_t& mapNar
 				continue;
 			}
 
-		int32_t nOutputId = -1;
 		nStealth++;
-		BOOST_FOREACH(const CTxOut& txoutB, tx.vout)
-		{
-			nOutputId++;
-
-			if (&txoutB == &txout)
-				continue;
+		if (mapCandidates.empty())
+			continue;
 
-			bool txnMatch = false; // only 1 txn will match an ephem pk
-			//printf("txoutB scriptPubKey %s\n",  txoutB.scriptPubKey.ToString().c_str());
+		// -- the one-time key for each owned stealth address, worked out once per ephemeral key
+		const std::vector<CStealthSecret>* pvSecrets = NULL;
+		if (pStealthSecrets)
+		{
+			std::map<ec_point, std::vector<CStealthSecret> >::const_iterator mi = pStealthSecrets->mapSecrets.find(vchEphemPK);
+			if (mi != pStealthSecrets->mapSecrets.end())
+				pvSecrets = &mi->second;
+		}
+		if (pvSecrets == NULL)
+		{
+			std::vector<CStealthSecret>& vSecrets = secretsLocal.mapSecrets[vchEphemPK];
+			vSecrets.resize(pvScanKeys->size());
+			for (unsigned int i = 0; i < pvScanKeys->size(); i++)
+				ComputeStealthSecret((*pvScanKeys)[i], vchEphemPK, vSecrets[i]);
+			pvSecrets = &vSecrets;
+		}
 
-			CTxDestination address;
-			if (!ExtractDestination(txoutB.scriptPubKey, address))
+		// -- only 1 txn will match an ephem pk
+		for (unsigned int i = 0; i < pvScanKeys->size(); i++)
+		{
+			const CStealthSecret& secret = (*pvSecrets)[i];
+			if (!secret.fValid)
 				continue;
 
-			if (address.type() != typeid(CKeyID))
+			const CPubKey& cpkE = secret.pkExtracted;
+			std::map<CKeyID, int32_t>::iterator itCandidate = mapCandidates.find(cpkE.GetID());
+			if (itCandidate == mapCandidates.end())
 				continue;
+			nOutputId = itCandidate->second;
 
-			CKeyID ckidMatch = boost::get<CKeyID>(address);
+			const CStealthAddress* it = (*pvScanKeys)[i].pAddress;
+			memcpy(&sShared.e[0], &secret.sShared.e[0], ec_secret_size);
 
-			if (HaveKey(ckidMatch)) // no point checking if already have key
-				continue;
+			if (fDebug)
+				printf("Found stealth txn to address %s\n", it->Encoded().c_str());
 
-			std::set<CStealthAddress>::iterator it;
-			for (it = stealthAddresses.begin(); it != stealthAddresses.end(); ++it)
+			if (IsLocked())
 			{
-				if (it->scan_secret.size() != ec_secret_size)
-					continue; // stealth address is not owned
+				if (fDebug)
+					printf("Wallet is locked, adding key without secret.\n");
 
-				//printf("it->Encodeded() %s\n",  it->Encoded().c_str());
-				memcpy(&sScan.e[0], &it->scan_secret[0], ec_secret_size);
+				// -- add key without secret
+				std::vector<uint8_t> vchEmpty;
+				AddCryptedKey(cpkE, vchEmpty);
+				CKeyID keyId = cpkE.GetID();
+				CHarvestcoinAddress coinAddress(keyId);
+				std::string sLabel = it->Encoded();
+				SetAddressBookName(keyId, sLabel);
 
-				if (StealthSecret(sScan, vchEphemPK, it->spend_pubkey, sShared, pkExtracted) != 0)
-				{
-					printf("StealthSecret failed.\n");
-					continue;
-				};
-				//printf("pkExtracted %"PRIszu": %s\n", pkExtracted.size(), HexStr(pkExtracted).c_str());
+				CPubKey cpkEphem(vchEphemPK);
+				CPubKey cpkScan(it->scan_pubkey);
+				CStealthKeyMetadata lockedSkMeta(cpkEphem, cpkScan);
 
-				CPubKey cpkE(pkExtracted);
+				if (!CWalletDB(strWalletFile).WriteStealthKeyMeta(keyId, lockedSkMeta))
+					printf("WriteStealthKeyMeta failed for %s\n", coinAddress.ToString().c_str());
 
-				if (!cpkE.IsValid())
-					continue;
-				CKeyID ckidE = cpkE.GetID();
-
-				if (ckidMatch != ckidE)
+				mapStealthKeyMeta[keyId] = lockedSkMeta;
+				nFoundStealth++;
+			}
+			else
+			{
+				if (it->spend_secret.size() != ec_secret_size)
 					continue;
+				memcpy(&sSpend.e[0], &it->spend_secret[0], ec_secret_size);
 
-				if (fDebug)
-					printf("Found stealth txn to address %s\n", it->Encoded().c_str());
 
-				if (IsLocked())
-				{
-					if (fDebug)
-						printf("Wallet is locked, adding key without secret.\n");
-
-					// -- add key without secret
-					std::vector<uint8_t> vchEmpty;
-					AddCryptedKey(cpkE, vchEmpty);
-					CKeyID keyId = cpkE.GetID();
-					CHarvestcoinAddress coinAddress(keyId);
-					std::string sLabel = it->Encoded();
-					SetAddressBookName(keyId, sLabel);
-
-					CPubKey cpkEphem(vchEphemPK);
-					CPubKey cpkScan(it->scan_pubkey);
-					CStealthKeyMetadata lockedSkMeta(cpkEphem, cpkScan);
-
-					if (!CWalletDB(strWalletFile).WriteStealthKeyMeta(keyId, lockedSkMeta))
-						printf("WriteStealthKeyMeta failed for %s\n", coinAddress.ToString().c_str());
-
-					mapStealthKeyMeta[keyId] = lockedSkMeta;
-					nFoundStealth++;
-				}
-				else
+				if (StealthSharedToSecretSpend(sShared, sSpend, sSpendR) != 0)
 				{
-					if (it->spend_secret.size() != ec_secret_size)
-						continue;
-					memcpy(&sSpend.e[0], &it->spend_secret[0], ec_secret_size);
-
-
-					if (StealthSharedToSecretSpend(sShared, sSpend, sSpendR) != 0)
-					{
-						printf("StealthSharedToSecretSpend() failed.\n");
-						continue;
-					};
-
-					ec_point pkTestSpendR;
-					if (SecretToPublicKey(sSpendR, pkTestSpendR) != 0)
-					{
-						printf("SecretToPublicKey() failed.\n");
-						continue;
-					};
-
-					CSecret vchSecret;
-					vchSecret.resize(ec_secret_size);
+					printf("StealthSharedToSecretSpend() failed.\n");
+					continue;
+				};
 
-					memcpy(&vchSecret[0], &sSpendR.e[0], ec_secret_size);
-					CKey ckey;
+				ec_point pkTestSpendR;
+				if (SecretToPublicKey(sSpendR, pkTestSpendR) != 0)
+				{
+					printf("SecretToPublicKey() failed.\n");
+					continue;
+				};
 
-					try {
-						ckey.Set(vchSecret.begin(), vchSecret.end(), true);
-						//ckey.SetSecret(vchSecret, true);
-					}
-					catch (std::exception& e) {
-						printf("ckey.SetSecret() threw: %s.\n", e.what());
-						continue;
-					};
+				CSecret vchSecret;
+				vchSecret.resize(ec_secret_size);
 
-					CPubKey cpkT = ckey.GetPubKey();
-					if (!cpkT.IsValid())
-					{
-						printf("cpkT is invalid.\n");
-						continue;
-					};
+				memcpy(&vchSecret[0], &sSpendR.e[0], ec_secret_size);
+				CKey ckey;
 
-					if (!ckey.IsValid())
-					{
-						printf("Reconstructed key is invalid.\n");
-						continue;
-					};
+				try {
+					ckey.Set(vchSecret.begin(), vchSecret.end(), true);
+					//ckey.SetSecret(vchSecret, true);
+				}
+				catch (std::exception& e) {
+					printf("ckey.SetSecret() threw: %s.\n", e.what());
+					continue;
+				};
 
-					CKeyID keyID = cpkT.GetID();
-					if (fDebug)
-					{
-						CHarvestcoinAddress coinAddress(keyID);
-						printf("Adding key %s.\n", coinAddress.ToString().c_str());
-					};
+				CPubKey cpkT = ckey.GetPubKey();
+				if (!cpkT.IsValid())
+				{
+					printf("cpkT is invalid.\n");
+					continue;
+				};
 
-					if (!AddKey(ckey))
-					{
-						printf("AddKey failed.\n");
-						continue;
-					};
+				if (!ckey.IsValid())
+				{
+					printf("Reconstructed key is invalid.\n");
+					continue;
+				};
 
-					std::string sLabel = it->Encoded();
-					SetAddressBookName(keyID, sLabel);
-					nFoundStealth++;
+				CKeyID keyID = cpkT.GetID();
+				if (fDebug)
+				{
+					CHarvestcoinAddress coinAddress(keyID);
+					printf("Adding key %s.\n", coinAddress.ToString().c_str());
 				};
 
-				if (txout.scriptPubKey.GetOp(itTxA, opCode, vchENarr)
-					&& opCode == OP_RETURN
-					&& txout.scriptPubKey.GetOp(itTxA, opCode, vchENarr)
-					&& vchENarr.size() > 0)
+				if (!AddKey(ckey))
 				{
-					SecMsgCrypter crypter;
-					crypter.SetKey(&sShared.e[0], &vchEphemPK[0]);
-					std::vector<uint8_t> vchNarr;
-					if (!crypter.Decrypt(&vchENarr[0], vchENarr.size(), vchNarr))
-					{
-						printf("Decrypt narration failed.\n");
-						continue;
-					};
-					std::string sNarr = std::string(vchNarr.begin(), vchNarr.end());
+					printf("AddKey failed.\n");
+					continue;
+				};
+
+				std::string sLabel = it->Encoded();
+				SetAddressBookName(keyID, sLabel);
+				nFoundStealth++;
+			};
 
-					snprintf(cbuf, sizeof(cbuf), "n_%d", nOutputId);
-					mapNarr[cbuf] = sNarr;
+			if (txout.scriptPubKey.GetOp(itTxA, opCode, vchENarr)
+				&& opCode == OP_RETURN
+				&& txout.scriptPubKey.GetOp(itTxA, opCode, vchENarr)
+				&& vchENarr.size() > 0)
+			{
+				SecMsgCrypter crypter;
+				crypter.SetKey(&sShared.e[0], &vchEphemPK[0]);
+				std::vector<uint8_t> vchNarr;
+				if (!crypter.Decrypt(&vchENarr[0], vchENarr.size(), vchNarr))
+				{
+					printf("Decrypt narration failed.\n");
+					continue;
 				};
+				std::string sNarr = std::string(vchNarr.begin(), vchNarr.end());
 
-				txnMatch = true;
-				break;
+				snprintf(cbuf, sizeof(cbuf), "n_%d", nOutputId);
+				mapNarr[cbuf] = sNarr;
 			};
-			if (txnMatch)
-				break;
-		};
+
+			mapCandidates.erase(itCandidate);
+			break;
+		}
 	};
 
 	return true;
@@ -3357,6 +3480,23 @@ uint64_t CWallet::GetStakeWeight() const
 	return nWeight;
 }
 
+bool CWallet::GetStakeCandidate(const CWalletTx& wtx, const COutPoint& prevout, CStakeCandidate& candidate) const
+{
+	LOCK(cs_wallet);
+	map<COutPoint, CStakeCandidate>::const_iterator it = mapStakeCandidates.find(prevout);
+	if (it != mapStakeCandidates.end() && it->second.hashBlock == wtx.hashBlock)
+	{
+		candidate = it->second;
+		return true;
+	}
+
+	// Not seen yet, or confirmed in a different block since
+	if (!::GetStakeCandidate(prevout, candidate))
+		return false;
+	mapStakeCandidates[prevout] = candidate;
+	return true;
+}
+
 bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int64_t nSearchInterval, int64_t nFees, CTransaction& txNew, CKey& key)
 {
 	CBlockIndex* pindexPrev = pindexBest;
@@ -3389,21 +3529,43 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
 	if (setCoins.empty())
 		return false;
 
+	// Forget the kernel inputs of outputs that are no longer stakeable
+	{
+		LOCK(cs_wallet);
+		set<COutPoint> setStakeable;
+		BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
+			setStakeable.insert(COutPoint(pcoin.first->GetHash(), pcoin.second));
+		for (map<COutPoint, CStakeCandidate>::iterator it = mapStakeCandidates.begin(); it != mapStakeCandidates.end(); )
+		{
+			if (setStakeable.count(it->first))
+				++it;
+			else
+				mapStakeCandidates.erase(it++);
+		}
+	}
+
 	int64_t nCredit = 0;
 	CScript scriptPubKeyKernel;
-	CTxDB txdb("r");
 	BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
 	{
 		static int nMaxStakeSearchInterval = 60;
 		bool fKernelFound = false;
-		for (unsigned int n = 0; n < min(nSearchInterval, (int64_t)nMaxStakeSearchInterval) && !fKernelFound && pindexPrev == pindexBest; n++)
+		COutPoint prevoutStake = COutPoint(pcoin.first->GetHash(), pcoin.second);
+		CStakeCandidate candidate;
+		if (!GetStakeCandidate(*pcoin.first, prevoutStake, candidate))
+			continue;
+		// Search backward in time from the given txNew timestamp
+		// Search nSearchInterval seconds back up to nMaxStakeSearchInterval
+		// Hash the whole window in one go; hits are confirmed one by one below
+		unsigned int nSearch = (unsigned int)max((int64_t)0, min(nSearchInterval, (int64_t)nMaxStakeSearchInterval));
+		vector<bool> vKernel;
+		boost::this_thread::interruption_point();
+		if (!CheckKernelBatch(pindexPrev, nBits, txNew.nTime, nSearch, prevoutStake, candidate, vKernel))
+			continue;
+		for (unsigned int n = 0; n < nSearch && !fKernelFound && pindexPrev == pindexBest; n++)
 		{
 			boost::this_thread::interruption_point();
-			// Search backward in time from the given txNew timestamp
-			// Search nSearchInterval seconds back up to nMaxStakeSearchInterval
-			COutPoint prevoutStake = COutPoint(pcoin.first->GetHash(), pcoin.second);
-			int64_t nBlockTime;
-			if (CheckKernel(pindexPrev, nBits, txNew.nTime - n, prevoutStake, &nBlockTime))
+			if (vKernel[n] && CheckKernel(pindexPrev, nBits, txNew.nTime - n, prevoutStake, candidate))
 			{
 				// Found a kernel
 				LogPrint("coinstake", "CreateCoinStake : kernel found\n");
@@ -4522,7 +4684,7 @@ void CWallet::GetKeyBirthTimes(std::map<CKeyID, int64_t> &mapKeyBirth) const {
 	for (std::map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); it++) {
 		// iterate over all wallet transactions...
 		const CWalletTx &wtx = (*it).second;
-		std::map<uint256, CBlockIndex*>::const_iterator blit = mapBlockIndex.find(wtx.hashBlock);
+		BlockMap::const_iterator blit = mapBlockIndex.find(wtx.hashBlock);
 		if (blit != mapBlockIndex.end() && blit->second->IsInMainChain()) {
 			// ... which are already in a block
 			int nHeight = blit->second->nHeight;
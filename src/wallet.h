@@ -14,6 +14,7 @@
 
 #include "crypter.h"
 #include "main.h"
+#include "kernel.h"
 #include "key.h"
 #include "keystore.h"
 #include "script.h"
@@ -84,6 +85,40 @@ public:
     )
 };
 
+/** An owned stealth address with its scan secret, ready for matching */
+class CStealthScanKey
+{
+public:
+    const CStealthAddress* pAddress;
+    ec_secret sScan;
+};
+
+/** The shared secret and one-time key of an ephemeral key and one stealth address */
+class CStealthSecret
+{
+public:
+    bool fValid;
+    ec_secret sShared;
+    CPubKey pkExtracted;
+
+    CStealthSecret() : fValid(false) {}
+};
+
+/** The scan keys of the owned stealth addresses and the secrets of every
+ * ephemeral key in one block, worked out ahead of scanning the block. It
+ * holds secret key material, which is wiped on Clear() and destruction.
+ */
+class CStealthBlockSecrets
+{
+public:
+    std::vector<CStealthScanKey> vScanKeys;
+    // by ephemeral key, one per entry of vScanKeys
+    std::map<ec_point, std::vector<CStealthSecret> > mapSecrets;
+
+    ~CStealthBlockSecrets() { Clear(); }
+    void Clear();
+};
+
 /** A CWallet is an extension of a keystore, which also maintains a set of transactions and balances,
  * and provides the ability to create new transactions.
  */
@@ -95,6 +130,8 @@ private:
     bool SelectCoins(CAmount nTargetValue, unsigned int nSpendTime, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet, const CCoinControl *coinControl = NULL, AvailableCoinsType coin_type=ALL_COINS, bool useIX = false) const;
     CWalletDB *pwalletdbEncryption;
 
+    void GetStealthScanKeys(std::vector<CStealthScanKey>& vScanKeys) const;
+
     // the current wallet version: clients below this version are not able to load the wallet
     int nWalletVersion;
 
@@ -111,6 +148,11 @@ private:
 
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
+    // Kernel hash inputs of our stakeable outputs, filled in on first use
+    // and checked against the confirming block on every lookup
+    mutable std::map<COutPoint, CStakeCandidate> mapStakeCandidates;
+    bool GetStakeCandidate(const CWalletTx& wtx, const COutPoint& prevout, CStakeCandidate& candidate) const;
+
 public:
     /// Main wallet lock.
     /// This lock protects all the fields added by CWallet
@@ -252,7 +294,7 @@ public:
     void MarkDirty();
     bool AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet=false);
     void SyncTransaction(const CTransaction& tx, const CBlock* pblock, bool fConnect = true);
-    bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate);
+    bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate, const CStealthBlockSecrets* pStealthSecrets = NULL);
     void EraseFromWallet(const uint256 &hash);
     int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false);
     void ReacceptWalletTransactions();
@@ -293,7 +335,8 @@ public:
     bool CreateStealthTransaction(CScript scriptPubKey, int64_t nValue, std::vector<uint8_t>& P, std::vector<uint8_t>& narr, std::string& sNarr, CWalletTx& wtxNew, CReserveKey& reservekey, int64_t& nFeeRet, const CCoinControl* coinControl=NULL);
     std::string SendStealthMoney(CScript scriptPubKey, int64_t nValue, std::vector<uint8_t>& P, std::vector<uint8_t>& narr, std::string& sNarr, CWalletTx& wtxNew, bool fAskFee=false);
     bool SendStealthMoneyToDestination(CStealthAddress& sxAddress, int64_t nValue, std::string& sNarr, CWalletTx& wtxNew, std::string& sError, bool fAskFee=false);
-    bool FindStealthTransactions(const CTransaction& tx, mapValue_t& mapNarr);
+    void PrecomputeStealthSecrets(const CBlock& block, CStealthBlockSecrets& secrets) const;
+    bool FindStealthTransactions(const CTransaction& tx, mapValue_t& mapNarr, const CStealthBlockSecrets* pStealthSecrets = NULL);
 
     std::string PrepareDarksendDenominate(int minRounds, int maxRounds);
     int GenerateDarksendOutputs(int nTotalValue, std::vector<CTxOut>& vout);